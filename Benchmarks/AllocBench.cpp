@@ -0,0 +1,127 @@
+#include "Bench.h"
+#include <atomic>
+#include <new>
+
+namespace
+{
+	std::atomic<bool>     g_counting(false);
+	std::atomic<uint64_t> g_allocations(0);
+
+	void* CountedAlloc(size_t size)
+	{
+		if (g_counting.load(std::memory_order_relaxed))
+		{
+			g_allocations.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		void* memory = malloc(size ? size : 1);
+		if (memory == nullptr)
+		{
+			throw std::bad_alloc();
+		}
+		return memory;
+	}
+
+	enum Mode
+	{
+		PLAIN,
+		SECURE,      // key and FEC
+		UNCAPPED,    // scheduler flow without a rate
+		CAPPED,      // scheduler flow under a rate far above loopback speed
+		MODES
+	};
+
+	const char* const ModeNames[MODES] = { "", ", key and FEC", ", uncapped flow", ", capped flow" };
+
+	// Allocations of one whole transfer of a file of size bytes, both ends.
+	uint64_t TransferAllocations(uint64_t size, short port, Mode mode)
+	{
+		const bool secure = mode == SECURE;
+		TransferScheduler scheduler(mode == CAPPED ? 64ULL * 1024 * 1024 * 1024 : 0);
+		const std::shared_ptr<TransferScheduler::Flow> flow = scheduler.AddFlow(1);
+
+		CipherKey key;
+		memset(key.bytes, 7, sizeof(key.bytes));
+
+		const std::string path = "alloc_bench.bin";
+		const std::string out = "alloc_bench_out";
+
+		WriteTestFile(path, size, 1);
+		::MakeDirectory(out);
+
+		g_allocations = 0;
+		g_counting = true;
+		{
+			LoopbackServer server(port, [&]()
+				{ return std::unique_ptr<StorageBackend>(new FileStorage(std::vector<std::string>(1, out))); },
+				[&](FileTransferServer& receiver) { if (secure) receiver.SetKey(key); });
+
+			SendFiles(port, std::vector<std::string>(1, path), [&](FileTransferClient& sender)
+			{
+				if (secure)
+				{
+					sender.SetKey(key);
+					sender.SetForwardErrorCorrection(true);
+				}
+				if (mode == UNCAPPED || mode == CAPPED)
+					sender.SetSchedulerFlow(flow);
+			});
+			server.Wait();
+		}
+		g_counting = false;
+
+		remove(path.c_str());
+		remove((out + "/" + path).c_str());
+
+		return g_allocations;
+	}
+}
+
+// Every allocation of the process goes through here while counting.
+void* operator new(size_t size)
+{
+	return CountedAlloc(size);
+}
+
+void* operator new[](size_t size)
+{
+	return CountedAlloc(size);
+}
+
+void operator delete(void* memory) noexcept
+{
+	free(memory);
+}
+
+void operator delete[](void* memory) noexcept
+{
+	free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept
+{
+	free(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept
+{
+	free(memory);
+}
+
+void AllocBench(const std::vector<std::string>& args)
+{
+	const uint64_t smallSize = ArgOr(args, 0, 1) * 1024 * 1024;
+	const uint64_t largeSize = ArgOr(args, 1, 9) * 1024 * 1024;
+
+	const double blocks = double(largeSize - smallSize) / MAX_LENGTH;
+
+	for (int mode = 0; mode < MODES; ++mode)
+	{
+		const uint64_t small = TransferAllocations(smallSize, short(5601 + 2 * mode), Mode(mode));
+		const uint64_t large = TransferAllocations(largeSize, short(5602 + 2 * mode), Mode(mode));
+
+		Report("alloc", (std::string("allocations, small file") + ModeNames[mode]).c_str(), double(small), "");
+		Report("alloc", (std::string("allocations, large file") + ModeNames[mode]).c_str(), double(large), "");
+		Report("alloc", (std::string("allocations per block") + ModeNames[mode]).c_str(), (double(large) - double(small)) / blocks, "");
+	}
+}
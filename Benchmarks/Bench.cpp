@@ -0,0 +1,193 @@
+#include "Bench.h"
+#include <chrono>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+#ifdef _WIN32
+	double Seconds(const FILETIME& time)
+	{
+		ULARGE_INTEGER ticks;
+		ticks.LowPart = time.dwLowDateTime;
+		ticks.HighPart = time.dwHighDateTime;
+
+		// 100 ns ticks
+		return double(ticks.QuadPart) / 1e7;
+	}
+#endif
+}
+
+double Now()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t ArgOr(const std::vector<std::string>& args, size_t index, uint64_t fallback)
+{
+	if (index >= args.size())
+		return fallback;
+
+	return strtoull(args[index].c_str(), nullptr, 10);
+}
+
+void Report(const char* bench, const char* what, double value, const char* unit)
+{
+	printf("%-10s %-40s %14.2f %s\n", bench, what, value, unit);
+	fflush(stdout);
+}
+
+uint64_t ResidentBytes()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+	{
+		throw std::runtime_error("Error: [ResidentBytes] unable to read the working set");
+	}
+
+	return counters.WorkingSetSize;
+#else
+	std::ifstream statm("/proc/self/statm");
+	uint64_t size = 0;
+	uint64_t resident = 0;
+	statm >> size >> resident;
+
+	return resident * uint64_t(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+double ThreadCpuSeconds()
+{
+#ifdef _WIN32
+	FILETIME created, exited, kernel, user;
+	if (!GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel, &user))
+	{
+		throw std::runtime_error("Error: [ThreadCpuSeconds] unable to read the thread times");
+	}
+
+	return Seconds(kernel) + Seconds(user);
+#else
+	timespec time;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+
+	return double(time.tv_sec) + double(time.tv_nsec) / 1e9;
+#endif
+}
+
+double ProcessCpuSeconds()
+{
+#ifdef _WIN32
+	FILETIME created, exited, kernel, user;
+	if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user))
+	{
+		throw std::runtime_error("Error: [ProcessCpuSeconds] unable to read the process times");
+	}
+
+	return Seconds(kernel) + Seconds(user);
+#else
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	return double(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+		double(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+#endif
+}
+
+void WriteTestFile(const std::string& path, uint64_t size, unsigned int seed)
+{
+	std::ofstream file(path.c_str(), std::ios::binary | std::ios::trunc);
+	std::vector<char> block(64 * 1024);
+	uint32_t state = seed * 2654435761u + 1;
+
+	for (uint64_t written = 0; written < size; written += block.size())
+	{
+		for (size_t i = 0; i < block.size(); ++i)
+		{
+			// xorshift, never a zero block
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			block[i] = static_cast<char>(state | 1);
+		}
+
+		const uint64_t left = size - written;
+		file.write(block.data(), static_cast<std::streamsize>(left < block.size() ? left : block.size()));
+	}
+
+	if (!file)
+	{
+		throw std::runtime_error("Error: [WriteTestFile] failed write " + path);
+	}
+}
+
+LoopbackServer::LoopbackServer(short port, const StorageFactory& makeStorage,
+	const std::function<void(FileTransferServer&)>& setup)
+	: m_server(FileTransferServer::MakeServer(PROTOCOL, LOOPBACK_ADDRESS, port))
+{
+	m_server->SetStorage(makeStorage);
+	if (setup)
+	{
+		setup(*m_server);
+	}
+	m_server->Init();
+
+	m_thread = std::thread(&LoopbackServer::RunServer, this);
+}
+
+LoopbackServer::~LoopbackServer()
+{
+	if (m_thread.joinable())
+	{
+		m_server.release();
+		m_thread.detach();
+	}
+}
+
+void LoopbackServer::Wait()
+{
+	m_thread.join();
+
+	if (!m_error.empty())
+	{
+		throw std::runtime_error(m_error);
+	}
+}
+
+void LoopbackServer::RunServer()
+{
+	try
+	{
+		m_server->Run();
+	}
+	catch (const std::exception& exc)
+	{
+		m_error = exc.what();
+	}
+}
+
+double SendFiles(short port, const std::vector<std::string>& files,
+	const std::function<void(FileTransferClient&)>& setup)
+{
+	std::unique_ptr<FileTransferClient> client(FileTransferClient::MakeClient(PROTOCOL, LOOPBACK_ADDRESS, port));
+	if (setup)
+	{
+		setup(*client);
+	}
+
+	const double begin = Now();
+	client->Init();
+	client->Transfer(files);
+
+	return Now() - begin;
+}
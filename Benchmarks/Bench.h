@@ -0,0 +1,184 @@
+#pragma once
+
+#include <TransferClient.h>
+#include <TransferServer.h>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Standalone measurements of the claims made for the transfer code. Each
+// benchmark takes the arguments after its name and prints one line per
+// result, so runs can be compared with diff.
+typedef void (*BenchFunction)(const std::vector<std::string>& args);
+
+// Seconds on a steady clock.
+double Now();
+
+// args[index] as a number, fallback when it is missing.
+uint64_t ArgOr(const std::vector<std::string>& args, size_t index, uint64_t fallback);
+
+void Report(const char* bench, const char* what, double value, const char* unit);
+
+// Bytes of the process currently in memory, the working set on Windows.
+uint64_t ResidentBytes();
+
+// CPU seconds, user and kernel, the calling thread has used so far.
+double ThreadCpuSeconds();
+
+// The same over every thread of the process.
+double ProcessCpuSeconds();
+
+// A file of size bytes that does not compress or look sparse, seed varies the content.
+void WriteTestFile(const std::string& path, uint64_t size, unsigned int seed);
+
+// A server of the built transport on a loopback port, serving one client
+// on its own thread.
+class LoopbackServer
+{
+public:
+	// setup runs before Init when set.
+	LoopbackServer(short port, const StorageFactory& makeStorage,
+		const std::function<void(FileTransferServer&)>& setup = nullptr);
+
+	// A server still waiting for a client that failed is left running.
+	~LoopbackServer();
+
+	// Joins the server thread, rethrows what stopped it.
+	void Wait();
+
+private:
+	void RunServer();
+
+	LoopbackServer(const LoopbackServer&);
+
+	LoopbackServer& operator = (const LoopbackServer&);
+
+private:
+	std::unique_ptr<FileTransferServer> m_server;
+	std::thread                         m_thread;
+	std::string                         m_error;
+};
+
+// Sends files to a LoopbackServer on port, returns the seconds it took.
+// setup runs before Init when set.
+double SendFiles(short port, const std::vector<std::string>& files,
+	const std::function<void(FileTransferClient&)>& setup = nullptr);
+
+// Keeps nothing, so only the code in front of the storage is measured.
+class NullStorage : public StorageBackend
+{
+public:
+	NullStorage() : m_open(false) {}
+
+	void SetPolicy(SyncPolicy policy, bool directIo) override {}
+
+	SyncPolicy Policy() const override { return SyncNone; }
+
+	void Reserve(const std::string& name, uint64_t size) override {}
+
+	void Open(const std::string& name, bool reserved) override { m_open = true; }
+
+	bool IsOpen() const override { return m_open; }
+
+	void WriteAt(uint64_t offset, const char* data, size_t size) override {}
+
+	void WriteHole(uint64_t offset, uint64_t size) override {}
+
+	void Finalize() override { m_open = false; }
+
+	void Abort() override { m_open = false; }
+
+	void WriteWhole(const std::string& name, const char* data, size_t size) override {}
+
+	void MakeDirectory(const std::string& name) override {}
+
+	std::string PathOf(const std::string& name) const override { return name; }
+
+	void DirectoryPaths(const std::string& name, std::vector<std::string>* paths) const override { paths->clear(); }
+
+	void DropReserved() override {}
+
+private:
+	bool m_open;
+};
+
+// Heap allocations per block of a whole loopback transfer, both ends,
+// from the difference between a small and a large file. Plain, and
+// encrypted with FEC on UDP. [smallMB largeMB]
+void AllocBench(const std::vector<std::string>& args);
+
+// Data frames per second through the sessions' Dispatch, and through a
+// std::map lookup in front of it as the old handler registry did.
+// [frames]
+void DispatchBench(const std::vector<std::string>& args);
+
+// Resident memory of an upload running on AsyncTransferClient, both ends
+// of the loopback transfer, and of one waiting in its queue.
+// [running queued]
+void UploadBench(const std::vector<std::string>& args);
+
+// Goodput and the p50/p99 time per acknowledged window of a UDP loopback
+// transfer at 0 to 5% loss towards the server, with FEC and with
+// retransmission alone. [sizeMB]
+void FecBench(const std::vector<std::string>& args);
+
+// Files per second over many small files with their pages evicted from the
+// cache: opened and read one after the other, through FilePrefetcher, and
+// sent whole over a loopback transfer. [files sizeKB]
+void ScanBench(const std::vector<std::string>& args);
+
+// Time to upload a 64 KB file alone and next to a bulk upload under the
+// bandwidth cap, at the bulk upload's priority and above it, with the share
+// that finished within the latency target. UDP only.
+// [smallFiles capMB targetMs]
+void LatencyBench(const std::vector<std::string>& args);
+
+// Files per second, throughput and wire bytes per file of a loopback
+// transfer of a source-tree-like corpus of small files, sent as a directory
+// with a manifest and packed small files, and as its files one by one.
+// [files]
+void CorpusBench(const std::vector<std::string>& args);
+
+// CPU seconds per GB of the sending thread and of both ends of a loopback
+// transfer, with blocks sent from a file mapping and through the staging
+// buffer. [sizeMB]
+void MappedBench(const std::vector<std::string>& args);
+
+// Files per second created and finalized through FileStorage, 4 KB each,
+// and the write rate of one large file per root, synced at the end, over
+// 1 to N roots with one worker per root. [files sizeMB root...]
+void StorageBench(const std::vector<std::string>& args);
+
+// Transfer time and payload on the wire for a mostly sparse image, with
+// holes and zero blocks skipped and with every byte sent. [sizeGB]
+void SparseBench(const std::vector<std::string>& args);
+
+// Loopback transfer rate into FileStorage under every sync policy, with
+// and without direct I/O, as the server's -sync and -direct flags set
+// them. [files sizeMB]
+void SyncBench(const std::vector<std::string>& args);
+
+// Aggregate rate of clients sending a file each at once to a ServerPool
+// of 1, 2, 4 and up to one worker per core or maxWorkers. The loopback
+// transport has no SO_REUSEPORT, so the workers share one socket.
+// [clients sizeMB maxWorkers]
+void PoolBench(const std::vector<std::string>& args);
+
+// Sealing rate of the AEAD kernel this CPU runs, frame by frame and a
+// window at a time through the sealing pool, then a loopback transfer
+// with and without a key. [sizeMB]
+void CryptoBench(const std::vector<std::string>& args);
+
+// Loopback UDP transfer into FileStorage with every window delivered in
+// order and shuffled: goodput, the most bytes ReassemblyBuffer held for an
+// earlier block, and the size and p50/p99 time of the storage writes as
+// the receive loop sees them, handed to the write-behind thread. [sizeMB]
+void ReorderBench(const std::vector<std::string>& args);
+
+// Time from Init to a ready session for clients one after the other, with a
+// fresh connect and Hello each and with the connection taken from a
+// ConnectionPool, plain and keyed, and of Init plus a 4 KB file. A keyed
+// UDP server never keeps sessions alive, those always run Hello.
+// [transfers]
+void ReuseBench(const std::vector<std::string>& args);
@@ -0,0 +1,154 @@
+#include "Bench.h"
+#include <Loopback.h>
+#include <Manifest.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace
+{
+	const char* const CorpusDirectory = "corpus_bench";
+
+	// Subdirectories per level, two levels as in module/component/file.
+	const size_t CorpusFanOut = 8;
+
+	struct Corpus
+	{
+		std::vector<std::string> directories;   // parents first
+		std::vector<std::string> files;
+		uint64_t                 bytes;
+		size_t                   packable;      // files small enough for PackedData
+	};
+
+	// count files with sizes of a source tree: most are a few hundred bytes
+	// to a few KB, one in ten up to 32 KB. Names are unique over the tree so
+	// the files can also be sent one by one.
+	Corpus WriteCorpus(size_t count)
+	{
+		Corpus corpus;
+		corpus.bytes = 0;
+		corpus.packable = 0;
+
+		corpus.directories.push_back(CorpusDirectory);
+		for (size_t i = 0; i < CorpusFanOut; ++i)
+		{
+			const std::string module = std::string(CorpusDirectory) + "/m" + std::to_string(i);
+			corpus.directories.push_back(module);
+
+			for (size_t j = 0; j < CorpusFanOut; ++j)
+			{
+				corpus.directories.push_back(module + "/c" + std::to_string(j));
+			}
+		}
+		for (size_t i = 0; i < corpus.directories.size(); ++i)
+		{
+			::MakeDirectory(corpus.directories[i]);
+		}
+
+		const size_t packLimit = MAX_LENGTH - 2 * sizeof(uint32_t);
+		const size_t leaves = CorpusFanOut * CorpusFanOut;
+		std::vector<char> contents(32 * 1024);
+		uint32_t state = 12345;
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+
+			const uint32_t kind = state % 10;
+			const size_t size = kind < 6 ? 64 + state % 400 : kind < 9 ? 512 + state % 3584 : 4096 + state % 28672;
+
+			for (size_t k = 0; k < size; ++k)
+			{
+				contents[k] = static_cast<char>('a' + (i + k * 7) % 26);
+			}
+
+			const size_t leaf = i % leaves;
+			char name[128];
+			sprintf_s(name, sizeof(name), "%s/m%u/c%u/s%06u.cpp", CorpusDirectory,
+				unsigned(leaf / CorpusFanOut), unsigned(leaf % CorpusFanOut), unsigned(i));
+			corpus.files.push_back(name);
+
+			FILE* file = fopen(name, "wb");
+			if (file == nullptr || fwrite(contents.data(), 1, size, file) != size)
+			{
+				throw std::runtime_error(std::string("Error: [WriteCorpus] failed write ") + name);
+			}
+			fclose(file);
+
+			corpus.bytes += size;
+			if (size <= packLimit)
+			{
+				++corpus.packable;
+			}
+		}
+
+		return corpus;
+	}
+
+	void RemoveCorpus(const Corpus& corpus)
+	{
+		for (size_t i = 0; i < corpus.files.size(); ++i)
+		{
+			remove(corpus.files[i].c_str());
+		}
+
+		for (size_t i = corpus.directories.size(); i-- > 0;)
+		{
+#ifdef _WIN32
+			_rmdir(corpus.directories[i].c_str());
+#else
+			rmdir(corpus.directories[i].c_str());
+#endif
+		}
+	}
+
+	struct CorpusRun
+	{
+		double   seconds;
+		uint64_t wireBytes;   // sent to the server, headers included
+	};
+
+	CorpusRun SendCorpus(short port, const std::vector<std::string>& paths)
+	{
+		LoopbackServer server(port, []() { return std::unique_ptr<StorageBackend>(new NullStorage()); });
+
+		CorpusRun run;
+		run.seconds = SendFiles(port, paths, [](FileTransferClient& sender)
+		{
+			sender.SetProgressCallback([](const std::string&, uint64_t, uint64_t) {});
+		});
+		server.Wait();
+		run.wireBytes = LoopbackTransport::BytesSentTo(port);
+
+		return run;
+	}
+}
+
+void CorpusBench(const std::vector<std::string>& args)
+{
+	const size_t count = static_cast<size_t>(ArgOr(args, 0, 20000));
+	short port = 5731;
+
+	const Corpus corpus = WriteCorpus(count);
+	Report("corpus", "files", double(count), "");
+	Report("corpus", "files packable", corpus.packable * 100.0 / count, "%");
+
+	// the same tree as a directory, manifest and packed small files, and
+	// as its files named one by one
+	const CorpusRun tree = SendCorpus(port++, std::vector<std::string>(1, CorpusDirectory));
+	const CorpusRun single = SendCorpus(port++, corpus.files);
+
+	Report("corpus", "tree, files/sec", count / tree.seconds, "");
+	Report("corpus", "tree, throughput", corpus.bytes / tree.seconds / (1024 * 1024), "MB/s");
+	Report("corpus", "tree, wire bytes per file", double(tree.wireBytes) / count, "bytes");
+	Report("corpus", "file by file, files/sec", count / single.seconds, "");
+	Report("corpus", "file by file, throughput", corpus.bytes / single.seconds / (1024 * 1024), "MB/s");
+	Report("corpus", "file by file, wire bytes per file", double(single.wireBytes) / count, "bytes");
+
+	RemoveCorpus(corpus);
+}
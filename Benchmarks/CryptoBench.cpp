@@ -0,0 +1,99 @@
+#include "Bench.h"
+#include <FrameCipher.h>
+
+namespace
+{
+	const size_t WindowFrames = 20;
+
+	CipherKey BenchKey()
+	{
+		CipherKey key;
+		memset(key.bytes, 7, sizeof(key.bytes));
+		return key;
+	}
+
+	// MB/s of payload sealed, one frame at a time or a window per SealBatch.
+	double SealThroughput(size_t batch)
+	{
+		FrameCipher cipher(BenchKey(), true);
+		std::vector<MessageData> frames(batch);
+		std::vector<FrameCipher::SealJob> jobs(batch);
+
+		for (size_t i = 0; i < batch; ++i)
+		{
+			frames[i].protocol = Protocol::FileData;
+			frames[i].dataSize = MAX_LENGTH;
+			frames[i].dataIndex = static_cast<int>(i);
+			memset(frames[i].data, int(i), MAX_LENGTH);
+
+			const FrameCipher::SealJob job = { &frames[i], frames[i].data, &frames[i] };
+			jobs[i] = job;
+		}
+
+		uint64_t bytes = 0;
+		const double start = Now();
+		double seconds = 0;
+
+		while (seconds < 0.5)
+		{
+			for (int k = 0; k < 64; ++k)
+			{
+				if (batch == 1)
+					cipher.Seal(frames[0], frames[0].data, &frames[0]);
+				else
+					cipher.SealBatch(jobs.data(), batch);
+			}
+			bytes += 64 * batch * MAX_LENGTH;
+			seconds = Now() - start;
+		}
+
+		return bytes / seconds / (1024 * 1024);
+	}
+
+	double SendOnce(short port, const std::string& path, uint64_t size, bool secure)
+	{
+		const CipherKey key = BenchKey();
+
+		LoopbackServer server(port, []() { return std::unique_ptr<StorageBackend>(new NullStorage()); },
+			[&](FileTransferServer& receiver) { if (secure) receiver.SetKey(key); });
+
+		const double seconds = SendFiles(port, std::vector<std::string>(1, path), [&](FileTransferClient& sender)
+		{
+			if (secure)
+				sender.SetKey(key);
+			sender.SetProgressCallback([](const std::string&, uint64_t, uint64_t) {});
+		});
+		server.Wait();
+
+		return double(size) / seconds / (1024 * 1024);
+	}
+}
+
+void CryptoBench(const std::vector<std::string>& args)
+{
+	const uint64_t size = ArgOr(args, 0, 256) * 1024 * 1024;
+	const std::string path = "crypto_bench.bin";
+	short port = 5701;
+
+	char label[64];
+	sprintf_s(label, sizeof(label), "seal (%s), per frame", ChaChaKernel());
+	Report("crypto", label, SealThroughput(1), "MB/s");
+
+	sprintf_s(label, sizeof(label), "seal (%s), %d-frame window", ChaChaKernel(), int(WindowFrames));
+	Report("crypto", label, SealThroughput(WindowFrames), "MB/s");
+	Report("crypto", "cores", std::thread::hardware_concurrency(), "");
+
+	WriteTestFile(path, size, 9);
+
+	// the first pass brings the file into the cache
+	SendOnce(port++, path, size, false);
+
+	const double plain = SendOnce(port++, path, size, false);
+	const double secure = SendOnce(port++, path, size, true);
+
+	Report("crypto", "plain, throughput", plain, "MB/s");
+	Report("crypto", "encrypted, throughput", secure, "MB/s");
+	Report("crypto", "encrypted, share of plain", secure / plain * 100, "%");
+
+	remove(path.c_str());
+}
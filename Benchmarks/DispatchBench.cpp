@@ -0,0 +1,73 @@
+#include "Bench.h"
+#include <ServerSession.h>
+#include <map>
+
+namespace
+{
+	typedef void (*Handler)(TcpSession& session, const MessageData& data);
+
+	void DispatchFrame(TcpSession& session, const MessageData& data)
+	{
+		session.Dispatch(data);
+	}
+
+	template <typename Session, typename Send>
+	double FramesPerSecond(Session& session, MessageData& frame, uint64_t frames, Send send)
+	{
+		session.Dispatch(MessageData(Protocol::FileBegin, "bench.bin"));
+
+		const double begin = Now();
+		for (uint64_t i = 0; i < frames; ++i)
+		{
+			frame.dataIndex = static_cast<int>(i);
+			send(frame);
+		}
+		const double seconds = Now() - begin;
+
+		session.ResetSession();
+
+		return frames / seconds;
+	}
+}
+
+void DispatchBench(const std::vector<std::string>& args)
+{
+	const uint64_t frames = ArgOr(args, 0, 5000000);
+
+	SessionOptions options;
+	BufferPool pool;
+	MessageData frame;
+	memset(&frame, 0, sizeof(frame));
+	frame.dataSize = MAX_LENGTH;
+
+	{
+		TcpSession session(options, pool);
+		session.SetStorage(std::unique_ptr<StorageBackend>(new NullStorage()));
+		frame.protocol = Protocol::FileData;
+
+		Report("dispatch", "TCP FileData, switch", FramesPerSecond(session, frame, frames,
+			[&](const MessageData& data) { session.Dispatch(data); }), "frames/s");
+
+		std::map<Protocol, Handler> handlers;
+		handlers[Protocol::FileBegin] = &DispatchFrame;
+		handlers[Protocol::FileData] = &DispatchFrame;
+		handlers[Protocol::FileEnd] = &DispatchFrame;
+		handlers[Protocol::Done] = &DispatchFrame;
+		handlers[Protocol::Manifest] = &DispatchFrame;
+		handlers[Protocol::Hole] = &DispatchFrame;
+
+		Report("dispatch", "TCP FileData, std::map in front", FramesPerSecond(session, frame, frames,
+			[&](const MessageData& data) { handlers.find(data.protocol)->second(session, data); }), "frames/s");
+	}
+
+	{
+		Socket unused(Socket::Udp);
+		UdpSession session(options, pool, unused);
+		session.SetStorage(std::unique_ptr<StorageBackend>(new NullStorage()));
+		frame.protocol = Protocol::Chunk;
+
+		// blocks in order, each one flushes the window right away
+		Report("dispatch", "UDP Chunk, switch", FramesPerSecond(session, frame, frames,
+			[&](const MessageData& data) { session.Dispatch(data); }), "frames/s");
+	}
+}
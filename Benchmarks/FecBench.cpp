@@ -0,0 +1,110 @@
+#include "Bench.h"
+#include <Fec.h>
+#include <Loopback.h>
+#include <algorithm>
+
+namespace
+{
+	struct LossRun
+	{
+		double seconds;
+		double p50;    // gaps between acknowledged windows, milliseconds
+		double p99;
+	};
+
+	LossRun SendWithLoss(short port, const std::string& path, double loss, bool fec)
+	{
+		std::vector<double> gaps;
+		double last = 0;
+
+		LoopbackServer server(port, []() { return std::unique_ptr<StorageBackend>(new NullStorage()); });
+		LoopbackTransport::SetLoss(port, loss);
+
+		LossRun run;
+		run.seconds = SendFiles(port, std::vector<std::string>(1, path), [&](FileTransferClient& sender)
+		{
+			sender.SetForwardErrorCorrection(fec);
+			sender.SetProgressCallback([&](const std::string&, uint64_t, uint64_t)
+			{
+				const double now = Now();
+				if (last > 0)
+					gaps.push_back((now - last) * 1000);
+				last = now;
+			});
+		});
+		server.Wait();
+
+		std::sort(gaps.begin(), gaps.end());
+		run.p50 = gaps.empty() ? 0 : gaps[gaps.size() / 2];
+		run.p99 = gaps.empty() ? 0 : gaps[gaps.size() * 99 / 100];
+
+		return run;
+	}
+
+	// MB/s of GfMulAdd with one factor over a block of the given length.
+	double KernelThroughput(uint8_t factor, size_t length)
+	{
+		std::vector<char> src(length);
+		std::vector<char> dst(length, 0);
+		for (size_t i = 0; i < length; ++i)
+		{
+			src[i] = static_cast<char>(i * 7 + 1);
+		}
+
+		uint64_t bytes = 0;
+		const double start = Now();
+		double seconds = 0;
+
+		while (seconds < 0.5)
+		{
+			for (int k = 0; k < 256; ++k)
+			{
+				GfMulAdd(dst.data(), src.data(), factor, length);
+			}
+			bytes += 256 * length;
+			seconds = Now() - start;
+		}
+
+		return bytes / seconds / (1024 * 1024);
+	}
+}
+
+void FecBench(const std::vector<std::string>& args)
+{
+	// the kernel this CPU dispatches to, over one block and over 64 KB
+	const std::string kernel = std::string("GF multiply-add, ") + GfMulAddKernel();
+
+	Report("fec", (kernel + ", block").c_str(), KernelThroughput(0x53, MAX_LENGTH), "MB/s");
+	Report("fec", (kernel + ", 64 KB").c_str(), KernelThroughput(0x53, 64 * 1024), "MB/s");
+	Report("fec", "GF XOR, 64 KB", KernelThroughput(1, 64 * 1024), "MB/s");
+
+	if (PROTOCOL != Socket::Udp)
+	{
+		Report("fec", "parity only runs over UDP", 0, "");
+		return;
+	}
+
+	const uint64_t size = ArgOr(args, 0, 1) * 1024 * 1024;
+	const std::string path = "fec_bench.bin";
+	const double losses[] = { 0, 0.01, 0.02, 0.05 };
+	short port = 5621;
+
+	WriteTestFile(path, size, 4);
+
+	for (size_t i = 0; i < sizeof(losses) / sizeof(losses[0]); ++i)
+	{
+		for (int fec = 0; fec < 2; ++fec)
+		{
+			const LossRun run = SendWithLoss(port++, path, losses[i], fec != 0);
+
+			char what[64];
+			sprintf_s(what, sizeof(what), "%.0f%% loss, %s", losses[i] * 100, fec ? "FEC" : "ARQ only");
+
+			Report("fec", (std::string(what) + ", goodput").c_str(), size / run.seconds / (1024 * 1024), "MB/s");
+			Report("fec", (std::string(what) + ", p50 window").c_str(), run.p50, "ms");
+			Report("fec", (std::string(what) + ", p99 window").c_str(), run.p99, "ms");
+		}
+	}
+
+	remove(path.c_str());
+}
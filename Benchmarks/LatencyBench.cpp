@@ -0,0 +1,104 @@
+#include "Bench.h"
+#include <AsyncTransferClient.h>
+#include <algorithm>
+#include <atomic>
+
+namespace
+{
+	const size_t SmallFileSize = 64 * 1024;
+
+	// Milliseconds each small upload took from Upload to done, one after
+	// the other, next to a bulk upload when bulk is set.
+	std::vector<double> SmallLatencies(short port, uint64_t cap, size_t count, bool bulk, unsigned int priority)
+	{
+		LoopbackServer server(port, []() { return std::unique_ptr<StorageBackend>(new NullStorage()); },
+			[](FileTransferServer& receiver) { receiver.SetPersistent(true); });
+
+		AsyncTransferClient client(PROTOCOL, LOOPBACK_ADDRESS, port, 2);
+		client.SetBandwidthCap(cap);
+
+		UploadTask bulkTask;
+		if (bulk)
+		{
+			std::atomic<bool> started(false);
+			bulkTask = client.Upload("latency_bulk.bin", [&started](const std::string&, uint64_t sent, uint64_t)
+			{
+				if (sent > 0)
+					started = true;
+			});
+
+			while (!started && !bulkTask.IsDone())
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+		}
+
+		std::vector<double> latencies;
+		for (size_t i = 0; i < count; ++i)
+		{
+			const double begin = Now();
+			client.Upload("latency_small.bin", ProgressCallback(), priority).Wait();
+			latencies.push_back((Now() - begin) * 1000);
+
+			if (bulk && bulkTask.IsDone())
+			{
+				throw std::runtime_error("Error: [LatencyBench] bulk upload ended before the small ones");
+			}
+
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		}
+
+		if (bulk)
+		{
+			bulkTask.Cancel();
+			try
+			{
+				bulkTask.Wait();
+			}
+			catch (const std::runtime_error&)
+			{
+				// cancelled
+			}
+		}
+
+		std::sort(latencies.begin(), latencies.end());
+		return latencies;
+	}
+
+	void ReportLatencies(const char* what, const std::vector<double>& latencies, double target)
+	{
+		const size_t within = std::upper_bound(latencies.begin(), latencies.end(), target) - latencies.begin();
+
+		Report("latency", (std::string(what) + ", p50").c_str(), latencies[latencies.size() / 2], "ms");
+		Report("latency", (std::string(what) + ", p99").c_str(), latencies[latencies.size() * 99 / 100], "ms");
+		Report("latency", (std::string(what) + ", in target").c_str(), 100.0 * within / latencies.size(), "%");
+	}
+}
+
+void LatencyBench(const std::vector<std::string>& args)
+{
+	// a TCP server serves one connection at a time, the small files would wait for the bulk one
+	if (PROTOCOL == Socket::Tcp)
+	{
+		Report("latency", "uploads never overlap over TCP", 0, "");
+		return;
+	}
+
+	const size_t count = static_cast<size_t>(ArgOr(args, 0, 100));
+	// low enough that the bulk upload alone fills it on loopback
+	const uint64_t cap = ArgOr(args, 1, 4) * 1024 * 1024;
+	const double target = static_cast<double>(ArgOr(args, 2, 30));
+	short port = 5641;
+
+	WriteTestFile("latency_small.bin", SmallFileSize, 5);
+	// at the cap the bulk upload outlasts the small ones, about 100 ms each
+	WriteTestFile("latency_bulk.bin", cap * (count / 10 + 5), 6);
+
+	Report("latency", "latency target", target, "ms");
+	ReportLatencies("64 KB alone", SmallLatencies(port++, cap, count, false, 1), target);
+	ReportLatencies("64 KB beside bulk, priority 1", SmallLatencies(port++, cap, count, true, 1), target);
+	ReportLatencies("64 KB beside bulk, priority 8", SmallLatencies(port++, cap, count, true, 8), target);
+
+	remove("latency_small.bin");
+	remove("latency_bulk.bin");
+}
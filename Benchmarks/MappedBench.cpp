@@ -0,0 +1,57 @@
+#include "Bench.h"
+
+namespace
+{
+	struct CpuCost
+	{
+		double client;    // CPU seconds of the sending thread
+		double total;     // both ends
+		double seconds;
+	};
+
+	CpuCost SendOnce(short port, const std::string& path, bool mapped)
+	{
+		LoopbackServer server(port, []() { return std::unique_ptr<StorageBackend>(new NullStorage()); });
+
+		const double thread = ThreadCpuSeconds();
+		const double process = ProcessCpuSeconds();
+
+		CpuCost cost;
+		cost.seconds = SendFiles(port, std::vector<std::string>(1, path), [mapped](FileTransferClient& sender)
+		{
+			sender.SetMappedReads(mapped);
+			sender.SetProgressCallback([](const std::string&, uint64_t, uint64_t) {});
+		});
+		server.Wait();
+
+		cost.client = ThreadCpuSeconds() - thread;
+		cost.total = ProcessCpuSeconds() - process;
+
+		return cost;
+	}
+}
+
+void MappedBench(const std::vector<std::string>& args)
+{
+	const uint64_t size = ArgOr(args, 0, 1024) * 1024 * 1024;
+	const double gigabytes = double(size) / (1024.0 * 1024 * 1024);
+	const std::string path = "mapped_bench.bin";
+	short port = 5651;
+
+	WriteTestFile(path, size, 7);
+
+	// the first pass brings the file into the cache, both modes then read it from there
+	SendOnce(port++, path, true);
+
+	for (int mapped = 1; mapped >= 0; --mapped)
+	{
+		const CpuCost cost = SendOnce(port++, path, mapped != 0);
+		const char* mode = mapped ? "mapped" : "staging";
+
+		Report("mapped", (std::string(mode) + ", client CPU per GB").c_str(), cost.client / gigabytes, "s");
+		Report("mapped", (std::string(mode) + ", both ends CPU per GB").c_str(), cost.total / gigabytes, "s");
+		Report("mapped", (std::string(mode) + ", throughput").c_str(), double(size) / cost.seconds / (1024 * 1024), "MB/s");
+	}
+
+	remove(path.c_str());
+}
@@ -0,0 +1,87 @@
+#include "Bench.h"
+#include <ServerPool.h>
+
+namespace
+{
+	// A pool of workers on port. ServerPool serves until the process
+	// ends, so it is left running.
+	void StartPool(short port, size_t workers)
+	{
+		ServerPool* pool = new ServerPool(PROTOCOL, LOOPBACK_ADDRESS, port, workers);
+		pool->SetStorage([]() { return std::unique_ptr<StorageBackend>(new NullStorage()); });
+		pool->Init();
+
+		std::thread([pool]() { pool->Run(); }).detach();
+	}
+
+	// Seconds until all clients have sent the file, each on its own thread.
+	double SendFromClients(short port, const std::string& path, size_t clients)
+	{
+		std::vector<std::thread> threads;
+		std::vector<std::string> errors(clients);
+
+		const double begin = Now();
+		for (size_t c = 0; c < clients; ++c)
+		{
+			threads.push_back(std::thread([&, c]()
+			{
+				try
+				{
+					SendFiles(port, std::vector<std::string>(1, path), [](FileTransferClient& sender)
+					{
+						sender.SetProgressCallback([](const std::string&, uint64_t, uint64_t) {});
+					});
+				}
+				catch (const std::exception& exc)
+				{
+					errors[c] = exc.what();
+				}
+			}));
+		}
+
+		for (size_t c = 0; c < clients; ++c)
+		{
+			threads[c].join();
+		}
+		const double seconds = Now() - begin;
+
+		for (size_t c = 0; c < clients; ++c)
+		{
+			if (!errors[c].empty())
+			{
+				throw std::runtime_error(errors[c]);
+			}
+		}
+
+		return seconds;
+	}
+}
+
+void PoolBench(const std::vector<std::string>& args)
+{
+	const size_t clients = static_cast<size_t>(ArgOr(args, 0, 8));
+	const uint64_t size = ArgOr(args, 1, 64) * 1024 * 1024;
+	const size_t cores = std::thread::hardware_concurrency() > 0 ? std::thread::hardware_concurrency() : 1;
+	const size_t most = static_cast<size_t>(ArgOr(args, 2, cores));
+	const std::string path = "pool_bench.bin";
+	short port = 5681;
+
+	WriteTestFile(path, size, 8);
+
+	for (size_t workers = 1; ; workers *= 2)
+	{
+		if (workers > most)
+			workers = most;
+
+		StartPool(port, workers);
+		const double seconds = SendFromClients(port++, path, clients);
+
+		const std::string what = std::to_string(workers) + (workers == 1 ? " worker" : " workers");
+		Report("pool", what.c_str(), double(size) * clients / seconds / (1024 * 1024), "MB/s");
+
+		if (workers == most)
+			break;
+	}
+
+	remove(path.c_str());
+}
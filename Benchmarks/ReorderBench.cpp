@@ -0,0 +1,132 @@
+#include "Bench.h"
+#include <Loopback.h>
+#include <Reassembly.h>
+#include <algorithm>
+
+namespace
+{
+	const char* const ReorderDirectory = "reorder_bench_out";
+
+	// FileStorage that times every WriteAt, in microseconds, and counts its bytes.
+	class TimedStorage : public StorageBackend
+	{
+	public:
+		TimedStorage(std::vector<double>* latencies, uint64_t* bytes)
+			: m_storage(std::vector<std::string>(1, ReorderDirectory))
+			, m_latencies(latencies)
+			, m_bytes(bytes)
+		{}
+
+		void SetPolicy(SyncPolicy policy, bool directIo) override { m_storage.SetPolicy(policy, directIo); }
+
+		SyncPolicy Policy() const override { return m_storage.Policy(); }
+
+		void Reserve(const std::string& name, uint64_t size) override { m_storage.Reserve(name, size); }
+
+		void Open(const std::string& name, bool reserved) override { m_storage.Open(name, reserved); }
+
+		bool IsOpen() const override { return m_storage.IsOpen(); }
+
+		void WriteAt(uint64_t offset, const char* data, size_t size) override
+		{
+			const double start = Now();
+			m_storage.WriteAt(offset, data, size);
+			m_latencies->push_back((Now() - start) * 1000000);
+			*m_bytes += size;
+		}
+
+		void WriteHole(uint64_t offset, uint64_t size) override { m_storage.WriteHole(offset, size); }
+
+		void Finalize() override { m_storage.Finalize(); }
+
+		void Abort() override { m_storage.Abort(); }
+
+		void WriteWhole(const std::string& name, const char* data, size_t size) override { m_storage.WriteWhole(name, data, size); }
+
+		void MakeDirectory(const std::string& name) override { m_storage.MakeDirectory(name); }
+
+		std::string PathOf(const std::string& name) const override { return m_storage.PathOf(name); }
+
+		void DirectoryPaths(const std::string& name, std::vector<std::string>* paths) const override
+		{
+			m_storage.DirectoryPaths(name, paths);
+		}
+
+		void DropReserved() override { m_storage.DropReserved(); }
+
+	private:
+		FileStorage          m_storage;
+		std::vector<double>* m_latencies;
+		uint64_t*            m_bytes;
+	};
+
+	struct ReorderRun
+	{
+		double   seconds;
+		size_t   peakHeld;   // ReassemblyBuffer bytes waiting for an earlier block
+		size_t   writes;
+		uint64_t written;
+		double   p50;        // WriteAt, microseconds
+		double   p99;
+	};
+
+	ReorderRun SendShuffled(short port, const std::string& path, bool shuffle)
+	{
+		std::vector<double> latencies;
+		latencies.reserve(1 << 20);
+
+		ReorderRun run;
+		run.written = 0;
+
+		LoopbackServer server(port, [&]() { return std::unique_ptr<StorageBackend>(new TimedStorage(&latencies, &run.written)); });
+		LoopbackTransport::SetReorder(port, shuffle);
+		ReassemblyBuffer::TakePeakHeld();
+
+		run.seconds = SendFiles(port, std::vector<std::string>(1, path), [](FileTransferClient& sender)
+		{
+			sender.SetProgressCallback([](const std::string&, uint64_t, uint64_t) {});
+		});
+		server.Wait();
+		run.peakHeld = ReassemblyBuffer::TakePeakHeld();
+
+		std::sort(latencies.begin(), latencies.end());
+		run.writes = latencies.size();
+		run.p50 = latencies.empty() ? 0 : latencies[latencies.size() / 2];
+		run.p99 = latencies.empty() ? 0 : latencies[latencies.size() * 99 / 100];
+
+		remove((std::string(ReorderDirectory) + "/" + path).c_str());
+
+		return run;
+	}
+}
+
+void ReorderBench(const std::vector<std::string>& args)
+{
+	if (PROTOCOL != Socket::Udp)
+	{
+		Report("reorder", "blocks only arrive out of order over UDP", 0, "");
+		return;
+	}
+
+	const uint64_t size = ArgOr(args, 0, 16) * 1024 * 1024;
+	const std::string path = "reorder_bench.bin";
+	short port = 5711;
+
+	WriteTestFile(path, size, 11);
+	::MakeDirectory(ReorderDirectory);
+
+	for (int shuffle = 0; shuffle < 2; ++shuffle)
+	{
+		const ReorderRun run = SendShuffled(port++, path, shuffle != 0);
+		const std::string what = shuffle ? "shuffled" : "in order";
+
+		Report("reorder", (what + ", goodput").c_str(), size / run.seconds / (1024 * 1024), "MB/s");
+		Report("reorder", (what + ", reassembly peak held").c_str(), run.peakHeld / 1024.0, "KB");
+		Report("reorder", (what + ", bytes per write").c_str(),
+			run.writes > 0 ? double(run.written) / run.writes : 0, "bytes");
+		Report("reorder", (what + ", write p50").c_str(), run.p50, "us");
+		Report("reorder", (what + ", write p99").c_str(), run.p99, "us");
+	}
+
+	remove(path.c_str());
+}
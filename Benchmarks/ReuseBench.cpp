@@ -0,0 +1,98 @@
+#include "Bench.h"
+#include <ConnectionPool.h>
+#include <algorithm>
+
+namespace
+{
+	struct SetupRun
+	{
+		double p50;    // Init, microseconds
+		double p99;
+		double total;  // mean of Init and a small transfer, microseconds
+	};
+
+	// Clients one after the other, each Init followed by one transfer of
+	// path, taking their connection from the pool when one is given.
+	SetupRun TimeSetups(short port, const std::string& path, size_t transfers, ConnectionPool* connections,
+		const CipherKey* key)
+	{
+		// persistent, so it keeps serving every client; TCP connections
+		// stay open for the pool
+		LoopbackServer server(port, []() { return std::unique_ptr<StorageBackend>(new NullStorage()); },
+			[key](FileTransferServer& receiver)
+		{
+			receiver.SetPersistent(true);
+			if (key != nullptr)
+				receiver.SetKey(*key);
+		});
+
+		std::vector<double> setups;
+		double total = 0;
+
+		// the first one fills the pool and is not counted
+		for (size_t i = 0; i <= transfers; ++i)
+		{
+			std::unique_ptr<FileTransferClient> client(FileTransferClient::MakeClient(PROTOCOL, LOOPBACK_ADDRESS, port));
+			client->SetConnectionPool(connections);
+			client->SetProgressCallback([](const std::string&, uint64_t, uint64_t) {});
+			if (key != nullptr)
+				client->SetKey(*key);
+
+			const double begin = Now();
+			client->Init();
+			const double setup = Now() - begin;
+			client->Transfer(std::vector<std::string>(1, path));
+			const double end = Now();
+
+			if (i > 0)
+			{
+				setups.push_back(setup * 1000000);
+				total += (end - begin) * 1000000;
+			}
+		}
+
+		if (connections != nullptr)
+		{
+			connections->Clear();
+		}
+
+		std::sort(setups.begin(), setups.end());
+
+		SetupRun run;
+		run.p50 = setups[setups.size() / 2];
+		run.p99 = setups[setups.size() * 99 / 100];
+		run.total = total / setups.size();
+
+		return run;
+	}
+}
+
+void ReuseBench(const std::vector<std::string>& args)
+{
+	const size_t transfers = static_cast<size_t>(std::max<uint64_t>(ArgOr(args, 0, 200), 1));
+	const std::string path = "reuse_bench.bin";
+	short port = 5721;
+
+	CipherKey key;
+	memset(key.bytes, 7, sizeof(key.bytes));
+
+	WriteTestFile(path, 4 * 1024, 12);
+
+	for (int keyed = 0; keyed < 2; ++keyed)
+	{
+		for (int pooled = 0; pooled < 2; ++pooled)
+		{
+			ConnectionPool connections;
+			const SetupRun run = TimeSetups(port++, path, transfers, pooled ? &connections : nullptr,
+				keyed ? &key : nullptr);
+
+			const std::string what = std::string(keyed ? "keyed" : "plain") + (pooled ? ", pooled" : ", fresh Init");
+
+			Report("reuse", (what + ", setup p50").c_str(), run.p50, "us");
+			Report("reuse", (what + ", setup p99").c_str(), run.p99, "us");
+			Report("reuse", (what + ", setup and 4 KB file").c_str(), run.total, "us");
+		}
+	}
+
+	remove(path.c_str());
+}
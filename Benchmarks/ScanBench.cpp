@@ -0,0 +1,157 @@
+#include "Bench.h"
+#include <Prefetcher.h>
+#include <cstdio>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+	const char* const ScanDirectory = "scan_bench";
+
+	// count files of size bytes each, every one different.
+	std::vector<std::string> WriteSmallFiles(size_t count, size_t size)
+	{
+		::MakeDirectory(ScanDirectory);
+
+		std::vector<char> contents(size, 'x');
+		std::vector<std::string> paths;
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			char name[64];
+			sprintf_s(name, sizeof(name), "%s/f%07u.bin", ScanDirectory, unsigned(i));
+			paths.push_back(name);
+
+			memcpy(contents.data(), &i, std::min(sizeof(i), contents.size()));
+
+			FILE* file = fopen(name, "wb");
+			if (file == nullptr || fwrite(contents.data(), 1, contents.size(), file) != contents.size())
+			{
+				throw std::runtime_error(std::string("Error: [WriteSmallFiles] failed write ") + name);
+			}
+			fclose(file);
+		}
+
+		return paths;
+	}
+
+	// Evicts the file's pages from the page cache, its directory entry stays cached.
+	void DropCached(const std::string& path)
+	{
+#ifdef _WIN32
+		// the first unbuffered handle to a file flushes and purges its cached pages
+		HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+			OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, NULL);
+		if (file != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(file);
+		}
+#else
+		const int file = open(path.c_str(), O_RDONLY);
+		if (file >= 0)
+		{
+			fdatasync(file);
+			posix_fadvise(file, 0, 0, POSIX_FADV_DONTNEED);
+			close(file);
+		}
+#endif
+	}
+
+	void DropCached(const std::vector<std::string>& paths)
+	{
+		for (size_t i = 0; i < paths.size(); ++i)
+		{
+			DropCached(paths[i]);
+		}
+	}
+
+	// Open, size and read one file after the other, as the sender did
+	// before the prefetcher.
+	double SerialScan(const std::vector<std::string>& paths, size_t size)
+	{
+		std::vector<char> buffer(size);
+		const double begin = Now();
+
+		for (size_t i = 0; i < paths.size(); ++i)
+		{
+			FILE* file = fopen(paths[i].c_str(), "rb");
+			if (file == nullptr)
+			{
+				throw std::runtime_error("Error: [SerialScan] failed load file, name " + paths[i]);
+			}
+
+			fseek(file, 0, SEEK_END);
+			const long length = ftell(file);
+			fseek(file, 0, SEEK_SET);
+
+			fread(buffer.data(), 1, std::min(size_t(length), buffer.size()), file);
+			fclose(file);
+		}
+
+		return Now() - begin;
+	}
+
+	// The same through FilePrefetcher, which reads the files whole.
+	double PrefetchedScan(const std::vector<std::string>& paths, size_t size)
+	{
+		const double begin = Now();
+		{
+			FilePrefetcher prefetcher(paths, size);
+			FilePrefetcher::Entry entry;
+
+			for (size_t i = 0; i < paths.size(); ++i)
+			{
+				prefetcher.Take(i, &entry);
+
+				if (!entry.error.empty())
+				{
+					throw std::runtime_error(entry.error);
+				}
+				if (entry.file != nullptr)
+				{
+					fclose(entry.file);
+				}
+			}
+		}
+
+		return Now() - begin;
+	}
+}
+
+void ScanBench(const std::vector<std::string>& args)
+{
+	const size_t count = static_cast<size_t>(ArgOr(args, 0, 100000));
+	const size_t size = static_cast<size_t>(ArgOr(args, 1, 4)) * 1024;
+	const short port = 5631;
+
+	const std::vector<std::string> paths = WriteSmallFiles(count, size);
+
+	DropCached(paths);
+	Report("scan", "files/sec, cold, one after the other", count / SerialScan(paths, size), "");
+
+	DropCached(paths);
+	Report("scan", "files/sec, cold, prefetched", count / PrefetchedScan(paths, size), "");
+
+	DropCached(paths);
+	{
+		LoopbackServer server(port, []() { return std::unique_ptr<StorageBackend>(new NullStorage()); });
+
+		const double seconds = SendFiles(port, paths, [](FileTransferClient& sender)
+		{
+			sender.SetProgressCallback([](const std::string&, uint64_t, uint64_t) {});
+		});
+		server.Wait();
+
+		Report("scan", "files/sec, cold, loopback transfer", count / seconds, "");
+	}
+
+	for (size_t i = 0; i < paths.size(); ++i)
+	{
+		remove(paths[i].c_str());
+	}
+}
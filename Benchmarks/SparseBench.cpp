@@ -0,0 +1,103 @@
+#include "Bench.h"
+#include <Loopback.h>
+#include <Storage.h>
+#include <atomic>
+
+namespace
+{
+	const uint64_t Gigabyte = 1024ULL * 1024 * 1024;
+	const size_t RegionSize = 8 * 1024 * 1024;
+
+	// Keeps nothing, counts what arrives as data and as holes.
+	class CountingStorage : public NullStorage
+	{
+	public:
+		CountingStorage(std::atomic<uint64_t>& data, std::atomic<uint64_t>& holes)
+			: m_data(data)
+			, m_holes(holes)
+		{}
+
+		void WriteAt(uint64_t offset, const char* data, size_t size) override { m_data += size; }
+
+		void WriteHole(uint64_t offset, uint64_t size) override { m_holes += size; }
+
+	private:
+		std::atomic<uint64_t>& m_data;
+		std::atomic<uint64_t>& m_holes;
+	};
+
+	// A VM image of size bytes: at the start of every gigabyte a region of
+	// data and one of written zeros, holes everywhere else. It is laid out
+	// through FileStorage so the holes are real on every platform.
+	void WriteSparseImage(const std::string& name, uint64_t size)
+	{
+		FileStorage storage;
+		std::vector<char> data(RegionSize);
+		const std::vector<char> zeros(RegionSize, 0);
+
+		for (size_t i = 0; i < data.size(); ++i)
+		{
+			data[i] = static_cast<char>(i * 2654435761u >> 13 | 1);
+		}
+
+		storage.Open(name, false);
+		for (uint64_t offset = 0; offset < size; offset += Gigabyte)
+		{
+			const uint64_t left = size - offset;
+			const uint64_t gap = left < Gigabyte ? left : Gigabyte;
+
+			storage.WriteAt(offset, data.data(), data.size());
+			storage.WriteAt(offset + RegionSize, zeros.data(), zeros.size());
+			storage.WriteHole(offset + 2 * RegionSize, gap - 2 * RegionSize);
+		}
+		storage.Finalize();
+	}
+
+	void SendImage(short port, const std::string& path, uint64_t size, bool sparse)
+	{
+		std::atomic<uint64_t> data(0);
+		std::atomic<uint64_t> holes(0);
+
+		LoopbackServer server(port, [&]() { return std::unique_ptr<StorageBackend>(new CountingStorage(data, holes)); });
+		const uint64_t wireBefore = LoopbackTransport::BytesSentTo(port);
+
+		const double seconds = SendFiles(port, std::vector<std::string>(1, path), [sparse](FileTransferClient& sender)
+		{
+			sender.SetSparse(sparse);
+			sender.SetProgressCallback([](const std::string&, uint64_t, uint64_t) {});
+		});
+		server.Wait();
+
+		// every frame the client sent, headers and control frames included
+		const uint64_t wire = LoopbackTransport::BytesSentTo(port) - wireBefore;
+
+		const char* mode = sparse ? "holes skipped" : "every byte";
+
+		Report("sparse", (std::string(mode) + ", transfer time").c_str(), seconds, "s");
+		Report("sparse", (std::string(mode) + ", bytes on the wire").c_str(), double(wire) / (1024 * 1024), "MB");
+		Report("sparse", (std::string(mode) + ", stored as data").c_str(), double(data) / (1024 * 1024), "MB");
+		Report("sparse", (std::string(mode) + ", sent as holes").c_str(), double(holes) / (1024 * 1024), "MB");
+	}
+}
+
+void SparseBench(const std::vector<std::string>& args)
+{
+	const uint64_t size = ArgOr(args, 0, 20) * Gigabyte;
+	const std::string path = "sparse_bench.img";
+	short port = 5661;
+
+	if (size < Gigabyte)
+	{
+		throw std::runtime_error("Error: [SparseBench] the image is at least 1 GB");
+	}
+
+	WriteSparseImage(path, size);
+
+	Report("sparse", "image size", double(size) / (1024 * 1024), "MB");
+	Report("sparse", "image data and written zeros", double(size / Gigabyte * 2 * RegionSize) / (1024 * 1024), "MB");
+
+	SendImage(port++, path, size, true);
+	SendImage(port++, path, size, false);
+
+	remove(path.c_str());
+}
@@ -0,0 +1,129 @@
+#include "Bench.h"
+#include <Storage.h>
+
+namespace
+{
+	const size_t SmallFileSize = 4 * 1024;
+	const size_t WriteSize = 64 * 1024;
+
+	// Every worker stores its names through a FileStorage of its own over
+	// the same roots, as the sessions of a server pool do. Returns seconds.
+	double RunWorkers(const std::vector<std::string>& roots, size_t workers,
+		const std::function<void(StorageBackend&, size_t)>& work)
+	{
+		std::vector<std::thread> threads;
+		std::vector<std::string> errors(workers);
+
+		const double begin = Now();
+		for (size_t w = 0; w < workers; ++w)
+		{
+			threads.push_back(std::thread([&, w]()
+			{
+				try
+				{
+					FileStorage storage(roots, 2);
+					storage.SetPolicy(SyncOnFileEnd, false);
+					work(storage, w);
+				}
+				catch (const std::exception& exc)
+				{
+					errors[w] = exc.what();
+				}
+			}));
+		}
+
+		for (size_t w = 0; w < workers; ++w)
+		{
+			threads[w].join();
+		}
+		const double seconds = Now() - begin;
+
+		for (size_t w = 0; w < workers; ++w)
+		{
+			if (!errors[w].empty())
+			{
+				throw std::runtime_error(errors[w]);
+			}
+		}
+
+		return seconds;
+	}
+
+	std::string FileName(size_t worker, size_t index)
+	{
+		char name[64];
+		sprintf_s(name, sizeof(name), "w%u_f%07u.bin", unsigned(worker), unsigned(index));
+		return name;
+	}
+
+	// Removes files 0 to count of every worker, and the large one after them.
+	void RemoveFiles(const std::vector<std::string>& roots, size_t workers, size_t count)
+	{
+		FileStorage storage(roots, 2);
+
+		for (size_t w = 0; w < workers; ++w)
+		{
+			for (size_t i = 0; i <= count; ++i)
+			{
+				remove(storage.PathOf(FileName(w, i)).c_str());
+			}
+		}
+	}
+}
+
+void StorageBench(const std::vector<std::string>& args)
+{
+	const size_t files = static_cast<size_t>(ArgOr(args, 0, 10000));
+	const uint64_t largeSize = ArgOr(args, 1, 256) * 1024 * 1024;
+
+	// one root per disk, two directories of the current one without any
+	std::vector<std::string> roots(args.size() > 2 ? args.begin() + 2 : args.end(), args.end());
+	if (roots.empty())
+	{
+		roots.push_back("storage_bench_a");
+		roots.push_back("storage_bench_b");
+	}
+	for (size_t i = 0; i < roots.size(); ++i)
+	{
+		::MakeDirectory(roots[i]);
+	}
+
+	const std::vector<char> data(WriteSize, 'x');
+
+	for (size_t used = 1; used <= roots.size(); ++used)
+	{
+		const std::vector<std::string> some(roots.begin(), roots.begin() + used);
+		const std::string label = std::to_string(used) + (used == 1 ? " root" : " roots");
+
+		const size_t perWorker = files / used;
+		const double smallSeconds = RunWorkers(some, used, [&](StorageBackend& storage, size_t worker)
+		{
+			for (size_t i = 0; i < perWorker; ++i)
+			{
+				const std::string name = FileName(worker, i);
+
+				storage.Open(name, false);
+				storage.WriteAt(0, data.data(), SmallFileSize);
+				storage.Finalize();
+			}
+		});
+
+		const double largeSeconds = RunWorkers(some, used, [&](StorageBackend& storage, size_t worker)
+		{
+			const std::string name = FileName(worker, perWorker);
+
+			storage.Open(name, false);
+			for (uint64_t offset = 0; offset < largeSize; offset += data.size())
+			{
+				storage.WriteAt(offset, data.data(), data.size());
+			}
+			storage.Finalize();
+		});
+
+		RemoveFiles(some, used, perWorker);
+
+		Report("storage", (label + ", 4 KB files created/sec").c_str(), perWorker * used / smallSeconds, "");
+		Report("storage", (label + ", large file write").c_str(),
+			double(largeSize) * used / largeSeconds / (1024 * 1024), "MB/s");
+	}
+}
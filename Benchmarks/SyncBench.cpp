@@ -0,0 +1,62 @@
+#include "Bench.h"
+
+namespace
+{
+	const char* const SyncDirectory = "sync_bench_out";
+
+	// Seconds for a loopback transfer of the files into SyncDirectory with
+	// the server writing under policy.
+	double SendWithPolicy(short port, const std::vector<std::string>& files, SyncPolicy policy, bool directIo)
+	{
+		LoopbackServer server(port, []()
+			{ return std::unique_ptr<StorageBackend>(new FileStorage(std::vector<std::string>(1, SyncDirectory))); },
+			[=](FileTransferServer& receiver) { receiver.SetSyncPolicy(policy, directIo); });
+
+		const double seconds = SendFiles(port, files, [](FileTransferClient& sender)
+		{
+			sender.SetProgressCallback([](const std::string&, uint64_t, uint64_t) {});
+		});
+		server.Wait();
+
+		for (size_t i = 0; i < files.size(); ++i)
+		{
+			remove((std::string(SyncDirectory) + "/" + files[i]).c_str());
+		}
+
+		return seconds;
+	}
+}
+
+void SyncBench(const std::vector<std::string>& args)
+{
+	const size_t count = static_cast<size_t>(ArgOr(args, 0, 4));
+	const uint64_t size = ArgOr(args, 1, 64) * 1024 * 1024;
+
+	const SyncPolicy policies[] = { SyncNone, SyncOnFileEnd, SyncPeriodic };
+	const char* const names[] = { "none", "end", "periodic" };
+	short port = 5671;
+
+	std::vector<std::string> files;
+	for (size_t i = 0; i < count; ++i)
+	{
+		files.push_back("sync_bench_" + std::to_string(i) + ".bin");
+		WriteTestFile(files.back(), size, unsigned(10 + i));
+	}
+	::MakeDirectory(SyncDirectory);
+
+	for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]); ++p)
+	{
+		for (int direct = 0; direct < 2; ++direct)
+		{
+			const double seconds = SendWithPolicy(port++, files, policies[p], direct != 0);
+			const std::string what = std::string("-sync ") + names[p] + (direct ? " -direct" : "");
+
+			Report("sync", what.c_str(), double(size) * count / seconds / (1024 * 1024), "MB/s");
+		}
+	}
+
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		remove(files[i].c_str());
+	}
+}
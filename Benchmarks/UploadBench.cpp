@@ -0,0 +1,145 @@
+#include "Bench.h"
+#include <AsyncTransferClient.h>
+#include <atomic>
+
+namespace
+{
+	// Share of the bandwidth cap per upload, low enough that none finishes
+	// while it is measured and that a thousand fit through one server.
+	const uint64_t UploadRate = 64 * 1024;
+
+	// Waits up to seconds for ready.
+	template <typename Ready>
+	bool WaitFor(Ready ready, double seconds)
+	{
+		const double end = Now() + seconds;
+		while (!ready())
+		{
+			if (Now() > end)
+				return false;
+
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+
+		return true;
+	}
+
+	void CancelAll(std::vector<UploadTask>& tasks)
+	{
+		for (size_t i = 0; i < tasks.size(); ++i)
+		{
+			tasks[i].Cancel();
+		}
+
+		for (size_t i = 0; i < tasks.size(); ++i)
+		{
+			try
+			{
+				tasks[i].Wait();
+			}
+			catch (const std::runtime_error&)
+			{
+				// cancelled
+			}
+		}
+	}
+}
+
+void UploadBench(const std::vector<std::string>& args)
+{
+	// a TCP server serves one connection at a time, uploads to it never overlap
+	const size_t running = PROTOCOL == Socket::Tcp ? 1 : static_cast<size_t>(ArgOr(args, 0, 1000));
+	const size_t queued = static_cast<size_t>(ArgOr(args, 1, 10000));
+	const short port = 5611;
+	const std::string path = "upload_bench.bin";
+
+	WriteTestFile(path, 64 * 1024 * 1024, 3);
+
+	// persistent, so they keep serving every upload; one per phase, a TCP
+	// server would otherwise serve only the first client
+	const StorageFactory makeStorage = []() { return std::unique_ptr<StorageBackend>(new NullStorage()); };
+	const auto persistent = [](FileTransferServer& receiver) { receiver.SetPersistent(true); };
+	LoopbackServer queueServer(port, makeStorage, persistent);
+	LoopbackServer runServer(port + 1, makeStorage, persistent);
+
+	// Queued first and kept until the end, so neither phase reuses heap
+	// the other freed.
+	AsyncTransferClient queueClient(PROTOCOL, LOOPBACK_ADDRESS, port, 1);
+	queueClient.SetBandwidthCap(UploadRate);
+	std::vector<UploadTask> queuedTasks;
+	std::atomic<bool> started(false);
+	{
+		// the only running upload stays busy, everything after it waits in the queue
+		queuedTasks.push_back(queueClient.Upload(path, [&started](const std::string&, uint64_t sent, uint64_t)
+		{
+			if (sent > 0)
+				started = true;
+		}));
+		queuedTasks.reserve(queued + 1);
+
+		if (!WaitFor([&]() { return bool(started); }, 30))
+		{
+			CancelAll(queuedTasks);
+			throw std::runtime_error("Error: [UploadBench] upload did not start");
+		}
+
+		const uint64_t before = ResidentBytes();
+		for (size_t i = 0; i < queued; ++i)
+		{
+			queuedTasks.push_back(queueClient.Upload(path));
+		}
+		const uint64_t after = ResidentBytes();
+
+		Report("upload", "memory per queued upload", (double(after) - double(before)) / queued, "bytes");
+	}
+
+	{
+		const uint64_t before = ResidentBytes();
+
+		AsyncTransferClient client(PROTOCOL, LOOPBACK_ADDRESS, port + 1, running);
+		client.SetBandwidthCap(running * UploadRate);
+
+		std::unique_ptr<std::atomic<bool>[]> started(new std::atomic<bool>[running]());
+		std::vector<UploadTask> tasks;
+
+		for (size_t i = 0; i < running; ++i)
+		{
+			std::atomic<bool>* flag = &started[i];
+			tasks.push_back(client.Upload(path, [flag](const std::string&, uint64_t sent, uint64_t)
+			{
+				if (sent > 0)
+					*flag = true;
+			}));
+		}
+
+		const bool allRunning = WaitFor([&]()
+		{
+			for (size_t i = 0; i < running; ++i)
+			{
+				if (!started[i])
+					return false;
+			}
+			return true;
+		}, 30);
+
+		if (!allRunning)
+		{
+			CancelAll(tasks);
+			CancelAll(queuedTasks);
+			throw std::runtime_error("Error: [UploadBench] uploads did not start side by side");
+		}
+
+		// let the windows and read-ahead fill up
+		std::this_thread::sleep_for(std::chrono::milliseconds(500));
+		const uint64_t during = ResidentBytes();
+
+		CancelAll(tasks);
+
+		Report("upload", "uploads running", double(running), "");
+		Report("upload", "memory per running upload, both ends", (double(during) - double(before)) / running / 1024, "KB");
+	}
+
+	CancelAll(queuedTasks);
+
+	remove(path.c_str());
+}
@@ -0,0 +1,91 @@
+#include "Bench.h"
+#include <Common.h>
+#include <Socket.h>
+#include <cstring>
+
+namespace
+{
+	struct Bench
+	{
+		const char*   name;
+		BenchFunction run;
+		const char*   usage;
+	};
+
+	const Bench Benches[] =
+	{
+		{ "dispatch", &DispatchBench, "[frames]" },
+		{ "alloc", &AllocBench, "[smallMB largeMB]" },
+		{ "upload", &UploadBench, "[running queued]" },
+		{ "fec", &FecBench, "[sizeMB]" },
+		{ "scan", &ScanBench, "[files sizeKB]" },
+		{ "latency", &LatencyBench, "[smallFiles capMB targetMs]" },
+		{ "corpus", &CorpusBench, "[files]" },
+		{ "mapped", &MappedBench, "[sizeMB]" },
+		{ "storage", &StorageBench, "[files sizeMB root...]" },
+		{ "sparse", &SparseBench, "[sizeGB]" },
+		{ "sync", &SyncBench, "[files sizeMB]" },
+		{ "pool", &PoolBench, "[clients sizeMB maxWorkers]" },
+		{ "crypto", &CryptoBench, "[sizeMB]" },
+		{ "reorder", &ReorderBench, "[sizeMB]" },
+		{ "reuse", &ReuseBench, "[transfers]" },
+	};
+
+	void PrintUsage()
+	{
+		std::cout << "Benchmarks all | <name> [args], names:" << std::endl;
+
+		for (size_t i = 0; i < sizeof(Benches) / sizeof(Benches[0]); ++i)
+		{
+			std::cout << "  " << Benches[i].name << " " << Benches[i].usage << std::endl;
+		}
+	}
+}
+
+int main(int argc, char ** argv)
+{
+#ifdef _WINSOCK2API_
+	InitSockets();
+#endif
+
+	int appCode = EXIT_SUCCESS;
+	try
+	{
+		if (argc < 2)
+		{
+			PrintUsage();
+		}
+		else
+		{
+			const std::vector<std::string> args(argv + 2, argv + argc);
+			bool found = false;
+
+			for (size_t i = 0; i < sizeof(Benches) / sizeof(Benches[0]); ++i)
+			{
+				if (strcmp(argv[1], "all") == 0 || strcmp(argv[1], Benches[i].name) == 0)
+				{
+					Benches[i].run(args);
+					found = true;
+				}
+			}
+
+			if (!found)
+			{
+				PrintUsage();
+				appCode = EXIT_FAILURE;
+			}
+		}
+	}
+	catch (const std::exception& exc)
+	{
+		std::cout << exc.what() << std::endl;
+
+		appCode = EXIT_FAILURE;
+	}
+
+#ifdef _WINSOCK2API_
+	FreeSockets();
+#endif
+
+	return appCode;
+}
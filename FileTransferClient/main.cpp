@@ -16,6 +16,9 @@ public:
 		, m_address(ADDRESS)  // default ip address
 		, m_port(PORT)            // default port
 		, m_state(File)
+		, m_fec(false)
+		, m_bandwidth(0)
+		, m_hasKey(false)
 	{}
 
 	void Parse(std::vector<std::string>& fileList)
@@ -27,9 +30,39 @@ public:
 
 		std::string addressFlag = "-a";
 		std::string portFlag = "-p";
+		std::string fecFlag = "-fec";
+		std::string bandwidthFlag = "-bw";
+		std::string keyFlag = "-key";
+		std::string profileFlag = "-profile";
 
 		for (int i = 1; i < m_argc; ++i)
 		{
+			if (m_argv[i] == fecFlag)
+			{
+				m_fec = true;
+				continue;
+			}
+			if (m_argv[i] == bandwidthFlag && i + 1 < m_argc)
+			{
+				m_bandwidth = strtoull(m_argv[++i], nullptr, 10);
+				continue;
+			}
+			if (m_argv[i] == keyFlag && i + 1 < m_argc)
+			{
+				if (!ParseCipherKey(m_argv[++i], &m_key))
+				{
+					throw std::runtime_error("Error: key must be 64 hex digits");
+				}
+				m_hasKey = true;
+				continue;
+			}
+
+			if (m_argv[i] == profileFlag && i + 1 < m_argc)
+			{
+				m_profilePath = m_argv[++i];
+				continue;
+			}
+
 			if (m_state == File)
 			{
 				m_state = m_argv[i] == addressFlag ? Address :
@@ -59,12 +92,41 @@ public:
 		return m_port;
 	}
 
+	bool UseFec() const
+	{
+		return m_fec;
+	}
+
+	// pre-shared key, the transfer is in the clear without one
+	bool GetKey(CipherKey* key) const
+	{
+		*key = m_key;
+		return m_hasKey;
+	}
+
+	// bytes per second, 0 when not capped
+	uint64_t GetBandwidth() const
+	{
+		return m_bandwidth;
+	}
+
+	// Chrome trace output, empty when not profiling
+	const std::string& GetProfilePath() const
+	{
+		return m_profilePath;
+	}
+
 private:
 	int         m_argc;
 	char **     m_argv;
 	std::string m_address;
 	short       m_port;
 	ParserState m_state;
+	bool        m_fec;
+	uint64_t    m_bandwidth;
+	bool        m_hasKey;
+	CipherKey   m_key;
+	std::string m_profilePath;
 };
 
 int main(int argc, char ** argv)
@@ -82,11 +144,35 @@ int main(int argc, char ** argv)
 
 		parser.Parse(files);
 
+		TransferScheduler scheduler(parser.GetBandwidth());
+
 		std::unique_ptr<FileTransferClient>
 			transfer(FileTransferClient::MakeClient(PROTOCOL, ADDRESS, PORT));
 
+		transfer->SetForwardErrorCorrection(parser.UseFec());
+		transfer->SetSchedulerFlow(scheduler.AddFlow());
+
+		CipherKey key;
+		if (parser.GetKey(&key))
+		{
+			transfer->SetKey(key);
+		}
+
+		std::unique_ptr<TransferProfiler> profiler;
+		if (!parser.GetProfilePath().empty())
+		{
+			profiler.reset(new TransferProfiler());
+			transfer->SetProfiler(profiler.get());
+		}
+
 		transfer->Init();
 		transfer->Transfer(files);
+
+		if (profiler)
+		{
+			profiler->Report(std::cout);
+			profiler->WriteTrace(parser.GetProfilePath());
+		}
 	}
 	catch (const std::exception& exc)
 	{
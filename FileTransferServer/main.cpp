@@ -1,6 +1,8 @@
 #include <TransferServer.h>
+#include <ServerPool.h>
+#include <cstring>
 
-int main()
+int main(int argc, char ** argv)
 {
 #ifdef _WINSOCK2API_
 	InitSockets();
@@ -9,12 +11,122 @@ int main()
 	int appCode = EXIT_SUCCESS;
 	try
 	{
-		std::unique_ptr<FileTransferServer> 
-			transfer(FileTransferServer::MakeServer(PROTOCOL, ADDRESS, PORT));
+		// [workers] [-sync none|end|periodic] [-direct] [-key hex]
+		// [-root dir]... [-shard levels] [-objects dir] [-profile trace.json],
+		// 0 workers means one per core
+		int workers = 1;
+		SyncPolicy policy = SyncNone;
+		bool directIo = false;
+		bool hasKey = false;
+		CipherKey key;
+		std::vector<std::string> roots;
+		unsigned int shardLevels = 0;
+		std::string bucket;
+		std::string profilePath;
 
-		transfer->Init();
+		for (int i = 1; i < argc; ++i)
+		{
+			if (strcmp(argv[i], "-direct") == 0)
+			{
+				directIo = true;
+			}
+			else if (strcmp(argv[i], "-key") == 0 && i + 1 < argc)
+			{
+				if (!ParseCipherKey(argv[++i], &key))
+				{
+					throw std::runtime_error("Error: key must be 64 hex digits");
+				}
+				hasKey = true;
+			}
+			else if (strcmp(argv[i], "-root") == 0 && i + 1 < argc)
+			{
+				roots.push_back(argv[++i]);
+			}
+			else if (strcmp(argv[i], "-shard") == 0 && i + 1 < argc)
+			{
+				shardLevels = static_cast<unsigned int>(atoi(argv[++i]));
+			}
+			else if (strcmp(argv[i], "-profile") == 0 && i + 1 < argc)
+			{
+				profilePath = argv[++i];
+			}
+			else if (strcmp(argv[i], "-objects") == 0 && i + 1 < argc)
+			{
+				bucket = argv[++i];
+			}
+			else if (strcmp(argv[i], "-sync") == 0 && i + 1 < argc)
+			{
+				++i;
+				policy = strcmp(argv[i], "end") == 0 ? SyncOnFileEnd :
+					(strcmp(argv[i], "periodic") == 0 ? SyncPeriodic : SyncNone);
+			}
+			else
+			{
+				workers = atoi(argv[i]);
+			}
+		}
 
-		transfer->Run();
+		if (roots.empty())
+		{
+			roots.push_back(".");
+		}
+
+		const StorageFactory makeStorage = [&]() -> std::unique_ptr<StorageBackend>
+		{
+			if (!bucket.empty())
+			{
+				return std::unique_ptr<StorageBackend>(new ObjectStorage(bucket));
+			}
+			return std::unique_ptr<StorageBackend>(new FileStorage(roots, shardLevels));
+		};
+
+		std::unique_ptr<TransferProfiler> profiler;
+		if (!profilePath.empty())
+		{
+			profiler.reset(new TransferProfiler());
+		}
+
+		if (workers != 1)
+		{
+			ServerPool pool(PROTOCOL, ADDRESS, PORT, workers < 0 ? 0 : workers);
+
+			pool.SetStorage(makeStorage);
+			pool.SetProfiler(profiler.get());
+			pool.SetSyncPolicy(policy, directIo);
+
+			if (hasKey)
+			{
+				pool.SetKey(key);
+			}
+
+			pool.Init();
+
+			pool.Run();
+		}
+		else
+		{
+			std::unique_ptr<FileTransferServer> 
+				transfer(FileTransferServer::MakeServer(PROTOCOL, ADDRESS, PORT));
+
+			transfer->SetStorage(makeStorage);
+			transfer->SetProfiler(profiler.get());
+			transfer->SetSyncPolicy(policy, directIo);
+
+			if (hasKey)
+			{
+				transfer->SetKey(key);
+			}
+
+			transfer->Init();
+
+			transfer->Run();
+		}
+
+		if (profiler)
+		{
+			profiler->Report(std::cout);
+			profiler->WriteTrace(profilePath);
+		}
 	}
 	catch (const std::exception& exc)
 	{
@@ -0,0 +1,914 @@
+#include "AsyncTransferClient.h"
+#include <cstddef>
+
+// Longest the loop waits on its sockets before it looks at new uploads,
+// cancels and timers again, milliseconds.
+#define LOOP_TICK 10
+
+// TCP data frames sent ahead of their answers. One frame buffer serves
+// them all, a frame is written out before the next one is read.
+#define ASYNC_TCP_FRAMES 4
+
+struct UploadTask::State
+{
+	std::string              path;
+	ProgressCallback         progress;
+	CompletionCallback       completion;
+	std::promise<void>       promise;
+	std::shared_future<void> future;
+	std::atomic<bool>        cancelled;
+	unsigned int             priority;
+
+	State(const std::string& filePath, const ProgressCallback& callback, const CompletionCallback& done,
+		unsigned int uploadPriority)
+		: path(filePath)
+		, progress(callback)
+		, completion(done)
+		, future(promise.get_future().share())
+		, cancelled(false)
+		, priority(uploadPriority > 0 ? uploadPriority : 1)
+	{}
+
+	void Complete(std::exception_ptr error)
+	{
+		if (completion)
+		{
+			completion(path, error);
+		}
+
+		if (error)
+			promise.set_exception(error);
+		else
+			promise.set_value();
+	}
+};
+
+// One upload on the loop, the stage says which answer it waits for.
+struct AsyncTransferClient::Running
+{
+	enum Stage
+	{
+		Connecting,   // TCP connect under way
+		Hello,
+		Begin,
+		Data,
+		End,
+		Done,
+		Finished
+	};
+
+	explicit Running(const std::shared_ptr<UploadTask::State>& task)
+		: state(task)
+		, stage(Connecting)
+		, hasKey(false)
+		, file(nullptr)
+		, size(0)
+		, read(0)
+		, sent(0)
+		, control(0)
+		, queued(0)
+		, written(0)
+		, received(0)
+		, inFlight(0)
+		, answered(0)
+		, sentAt(0)
+		, tries(0)
+		, windowBytes(0)
+		, blocks(0)
+		, next(0)
+		, acked(0)
+	{
+		memset(&server, 0, sizeof(server));
+		memset(done, 0, sizeof(done));
+	}
+
+	~Running()
+	{
+		if (file != nullptr)
+		{
+			fclose(file);
+		}
+	}
+
+	std::shared_ptr<UploadTask::State>       state;
+	std::unique_ptr<Socket>                  socket;
+	std::shared_ptr<TransferScheduler::Flow> flow;
+	Stage                                    stage;
+
+	bool                         hasKey;
+	CipherKey                    key;
+	SessionInfo                  local;
+	SessionInfo                  session;
+	std::shared_ptr<FrameCipher> cipher;
+	sockaddr_in                  server;
+
+	FILE*    file;
+	uint64_t size;
+	uint64_t read;      // file bytes read so far
+	uint64_t sent;      // file bytes the server accepted
+	int      control;   // last control frame number of the session
+
+	MessageBuffer request;    // control frame waiting for its answer
+	MessageBuffer outgoing;   // TCP frame being written, UDP scratch
+	size_t        queued;     // length of the frame being written, 0 when none
+	size_t        written;
+	MessageBuffer incoming;
+	size_t        received;   // TCP bytes of the next answer so far
+	size_t        inFlight;   // TCP data frames without an answer
+	uint64_t      answered;
+
+	// UDP, when the control frame or the window last went out in full
+	DWORD sentAt;
+	int   tries;
+
+	// UDP window of file data, blocks are numbered by file offset
+	std::unique_ptr<char[]> window;
+	int                     windowBytes;
+	int                     blocks;   // 0 when the next window is not read yet
+	int                     next;     // next block of this round
+	int                     acked;
+	bool                    done[CHUNK_LENGTH];
+};
+
+void UploadTask::Cancel()
+{
+	if (!m_state)
+		return;
+
+	m_state->cancelled = true;
+}
+
+bool UploadTask::IsDone() const
+{
+	return m_state &&
+		m_state->future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+void UploadTask::Wait() const
+{
+	assert(m_state);
+
+	m_state->future.get();
+}
+
+std::shared_future<void> UploadTask::GetFuture() const
+{
+	assert(m_state);
+
+	return m_state->future;
+}
+
+AsyncTransferClient::AsyncTransferClient(Socket::SocketType type, const char* address, short port, size_t maxConcurrent)
+	: m_type(type)
+	, m_address(address)
+	, m_port(port)
+	, m_maxRunning(maxConcurrent > 0 ? maxConcurrent : 1)
+	, m_stop(false)
+	, m_concurrent(false)
+	, m_connections(m_maxRunning)
+	, m_hasKey(false)
+{
+	m_thread = std::thread(&AsyncTransferClient::Loop, this);
+}
+
+AsyncTransferClient::~AsyncTransferClient()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_wakeUp.notify_all();
+
+	m_thread.join();
+}
+
+UploadTask AsyncTransferClient::Upload(const std::string& path, const ProgressCallback& progress,
+	unsigned int priority, const CompletionCallback& completion)
+{
+	std::shared_ptr<UploadTask::State> state =
+		std::make_shared<UploadTask::State>(path, progress, completion, priority);
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		if (m_stop)
+		{
+			throw std::runtime_error("Error: [Upload] client is shutting down");
+		}
+		// behind every queued upload of the same or higher priority
+		UploadQueue::iterator pos = m_queue.begin();
+		while (pos != m_queue.end() && (*pos)->priority >= state->priority)
+		{
+			++pos;
+		}
+		m_queue.insert(pos, state);
+	}
+	m_wakeUp.notify_one();
+
+	return UploadTask(state);
+}
+
+void AsyncTransferClient::SetBandwidthCap(uint64_t bytesPerSecond)
+{
+	m_scheduler.SetRate(bytesPerSecond);
+}
+
+void AsyncTransferClient::SetKey(const CipherKey& key)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_key = key;
+	m_hasKey = true;
+}
+
+size_t AsyncTransferClient::Pending() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	return m_queue.size();
+}
+
+void AsyncTransferClient::Loop()
+{
+	RunningList running;
+	std::vector<std::pair<double, Running*>> order;
+	std::vector<Socket::Watch> watches;
+	std::vector<Running*> watched;
+
+	while (true)
+	{
+		running.erase(std::remove_if(running.begin(), running.end(), [](const std::unique_ptr<Running>& upload)
+		{
+			return upload->stage == Running::Finished;
+		}), running.end());
+
+		if (!StartQueued(running))
+			return;
+
+		// under a cap the smallest finish tag asks the bucket first, which
+		// shares it by priority
+		const bool capped = m_scheduler.Rate() > 0;
+		order.clear();
+		for (size_t i = 0; i < running.size(); ++i)
+		{
+			Running* upload = running[i].get();
+			if (upload->stage != Running::Finished)
+			{
+				order.push_back(std::make_pair(capped ? upload->flow->NextTag(MAX_LENGTH) : 0.0, upload));
+			}
+		}
+		if (capped)
+		{
+			std::stable_sort(order.begin(), order.end(),
+				[](const std::pair<double, Running*>& a, const std::pair<double, Running*>& b)
+			{
+				return a.first < b.first;
+			});
+		}
+
+		int timeoutMs = LOOP_TICK;
+		for (size_t i = 0; i < order.size(); ++i)
+		{
+			Running& upload = *order[i].second;
+
+			if (upload.state->cancelled)
+			{
+				Finish(upload, std::make_exception_ptr(std::runtime_error("Error: transfer cancelled")));
+				continue;
+			}
+			Advance(upload, &timeoutMs);
+		}
+
+		watches.clear();
+		watched.clear();
+		for (size_t i = 0; i < running.size(); ++i)
+		{
+			Running& upload = *running[i];
+			if (upload.stage == Running::Finished)
+				continue;
+
+			Socket::Watch watch = { upload.socket.get(), Socket::Readable, 0 };
+			if (upload.stage == Running::Connecting || upload.queued > 0)
+			{
+				watch.events |= Socket::Writable;
+			}
+
+			watches.push_back(watch);
+			watched.push_back(&upload);
+		}
+
+		if (watches.empty() || Socket::Wait(watches, timeoutMs) == 0)
+			continue;
+
+		for (size_t i = 0; i < watches.size(); ++i)
+		{
+			Running& upload = *watched[i];
+			const int ready = watches[i].ready;
+
+			if ((ready & Socket::Writable) && upload.stage == Running::Connecting)
+			{
+				try
+				{
+					SendHello(upload);
+				}
+				catch (...)
+				{
+					Finish(upload, std::current_exception());
+				}
+			}
+
+			if ((ready & Socket::Readable) && upload.stage != Running::Finished)
+			{
+				Receive(upload);
+			}
+		}
+	}
+}
+
+bool AsyncTransferClient::StartQueued(RunningList& running)
+{
+	UploadQueue dropped;
+	bool stop = false;
+
+	while (true)
+	{
+		std::shared_ptr<UploadTask::State> state;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+
+			// with nothing running the loop sleeps until there is work
+			m_wakeUp.wait(lock, [&]()
+			{
+				return m_stop || !m_queue.empty() || !running.empty();
+			});
+
+			stop = m_stop;
+			if (stop)
+			{
+				dropped.swap(m_queue);
+			}
+			else if (!m_queue.empty() && running.size() < m_maxRunning && (running.empty() || m_concurrent))
+			{
+				state = m_queue.front();
+				m_queue.pop_front();
+			}
+		}
+
+		if (!state)
+			break;
+
+		running.push_back(std::unique_ptr<Running>(new Running(state)));
+		Running& upload = *running.back();
+
+		try
+		{
+			if (state->cancelled)
+			{
+				throw std::runtime_error("Error: transfer cancelled");
+			}
+			Start(upload);
+		}
+		catch (...)
+		{
+			Finish(upload, std::current_exception());
+		}
+	}
+
+	for (size_t i = 0; i < dropped.size(); ++i)
+	{
+		dropped[i]->cancelled = true;
+		dropped[i]->Complete(std::make_exception_ptr(std::runtime_error("Error: transfer cancelled")));
+	}
+
+	// running uploads finish before the loop ends
+	return !stop || !running.empty();
+}
+
+void AsyncTransferClient::Start(Running& upload)
+{
+	upload.flow = m_scheduler.AddFlow(upload.state->priority);
+	upload.request = m_pool.Acquire();
+	upload.incoming = m_pool.Acquire();
+	Socket::FillAddr(&upload.server, m_address.c_str(), m_port);
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		upload.hasKey = m_hasKey;
+		upload.key = m_key;
+	}
+
+	// a connection keyed differently is closed rather than reused
+	ConnectionPool::Connection connection;
+	if (m_connections.Take(m_type, m_address, m_port, &connection) &&
+		upload.hasKey == (connection.cipher != nullptr))
+	{
+		upload.socket = std::move(connection.socket);
+		upload.session = connection.session;
+		upload.cipher = connection.cipher;
+
+		BeginFile(upload);
+		return;
+	}
+
+	uint32_t capabilities = CapabilityKeepAlive | CapabilityConcurrent;
+	if (upload.hasKey)
+	{
+		capabilities |= CapabilityEncryption;
+	}
+	upload.local = MakeSession(capabilities, CHUNK_LENGTH);
+	upload.local.nonce = upload.hasKey ? RandomNonce() : 0;
+
+	upload.socket.reset(new Socket(m_type, m_address.c_str()));
+	upload.socket->Init(true);
+
+	if (m_type == Socket::Tcp)
+	{
+		// Hello goes out once the socket turns writable
+		upload.socket->Connect(m_address.c_str(), m_port);
+		upload.stage = Running::Connecting;
+		return;
+	}
+
+	SendHello(upload);
+}
+
+void AsyncTransferClient::SendHello(Running& upload)
+{
+	WriteHello(Protocol::Hello, upload.local, upload.request.Get());
+	upload.stage = Running::Hello;
+
+	SendControl(upload);
+}
+
+void AsyncTransferClient::Advance(Running& upload, int* timeoutMs)
+{
+	try
+	{
+		if (upload.queued > 0 && !Flush(upload))
+			return;
+
+		switch (upload.stage)
+		{
+		case Running::Data:
+			if (m_type == Socket::Tcp)
+				SendData(upload, timeoutMs);
+			else
+				SendWindow(upload, timeoutMs);
+			break;
+
+		case Running::Hello:
+		case Running::Begin:
+		case Running::End:
+		case Running::Done:
+			if (m_type == Socket::Udp)
+			{
+				DWORD waited = timeGetTime() - upload.sentAt;
+				if (waited >= RETRANSMIT_TIMEOUT)
+				{
+					if (++upload.tries > RETRANSMIT_TRIES)
+					{
+						throw std::runtime_error("Error: [Advance] no answer from server");
+					}
+
+					SendFrame(upload, *upload.request);
+					upload.sentAt = timeGetTime();
+					waited = 0;
+				}
+				*timeoutMs = std::min(*timeoutMs, int(RETRANSMIT_TIMEOUT - waited));
+			}
+			break;
+
+		default:
+			break;
+		}
+	}
+	catch (...)
+	{
+		Finish(upload, std::current_exception());
+	}
+}
+
+void AsyncTransferClient::Receive(Running& upload)
+{
+	MessageData& answer = *upload.incoming;
+
+	try
+	{
+		if (m_type == Socket::Tcp)
+		{
+			// a frame may arrive in pieces, the rest comes with a later wake up
+			while (upload.stage != Running::Finished)
+			{
+				const size_t count = upload.socket->TryRead(
+					reinterpret_cast<char*>(&answer) + upload.received, sizeof(MessageData) - upload.received);
+				if (count == 0)
+					return;
+
+				upload.received += count;
+				if (upload.received < sizeof(MessageData))
+					continue;
+
+				upload.received = 0;
+				if (upload.cipher && !upload.cipher->Open(answer))
+				{
+					throw std::runtime_error("Error: [Receive] frame failed authentication");
+				}
+
+				OnAnswer(upload, answer);
+			}
+			return;
+		}
+
+		while (upload.stage != Running::Finished && upload.socket->Poll(0) == Socket::PollReadable)
+		{
+			upload.socket->ReadFrom(reinterpret_cast<char*>(&answer), sizeof(answer), &upload.server);
+
+			// datagrams that fail authentication are dropped as if lost
+			if (upload.cipher && !upload.cipher->Open(answer))
+				continue;
+
+			OnAnswer(upload, answer);
+		}
+	}
+	catch (...)
+	{
+		Finish(upload, std::current_exception());
+	}
+}
+
+void AsyncTransferClient::OnAnswer(Running& upload, MessageData& answer)
+{
+	if (answer.protocol == Protocol::FatalError)
+	{
+		throw std::runtime_error(answer.data);
+	}
+
+	// TCP answers come in order, over UDP late answers to earlier frames
+	// are skipped
+	if (upload.stage != Running::Data && m_type == Socket::Udp && !IsAnswerTo(answer, *upload.request))
+		return;
+
+	switch (upload.stage)
+	{
+	case Running::Hello:
+		OnHelloAck(upload, answer);
+		break;
+
+	case Running::Begin:
+		upload.stage = Running::Data;
+		break;
+
+	case Running::Data:
+		if (m_type == Socket::Tcp)
+		{
+			if (upload.inFlight == 0)
+			{
+				throw std::runtime_error("Error: [OnAnswer] unexpected answer");
+			}
+
+			--upload.inFlight;
+			++upload.answered;
+			upload.sent = std::min<uint64_t>(upload.read, upload.answered * MAX_LENGTH);
+			ReportProgress(upload);
+		}
+		else
+		{
+			const int index = answer.dataIndex - static_cast<int>(upload.sent / MAX_LENGTH);
+			if ((AnsweredProtocol(answer) == Protocol::Chunk || answer.protocol == Protocol::Recovered) &&
+				index >= 0 &&
+				index < upload.blocks &&
+				!upload.done[index])
+			{
+				upload.done[index] = true;
+
+				if (++upload.acked == upload.blocks)
+				{
+					upload.sent += upload.windowBytes;
+					upload.blocks = 0;
+					ReportProgress(upload);
+				}
+			}
+		}
+		break;
+
+	case Running::End:
+		*upload.request = MessageData(Protocol::Done, "Done.");
+		upload.request->dataIndex = ++upload.control;
+		upload.stage = Running::Done;
+
+		SendControl(upload);
+		break;
+
+	case Running::Done:
+		if (upload.session.Has(CapabilityKeepAlive))
+		{
+			ConnectionPool::Connection connection;
+			connection.socket = std::move(upload.socket);
+			connection.session = upload.session;
+			connection.cipher = upload.cipher;
+
+			m_connections.Put(m_type, m_address, m_port, connection);
+		}
+
+		Finish(upload, std::exception_ptr());
+		break;
+
+	default:
+		break;
+	}
+}
+
+void AsyncTransferClient::OnHelloAck(Running& upload, const MessageData& answer)
+{
+	if (answer.protocol != Protocol::HelloAck)
+	{
+		throw std::runtime_error("Error: [Handshake] unexpected answer");
+	}
+
+	const SessionInfo remote = ReadHello(answer);
+	upload.session = Negotiate(upload.local, remote);
+
+	if (upload.hasKey)
+	{
+		if (!upload.session.Has(CapabilityEncryption))
+		{
+			throw std::runtime_error("Error: [Handshake] server does not encrypt");
+		}
+
+		upload.cipher = std::make_shared<FrameCipher>(DeriveSessionKey(upload.key, upload.local.nonce, remote.nonce), true);
+
+		if (!upload.cipher->CheckHello(answer))
+		{
+			throw std::runtime_error("Error: [Handshake] server key does not match");
+		}
+	}
+
+	BeginFile(upload);
+}
+
+void AsyncTransferClient::BeginFile(Running& upload)
+{
+	if (upload.session.Has(CapabilityConcurrent))
+	{
+		m_concurrent = true;
+	}
+
+	FilePrefetcher::Entry entry;
+	entry.path = upload.state->path;
+	FilePrefetcher::Open(&entry);
+
+	if (entry.isDirectory)
+	{
+		throw std::runtime_error("Error: [BeginFile] directories need FileTransferClient, name " + entry.path);
+	}
+	if (!entry.error.empty())
+	{
+		throw std::runtime_error(entry.error);
+	}
+
+	upload.file = entry.file;
+	upload.size = entry.size;
+
+	std::string name = entry.path;
+	size_t pos = name.find_last_of("/\\");
+	if (pos != std::string::npos)
+	{
+		name.erase(0, pos + 1);
+	}
+
+	upload.control = 0;
+	*upload.request = MessageData(Protocol::FileBegin, name);
+	upload.request->dataIndex = ++upload.control;
+	upload.stage = Running::Begin;
+
+	SendControl(upload);
+}
+
+void AsyncTransferClient::SendData(Running& upload, int* timeoutMs)
+{
+	while (upload.queued == 0 && upload.inFlight < ASYNC_TCP_FRAMES && upload.read < upload.size)
+	{
+		const size_t length = static_cast<size_t>(std::min<uint64_t>(MAX_LENGTH, upload.size - upload.read));
+
+		int retryMs = 0;
+		if (!upload.flow->TryAcquire(length, &retryMs))
+		{
+			*timeoutMs = std::min(*timeoutMs, retryMs);
+			return;
+		}
+
+		if (upload.outgoing.IsNull())
+		{
+			upload.outgoing = m_pool.Acquire();
+		}
+
+		MessageData& frame = *upload.outgoing;
+		frame.protocol = Protocol::FileData;
+		frame.dataIndex = 0;
+		frame.dataSize = fread(frame.data, 1, MAX_LENGTH, upload.file);
+
+		// the file got shorter since it was opened
+		if (frame.dataSize == 0)
+		{
+			upload.size = upload.read;
+			break;
+		}
+
+		upload.read += frame.dataSize;
+		++upload.inFlight;
+
+		SendFrame(upload, frame);
+	}
+
+	if (upload.read >= upload.size && upload.inFlight == 0 && upload.queued == 0)
+	{
+		EndFile(upload);
+	}
+}
+
+void AsyncTransferClient::SendWindow(Running& upload, int* timeoutMs)
+{
+	if (upload.blocks == 0)
+	{
+		// the agreed window never exceeds CHUNK_LENGTH
+		if (!upload.window)
+		{
+			upload.window.reset(new char[MAX_LENGTH * CHUNK_LENGTH]);
+		}
+
+		const size_t bytes = fread(upload.window.get(), 1, MAX_LENGTH * upload.session.windowSize, upload.file);
+		if (bytes == 0)
+		{
+			EndFile(upload);
+			return;
+		}
+
+		upload.read += bytes;
+		upload.windowBytes = static_cast<int>(bytes);
+		upload.blocks = (upload.windowBytes + MAX_LENGTH - 1) / MAX_LENGTH;
+		upload.next = 0;
+		upload.acked = 0;
+		upload.tries = 0;
+		memset(upload.done, 0, sizeof(upload.done));
+	}
+
+	if (upload.outgoing.IsNull())
+	{
+		upload.outgoing = m_pool.Acquire();
+	}
+
+	const int firstBlock = static_cast<int>(upload.sent / MAX_LENGTH);
+	MessageData& frame = *upload.outgoing;
+	bool sending = false;
+
+	for (; upload.next < upload.blocks; ++upload.next)
+	{
+		const int i = upload.next;
+		if (upload.done[i])
+			continue;
+
+		const int pos = i * MAX_LENGTH;
+		const size_t length = std::min(MAX_LENGTH, upload.windowBytes - pos);
+
+		int retryMs = 0;
+		if (!upload.flow->TryAcquire(length, &retryMs))
+		{
+			*timeoutMs = std::min(*timeoutMs, retryMs);
+			return;
+		}
+
+		frame.protocol = Protocol::Chunk;
+		frame.dataIndex = firstBlock + i;
+		frame.dataSize = length;
+
+		// sealed blocks are sent from the frame, plain ones from the window
+		const char* payload = upload.window.get() + pos;
+		if (upload.cipher)
+		{
+			upload.cipher->Seal(frame, payload, &frame);
+			payload = frame.data;
+		}
+
+		upload.socket->SendTo(reinterpret_cast<const char*>(&frame), offsetof(MessageData, data),
+			payload, static_cast<int>(length), &upload.server);
+		sending = true;
+	}
+
+	// the round is out, the timer starts
+	if (sending)
+	{
+		upload.sentAt = timeGetTime();
+	}
+
+	// missing blocks are sent again once no answer came for a while
+	const DWORD waited = timeGetTime() - upload.sentAt;
+	if (waited < RETRANSMIT_TIMEOUT)
+	{
+		*timeoutMs = std::min(*timeoutMs, int(RETRANSMIT_TIMEOUT - waited));
+		return;
+	}
+
+	if (++upload.tries > RETRANSMIT_TRIES)
+	{
+		throw std::runtime_error("Error: [SendWindow] no answer from server");
+	}
+
+	upload.next = 0;
+	*timeoutMs = 0;
+}
+
+void AsyncTransferClient::EndFile(Running& upload)
+{
+	fclose(upload.file);
+	upload.file = nullptr;
+	upload.window.reset();
+
+	WriteFileEnd(upload.read, upload.request.Get());
+	upload.request->dataIndex = ++upload.control;
+	upload.stage = Running::End;
+
+	SendControl(upload);
+}
+
+void AsyncTransferClient::SendControl(Running& upload)
+{
+	upload.tries = 0;
+	upload.sentAt = timeGetTime();
+
+	SendFrame(upload, *upload.request);
+}
+
+void AsyncTransferClient::SendFrame(Running& upload, const MessageData& frame)
+{
+	const bool seal = upload.cipher && frame.protocol != Protocol::Hello;
+
+	if (upload.outgoing.IsNull())
+	{
+		upload.outgoing = m_pool.Acquire();
+	}
+
+	MessageData& out = *upload.outgoing;
+	if (seal)
+	{
+		upload.cipher->Seal(frame, frame.data, &out);
+	}
+
+	if (m_type == Socket::Udp)
+	{
+		const MessageData& datagram = seal ? out : frame;
+		upload.socket->SendTo(reinterpret_cast<const char*>(&datagram), sizeof(MessageData), &upload.server);
+		return;
+	}
+
+	if (!seal && &frame != &out)
+	{
+		out = frame;
+	}
+
+	upload.queued = sizeof(MessageData);
+	upload.written = 0;
+
+	Flush(upload);
+}
+
+bool AsyncTransferClient::Flush(Running& upload)
+{
+	const char* frame = reinterpret_cast<const char*>(upload.outgoing.Get());
+
+	while (upload.written < upload.queued)
+	{
+		const size_t count = upload.socket->TrySend(frame + upload.written, upload.queued - upload.written);
+		if (count == 0)
+			return false;
+
+		upload.written += count;
+	}
+
+	upload.queued = 0;
+
+	return true;
+}
+
+void AsyncTransferClient::ReportProgress(Running& upload)
+{
+	const UploadTask::State& state = *upload.state;
+
+	if (state.progress)
+	{
+		state.progress(state.path, upload.sent, upload.size);
+	}
+}
+
+void AsyncTransferClient::Finish(Running& upload, std::exception_ptr error)
+{
+	if (upload.stage == Running::Finished)
+		return;
+
+	// the server drops the session on errors
+	if (error && upload.socket)
+	{
+		upload.socket->Close();
+	}
+
+	upload.stage = Running::Finished;
+	upload.state->Complete(error);
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include "TransferClient.h"
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+
+// Called once an upload is over, with its error or a null one.
+typedef std::function<void(const std::string&, std::exception_ptr)> CompletionCallback;
+
+// Handle to a queued or running upload. Copies refer to the same upload.
+class UploadTask
+{
+public:
+	UploadTask() {}
+
+	// Drops a queued upload or stops a running one.
+	void Cancel();
+
+	bool IsDone() const;
+
+	// Blocks until the upload finishes, rethrows its error if any.
+	void Wait() const;
+
+	std::shared_future<void> GetFuture() const;
+
+private:
+	friend class AsyncTransferClient;
+
+	struct State;
+
+	explicit UploadTask(const std::shared_ptr<State>& state)
+		: m_state(state)
+	{}
+
+private:
+	std::shared_ptr<State> m_state;
+};
+
+// Runs uploads of single files on one thread. Every running upload is a
+// state machine over a nonblocking socket, from connect and Hello through
+// FileBegin, the data and FileEnd to Done, and the thread waits on all of
+// their sockets at once with Socket::Wait. A running upload holds its
+// socket, the open file, a few frames and over UDP one window of file
+// data, so maxConcurrent can be in the thousands; further uploads wait in
+// the queue and cost only their UploadTask state. Connections the server
+// keeps alive are reused by later uploads.
+//
+// Progress and completion callbacks run on that thread and must not
+// block on other uploads. Uploads only run side by side once the server
+// advertised CapabilityConcurrent, a session per client; until then, and
+// for servers without it, one runs at a time. Directories, FEC and hole
+// skipping need FileTransferClient. "Benchmarks upload" measures the
+// memory of a running upload.
+class AsyncTransferClient
+{
+public:
+	AsyncTransferClient(Socket::SocketType type, const char* address, short port, size_t maxConcurrent);
+
+	// Cancels queued uploads and waits for the running ones to finish.
+	~AsyncTransferClient();
+
+	// Higher priority uploads start first and get a larger share of the cap.
+	UploadTask Upload(const std::string& path, const ProgressCallback& progress = ProgressCallback(),
+		unsigned int priority = 1, const CompletionCallback& completion = CompletionCallback());
+
+	// Global cap over all uploads in bytes per second, 0 for none.
+	// Applies immediately to running uploads.
+	void SetBandwidthCap(uint64_t bytesPerSecond);
+
+	// Uploads started after this call encrypt with the pre-shared key.
+	void SetKey(const CipherKey& key);
+
+	size_t Pending() const;
+
+private:
+	struct Running;
+
+	typedef std::deque<std::shared_ptr<UploadTask::State>> UploadQueue;
+	typedef std::vector<std::unique_ptr<Running>>          RunningList;
+
+	void Loop();
+
+	// Moves queued uploads to running while there is room, false once the
+	// client stops and nothing is left.
+	bool StartQueued(RunningList& running);
+
+	// Takes a pooled connection or opens one and sends Hello.
+	void Start(Running& upload);
+
+	void SendHello(Running& upload);
+
+	// Sends what the upload has ready without blocking and lowers timeoutMs
+	// to when it wants to be looked at again.
+	void Advance(Running& upload, int* timeoutMs);
+
+	// Takes in the answers that arrived, Finish on errors.
+	void Receive(Running& upload);
+
+	void OnAnswer(Running& upload, MessageData& answer);
+
+	void OnHelloAck(Running& upload, const MessageData& answer);
+
+	void BeginFile(Running& upload);
+
+	void SendData(Running& upload, int* timeoutMs);
+
+	void SendWindow(Running& upload, int* timeoutMs);
+
+	void EndFile(Running& upload);
+
+	// Sends the upload's request frame. It waits for its answer, over UDP
+	// it is sent again until that comes.
+	void SendControl(Running& upload);
+
+	// Queues a sealed or plain frame, over UDP it goes out at once.
+	void SendFrame(Running& upload, const MessageData& frame);
+
+	// Writes what the connection takes of the queued frame, true once all.
+	bool Flush(Running& upload);
+
+	void ReportProgress(Running& upload);
+
+	void Finish(Running& upload, std::exception_ptr error);
+
+	AsyncTransferClient(const AsyncTransferClient&);
+
+	AsyncTransferClient& operator = (const AsyncTransferClient&);
+
+private:
+	Socket::SocketType       m_type;
+	std::string              m_address;
+	short                    m_port;
+	size_t                   m_maxRunning;
+	bool                     m_stop;
+	bool                     m_concurrent;   // the server runs uploads side by side
+	UploadQueue              m_queue;
+	TransferScheduler        m_scheduler;
+	ConnectionPool           m_connections;
+	BufferPool               m_pool;
+	bool                     m_hasKey;
+	CipherKey                m_key;
+	mutable std::mutex       m_mutex;
+	std::condition_variable  m_wakeUp;
+	std::thread              m_thread;
+};
@@ -0,0 +1,125 @@
+#include "BufferPool.h"
+
+struct MessageBuffer::Slab
+{
+	MessageData      data;
+	std::atomic<int> refs;
+	BufferPool*      pool;
+	Slab*            next;
+
+	Slab()
+		: refs(0)
+		, pool(nullptr)
+		, next(nullptr)
+	{}
+};
+
+MessageBuffer::MessageBuffer()
+	: m_slab(nullptr)
+{}
+
+MessageBuffer::MessageBuffer(Slab* slab)
+	: m_slab(slab)
+{
+	m_slab->refs.store(1, std::memory_order_relaxed);
+}
+
+MessageBuffer::MessageBuffer(const MessageBuffer& other)
+	: m_slab(other.m_slab)
+{
+	if (m_slab != nullptr)
+		m_slab->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+MessageBuffer& MessageBuffer::operator = (const MessageBuffer& other)
+{
+	if (m_slab != other.m_slab)
+	{
+		if (other.m_slab != nullptr)
+			other.m_slab->refs.fetch_add(1, std::memory_order_relaxed);
+
+		Reset();
+		m_slab = other.m_slab;
+	}
+
+	return *this;
+}
+
+MessageBuffer::~MessageBuffer()
+{
+	Reset();
+}
+
+MessageData* MessageBuffer::Get() const
+{
+	assert(m_slab != nullptr);
+
+	return &m_slab->data;
+}
+
+void MessageBuffer::Reset()
+{
+	if (m_slab == nullptr)
+		return;
+
+	if (m_slab->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+	{
+		m_slab->pool->Release(m_slab);
+	}
+	m_slab = nullptr;
+}
+
+BufferPool::BufferPool(size_t blockSize)
+	: m_blockSize(blockSize > 0 ? blockSize : 1)
+	, m_free(nullptr)
+{
+	Grow();
+}
+
+BufferPool::~BufferPool()
+{}
+
+MessageBuffer BufferPool::Acquire()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (m_free == nullptr)
+	{
+		Grow();
+	}
+
+	MessageBuffer::Slab* slab = m_free;
+	m_free = slab->next;
+	slab->next = nullptr;
+
+	return MessageBuffer(slab);
+}
+
+size_t BufferPool::Capacity() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	return m_blocks.size() * m_blockSize;
+}
+
+void BufferPool::Release(MessageBuffer::Slab* slab)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	slab->next = m_free;
+	m_free = slab;
+}
+
+void BufferPool::Grow()
+{
+	SlabBlock block(new MessageBuffer::Slab[m_blockSize]);
+
+	for (size_t i = 0; i < m_blockSize; ++i)
+	{
+		block[i].pool = this;
+		block[i].next = m_free;
+		m_free = &block[i];
+	}
+
+	m_blocks.push_back(std::move(block));
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "Transfer.h"
+#include <atomic>
+#include <mutex>
+
+class BufferPool;
+
+// Ref-counted handle to a pooled MessageData slab. Copies share the slab,
+// the last handle to go away returns it to its pool.
+class MessageBuffer
+{
+public:
+	MessageBuffer();
+
+	MessageBuffer(const MessageBuffer& other);
+
+	MessageBuffer& operator = (const MessageBuffer& other);
+
+	~MessageBuffer();
+
+	MessageData* Get() const;
+
+	MessageData* operator -> () const { return Get(); }
+
+	MessageData& operator * () const { return *Get(); }
+
+	bool IsNull() const { return m_slab == nullptr; }
+
+	void Reset();
+
+private:
+	friend class BufferPool;
+
+	struct Slab;
+
+	explicit MessageBuffer(Slab* slab);
+
+private:
+	Slab* m_slab;
+};
+
+// Fixed-size MessageData slabs recycled through a free list. Slabs are
+// allocated in blocks on demand, so once the working set is reached the
+// send/receive loops run without touching the heap. The stages around
+// them keep their own buffers: file data is copied into the frames and
+// out of them into the writer. "Benchmarks alloc" counts the allocations
+// of whole transfers to check that none are made per block.
+class BufferPool
+{
+public:
+	explicit BufferPool(size_t blockSize = 16);
+
+	~BufferPool();
+
+	MessageBuffer Acquire();
+
+	size_t Capacity() const;
+
+private:
+	friend class MessageBuffer;
+
+	void Release(MessageBuffer::Slab* slab);
+
+	void Grow();
+
+	BufferPool(const BufferPool&);
+
+	BufferPool& operator = (const BufferPool&);
+
+private:
+	typedef std::unique_ptr<MessageBuffer::Slab[]> SlabBlock;
+
+	const size_t           m_blockSize;
+	std::vector<SlabBlock> m_blocks;
+	MessageBuffer::Slab*   m_free;
+	mutable std::mutex     m_mutex;
+};
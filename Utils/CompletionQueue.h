@@ -0,0 +1,69 @@
+#pragma once
+
+#include "Common.h"
+#include <atomic>
+
+// Lock-free hand-off of finished file names from server workers.
+// Producers push with a CAS, the single consumer detaches the whole
+// list with one exchange, so there is no ABA problem to care about.
+class CompletionQueue
+{
+public:
+	CompletionQueue()
+		: m_head(nullptr)
+	{}
+
+	~CompletionQueue()
+	{
+		std::vector<std::string> rest;
+		PopAll(&rest);
+	}
+
+	void Push(const std::string& fileName)
+	{
+		Node* node = new Node(fileName);
+		node->next = m_head.load(std::memory_order_relaxed);
+
+		while (!m_head.compare_exchange_weak(node->next, node,
+			std::memory_order_release, std::memory_order_relaxed))
+		{}
+	}
+
+	// Appends everything pushed so far, oldest first. Single consumer only.
+	size_t PopAll(std::vector<std::string>* out)
+	{
+		Node* node = m_head.exchange(nullptr, std::memory_order_acquire);
+
+		const size_t begin = out->size();
+		while (node != nullptr)
+		{
+			out->push_back(node->fileName);
+
+			Node* next = node->next;
+			delete node;
+			node = next;
+		}
+		std::reverse(out->begin() + begin, out->end());
+
+		return out->size() - begin;
+	}
+
+private:
+	struct Node
+	{
+		std::string fileName;
+		Node*       next;
+
+		explicit Node(const std::string& name)
+			: fileName(name)
+			, next(nullptr)
+		{}
+	};
+
+	CompletionQueue(const CompletionQueue&);
+
+	CompletionQueue& operator = (const CompletionQueue&);
+
+private:
+	std::atomic<Node*> m_head;
+};
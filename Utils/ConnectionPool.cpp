@@ -0,0 +1,62 @@
+#include "ConnectionPool.h"
+
+ConnectionPool::ConnectionPool(size_t maxIdle)
+	: m_maxIdle(maxIdle > 0 ? maxIdle : 1)
+{}
+
+bool ConnectionPool::Take(Socket::SocketType type, const std::string& address, short port, Connection* connection)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	// newest first, they are the least likely to have been dropped
+	for (size_t i = m_idle.size(); i > 0; --i)
+	{
+		Idle& idle = m_idle[i - 1];
+		if (idle.type != type || idle.port != port || idle.address != address)
+			continue;
+
+		// leave a margin before the server gives up on the connection
+		const std::chrono::milliseconds idleFor =
+			std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - idle.since);
+
+		Connection candidate = std::move(idle.connection);
+		m_idle.erase(m_idle.begin() + (i - 1));
+
+		if (idleFor.count() > KEEPALIVE_TIMEOUT / 2)
+			continue;
+
+		// data or a shutdown on an idle connection means it can't be used
+		if (type == Socket::Tcp && candidate.socket->Poll(0) != Socket::PollTimeout)
+			continue;
+
+		*connection = std::move(candidate);
+		return true;
+	}
+
+	return false;
+}
+
+void ConnectionPool::Put(Socket::SocketType type, const std::string& address, short port, Connection& connection)
+{
+	Idle idle;
+	idle.type = type;
+	idle.address = address;
+	idle.port = port;
+	idle.connection = std::move(connection);
+	idle.since = Clock::now();
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (m_idle.size() >= m_maxIdle)
+	{
+		m_idle.pop_front();
+	}
+	m_idle.push_back(std::move(idle));
+}
+
+void ConnectionPool::Clear()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_idle.clear();
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "FrameCipher.h"
+#include "Handshake.h"
+#include <chrono>
+#include <deque>
+#include <mutex>
+
+// Idle client connections kept open between transfers, so the next
+// transfer to the same server skips connect and the handshake.
+// Thread safe, shared by all clients of one process.
+class ConnectionPool
+{
+public:
+	struct Connection
+	{
+		std::unique_ptr<Socket>      socket;
+		SessionInfo                  session;
+		std::shared_ptr<FrameCipher> cipher;   // keeps its sequence numbers
+	};
+
+	explicit ConnectionPool(size_t maxIdle = 4);
+
+	// Takes an idle connection to the server if a live one is left.
+	bool Take(Socket::SocketType type, const std::string& address, short port, Connection* connection);
+
+	// Keeps the connection for later, the oldest is closed when full.
+	void Put(Socket::SocketType type, const std::string& address, short port, Connection& connection);
+
+	void Clear();
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Idle
+	{
+		Socket::SocketType type;
+		std::string        address;
+		short              port;
+		Connection         connection;
+		Clock::time_point  since;
+	};
+
+	ConnectionPool(const ConnectionPool&);
+
+	ConnectionPool& operator = (const ConnectionPool&);
+
+private:
+	size_t           m_maxIdle;
+	std::deque<Idle> m_idle;
+	std::mutex       m_mutex;
+};
@@ -0,0 +1,60 @@
+#include "Cpu.h"
+
+#if CPU_X86 && defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+namespace
+{
+	struct CpuFeatures
+	{
+		CpuFeatures()
+			: ssse3(false)
+			, avx2(false)
+		{
+#if CPU_X86 && defined(_MSC_VER)
+			int regs[4];
+
+			__cpuid(regs, 0);
+			const int highest = regs[0];
+
+			__cpuid(regs, 1);
+			ssse3 = (regs[2] & (1 << 9)) != 0;
+
+			// AVX state has to be enabled by the OS as well
+			const bool osxsave = (regs[2] & (1 << 27)) != 0;
+			const bool avx = (regs[2] & (1 << 28)) != 0;
+
+			if (highest >= 7 && osxsave && avx && (_xgetbv(0) & 6) == 6)
+			{
+				__cpuidex(regs, 7, 0);
+				avx2 = (regs[1] & (1 << 5)) != 0;
+			}
+#elif CPU_X86 && defined(__GNUC__)
+			__builtin_cpu_init();
+			ssse3 = __builtin_cpu_supports("ssse3") != 0;
+			avx2 = __builtin_cpu_supports("avx2") != 0;
+#endif
+		}
+
+		bool ssse3;
+		bool avx2;
+	};
+
+	const CpuFeatures& Features()
+	{
+		static const CpuFeatures features;
+		return features;
+	}
+}
+
+bool CpuHasSsse3()
+{
+	return Features().ssse3;
+}
+
+bool CpuHasAvx2()
+{
+	return Features().avx2;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+// Instruction sets of the running CPU, looked up once. Kernels for sets
+// newer than the compiler targets are built with CPU_TARGET and only
+// called when these say the CPU has them.
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define CPU_X86 1
+#else
+#define CPU_X86 0
+#endif
+
+// MSVC emits any intrinsic without /arch, GCC and Clang need the target
+// on the function.
+#if defined(__GNUC__) && CPU_X86
+#define CPU_TARGET(set) __attribute__((target(set)))
+#else
+#define CPU_TARGET(set)
+#endif
+
+bool CpuHasSsse3();
+
+// Also checks that the OS saves the AVX registers.
+bool CpuHasAvx2();
@@ -0,0 +1,574 @@
+#include "Crypto.h"
+#include "Cpu.h"
+#include <cstring>
+#include <random>
+
+#if CPU_X86
+#include <immintrin.h>
+#endif
+
+namespace
+{
+	inline uint32_t Load32(const uint8_t* p)
+	{
+		return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+	}
+
+	inline void Store32(uint8_t* p, uint32_t v)
+	{
+		p[0] = uint8_t(v);
+		p[1] = uint8_t(v >> 8);
+		p[2] = uint8_t(v >> 16);
+		p[3] = uint8_t(v >> 24);
+	}
+
+	inline void Store64(uint8_t* p, uint64_t v)
+	{
+		Store32(p, uint32_t(v));
+		Store32(p + 4, uint32_t(v >> 32));
+	}
+
+	inline uint32_t Rotl(uint32_t v, int c)
+	{
+		return (v << c) | (v >> (32 - c));
+	}
+
+	inline void QuarterRound(uint32_t* x, int a, int b, int c, int d)
+	{
+		x[a] += x[b]; x[d] = Rotl(x[d] ^ x[a], 16);
+		x[c] += x[d]; x[b] = Rotl(x[b] ^ x[c], 12);
+		x[a] += x[b]; x[d] = Rotl(x[d] ^ x[a], 8);
+		x[c] += x[d]; x[b] = Rotl(x[b] ^ x[c], 7);
+	}
+
+	void DoubleRounds(uint32_t* x)
+	{
+		for (int i = 0; i < 10; ++i)
+		{
+			QuarterRound(x, 0, 4, 8, 12);
+			QuarterRound(x, 1, 5, 9, 13);
+			QuarterRound(x, 2, 6, 10, 14);
+			QuarterRound(x, 3, 7, 11, 15);
+			QuarterRound(x, 0, 5, 10, 15);
+			QuarterRound(x, 1, 6, 11, 12);
+			QuarterRound(x, 2, 7, 8, 13);
+			QuarterRound(x, 3, 4, 9, 14);
+		}
+	}
+
+	void InitState(uint32_t* state, const uint8_t* key)
+	{
+		state[0] = 0x61707865;
+		state[1] = 0x3320646e;
+		state[2] = 0x79622d32;
+		state[3] = 0x6b206574;
+
+		for (int i = 0; i < 8; ++i)
+		{
+			state[4 + i] = Load32(key + 4 * i);
+		}
+	}
+
+	void ChaChaBlock(const uint32_t* state, uint8_t* out)
+	{
+		uint32_t x[16];
+		memcpy(x, state, sizeof(x));
+
+		DoubleRounds(x);
+
+		for (int i = 0; i < 16; ++i)
+		{
+			Store32(out + 4 * i, x[i] + state[i]);
+		}
+	}
+
+#if CPU_X86
+	// The vector kernels run one block per lane: vector i holds word i of
+	// every block, only the counters differ. They write the keystream of
+	// all their blocks and move the counter on past them.
+
+	inline __m128i Rotl128(__m128i v, int c)
+	{
+		return _mm_or_si128(_mm_slli_epi32(v, c), _mm_srli_epi32(v, 32 - c));
+	}
+
+	inline void QuarterRound128(__m128i* x, int a, int b, int c, int d)
+	{
+		x[a] = _mm_add_epi32(x[a], x[b]); x[d] = Rotl128(_mm_xor_si128(x[d], x[a]), 16);
+		x[c] = _mm_add_epi32(x[c], x[d]); x[b] = Rotl128(_mm_xor_si128(x[b], x[c]), 12);
+		x[a] = _mm_add_epi32(x[a], x[b]); x[d] = Rotl128(_mm_xor_si128(x[d], x[a]), 8);
+		x[c] = _mm_add_epi32(x[c], x[d]); x[b] = Rotl128(_mm_xor_si128(x[b], x[c]), 7);
+	}
+
+	// Four blocks at a time, SSE2 is there on every x86 target.
+	CPU_TARGET("sse2")
+	void ChaChaBlocksSse2(uint32_t* state, uint8_t* stream)
+	{
+		__m128i start[16];
+		__m128i x[16];
+
+		for (int i = 0; i < 16; ++i)
+		{
+			start[i] = _mm_set1_epi32(static_cast<int>(state[i]));
+		}
+		start[12] = _mm_add_epi32(start[12], _mm_set_epi32(3, 2, 1, 0));
+
+		memcpy(x, start, sizeof(x));
+
+		for (int round = 0; round < 10; ++round)
+		{
+			QuarterRound128(x, 0, 4, 8, 12);
+			QuarterRound128(x, 1, 5, 9, 13);
+			QuarterRound128(x, 2, 6, 10, 14);
+			QuarterRound128(x, 3, 7, 11, 15);
+			QuarterRound128(x, 0, 5, 10, 15);
+			QuarterRound128(x, 1, 6, 11, 12);
+			QuarterRound128(x, 2, 7, 8, 13);
+			QuarterRound128(x, 3, 4, 9, 14);
+		}
+
+		// words 4g to 4g+3 of the four blocks, turned into one vector per block
+		for (int g = 0; g < 4; ++g)
+		{
+			const __m128i a = _mm_add_epi32(x[4 * g], start[4 * g]);
+			const __m128i b = _mm_add_epi32(x[4 * g + 1], start[4 * g + 1]);
+			const __m128i c = _mm_add_epi32(x[4 * g + 2], start[4 * g + 2]);
+			const __m128i d = _mm_add_epi32(x[4 * g + 3], start[4 * g + 3]);
+
+			const __m128i ab0 = _mm_unpacklo_epi32(a, b);
+			const __m128i ab1 = _mm_unpackhi_epi32(a, b);
+			const __m128i cd0 = _mm_unpacklo_epi32(c, d);
+			const __m128i cd1 = _mm_unpackhi_epi32(c, d);
+
+			const __m128i blocks[4] = {
+				_mm_unpacklo_epi64(ab0, cd0), _mm_unpackhi_epi64(ab0, cd0),
+				_mm_unpacklo_epi64(ab1, cd1), _mm_unpackhi_epi64(ab1, cd1) };
+
+			for (int k = 0; k < 4; ++k)
+			{
+				_mm_storeu_si128((__m128i*)(stream + 64 * k + 16 * g), blocks[k]);
+			}
+		}
+
+		state[12] += 4;
+	}
+
+	CPU_TARGET("avx2")
+	inline __m256i Rotl256(__m256i v, int c)
+	{
+		return _mm256_or_si256(_mm256_slli_epi32(v, c), _mm256_srli_epi32(v, 32 - c));
+	}
+
+	// Rotations by whole bytes are a single shuffle.
+	CPU_TARGET("avx2")
+	inline void QuarterRound256(__m256i* x, int a, int b, int c, int d, __m256i rot16, __m256i rot8)
+	{
+		x[a] = _mm256_add_epi32(x[a], x[b]); x[d] = _mm256_shuffle_epi8(_mm256_xor_si256(x[d], x[a]), rot16);
+		x[c] = _mm256_add_epi32(x[c], x[d]); x[b] = Rotl256(_mm256_xor_si256(x[b], x[c]), 12);
+		x[a] = _mm256_add_epi32(x[a], x[b]); x[d] = _mm256_shuffle_epi8(_mm256_xor_si256(x[d], x[a]), rot8);
+		x[c] = _mm256_add_epi32(x[c], x[d]); x[b] = Rotl256(_mm256_xor_si256(x[b], x[c]), 7);
+	}
+
+	// Eight blocks at a time, blocks k and k + 4 share a transposed vector.
+	CPU_TARGET("avx2")
+	void ChaChaBlocksAvx2(uint32_t* state, uint8_t* stream)
+	{
+		__m256i start[16];
+		__m256i x[16];
+
+		for (int i = 0; i < 16; ++i)
+		{
+			start[i] = _mm256_set1_epi32(static_cast<int>(state[i]));
+		}
+		start[12] = _mm256_add_epi32(start[12], _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+
+		memcpy(x, start, sizeof(x));
+
+		const __m256i rot16 = _mm256_set_epi8(
+			13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+			13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+		const __m256i rot8 = _mm256_set_epi8(
+			14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3,
+			14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
+
+		for (int round = 0; round < 10; ++round)
+		{
+			QuarterRound256(x, 0, 4, 8, 12, rot16, rot8);
+			QuarterRound256(x, 1, 5, 9, 13, rot16, rot8);
+			QuarterRound256(x, 2, 6, 10, 14, rot16, rot8);
+			QuarterRound256(x, 3, 7, 11, 15, rot16, rot8);
+			QuarterRound256(x, 0, 5, 10, 15, rot16, rot8);
+			QuarterRound256(x, 1, 6, 11, 12, rot16, rot8);
+			QuarterRound256(x, 2, 7, 8, 13, rot16, rot8);
+			QuarterRound256(x, 3, 4, 9, 14, rot16, rot8);
+		}
+
+		for (int g = 0; g < 4; ++g)
+		{
+			const __m256i a = _mm256_add_epi32(x[4 * g], start[4 * g]);
+			const __m256i b = _mm256_add_epi32(x[4 * g + 1], start[4 * g + 1]);
+			const __m256i c = _mm256_add_epi32(x[4 * g + 2], start[4 * g + 2]);
+			const __m256i d = _mm256_add_epi32(x[4 * g + 3], start[4 * g + 3]);
+
+			// the unpacks work inside each 128-bit half
+			const __m256i ab0 = _mm256_unpacklo_epi32(a, b);
+			const __m256i ab1 = _mm256_unpackhi_epi32(a, b);
+			const __m256i cd0 = _mm256_unpacklo_epi32(c, d);
+			const __m256i cd1 = _mm256_unpackhi_epi32(c, d);
+
+			const __m256i blocks[4] = {
+				_mm256_unpacklo_epi64(ab0, cd0), _mm256_unpackhi_epi64(ab0, cd0),
+				_mm256_unpacklo_epi64(ab1, cd1), _mm256_unpackhi_epi64(ab1, cd1) };
+
+			for (int k = 0; k < 4; ++k)
+			{
+				uint8_t* block = stream + 64 * k + 16 * g;
+
+				_mm_storeu_si128((__m128i*)block, _mm256_castsi256_si128(blocks[k]));
+				_mm_storeu_si128((__m128i*)(block + 256), _mm256_extracti128_si256(blocks[k], 1));
+			}
+		}
+
+		state[12] += 8;
+	}
+#endif
+
+	void XorStream(const uint8_t* in, const uint8_t* stream, size_t count, uint8_t* out)
+	{
+		size_t i = 0;
+
+		for (; i + sizeof(uint64_t) <= count; i += sizeof(uint64_t))
+		{
+			uint64_t data;
+			uint64_t key;
+			memcpy(&data, in + i, sizeof(data));
+			memcpy(&key, stream + i, sizeof(key));
+			data ^= key;
+			memcpy(out + i, &data, sizeof(data));
+		}
+
+		for (; i < count; ++i)
+		{
+			out[i] = in[i] ^ stream[i];
+		}
+	}
+
+	// Keystream from block counter on, XORed into in. With polyKey the first
+	// block goes there instead, so sealing takes it from the same pass.
+	void ChaChaXor(const CipherKey& key, uint32_t counter, const uint8_t* nonce,
+		const uint8_t* in, size_t length, uint8_t* out, uint8_t* polyKey = nullptr)
+	{
+		uint32_t state[16];
+		InitState(state, key.bytes);
+		state[12] = counter;
+		state[13] = Load32(nonce);
+		state[14] = Load32(nonce + 4);
+		state[15] = Load32(nonce + 8);
+
+		uint8_t stream[512];
+		size_t skip = polyKey != nullptr ? 64 : 0;
+		size_t left = length + skip;
+
+		while (left > 0)
+		{
+			// the widest kernel that still uses more than half its blocks
+			size_t produced = 64;
+#if CPU_X86
+			if (left > 256 && CpuHasAvx2())
+			{
+				ChaChaBlocksAvx2(state, stream);
+				produced = 512;
+			}
+			else if (left > 64)
+			{
+				ChaChaBlocksSse2(state, stream);
+				produced = 256;
+			}
+			else
+#endif
+			{
+				ChaChaBlock(state, stream);
+				++state[12];
+			}
+
+			if (skip > 0)
+			{
+				memcpy(polyKey, stream, skip);
+			}
+
+			const size_t count = std::min(left, produced) - skip;
+			XorStream(in, stream + skip, count, out);
+
+			in += count;
+			out += count;
+			left -= count + skip;
+			skip = 0;
+		}
+	}
+
+	// Poly1305 with 26-bit limbs.
+	class Poly1305
+	{
+	public:
+		explicit Poly1305(const uint8_t* key)
+			: m_leftover(0)
+		{
+			m_r[0] = Load32(key + 0) & 0x3ffffff;
+			m_r[1] = (Load32(key + 3) >> 2) & 0x3ffff03;
+			m_r[2] = (Load32(key + 6) >> 4) & 0x3ffc0ff;
+			m_r[3] = (Load32(key + 9) >> 6) & 0x3f03fff;
+			m_r[4] = (Load32(key + 12) >> 8) & 0x00fffff;
+
+			memset(m_h, 0, sizeof(m_h));
+
+			for (int i = 0; i < 4; ++i)
+			{
+				m_pad[i] = Load32(key + 16 + 4 * i);
+			}
+		}
+
+		void Update(const uint8_t* data, size_t length)
+		{
+			if (m_leftover > 0)
+			{
+				const size_t count = std::min(length, size_t(16) - m_leftover);
+				memcpy(m_buffer + m_leftover, data, count);
+				m_leftover += count;
+				data += count;
+				length -= count;
+
+				if (m_leftover < 16)
+					return;
+
+				Blocks(m_buffer, 16, 1 << 24);
+				m_leftover = 0;
+			}
+
+			const size_t whole = length & ~size_t(15);
+			Blocks(data, whole, 1 << 24);
+
+			m_leftover = length - whole;
+			memcpy(m_buffer, data + whole, m_leftover);
+		}
+
+		// Zero bytes up to the next 16 byte boundary of the input so far.
+		void PadToBlock()
+		{
+			if (m_leftover == 0)
+				return;
+
+			memset(m_buffer + m_leftover, 0, 16 - m_leftover);
+			Blocks(m_buffer, 16, 1 << 24);
+			m_leftover = 0;
+		}
+
+		void Finish(uint8_t* tag)
+		{
+			if (m_leftover > 0)
+			{
+				m_buffer[m_leftover] = 1;
+				memset(m_buffer + m_leftover + 1, 0, 16 - m_leftover - 1);
+				Blocks(m_buffer, 16, 0);
+			}
+
+			uint32_t h0 = m_h[0], h1 = m_h[1], h2 = m_h[2], h3 = m_h[3], h4 = m_h[4];
+			uint32_t c;
+
+			c = h1 >> 26; h1 &= 0x3ffffff;
+			h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+			h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+			h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+			h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+			h1 += c;
+
+			// h - p, kept only when h >= p
+			uint32_t g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+			uint32_t g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+			uint32_t g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+			uint32_t g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+			uint32_t g4 = h4 + c - (1 << 26);
+
+			uint32_t mask = (g4 >> 31) - 1;
+			g0 &= mask; g1 &= mask; g2 &= mask; g3 &= mask; g4 &= mask;
+			mask = ~mask;
+			h0 = (h0 & mask) | g0;
+			h1 = (h1 & mask) | g1;
+			h2 = (h2 & mask) | g2;
+			h3 = (h3 & mask) | g3;
+			h4 = (h4 & mask) | g4;
+
+			h0 = h0 | (h1 << 26);
+			h1 = (h1 >> 6) | (h2 << 20);
+			h2 = (h2 >> 12) | (h3 << 14);
+			h3 = (h3 >> 18) | (h4 << 8);
+
+			uint64_t f;
+			f = uint64_t(h0) + m_pad[0]; Store32(tag + 0, uint32_t(f));
+			f = uint64_t(h1) + m_pad[1] + (f >> 32); Store32(tag + 4, uint32_t(f));
+			f = uint64_t(h2) + m_pad[2] + (f >> 32); Store32(tag + 8, uint32_t(f));
+			f = uint64_t(h3) + m_pad[3] + (f >> 32); Store32(tag + 12, uint32_t(f));
+		}
+
+	private:
+		void Blocks(const uint8_t* data, size_t length, uint32_t hibit)
+		{
+			const uint32_t r0 = m_r[0], r1 = m_r[1], r2 = m_r[2], r3 = m_r[3], r4 = m_r[4];
+			const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+			uint32_t h0 = m_h[0], h1 = m_h[1], h2 = m_h[2], h3 = m_h[3], h4 = m_h[4];
+
+			for (; length >= 16; data += 16, length -= 16)
+			{
+				h0 += Load32(data + 0) & 0x3ffffff;
+				h1 += (Load32(data + 3) >> 2) & 0x3ffffff;
+				h2 += (Load32(data + 6) >> 4) & 0x3ffffff;
+				h3 += (Load32(data + 9) >> 6) & 0x3ffffff;
+				h4 += (Load32(data + 12) >> 8) | hibit;
+
+				const uint64_t d0 = uint64_t(h0) * r0 + uint64_t(h1) * s4 + uint64_t(h2) * s3 + uint64_t(h3) * s2 + uint64_t(h4) * s1;
+				uint64_t d1 = uint64_t(h0) * r1 + uint64_t(h1) * r0 + uint64_t(h2) * s4 + uint64_t(h3) * s3 + uint64_t(h4) * s2;
+				uint64_t d2 = uint64_t(h0) * r2 + uint64_t(h1) * r1 + uint64_t(h2) * r0 + uint64_t(h3) * s4 + uint64_t(h4) * s3;
+				uint64_t d3 = uint64_t(h0) * r3 + uint64_t(h1) * r2 + uint64_t(h2) * r1 + uint64_t(h3) * r0 + uint64_t(h4) * s4;
+				uint64_t d4 = uint64_t(h0) * r4 + uint64_t(h1) * r3 + uint64_t(h2) * r2 + uint64_t(h3) * r1 + uint64_t(h4) * r0;
+
+				uint32_t c = uint32_t(d0 >> 26); h0 = uint32_t(d0) & 0x3ffffff;
+				d1 += c; c = uint32_t(d1 >> 26); h1 = uint32_t(d1) & 0x3ffffff;
+				d2 += c; c = uint32_t(d2 >> 26); h2 = uint32_t(d2) & 0x3ffffff;
+				d3 += c; c = uint32_t(d3 >> 26); h3 = uint32_t(d3) & 0x3ffffff;
+				d4 += c; c = uint32_t(d4 >> 26); h4 = uint32_t(d4) & 0x3ffffff;
+				h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+				h1 += c;
+			}
+
+			m_h[0] = h0; m_h[1] = h1; m_h[2] = h2; m_h[3] = h3; m_h[4] = h4;
+		}
+
+	private:
+		uint32_t m_r[5];
+		uint32_t m_h[5];
+		uint32_t m_pad[4];
+		uint8_t  m_buffer[16];
+		size_t   m_leftover;
+	};
+
+	// The one-time Poly1305 key is the first half of keystream block 0.
+	void ComputeTag(const uint8_t* polyKey,
+		const uint8_t* aad, size_t aadLength, const uint8_t* cipherText, size_t length, uint8_t* tag)
+	{
+		Poly1305 mac(polyKey);
+		mac.Update(aad, aadLength);
+		mac.PadToBlock();
+		mac.Update(cipherText, length);
+		mac.PadToBlock();
+
+		uint8_t lengths[16];
+		Store64(lengths, aadLength);
+		Store64(lengths + 8, length);
+		mac.Update(lengths, sizeof(lengths));
+
+		mac.Finish(tag);
+	}
+}
+
+const char* ChaChaKernel()
+{
+#if CPU_X86
+	return CpuHasAvx2() ? "avx2" : "sse2";
+#else
+	return "scalar";
+#endif
+}
+
+bool ParseCipherKey(const std::string& hex, CipherKey* key)
+{
+	if (hex.size() != 2 * CIPHER_KEY_LENGTH)
+	{
+		return false;
+	}
+
+	for (size_t i = 0; i < CIPHER_KEY_LENGTH; ++i)
+	{
+		int value = 0;
+		for (size_t j = 2 * i; j < 2 * i + 2; ++j)
+		{
+			const char c = hex[j];
+			int digit = -1;
+			if (c >= '0' && c <= '9') digit = c - '0';
+			else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+			else if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+
+			if (digit < 0)
+				return false;
+
+			value = value * 16 + digit;
+		}
+		key->bytes[i] = uint8_t(value);
+	}
+
+	return true;
+}
+
+CipherKey DeriveSessionKey(const CipherKey& preShared, uint64_t clientNonce, uint64_t serverNonce)
+{
+	uint32_t x[16];
+	InitState(x, preShared.bytes);
+	x[12] = uint32_t(clientNonce);
+	x[13] = uint32_t(clientNonce >> 32);
+	x[14] = uint32_t(serverNonce);
+	x[15] = uint32_t(serverNonce >> 32);
+
+	DoubleRounds(x);
+
+	CipherKey session;
+	for (int i = 0; i < 4; ++i)
+	{
+		Store32(session.bytes + 4 * i, x[i]);
+		Store32(session.bytes + 16 + 4 * i, x[12 + i]);
+	}
+
+	return session;
+}
+
+uint64_t RandomNonce()
+{
+	std::random_device device;
+
+	return (uint64_t(device()) << 32) | device();
+}
+
+void Seal(const CipherKey& key, const uint8_t nonce[CIPHER_NONCE_LENGTH],
+	const uint8_t* aad, size_t aadLength,
+	const uint8_t* in, size_t length, uint8_t* out, uint8_t tag[CIPHER_TAG_LENGTH])
+{
+	uint8_t polyKey[64];
+	ChaChaXor(key, 0, nonce, in, length, out, polyKey);
+
+	ComputeTag(polyKey, aad, aadLength, out, length, tag);
+}
+
+bool Open(const CipherKey& key, const uint8_t nonce[CIPHER_NONCE_LENGTH],
+	const uint8_t* aad, size_t aadLength,
+	const uint8_t* in, size_t length, uint8_t* out, const uint8_t tag[CIPHER_TAG_LENGTH])
+{
+	// the tag is checked before anything is decrypted, so block 0 is made alone
+	uint8_t polyKey[64];
+	memset(polyKey, 0, sizeof(polyKey));
+	ChaChaXor(key, 0, nonce, polyKey, sizeof(polyKey), polyKey);
+
+	uint8_t expected[CIPHER_TAG_LENGTH];
+	ComputeTag(polyKey, aad, aadLength, in, length, expected);
+
+	// constant time, a forger learns nothing from how long the check took
+	uint8_t diff = 0;
+	for (int i = 0; i < CIPHER_TAG_LENGTH; ++i)
+	{
+		diff |= expected[i] ^ tag[i];
+	}
+	if (diff != 0)
+	{
+		return false;
+	}
+
+	ChaChaXor(key, 1, nonce, in, length, out);
+
+	return true;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "Common.h"
+#include <cstdint>
+
+// ChaCha20-Poly1305 authenticated encryption (RFC 8439), the repo has no
+// crypto library to link against. ChaCha20 runs four or eight blocks at a
+// time in SSE2 or AVX2 where the CPU has them, Poly1305 is portable C++.
+
+#define CIPHER_KEY_LENGTH 32
+#define CIPHER_NONCE_LENGTH 12
+#define CIPHER_TAG_LENGTH 16
+
+struct CipherKey
+{
+	uint8_t bytes[CIPHER_KEY_LENGTH];
+};
+
+// 64 hex digits, false when the text is not a key.
+bool ParseCipherKey(const std::string& hex, CipherKey* key);
+
+// Subkey for one session from the pre-shared key and both Hello nonces (HChaCha20).
+CipherKey DeriveSessionKey(const CipherKey& preShared, uint64_t clientNonce, uint64_t serverNonce);
+
+uint64_t RandomNonce();
+
+// Name of the ChaCha20 kernel this CPU runs.
+const char* ChaChaKernel();
+
+// out may be the same buffer as in.
+void Seal(const CipherKey& key, const uint8_t nonce[CIPHER_NONCE_LENGTH],
+	const uint8_t* aad, size_t aadLength,
+	const uint8_t* in, size_t length, uint8_t* out, uint8_t tag[CIPHER_TAG_LENGTH]);
+
+// Decrypts only when the tag matches, returns false otherwise.
+bool Open(const CipherKey& key, const uint8_t nonce[CIPHER_NONCE_LENGTH],
+	const uint8_t* aad, size_t aadLength,
+	const uint8_t* in, size_t length, uint8_t* out, const uint8_t tag[CIPHER_TAG_LENGTH]);
@@ -0,0 +1,256 @@
+#include "Fec.h"
+#include "Cpu.h"
+#include <cmath>
+
+// SSE2 is the baseline of every x86 target, the shuffle kernels are picked
+// at run time so one build uses AVX2 where the CPU has it
+#if CPU_X86
+#include <immintrin.h>
+#define FEC_SSE2 1
+#endif
+
+namespace
+{
+	// GF(256) over x^8 + x^4 + x^3 + x^2 + 1.
+	struct GaloisField
+	{
+		GaloisField()
+		{
+			int x = 1;
+			for (int i = 0; i < 255; ++i)
+			{
+				exp[i] = exp[i + 255] = static_cast<uint8_t>(x);
+				log[x] = static_cast<uint8_t>(i);
+
+				x <<= 1;
+				if (x & 0x100)
+					x ^= 0x11d;
+			}
+			log[0] = 0;
+
+			// a product is the XOR of the products with the two nibbles, so
+			// 16 entries per nibble make a shuffle table per factor
+			for (int factor = 0; factor < 256; ++factor)
+			{
+				for (int nibble = 0; nibble < 16; ++nibble)
+				{
+					low[factor][nibble] = Mul(factor, nibble);
+					high[factor][nibble] = Mul(factor, nibble << 4);
+				}
+			}
+		}
+
+		uint8_t Mul(int a, int b) const
+		{
+			return a == 0 || b == 0 ? 0 : exp[log[a] + log[b]];
+		}
+
+		// a is not 0
+		uint8_t Inverse(int a) const
+		{
+			return exp[255 - log[a]];
+		}
+
+		uint8_t exp[510];
+		uint8_t log[256];
+		uint8_t low[256][16];
+		uint8_t high[256][16];
+	};
+
+	const GaloisField& Field()
+	{
+		static const GaloisField field;
+		return field;
+	}
+}
+
+#if CPU_X86
+namespace
+{
+	// The kernels return how far they got, the rest is left to the caller.
+	CPU_TARGET("ssse3")
+	size_t MulAddSsse3(char* dst, const char* src, const uint8_t* low, const uint8_t* high, size_t i, size_t count)
+	{
+		const __m128i lowTable = _mm_loadu_si128((const __m128i*)low);
+		const __m128i highTable = _mm_loadu_si128((const __m128i*)high);
+		const __m128i mask = _mm_set1_epi8(0x0f);
+
+		for (; i + 16 <= count; i += 16)
+		{
+			const __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+			const __m128i lo = _mm_shuffle_epi8(lowTable, _mm_and_si128(s, mask));
+			const __m128i hi = _mm_shuffle_epi8(highTable, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+			const __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+
+			_mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(d, _mm_xor_si128(lo, hi)));
+		}
+
+		return i;
+	}
+
+	CPU_TARGET("avx2")
+	size_t MulAddAvx2(char* dst, const char* src, const uint8_t* low, const uint8_t* high, size_t i, size_t count)
+	{
+		const __m256i lowTable = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)low));
+		const __m256i highTable = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)high));
+		const __m256i mask = _mm256_set1_epi8(0x0f);
+
+		for (; i + 32 <= count; i += 32)
+		{
+			const __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+			const __m256i lo = _mm256_shuffle_epi8(lowTable, _mm256_and_si256(s, mask));
+			const __m256i hi = _mm256_shuffle_epi8(highTable, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+			const __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+
+			_mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(d, _mm256_xor_si256(lo, hi)));
+		}
+
+		return i;
+	}
+}
+#endif
+
+const char* GfMulAddKernel()
+{
+#if CPU_X86
+	if (CpuHasAvx2())
+		return "avx2";
+	if (CpuHasSsse3())
+		return "ssse3";
+#endif
+
+	return "scalar";
+}
+
+void GfMulAdd(char* dst, const char* src, uint8_t factor, size_t count)
+{
+	size_t i = 0;
+
+	if (factor == 0)
+		return;
+
+	if (factor == 1)
+	{
+#if FEC_SSE2
+		for (; i + 16 <= count; i += 16)
+		{
+			__m128i a = _mm_loadu_si128((const __m128i*)(dst + i));
+			__m128i b = _mm_loadu_si128((const __m128i*)(src + i));
+			_mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(a, b));
+		}
+#endif
+
+		for (; i < count; ++i)
+		{
+			dst[i] ^= src[i];
+		}
+		return;
+	}
+
+	const uint8_t* low = Field().low[factor];
+	const uint8_t* high = Field().high[factor];
+
+#if CPU_X86
+	// the AVX2 tail of less than 32 bytes still fits the SSSE3 kernel
+	if (CpuHasAvx2())
+		i = MulAddAvx2(dst, src, low, high, i, count);
+	if (CpuHasSsse3())
+		i = MulAddSsse3(dst, src, low, high, i, count);
+#endif
+
+	for (; i < count; ++i)
+	{
+		const uint8_t s = static_cast<uint8_t>(src[i]);
+		dst[i] ^= static_cast<char>(low[s & 0x0f] ^ high[s >> 4]);
+	}
+}
+
+// Cauchy 1 / (x_row + y_block) with x_row = 128 + row and y_block = block,
+// every column scaled so row 0 is all ones and a single parity row is a
+// plain XOR. Scaling columns keeps every square submatrix invertible.
+uint8_t FecCoefficient(int row, int block)
+{
+	const GaloisField& field = Field();
+
+	return field.Mul(128 ^ block, field.Inverse((128 + row) ^ block));
+}
+
+bool FecInvert(const int* rows, const int* blocks, int count, uint8_t* inverse)
+{
+	if (count <= 0 || count > FEC_MAX_PARITY)
+		return false;
+
+	const GaloisField& field = Field();
+	uint8_t matrix[FEC_MAX_PARITY][FEC_MAX_PARITY];
+
+	for (int r = 0; r < count; ++r)
+	{
+		if (rows[r] < 0 || rows[r] >= FEC_MAX_PARITY || blocks[r] < 0 || blocks[r] >= FEC_MAX_GROUP)
+			return false;
+	}
+
+	// the rows taken over the lost blocks, next to the identity
+	for (int r = 0; r < count; ++r)
+	{
+		for (int b = 0; b < count; ++b)
+		{
+			matrix[r][b] = FecCoefficient(rows[r], blocks[b]);
+			inverse[r * count + b] = r == b ? 1 : 0;
+		}
+	}
+
+	// Gauss-Jordan, addition is XOR
+	for (int column = 0; column < count; ++column)
+	{
+		int pivot = column;
+		while (pivot < count && matrix[pivot][column] == 0)
+			++pivot;
+
+		if (pivot == count)
+			return false;
+
+		for (int b = 0; b < count; ++b)
+		{
+			std::swap(matrix[column][b], matrix[pivot][b]);
+			std::swap(inverse[column * count + b], inverse[pivot * count + b]);
+		}
+
+		const uint8_t scale = field.Inverse(matrix[column][column]);
+		for (int b = 0; b < count; ++b)
+		{
+			matrix[column][b] = field.Mul(matrix[column][b], scale);
+			inverse[column * count + b] = field.Mul(inverse[column * count + b], scale);
+		}
+
+		for (int r = 0; r < count; ++r)
+		{
+			const uint8_t factor = matrix[r][column];
+			if (r == column || factor == 0)
+				continue;
+
+			for (int b = 0; b < count; ++b)
+			{
+				matrix[r][b] ^= field.Mul(factor, matrix[column][b]);
+				inverse[r * count + b] ^= field.Mul(factor, inverse[column * count + b]);
+			}
+		}
+	}
+
+	return true;
+}
+
+int FecParityRows(double lossRate, int group)
+{
+	// the expected losses and two standard deviations of them
+	const double expected = lossRate * group;
+	int rows = static_cast<int>(expected + 2.0 * std::sqrt(expected) + 0.5);
+
+	if (rows > FEC_MAX_PARITY)
+		rows = FEC_MAX_PARITY;
+	if (rows > group)
+		rows = group;
+	if (rows < 1)
+		rows = 1;
+
+	return rows;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "Transfer.h"
+#include <cstdint>
+
+// Reed-Solomon parity over groups of UDP data blocks, in GF(256). Parity
+// row r of a group is the sum over its blocks i of FecCoefficient(r, i)
+// times block i, zero padded to MAX_LENGTH. The coefficients form a
+// Cauchy matrix, so the receiver rebuilds as many lost blocks of a group
+// as it got parity rows for it, whichever blocks and rows those are.
+
+#define FEC_MAX_GROUP CHUNK_LENGTH
+#define FEC_MAX_PARITY 4
+
+// dst ^= factor * src in GF(256), a factor of 1 is a plain XOR.
+void GfMulAdd(char* dst, const char* src, uint8_t factor, size_t count);
+
+// Name of the kernel GfMulAdd runs on this CPU.
+const char* GfMulAddKernel();
+
+uint8_t FecCoefficient(int row, int block);
+
+// Inverts the coefficients of the parity rows over the lost blocks of a
+// group, count of each. Lost block b is then the sum over r of
+// inverse[b * count + r] times row r with the received blocks taken out.
+// False only for rows or blocks out of range.
+bool FecInvert(const int* rows, const int* blocks, int count, uint8_t* inverse);
+
+// Parity dataIndex is the absolute first block of the group, dataSize
+// packs the size of its last block, the group length and the row.
+inline size_t PackParity(size_t lastSize, int count, int row)
+{
+	return lastSize | (size_t(count) << 16) | (size_t(row) << 24);
+}
+
+inline void UnpackParity(size_t packed, size_t* lastSize, int* count, int* row)
+{
+	*lastSize = packed & 0xffff;
+	*count = static_cast<int>((packed >> 16) & 0xff);
+	*row = static_cast<int>((packed >> 24) & 0xff);
+}
+
+// Parity rows per group of blocks for the observed loss rate, enough that
+// a group rarely loses more than it can rebuild.
+int FecParityRows(double lossRate, int group);
+
+// Smoothed fraction of data blocks lost on the way, rebuilt or sent again.
+class LossEstimator
+{
+public:
+	LossEstimator()
+		: m_rate(0.01)
+	{}
+
+	void Update(int blocks, int lost)
+	{
+		if (blocks <= 0)
+			return;
+
+		m_rate = 0.875 * m_rate + 0.125 * (double(lost) / blocks);
+	}
+
+	double Rate() const { return m_rate; }
+
+private:
+	double m_rate;
+};
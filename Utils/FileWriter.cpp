@@ -0,0 +1,637 @@
+#include "FileWriter.h"
+#include <chrono>
+#include <cstring>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+namespace
+{
+	// zeros that direct I/O can write
+	alignas(WRITE_ALIGNMENT) const char ZeroBlock[WRITE_ALIGNMENT] = {};
+
+	char* AllocAligned(size_t size)
+	{
+#ifdef _WIN32
+		void* memory = _aligned_malloc(size, WRITE_ALIGNMENT);
+#else
+		void* memory = nullptr;
+		if (posix_memalign(&memory, WRITE_ALIGNMENT, size) != 0)
+			memory = nullptr;
+#endif
+		if (memory == nullptr)
+		{
+			throw std::runtime_error("Error: [FileWriter] out of memory");
+		}
+		return static_cast<char*>(memory);
+	}
+
+	void FreeAligned(char* memory)
+	{
+#ifdef _WIN32
+		_aligned_free(memory);
+#else
+		free(memory);
+#endif
+	}
+}
+
+FileWriter::FileWriter(SyncPolicy policy, bool directIo, unsigned int periodMs)
+	: m_policy(policy)
+	, m_directIo(directIo)
+	, m_periodMs(periodMs)
+	, m_open(false)
+	, m_kept(false)
+	, m_sparse(false)
+	, m_written(0)
+	, m_end(0)
+	, m_flushed(0)
+	, m_synced(0)
+	, m_busy(false)
+	, m_stop(false)
+{
+	for (int i = 0; i < WRITE_BEHIND_BUFFERS; ++i)
+	{
+		m_buffers.push_back(AllocAligned(WRITE_BEHIND_BUFFER));
+	}
+	m_free.assign(m_buffers.begin() + 1, m_buffers.end());
+
+	m_current.data = m_buffers[0];
+	m_current.size = 0;
+	m_current.offset = 0;
+
+	m_thread = std::thread(&FileWriter::WriterLoop, this);
+}
+
+FileWriter::~FileWriter()
+{
+	Abort();
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_wakeUp.notify_all();
+	m_thread.join();
+
+	for (size_t i = 0; i < m_buffers.size(); ++i)
+	{
+		FreeAligned(m_buffers[i]);
+	}
+}
+
+void FileWriter::SetPolicy(SyncPolicy policy, bool directIo)
+{
+	if (m_open)
+	{
+		throw std::runtime_error("Error: [FileWriter] policy change while file open");
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_policy = policy;
+	m_directIo = directIo;
+}
+
+void FileWriter::Open(const std::string& path, bool truncate)
+{
+	if (m_open)
+	{
+		throw std::runtime_error("Error: [FileWriter] file already open");
+	}
+
+	FileHandle file = OpenNative(path, truncate, m_directIo);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_file = file;
+	m_open = true;
+	m_kept = !truncate;
+	m_sparse = false;
+	m_written = 0;
+	m_end = 0;
+	m_current.offset = 0;
+	m_flushed = 0;
+	m_synced = 0;
+	m_error.clear();
+}
+
+void FileWriter::WriteAt(uint64_t offset, const char* data, size_t size)
+{
+	assert(m_open);
+
+	ThrowIfFailed();
+
+	if (offset != m_current.offset + m_current.size)
+	{
+		if (m_directIo && offset % WRITE_ALIGNMENT != 0)
+		{
+			throw std::runtime_error("Error: [FileWriter] unaligned write with direct I/O");
+		}
+
+		Submit();
+		m_current.offset = offset;
+	}
+
+	if (offset + size > m_end)
+	{
+		m_end = offset + size;
+	}
+
+	while (size > 0)
+	{
+		size_t part = WRITE_BEHIND_BUFFER - m_current.size;
+		if (part > size)
+			part = size;
+
+		memcpy(m_current.data + m_current.size, data, part);
+		m_current.size += part;
+		m_written += part;
+		data += part;
+		size -= part;
+
+		if (m_current.size == WRITE_BEHIND_BUFFER)
+		{
+			Submit();
+		}
+	}
+}
+
+void FileWriter::WriteHole(uint64_t offset, uint64_t size)
+{
+	assert(m_open);
+
+	ThrowIfFailed();
+
+	uint64_t tail = 0;
+	if (m_directIo)
+	{
+		// writes may only jump to aligned offsets, the edges are written as zeros
+		const uint64_t head = std::min<uint64_t>(size, (WRITE_ALIGNMENT - offset % WRITE_ALIGNMENT) % WRITE_ALIGNMENT);
+		if (head > 0)
+		{
+			WriteAt(offset, ZeroBlock, static_cast<size_t>(head));
+		}
+		offset += head;
+		size -= head;
+
+		tail = size % WRITE_ALIGNMENT;
+		size -= tail;
+	}
+
+	if (size > 0)
+	{
+		if (!m_sparse)
+		{
+			SparseNative(m_file);
+			m_sparse = true;
+		}
+
+		// a fresh file has nothing there to remove
+		if (m_kept)
+		{
+			PunchNative(m_file, offset, size);
+		}
+
+		if (offset + size > m_end)
+		{
+			m_end = offset + size;
+		}
+	}
+
+	if (tail > 0)
+	{
+		WriteAt(offset + size, ZeroBlock, static_cast<size_t>(tail));
+	}
+}
+
+void FileWriter::Close()
+{
+	if (!m_open)
+		return;
+
+	Submit();
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	WaitIdle(lock);
+
+	std::string error;
+	error.swap(m_error);
+
+	if (error.empty())
+	{
+		try
+		{
+			// drops direct I/O padding and any stale tail of a pre-sized file
+			TruncateNative(m_file, m_end);
+
+			if (m_policy == SyncOnFileEnd)
+			{
+				SyncNative(m_file);
+				m_synced = m_written;
+			}
+
+			m_wakeUp.notify_all();
+			m_done.wait(lock, [this]() { return m_policy != SyncPeriodic || m_synced >= m_written || !m_error.empty(); });
+
+			error.swap(m_error);
+		}
+		catch (const std::exception& exc)
+		{
+			error = exc.what();
+		}
+	}
+
+	CloseNative(m_file);
+	m_open = false;
+
+	if (!error.empty())
+	{
+		throw std::runtime_error(error);
+	}
+}
+
+void FileWriter::Abort()
+{
+	if (!m_open)
+		return;
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	while (!m_queue.empty())
+	{
+		m_free.push_back(m_queue.front().data);
+		m_queue.pop_front();
+	}
+	WaitIdle(lock);
+
+	m_current.size = 0;
+	m_error.clear();
+
+	CloseNative(m_file);
+	m_open = false;
+}
+
+void FileWriter::Submit()
+{
+	if (m_current.size == 0)
+		return;
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	m_queue.push_back(m_current);
+	m_wakeUp.notify_all();
+
+	// bounded buffers give back pressure to the receive loop
+	m_done.wait(lock, [this]() { return !m_free.empty(); });
+
+	m_current.offset += m_current.size;
+	m_current.data = m_free.back();
+	m_current.size = 0;
+	m_free.pop_back();
+}
+
+void FileWriter::WaitIdle(std::unique_lock<std::mutex>& lock)
+{
+	m_done.wait(lock, [this]() { return m_queue.empty() && !m_busy; });
+}
+
+void FileWriter::ThrowIfFailed()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (!m_error.empty())
+	{
+		throw std::runtime_error(m_error);
+	}
+}
+
+void FileWriter::WriterLoop()
+{
+	typedef std::chrono::steady_clock Clock;
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	Clock::time_point lastSync = Clock::now();
+
+	while (true)
+	{
+		if (m_queue.empty() && !m_stop)
+		{
+			if (m_policy == SyncPeriodic && m_open)
+				m_wakeUp.wait_for(lock, std::chrono::milliseconds(m_periodMs));
+			else
+				m_wakeUp.wait(lock);
+		}
+
+		if (m_stop && m_queue.empty())
+			return;
+
+		if (!m_queue.empty())
+		{
+			Buffer buffer = m_queue.front();
+			m_queue.pop_front();
+			m_busy = true;
+
+			size_t size = buffer.size;
+			if (m_directIo)
+			{
+				// unbuffered writes must cover whole sectors, Close trims the padding
+				const size_t padded = (size + WRITE_ALIGNMENT - 1) / WRITE_ALIGNMENT * WRITE_ALIGNMENT;
+				memset(buffer.data + size, 0, padded - size);
+				size = padded;
+			}
+
+			const FileHandle file = m_file;
+			lock.unlock();
+
+			std::string error;
+			try
+			{
+				WriteNative(file, buffer.offset, buffer.data, size);
+			}
+			catch (const std::exception& exc)
+			{
+				error = exc.what();
+			}
+
+			lock.lock();
+			if (!error.empty() && m_error.empty())
+				m_error = error;
+
+			m_flushed += buffer.size;
+			m_free.push_back(buffer.data);
+			m_busy = false;
+			m_done.notify_all();
+		}
+
+		const bool due = Clock::now() - lastSync >= std::chrono::milliseconds(m_periodMs);
+		if (m_policy == SyncPeriodic && m_open && m_synced < m_flushed && due)
+		{
+			const uint64_t target = m_flushed;
+			const FileHandle file = m_file;
+			m_busy = true;
+			lock.unlock();
+
+			std::string error;
+			try
+			{
+				SyncNative(file);
+			}
+			catch (const std::exception& exc)
+			{
+				error = exc.what();
+			}
+
+			lock.lock();
+			if (!error.empty() && m_error.empty())
+				m_error = error;
+
+			m_synced = target;
+			m_busy = false;
+			lastSync = Clock::now();
+			m_done.notify_all();
+		}
+	}
+}
+
+void FileWriter::WriteWhole(const std::string& path, const char* data, size_t size, SyncPolicy policy)
+{
+	FileHandle file = OpenNative(path, true, false);
+
+	try
+	{
+		WriteNative(file, 0, data, size);
+
+		if (policy != SyncNone)
+		{
+			SyncNative(file);
+		}
+	}
+	catch (...)
+	{
+		CloseNative(file);
+		throw;
+	}
+
+	CloseNative(file);
+}
+
+void FileWriter::Preallocate(const std::string& path, uint64_t size)
+{
+	FileHandle file = OpenNative(path, true, false);
+
+	try
+	{
+		if (size > 0)
+		{
+			AllocateNative(file, size);
+		}
+	}
+	catch (...)
+	{
+		CloseNative(file);
+		throw;
+	}
+
+	CloseNative(file);
+}
+
+#ifdef _WIN32
+
+FileHandle FileWriter::OpenNative(const std::string& path, bool truncate, bool directIo)
+{
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_WRITE, 0, NULL,
+		truncate ? CREATE_ALWAYS : OPEN_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL | (directIo ? FILE_FLAG_NO_BUFFERING : 0), NULL);
+
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		throw std::runtime_error("Error: [FileWriter] failed open file " + path);
+	}
+	return file;
+}
+
+void FileWriter::WriteNative(FileHandle file, uint64_t offset, const char* data, size_t size)
+{
+	while (size > 0)
+	{
+		OVERLAPPED position;
+		memset(&position, 0, sizeof(position));
+		position.Offset = static_cast<DWORD>(offset);
+		position.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+		DWORD written = 0;
+		if (!WriteFile(file, data, static_cast<DWORD>(size), &written, &position))
+		{
+			throw std::runtime_error("Error: [FileWriter] write failed " + std::to_string(GetLastError()));
+		}
+		data += written;
+		size -= written;
+		offset += written;
+	}
+}
+
+void FileWriter::SyncNative(FileHandle file)
+{
+	if (!FlushFileBuffers(file))
+	{
+		throw std::runtime_error("Error: [FileWriter] flush failed " + std::to_string(GetLastError()));
+	}
+}
+
+void FileWriter::TruncateNative(FileHandle file, uint64_t size)
+{
+	LARGE_INTEGER position;
+	position.QuadPart = static_cast<LONGLONG>(size);
+
+	if (!SetFilePointerEx(file, position, NULL, FILE_BEGIN) || !SetEndOfFile(file))
+	{
+		throw std::runtime_error("Error: [FileWriter] truncate failed " + std::to_string(GetLastError()));
+	}
+}
+
+void FileWriter::AllocateNative(FileHandle file, uint64_t size)
+{
+	FILE_ALLOCATION_INFO allocation;
+	allocation.AllocationSize.QuadPart = static_cast<LONGLONG>(size);
+
+	if (!SetFileInformationByHandle(file, FileAllocationInfo, &allocation, sizeof(allocation)))
+	{
+		throw std::runtime_error("Error: [FileWriter] allocation failed " + std::to_string(GetLastError()));
+	}
+
+	TruncateNative(file, size);
+}
+
+void FileWriter::SparseNative(FileHandle file)
+{
+	// file systems without sparse files fill the gaps, which is still correct
+	DWORD returned = 0;
+	DeviceIoControl(file, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &returned, NULL);
+}
+
+void FileWriter::PunchNative(FileHandle file, uint64_t offset, uint64_t size)
+{
+	// deallocates on sparse files, writes zeros otherwise
+	FILE_ZERO_DATA_INFORMATION range;
+	range.FileOffset.QuadPart = static_cast<LONGLONG>(offset);
+	range.BeyondFinalZero.QuadPart = static_cast<LONGLONG>(offset + size);
+
+	DWORD returned = 0;
+	if (!DeviceIoControl(file, FSCTL_SET_ZERO_DATA, &range, sizeof(range), NULL, 0, &returned, NULL))
+	{
+		throw std::runtime_error("Error: [FileWriter] zeroing failed " + std::to_string(GetLastError()));
+	}
+}
+
+void FileWriter::CloseNative(FileHandle file)
+{
+	::CloseHandle(file);
+}
+
+#else
+
+FileHandle FileWriter::OpenNative(const std::string& path, bool truncate, bool directIo)
+{
+	int flags = O_WRONLY | O_CREAT | (truncate ? O_TRUNC : 0);
+#ifdef O_DIRECT
+	if (directIo)
+		flags |= O_DIRECT;
+#endif
+
+	const int file = open(path.c_str(), flags, 0644);
+
+	if (file < 0)
+	{
+		throw std::runtime_error("Error: [FileWriter] failed open file " + path);
+	}
+	return file;
+}
+
+void FileWriter::WriteNative(FileHandle file, uint64_t offset, const char* data, size_t size)
+{
+	while (size > 0)
+	{
+		const ssize_t written = pwrite(file, data, size, static_cast<off_t>(offset));
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error("Error: [FileWriter] write failed " + std::to_string(errno));
+		}
+		data += written;
+		size -= written;
+		offset += written;
+	}
+}
+
+void FileWriter::SyncNative(FileHandle file)
+{
+#ifdef __APPLE__
+	const int retVal = fsync(file);
+#else
+	const int retVal = fdatasync(file);
+#endif
+	if (retVal != 0)
+	{
+		throw std::runtime_error("Error: [FileWriter] flush failed " + std::to_string(errno));
+	}
+}
+
+void FileWriter::TruncateNative(FileHandle file, uint64_t size)
+{
+	if (ftruncate(file, static_cast<off_t>(size)) != 0)
+	{
+		throw std::runtime_error("Error: [FileWriter] truncate failed " + std::to_string(errno));
+	}
+}
+
+void FileWriter::AllocateNative(FileHandle file, uint64_t size)
+{
+#ifndef __APPLE__
+	// returns the error instead of setting errno
+	const int retVal = posix_fallocate(file, 0, static_cast<off_t>(size));
+	if (retVal == 0)
+		return;
+
+	if (retVal != EINVAL && retVal != EOPNOTSUPP)
+	{
+		throw std::runtime_error("Error: [FileWriter] allocation failed " + std::to_string(retVal));
+	}
+#endif
+
+	TruncateNative(file, size);
+}
+
+void FileWriter::SparseNative(FileHandle)
+{
+	// ranges never written are holes already
+}
+
+void FileWriter::PunchNative(FileHandle file, uint64_t offset, uint64_t size)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if (fallocate(file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(offset), static_cast<off_t>(size)) == 0)
+		return;
+
+	if (errno != EOPNOTSUPP && errno != ENOSYS)
+	{
+		throw std::runtime_error("Error: [FileWriter] punch hole failed " + std::to_string(errno));
+	}
+#endif
+
+	while (size > 0)
+	{
+		const size_t part = static_cast<size_t>(std::min<uint64_t>(size, WRITE_ALIGNMENT));
+		WriteNative(file, offset, ZeroBlock, part);
+		offset += part;
+		size -= part;
+	}
+}
+
+void FileWriter::CloseNative(FileHandle file)
+{
+	close(file);
+}
+
+#endif
@@ -0,0 +1,137 @@
+#pragma once
+
+#include "Common.h"
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#ifdef _WIN32
+#include <WinSock2.h>
+
+typedef HANDLE FileHandle;
+#else
+typedef int FileHandle;
+#endif
+
+#define WRITE_BEHIND_BUFFER (1024 * 1024)
+#define WRITE_BEHIND_BUFFERS 4
+#define WRITE_ALIGNMENT 4096
+
+enum SyncPolicy
+{
+	SyncNone,       // acknowledged once handed to the OS
+	SyncOnFileEnd,  // data flushed to disk before FileEnd is answered
+	SyncPeriodic    // background flush, FileEnd waits for the next one
+};
+
+// File writer with a write-behind thread. Incoming blocks are coalesced
+// into large aligned buffers which the thread writes while the receive
+// loop carries on; a write that does not continue the previous one starts
+// a new buffer at its own offset. Close returns once the sync policy holds for
+// everything written, so its caller can acknowledge the file.
+class FileWriter
+{
+public:
+	explicit FileWriter(SyncPolicy policy = SyncNone, bool directIo = false, unsigned int periodMs = 1000);
+
+	~FileWriter();
+
+	// Only while no file is open.
+	void SetPolicy(SyncPolicy policy, bool directIo);
+
+	// Keeps existing contents (and pre-allocated extents) when truncate is false.
+	void Open(const std::string& path, bool truncate);
+
+	bool IsOpen() const { return m_open; }
+
+	// With direct I/O a write that jumps must land on WRITE_ALIGNMENT.
+	void WriteAt(uint64_t offset, const char* data, size_t size);
+
+	// Leaves the range unwritten so it stays a hole, and punches out what a
+	// kept file had there. With direct I/O the unaligned edges are written
+	// as zeros.
+	void WriteHole(uint64_t offset, uint64_t size);
+
+	void Close();
+
+	// Closes without waiting for durability and drops pending errors.
+	void Abort();
+
+	SyncPolicy Policy() const { return m_policy; }
+
+	// Writes a small file in one go on the calling thread, honouring the policy.
+	static void WriteWhole(const std::string& path, const char* data, size_t size, SyncPolicy policy);
+
+	// Creates path at size with its blocks allocated on disk, so the data
+	// that follows lands in extents laid out up front.
+	static void Preallocate(const std::string& path, uint64_t size);
+
+private:
+	struct Buffer
+	{
+		char*    data;
+		size_t   size;
+		uint64_t offset;
+	};
+
+	void WriterLoop();
+
+	void Submit();
+
+	void WaitIdle(std::unique_lock<std::mutex>& lock);
+
+	void ThrowIfFailed();
+
+	static FileHandle OpenNative(const std::string& path, bool truncate, bool directIo);
+
+	static void WriteNative(FileHandle file, uint64_t offset, const char* data, size_t size);
+
+	static void SyncNative(FileHandle file);
+
+	static void TruncateNative(FileHandle file, uint64_t size);
+
+	// Allocates size bytes and sets the end of file there, file systems that
+	// can't allocate ahead get a sparse file instead.
+	static void AllocateNative(FileHandle file, uint64_t size);
+
+	// Lets ranges that are never written stay holes, on Windows files are
+	// only sparse when asked.
+	static void SparseNative(FileHandle file);
+
+	// Deallocates a range, or writes zeros over it where that is not possible.
+	static void PunchNative(FileHandle file, uint64_t offset, uint64_t size);
+
+	static void CloseNative(FileHandle file);
+
+	FileWriter(const FileWriter&);
+
+	FileWriter& operator = (const FileWriter&);
+
+private:
+	SyncPolicy              m_policy;
+	bool                    m_directIo;
+	const unsigned int      m_periodMs;
+
+	bool                    m_open;
+	bool                    m_kept;      // opened without truncating
+	bool                    m_sparse;
+	FileHandle              m_file;
+	uint64_t                m_written;   // bytes accepted by WriteAt
+	uint64_t                m_end;       // file size once everything is written
+	uint64_t                m_flushed;   // bytes written by the thread
+	uint64_t                m_synced;    // bytes known to be on disk
+
+	Buffer                  m_current;
+	std::deque<Buffer>      m_queue;
+	std::vector<char*>      m_free;
+	std::vector<char*>      m_buffers;
+	bool                    m_busy;
+	bool                    m_stop;
+	std::string             m_error;
+	std::mutex              m_mutex;
+	std::condition_variable m_wakeUp;
+	std::condition_variable m_done;
+	std::thread             m_thread;
+};
@@ -0,0 +1,305 @@
+#include "FrameCipher.h"
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+// Least payload a worker seals, below this the hand-off costs more than it saves.
+#define CIPHER_PART_BYTES (2 * 1024)
+
+// Windows being sealed at once before the pool's list first grows.
+#define CIPHER_BATCHES_RESERVED 64
+
+namespace
+{
+	const size_t AadLength = sizeof(uint32_t) + sizeof(uint64_t) + sizeof(int32_t) + sizeof(uint64_t);
+
+	void MakeAad(const MessageData& data, uint8_t* aad)
+	{
+		const uint32_t protocol = static_cast<uint32_t>(data.protocol);
+		const uint64_t dataSize = data.dataSize;
+		const int32_t dataIndex = data.dataIndex;
+
+		memcpy(aad, &protocol, sizeof(protocol));
+		memcpy(aad + 4, &dataSize, sizeof(dataSize));
+		memcpy(aad + 12, &dataIndex, sizeof(dataIndex));
+		memcpy(aad + 16, &data.sequence, sizeof(data.sequence));
+	}
+
+	void MakeNonce(uint32_t direction, uint64_t sequence, uint8_t* nonce)
+	{
+		memcpy(nonce, &direction, sizeof(direction));
+		memcpy(nonce + 4, &sequence, sizeof(sequence));
+	}
+}
+
+// One thread fewer than there are cores, the thread sealing a window takes
+// parts of it too. Parts are claimed under the pool mutex, so whoever is
+// free first seals the next one.
+class FrameCipher::Workers
+{
+public:
+	struct Batch
+	{
+		const FrameCipher* cipher;
+		SealJob*           jobs;
+		uint64_t           first;     // sequence number of jobs[0]
+		size_t             count;
+		size_t             parts;
+		size_t             claimed;
+		size_t             done;
+	};
+
+	static Workers& Instance()
+	{
+		static Workers workers;
+		return workers;
+	}
+
+	size_t Size() const { return m_threads.size(); }
+
+	// Returns once every part is sealed.
+	void Run(Batch& batch)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		m_batches.push_back(&batch);
+		m_wakeUp.notify_all();
+
+		size_t part = 0;
+		while (Claim(batch, &part))
+		{
+			lock.unlock();
+			SealPart(batch, part);
+			lock.lock();
+
+			++batch.done;
+		}
+
+		m_finished.wait(lock, [&batch]() { return batch.done == batch.parts; });
+	}
+
+private:
+	Workers()
+		: m_stop(false)
+	{
+		m_batches.reserve(CIPHER_BATCHES_RESERVED);
+
+		const unsigned int cores = std::thread::hardware_concurrency();
+		for (unsigned int i = 1; i < cores; ++i)
+		{
+			m_threads.push_back(std::thread(&Workers::Work, this));
+		}
+	}
+
+	~Workers()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+			m_wakeUp.notify_all();
+		}
+
+		for (size_t i = 0; i < m_threads.size(); ++i)
+		{
+			m_threads[i].join();
+		}
+	}
+
+	// Caller holds the mutex. A batch leaves the list with its last part.
+	bool Claim(Batch& batch, size_t* part)
+	{
+		if (batch.claimed == batch.parts)
+			return false;
+
+		*part = batch.claimed++;
+
+		if (batch.claimed == batch.parts)
+		{
+			m_batches.erase(std::find(m_batches.begin(), m_batches.end(), &batch));
+		}
+
+		return true;
+	}
+
+	void Work()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		while (true)
+		{
+			m_wakeUp.wait(lock, [this]() { return m_stop || !m_batches.empty(); });
+
+			if (m_stop)
+				return;
+
+			Batch& batch = *m_batches.front();
+			size_t part = 0;
+			Claim(batch, &part);
+
+			lock.unlock();
+			SealPart(batch, part);
+			lock.lock();
+
+			if (++batch.done == batch.parts)
+			{
+				m_finished.notify_all();
+			}
+		}
+	}
+
+	static void SealPart(const Batch& batch, size_t part)
+	{
+		const size_t begin = batch.count * part / batch.parts;
+		const size_t end = batch.count * (part + 1) / batch.parts;
+
+		for (size_t i = begin; i < end; ++i)
+		{
+			batch.cipher->SealWith(batch.first + i, batch.jobs[i]);
+		}
+	}
+
+	Workers(const Workers&);
+
+	Workers& operator = (const Workers&);
+
+private:
+	std::mutex               m_mutex;
+	std::condition_variable  m_wakeUp;
+	std::condition_variable  m_finished;
+	std::vector<Batch*>      m_batches;
+	std::vector<std::thread> m_threads;
+	bool                     m_stop;
+};
+
+FrameCipher::FrameCipher(const CipherKey& sessionKey, bool client)
+	: m_key(sessionKey)
+	, m_sendDirection(client ? 0 : 1)
+	, m_receiveDirection(client ? 1 : 0)
+	, m_sent(0)
+	, m_highest(0)
+	, m_seen(0)
+{
+	static_assert(FRAME_TAG_LENGTH == CIPHER_TAG_LENGTH, "frame tag does not fit the cipher");
+}
+
+size_t FrameCipher::PayloadLength(const MessageData& data)
+{
+	// parity packs the group into dataSize and always carries a full block
+	return data.dataSize < MAX_LENGTH ? data.dataSize : MAX_LENGTH;
+}
+
+void FrameCipher::SignHello(MessageData& answer) const
+{
+	// sequence 0 is never used by frames
+	uint8_t nonce[CIPHER_NONCE_LENGTH];
+	MakeNonce(1, 0, nonce);
+
+	uint8_t empty = 0;
+	::Seal(m_key, nonce, reinterpret_cast<const uint8_t*>(answer.data), PayloadLength(answer),
+		&empty, 0, &empty, answer.tag);
+}
+
+bool FrameCipher::CheckHello(const MessageData& answer) const
+{
+	uint8_t nonce[CIPHER_NONCE_LENGTH];
+	MakeNonce(1, 0, nonce);
+
+	uint8_t empty = 0;
+	return ::Open(m_key, nonce, reinterpret_cast<const uint8_t*>(answer.data), PayloadLength(answer),
+		&empty, 0, &empty, answer.tag);
+}
+
+void FrameCipher::SealWith(uint64_t sequence, const SealJob& job) const
+{
+	MessageData* out = job.out;
+	out->protocol = job.header->protocol;
+	out->dataSize = job.header->dataSize;
+	out->dataIndex = job.header->dataIndex;
+	out->sequence = sequence;
+
+	uint8_t aad[AadLength];
+	MakeAad(*out, aad);
+
+	uint8_t nonce[CIPHER_NONCE_LENGTH];
+	MakeNonce(m_sendDirection, sequence, nonce);
+
+	::Seal(m_key, nonce, aad, AadLength,
+		reinterpret_cast<const uint8_t*>(job.payload), PayloadLength(*out),
+		reinterpret_cast<uint8_t*>(out->data), out->tag);
+}
+
+void FrameCipher::Seal(const MessageData& header, const char* payload, MessageData* out)
+{
+	const SealJob job = { &header, payload, out };
+
+	SealWith(++m_sent, job);
+}
+
+void FrameCipher::SealBatch(SealJob* jobs, size_t count)
+{
+	const uint64_t first = m_sent + 1;
+	m_sent += count;
+
+	size_t bytes = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		bytes += PayloadLength(*jobs[i].header);
+	}
+
+	Workers& workers = Workers::Instance();
+	const size_t parts = std::min(std::min(workers.Size() + 1, count), bytes / CIPHER_PART_BYTES);
+
+	if (parts <= 1)
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			SealWith(first + i, jobs[i]);
+		}
+		return;
+	}
+
+	Workers::Batch batch = { this, jobs, first, count, parts, 0, 0 };
+	workers.Run(batch);
+}
+
+bool FrameCipher::Open(MessageData& data)
+{
+	if (data.sequence == 0 || data.sequence + 64 <= m_highest)
+	{
+		return false;
+	}
+
+	const uint64_t behind = data.sequence <= m_highest ? m_highest - data.sequence : 0;
+	if (data.sequence <= m_highest && (m_seen >> behind) & 1)
+	{
+		return false;
+	}
+
+	uint8_t aad[AadLength];
+	MakeAad(data, aad);
+
+	uint8_t nonce[CIPHER_NONCE_LENGTH];
+	MakeNonce(m_receiveDirection, data.sequence, nonce);
+
+	uint8_t* payload = reinterpret_cast<uint8_t*>(data.data);
+	if (!::Open(m_key, nonce, aad, AadLength, payload, PayloadLength(data), payload, data.tag))
+	{
+		return false;
+	}
+
+	// only authentic frames move the replay window
+	if (data.sequence > m_highest)
+	{
+		const uint64_t shift = data.sequence - m_highest;
+		m_seen = shift >= 64 ? 0 : m_seen << shift;
+		m_seen |= 1;
+		m_highest = data.sequence;
+	}
+	else
+	{
+		m_seen |= uint64_t(1) << behind;
+	}
+
+	return true;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "Crypto.h"
+#include "Transfer.h"
+
+// Seals frame payloads with the session key. The header travels in the
+// clear as associated data, so it can't be altered either. Each frame
+// takes the next sequence number of its direction as the nonce, and the
+// receiver drops sequence numbers it has already seen.
+class FrameCipher
+{
+public:
+	struct SealJob
+	{
+		const MessageData* header;
+		const char*        payload;
+		MessageData*       out;
+	};
+
+	FrameCipher(const CipherKey& sessionKey, bool client);
+
+	// Writes the header, the ciphertext of payload and the tag to out.
+	// The payload may live outside the frame, out may be the header itself.
+	void Seal(const MessageData& header, const char* payload, MessageData* out);
+
+	// Seals a whole window, one sequence number per job in order. Parts of
+	// it go to a pool of worker threads shared by every cipher.
+	void SealBatch(SealJob* jobs, size_t count);
+
+	// Decrypts in place, false for forged, damaged or replayed frames.
+	bool Open(MessageData& data);
+
+	// The server tags its HelloAck with the session key, so a client with
+	// the wrong pre-shared key fails at the handshake instead of having
+	// its frames dropped.
+	void SignHello(MessageData& answer) const;
+
+	bool CheckHello(const MessageData& answer) const;
+
+	static size_t PayloadLength(const MessageData& data);
+
+private:
+	class Workers;
+
+	void SealWith(uint64_t sequence, const SealJob& job) const;
+
+	FrameCipher(const FrameCipher&);
+
+	FrameCipher& operator = (const FrameCipher&);
+
+private:
+	CipherKey m_key;
+	uint32_t  m_sendDirection;
+	uint32_t  m_receiveDirection;
+	uint64_t  m_sent;
+	uint64_t  m_highest;
+	uint64_t  m_seen;   // bit i set when m_highest - i arrived
+};
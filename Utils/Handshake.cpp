@@ -0,0 +1,89 @@
+#include "Handshake.h"
+
+namespace
+{
+	const size_t HelloSize = 4 * sizeof(uint32_t);
+	const size_t NonceSize = sizeof(uint64_t);
+}
+
+SessionInfo MakeSession(uint32_t capabilities, uint32_t windowSize)
+{
+	SessionInfo info;
+	info.version = PROTOCOL_VERSION;
+	info.capabilities = capabilities;
+	info.blockSize = MAX_LENGTH;
+	info.windowSize = windowSize;
+	info.nonce = 0;
+
+	return info;
+}
+
+SessionInfo DefaultSession()
+{
+	return MakeSession(CapabilityFec | CapabilityManifest, CHUNK_LENGTH);
+}
+
+void WriteHello(Protocol pr, const SessionInfo& info, MessageData* data)
+{
+	const uint32_t fields[] = { info.version, info.capabilities, info.blockSize, info.windowSize };
+
+	data->protocol = pr;
+	data->dataIndex = 0;
+	data->dataSize = HelloSize + NonceSize;
+	memcpy(data->data, fields, HelloSize);
+	memcpy(data->data + HelloSize, &info.nonce, NonceSize);
+}
+
+SessionInfo ReadHello(const MessageData& data)
+{
+	if (data.dataSize < HelloSize || data.dataSize > MAX_LENGTH)
+	{
+		throw std::runtime_error("Error: [ReadHello] truncated hello");
+	}
+
+	// later versions may append fields, only the known ones are read
+	uint32_t fields[4];
+	memcpy(fields, data.data, HelloSize);
+
+	SessionInfo info;
+	info.version = fields[0];
+	info.capabilities = fields[1];
+	info.blockSize = fields[2];
+	info.windowSize = fields[3];
+	info.nonce = 0;
+
+	if (data.dataSize >= HelloSize + NonceSize)
+	{
+		memcpy(&info.nonce, data.data + HelloSize, NonceSize);
+	}
+
+	return info;
+}
+
+SessionInfo Negotiate(const SessionInfo& local, const SessionInfo& remote)
+{
+	if (remote.version < PROTOCOL_MIN_VERSION)
+	{
+		throw std::runtime_error("Error: [Negotiate] unsupported protocol version " + std::to_string(remote.version));
+	}
+
+	// frames have a fixed layout, both builds must agree on it
+	if (remote.blockSize != local.blockSize)
+	{
+		throw std::runtime_error("Error: [Negotiate] block size mismatch");
+	}
+
+	if (remote.windowSize == 0)
+	{
+		throw std::runtime_error("Error: [Negotiate] empty window");
+	}
+
+	SessionInfo session;
+	session.version = std::min(local.version, remote.version);
+	session.capabilities = local.capabilities & remote.capabilities;
+	session.blockSize = local.blockSize;
+	session.windowSize = std::min(local.windowSize, remote.windowSize);
+	session.nonce = 0;
+
+	return session;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "Transfer.h"
+#include <cstdint>
+
+// Hello is the first frame on a connection. Each side advertises its
+// protocol version, capabilities and limits; the session runs with the
+// lower version, the capabilities both have and the smaller window.
+
+// 2: FileEnd carries the file size, Accepted names the frame it answers.
+// 3: Parity frames are Reed-Solomon rows.
+#define PROTOCOL_VERSION 3
+#define PROTOCOL_MIN_VERSION 3
+
+// How long the server keeps an idle kept-alive connection, milliseconds.
+#define KEEPALIVE_TIMEOUT 30000
+
+enum Capability
+{
+	CapabilityFec       = 1 << 0,   // UDP parity frames
+	CapabilityManifest  = 1 << 1,   // directory trees and packed small files
+	CapabilityKeepAlive = 1 << 2,   // connection stays open after Done
+	CapabilityEncryption = 1 << 3,  // frames sealed with a key derived from the pre-shared one
+	CapabilitySparse    = 1 << 4,   // Hole frames for runs of zeros
+	CapabilityConcurrent = 1 << 5   // a session per client, uploads may run side by side
+};
+
+struct SessionInfo
+{
+	uint32_t version;
+	uint32_t capabilities;
+	uint32_t blockSize;    // payload bytes per frame, MAX_LENGTH
+	uint32_t windowSize;   // UDP blocks in flight
+	uint64_t nonce;        // sender's key derivation input, 0 without encryption
+
+	bool Has(Capability capability) const
+	{
+		return (capabilities & capability) != 0;
+	}
+};
+
+// This build's side of the handshake.
+SessionInfo MakeSession(uint32_t capabilities, uint32_t windowSize);
+
+// Session of peers that never sent a Hello.
+SessionInfo DefaultSession();
+
+void WriteHello(Protocol pr, const SessionInfo& info, MessageData* data);
+
+SessionInfo ReadHello(const MessageData& data);
+
+// Throws when the peers can't interoperate.
+SessionInfo Negotiate(const SessionInfo& local, const SessionInfo& remote);
@@ -0,0 +1,796 @@
+#include "Loopback.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#define LOOPBACK_SLOT_LENGTH (16 * 1024)
+#define LOOPBACK_STREAM_SLOTS 64
+#define LOOPBACK_DATAGRAM_SLOTS 128
+#define LOOPBACK_EPHEMERAL_FIRST 49152
+
+struct LoopbackTransport::Channel
+{
+	Channel()
+		: queue(LOOPBACK_STREAM_SLOTS, LOOPBACK_SLOT_LENGTH)
+		, writerClosed(false)
+		, readerClosed(false)
+	{}
+
+	SpscQueue         queue;
+	std::atomic<bool> writerClosed;
+	std::atomic<bool> readerClosed;
+};
+
+typedef std::shared_ptr<std::atomic<uint64_t>> ByteCounter;
+
+struct LoopbackTransport::Connection
+{
+	Channel     toServer;
+	Channel     toClient;
+	ByteCounter sentToServer;
+};
+
+struct LoopbackTransport::Listener
+{
+	Listener()
+		: closed(false)
+	{}
+
+	std::mutex                              mutex;
+	std::condition_variable                 ready;
+	std::deque<std::shared_ptr<Connection>> pending;
+	bool                                    closed;
+};
+
+struct LoopbackTransport::DatagramPort
+{
+	explicit DatagramPort(uint16_t port)
+		: port(port)
+		, closed(false)
+		, lossPpm(0)
+		, shuffle(false)
+		, joined(false)
+	{}
+
+	const uint16_t    port;
+	std::atomic<bool> closed;
+
+	// datagrams dropped per million sent here
+	std::atomic<uint32_t> lossPpm;
+
+	// senders hold datagrams back and deliver them shuffled
+	std::atomic<bool> shuffle;
+
+	// null for ephemeral ports
+	ByteCounter received;
+
+	// senders hand their rings over here, the owner moves them to inbound
+	std::mutex                              joinMutex;
+	std::vector<std::shared_ptr<SpscQueue>> joining;
+	std::atomic<bool>                       joined;
+
+	std::vector<std::shared_ptr<SpscQueue>> inbound;
+};
+
+namespace
+{
+	// Process-wide port table, only touched to bind, listen and connect,
+	// never on the data path.
+	struct Hub
+	{
+		static Hub& Instance()
+		{
+			static Hub hub;
+			return hub;
+		}
+
+		std::mutex mutex;
+		std::map<uint16_t, std::shared_ptr<LoopbackTransport::Listener>> listeners;
+		std::map<uint16_t, std::weak_ptr<LoopbackTransport::DatagramPort>> ports;
+		std::map<uint16_t, ByteCounter> received;
+		uint16_t nextEphemeral = LOOPBACK_EPHEMERAL_FIRST;
+	};
+
+	// Caller holds the hub mutex.
+	std::shared_ptr<LoopbackTransport::DatagramPort> FindPort(Hub& hub, uint16_t port)
+	{
+		auto found = hub.ports.find(port);
+		if (found == hub.ports.end())
+		{
+			return nullptr;
+		}
+
+		std::shared_ptr<LoopbackTransport::DatagramPort> bound = found->second.lock();
+		if (bound == nullptr || bound->closed)
+		{
+			hub.ports.erase(found);
+			return nullptr;
+		}
+
+		return bound;
+	}
+
+	// Caller holds the hub mutex.
+	ByteCounter CounterOf(Hub& hub, uint16_t port)
+	{
+		ByteCounter& counter = hub.received[port];
+		if (counter == nullptr)
+		{
+			counter = std::make_shared<std::atomic<uint64_t>>(0);
+		}
+
+		return counter;
+	}
+}
+
+LoopbackTransport::LoopbackTransport(Socket::SocketType type)
+	: m_type(type)
+	, m_open(false)
+	, m_noBlock(false)
+	, m_port(0)
+	, m_accepted(false)
+	, m_readOffset(0)
+	, m_nextQueue(0)
+	, m_random(0x9e3779b9u ^ static_cast<uint32_t>(reinterpret_cast<uintptr_t>(this)))
+	, m_heldCount(0)
+{}
+
+LoopbackTransport::~LoopbackTransport()
+{
+	Close();
+}
+
+void LoopbackTransport::Open(bool noBlock)
+{
+	m_open = true;
+	m_noBlock = noBlock;
+}
+
+void LoopbackTransport::Close()
+{
+	Hub& hub = Hub::Instance();
+
+	if (m_listener != nullptr)
+	{
+		{
+			std::lock_guard<std::mutex> lock(hub.mutex);
+
+			auto found = hub.listeners.find(m_port);
+			if (found != hub.listeners.end() && found->second == m_listener)
+			{
+				hub.listeners.erase(found);
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(m_listener->mutex);
+		m_listener->closed = true;
+
+		// connections nobody accepted see the server go away
+		for (size_t i = 0; i < m_listener->pending.size(); ++i)
+		{
+			m_listener->pending[i]->toClient.writerClosed = true;
+			m_listener->pending[i]->toServer.readerClosed = true;
+		}
+		m_listener->pending.clear();
+		m_listener->ready.notify_all();
+		m_listener.reset();
+	}
+
+	if (m_connection != nullptr)
+	{
+		Outbound().writerClosed = true;
+		Inbound().readerClosed = true;
+		m_connection.reset();
+	}
+
+	ReleaseHeld();
+
+	if (m_datagrams != nullptr)
+	{
+		m_datagrams->closed = true;
+
+		std::lock_guard<std::mutex> lock(hub.mutex);
+		FindPort(hub, m_datagrams->port);
+		m_datagrams.reset();
+	}
+
+	m_routes.clear();
+	m_readOffset = 0;
+	m_open = false;
+}
+
+bool LoopbackTransport::IsOpen() const
+{
+	return m_open;
+}
+
+LoopbackTransport::Channel& LoopbackTransport::Inbound() const
+{
+	return m_accepted ? m_connection->toServer : m_connection->toClient;
+}
+
+LoopbackTransport::Channel& LoopbackTransport::Outbound() const
+{
+	return m_accepted ? m_connection->toClient : m_connection->toServer;
+}
+
+Socket::PollResult LoopbackTransport::Poll(int timeoutMs)
+{
+	if (m_type == Socket::Udp)
+	{
+		if (m_datagrams == nullptr)
+		{
+			BindEphemeral();
+		}
+		ReleaseHeld();
+
+		const char* record = nullptr;
+		size_t length = 0;
+		uint32_t sender = 0;
+
+		const bool ready = WaitUntil([&]()
+		{
+			return FrontDatagram(&record, &length, &sender) != nullptr;
+		}, timeoutMs);
+
+		return ready ? Socket::PollReadable : Socket::PollTimeout;
+	}
+
+	if (m_listener != nullptr)
+	{
+		const bool ready = WaitUntil([this]()
+		{
+			std::lock_guard<std::mutex> lock(m_listener->mutex);
+			return !m_listener->pending.empty() || m_listener->closed;
+		}, timeoutMs);
+
+		return ready ? Socket::PollReadable : Socket::PollTimeout;
+	}
+
+	if (m_connection == nullptr)
+	{
+		throw std::runtime_error("Error: unable to poll");
+	}
+
+	Channel& in = Inbound();
+	size_t length = 0;
+
+	if (!WaitUntil([&]() { return !in.queue.Empty() || in.writerClosed; }, timeoutMs))
+	{
+		return Socket::PollTimeout;
+	}
+
+	// the writer may have sent its last bytes right before closing
+	return in.queue.Front(&length, nullptr) != nullptr ? Socket::PollReadable : Socket::PollClosed;
+}
+
+void LoopbackTransport::Bind(const char* address, short port)
+{
+	const uint16_t loopbackPort = static_cast<uint16_t>(port);
+
+	if (m_type == Socket::Tcp)
+	{
+		// the port is claimed by Listen
+		m_port = loopbackPort;
+		return;
+	}
+
+	Hub& hub = Hub::Instance();
+	std::lock_guard<std::mutex> lock(hub.mutex);
+
+	if (FindPort(hub, loopbackPort) != nullptr)
+	{
+		throw std::runtime_error("Error: [Bind] loopback port in use");
+	}
+
+	m_datagrams = std::make_shared<DatagramPort>(loopbackPort);
+	m_datagrams->received = CounterOf(hub, loopbackPort);
+	hub.ports[loopbackPort] = m_datagrams;
+	m_port = loopbackPort;
+}
+
+void LoopbackTransport::BindEphemeral()
+{
+	Hub& hub = Hub::Instance();
+	std::lock_guard<std::mutex> lock(hub.mutex);
+
+	for (int tries = 0; tries < 65536 - LOOPBACK_EPHEMERAL_FIRST; ++tries)
+	{
+		const uint16_t port = hub.nextEphemeral;
+		hub.nextEphemeral = port == 65535 ? LOOPBACK_EPHEMERAL_FIRST : port + 1;
+
+		if (FindPort(hub, port) == nullptr)
+		{
+			m_datagrams = std::make_shared<DatagramPort>(port);
+			hub.ports[port] = m_datagrams;
+			m_port = port;
+			return;
+		}
+	}
+
+	throw std::runtime_error("Error: [BindEphemeral] no free loopback port");
+}
+
+void LoopbackTransport::SetReusePort()
+{
+	throw std::runtime_error("Error: SO_REUSEPORT not supported on loopback");
+}
+
+SOCKET LoopbackTransport::Handle() const
+{
+	return INVALID_SOCKET;
+}
+
+void LoopbackTransport::SetLoss(short port, double rate)
+{
+	Hub& hub = Hub::Instance();
+	std::lock_guard<std::mutex> lock(hub.mutex);
+
+	std::shared_ptr<DatagramPort> bound = FindPort(hub, static_cast<uint16_t>(port));
+	if (bound == nullptr)
+	{
+		throw std::runtime_error("Error: [SetLoss] port not bound");
+	}
+
+	bound->lossPpm = static_cast<uint32_t>(rate * 1000000);
+}
+
+void LoopbackTransport::SetReorder(short port, bool shuffle)
+{
+	Hub& hub = Hub::Instance();
+	std::lock_guard<std::mutex> lock(hub.mutex);
+
+	std::shared_ptr<DatagramPort> bound = FindPort(hub, static_cast<uint16_t>(port));
+	if (bound == nullptr)
+	{
+		throw std::runtime_error("Error: [SetReorder] port not bound");
+	}
+
+	bound->shuffle = shuffle;
+}
+
+uint64_t LoopbackTransport::BytesSentTo(short port)
+{
+	Hub& hub = Hub::Instance();
+	std::lock_guard<std::mutex> lock(hub.mutex);
+
+	auto found = hub.received.find(static_cast<uint16_t>(port));
+
+	return found != hub.received.end() ? found->second->load() : 0;
+}
+
+void LoopbackTransport::Listen(int backlog)
+{
+	if (m_type == Socket::Udp)
+		return;
+
+	Hub& hub = Hub::Instance();
+	std::lock_guard<std::mutex> lock(hub.mutex);
+
+	if (hub.listeners.find(m_port) != hub.listeners.end())
+	{
+		throw std::runtime_error("Error: [Listen] loopback port in use");
+	}
+
+	m_listener = std::make_shared<Listener>();
+	hub.listeners[m_port] = m_listener;
+	CounterOf(hub, m_port);
+}
+
+void LoopbackTransport::Connect(const char* address, short port)
+{
+	std::shared_ptr<Listener> listener;
+	ByteCounter received;
+
+	{
+		Hub& hub = Hub::Instance();
+		std::lock_guard<std::mutex> lock(hub.mutex);
+
+		auto found = hub.listeners.find(static_cast<uint16_t>(port));
+		if (found != hub.listeners.end())
+		{
+			listener = found->second;
+			received = CounterOf(hub, found->first);
+		}
+	}
+
+	if (listener == nullptr)
+	{
+		throw std::runtime_error("Error: unable to connect");
+	}
+
+	std::lock_guard<std::mutex> lock(listener->mutex);
+	if (listener->closed)
+	{
+		throw std::runtime_error("Error: unable to connect");
+	}
+
+	m_connection = std::make_shared<Connection>();
+	m_connection->sentToServer = received;
+	m_accepted = false;
+	m_readOffset = 0;
+
+	listener->pending.push_back(m_connection);
+	listener->ready.notify_one();
+}
+
+bool LoopbackTransport::Accept(std::unique_ptr<Socket::Transport>* accepted)
+{
+	if (m_type == Socket::Udp || m_listener == nullptr)
+	{
+		return false;
+	}
+
+	std::unique_lock<std::mutex> lock(m_listener->mutex);
+
+	if (!m_noBlock)
+	{
+		m_listener->ready.wait(lock, [this]()
+		{
+			return !m_listener->pending.empty() || m_listener->closed;
+		});
+	}
+
+	if (m_listener->pending.empty())
+	{
+		return false;
+	}
+
+	LoopbackTransport* transport = new LoopbackTransport(m_type);
+	transport->m_open = true;
+	transport->m_port = m_port;
+	transport->m_connection = m_listener->pending.front();
+	transport->m_accepted = true;
+
+	m_listener->pending.pop_front();
+	accepted->reset(transport);
+
+	return true;
+}
+
+void LoopbackTransport::Send(const char* buffer, size_t count)
+{
+	if (m_connection == nullptr)
+	{
+		throw std::runtime_error("Error: unable to send");
+	}
+
+	Channel& out = Outbound();
+
+	if (!m_accepted)
+	{
+		*m_connection->sentToServer += count;
+	}
+
+	// a stream has no record boundaries, large writes span several slots
+	while (count > 0)
+	{
+		const size_t chunk = std::min(count, out.queue.SlotLength());
+		bool pushed = false;
+
+		WaitUntil([&]()
+		{
+			pushed = out.queue.TryPush(buffer, chunk, nullptr, 0, 0);
+			return pushed || out.readerClosed;
+		}, -1);
+
+		if (!pushed)
+		{
+			throw std::runtime_error("Error: unable to send");
+		}
+
+		buffer += chunk;
+		count -= chunk;
+	}
+}
+
+void LoopbackTransport::Read(char* buffer, size_t count)
+{
+	if (m_connection == nullptr)
+	{
+		throw std::runtime_error("Error: unable to read");
+	}
+
+	Channel& in = Inbound();
+
+	while (count > 0)
+	{
+		const char* record = nullptr;
+		size_t length = 0;
+
+		const bool ready = WaitUntil([&]()
+		{
+			record = in.queue.Front(&length, nullptr);
+			return record != nullptr || in.writerClosed;
+		}, m_noBlock ? 0 : -1);
+
+		if (!ready)
+		{
+			throw std::runtime_error("Error: unable to read");
+		}
+
+		if (record == nullptr)
+		{
+			record = in.queue.Front(&length, nullptr);
+			if (record == nullptr)
+			{
+				throw std::runtime_error("Error: connection closed");
+			}
+		}
+
+		// reads may end inside a record, the rest waits for the next call
+		const size_t take = std::min(count, length - m_readOffset);
+		memcpy(buffer, record + m_readOffset, take);
+
+		buffer += take;
+		count -= take;
+		m_readOffset += take;
+
+		if (m_readOffset == length)
+		{
+			in.queue.Pop();
+			m_readOffset = 0;
+		}
+	}
+}
+
+size_t LoopbackTransport::TrySend(const char* buffer, size_t count)
+{
+	if (m_connection == nullptr)
+	{
+		throw std::runtime_error("Error: unable to send");
+	}
+
+	Channel& out = Outbound();
+	if (out.readerClosed)
+	{
+		throw std::runtime_error("Error: unable to send");
+	}
+
+	size_t sent = 0;
+	while (sent < count)
+	{
+		const size_t chunk = std::min(count - sent, out.queue.SlotLength());
+		if (!out.queue.TryPush(buffer + sent, chunk, nullptr, 0, 0))
+			break;
+
+		sent += chunk;
+	}
+
+	if (!m_accepted)
+	{
+		*m_connection->sentToServer += sent;
+	}
+
+	return sent;
+}
+
+size_t LoopbackTransport::TryRead(char* buffer, size_t count)
+{
+	if (m_connection == nullptr)
+	{
+		throw std::runtime_error("Error: unable to read");
+	}
+
+	Channel& in = Inbound();
+	size_t read = 0;
+
+	while (read < count)
+	{
+		// closed is checked first, the last bytes may come right before it
+		const bool closed = in.writerClosed;
+		size_t length = 0;
+
+		const char* record = in.queue.Front(&length, nullptr);
+		if (record == nullptr)
+		{
+			if (closed && read == 0)
+			{
+				throw std::runtime_error("Error: connection closed");
+			}
+			break;
+		}
+
+		const size_t take = std::min(count - read, length - m_readOffset);
+		memcpy(buffer + read, record + m_readOffset, take);
+
+		read += take;
+		m_readOffset += take;
+
+		if (m_readOffset == length)
+		{
+			in.queue.Pop();
+			m_readOffset = 0;
+		}
+	}
+
+	return read;
+}
+
+bool LoopbackTransport::CanSend()
+{
+	if (m_type == Socket::Udp)
+	{
+		return true;
+	}
+
+	// a closed peer counts, the next send reports it
+	return m_connection != nullptr && (!Outbound().queue.Full() || Outbound().readerClosed);
+}
+
+void LoopbackTransport::SendTo(const char* header, int headerLength, const char* payload, int payloadLength, const sockaddr_in* to)
+{
+	if (size_t(headerLength) + size_t(payloadLength) > LOOPBACK_SLOT_LENGTH)
+	{
+		throw std::runtime_error("Error: unable to send");
+	}
+
+	if (m_datagrams == nullptr)
+	{
+		BindEphemeral();
+	}
+
+	const uint16_t port = ntohs(to->sin_port);
+	Route& route = m_routes[port];
+	std::shared_ptr<DatagramPort> target = route.port.lock();
+
+	if (target == nullptr || target->closed)
+	{
+		{
+			Hub& hub = Hub::Instance();
+			std::lock_guard<std::mutex> lock(hub.mutex);
+			target = FindPort(hub, port);
+		}
+
+		// nobody bound there, the datagram is lost
+		if (target == nullptr)
+		{
+			m_routes.erase(port);
+			return;
+		}
+
+		route.port = target;
+		route.queue = std::make_shared<SpscQueue>(LOOPBACK_DATAGRAM_SLOTS, LOOPBACK_SLOT_LENGTH);
+
+		std::lock_guard<std::mutex> lock(target->joinMutex);
+		target->joining.push_back(route.queue);
+		target->joined = true;
+	}
+
+	const uint32_t lossPpm = target->lossPpm;
+	if (lossPpm != 0)
+	{
+		m_random ^= m_random << 13;
+		m_random ^= m_random >> 17;
+		m_random ^= m_random << 5;
+
+		if (m_random % 1000000 < lossPpm)
+			return;
+	}
+
+	if (target->shuffle)
+	{
+		if (m_heldCount == m_held.size())
+		{
+			m_held.push_back(Held());
+		}
+
+		Held& held = m_held[m_heldCount++];
+		held.port = port;
+		held.datagram.assign(header, header + headerLength);
+		held.datagram.insert(held.datagram.end(), payload, payload + payloadLength);
+		return;
+	}
+
+	Deliver(route, header, headerLength, payload, payloadLength);
+}
+
+void LoopbackTransport::Deliver(Route& route, const char* header, int headerLength, const char* payload, int payloadLength)
+{
+	std::shared_ptr<DatagramPort> target = route.port.lock();
+
+	// a full ring drops the datagram, the protocol retransmits
+	if (route.queue->TryPush(header, headerLength, payload, payloadLength, m_port) &&
+		target != nullptr && target->received != nullptr)
+	{
+		*target->received += headerLength + payloadLength;
+	}
+}
+
+void LoopbackTransport::ReleaseHeld()
+{
+	// Fisher-Yates from the back, delivering each pick as it is drawn
+	while (m_heldCount > 0)
+	{
+		m_random ^= m_random << 13;
+		m_random ^= m_random >> 17;
+		m_random ^= m_random << 5;
+
+		const size_t pick = m_random % m_heldCount;
+		std::swap(m_held[pick], m_held[--m_heldCount]);
+
+		const Held& held = m_held[m_heldCount];
+		auto route = m_routes.find(held.port);
+		if (route != m_routes.end())
+		{
+			Deliver(route->second, held.datagram.data(), static_cast<int>(held.datagram.size()), nullptr, 0);
+		}
+	}
+}
+
+SpscQueue* LoopbackTransport::FrontDatagram(const char** record, size_t* length, uint32_t* sender)
+{
+	std::vector<std::shared_ptr<SpscQueue>>& inbound = m_datagrams->inbound;
+
+	if (m_datagrams->joined)
+	{
+		std::lock_guard<std::mutex> lock(m_datagrams->joinMutex);
+
+		inbound.insert(inbound.end(), m_datagrams->joining.begin(), m_datagrams->joining.end());
+		m_datagrams->joining.clear();
+		m_datagrams->joined = false;
+	}
+
+	// round robin, so one busy sender can't starve the others
+	for (size_t i = 0; i < inbound.size(); ++i)
+	{
+		const size_t index = (m_nextQueue + i) % inbound.size();
+
+		*record = inbound[index]->Front(length, sender);
+		if (*record != nullptr)
+		{
+			m_nextQueue = index + 1;
+			return inbound[index].get();
+		}
+	}
+
+	// rings whose sender is gone and that are drained
+	inbound.erase(std::remove_if(inbound.begin(), inbound.end(), [](const std::shared_ptr<SpscQueue>& queue)
+	{
+		return queue.use_count() == 1 && queue->Empty();
+	}), inbound.end());
+
+	return nullptr;
+}
+
+int LoopbackTransport::ReadFrom(char* buffer, int len, sockaddr_in* from)
+{
+	if (m_datagrams == nullptr)
+	{
+		BindEphemeral();
+	}
+
+	ReleaseHeld();
+
+	SpscQueue* queue = nullptr;
+	const char* record = nullptr;
+	size_t length = 0;
+	uint32_t sender = 0;
+
+	const bool ready = WaitUntil([&]()
+	{
+		queue = FrontDatagram(&record, &length, &sender);
+		return queue != nullptr;
+	}, m_noBlock ? 0 : -1);
+
+	if (!ready)
+	{
+		throw std::runtime_error("Error: unable to read");
+	}
+
+	// like recvfrom, the rest of a datagram larger than the buffer is lost
+	const size_t copied = std::min(length, size_t(len));
+	memcpy(buffer, record, copied);
+	queue->Pop();
+
+	if (from != nullptr)
+	{
+		memset(from, 0, sizeof(*from));
+		from->sin_family = PF_INET;
+		from->sin_port = htons(static_cast<uint16_t>(sender));
+	}
+
+	return static_cast<int>(copied);
+}
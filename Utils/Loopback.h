@@ -0,0 +1,123 @@
+#pragma once
+
+#include "Socket.h"
+#include "SpscQueue.h"
+#include <map>
+
+// Socket transport between threads of one process, selected with
+// LOOPBACK_ADDRESS. Bytes move through SpscQueue rings and never reach
+// the kernel, ports only exist inside the process. A connection is a pair
+// of rings, one per direction. A datagram port drains one ring per sender,
+// a full ring drops the datagram like a full socket buffer would.
+// SO_REUSEPORT has no loopback counterpart.
+class LoopbackTransport : public Socket::Transport
+{
+public:
+	explicit LoopbackTransport(Socket::SocketType type);
+
+	~LoopbackTransport();
+
+	void Open(bool noBlock) override;
+
+	void Close() override;
+
+	bool IsOpen() const override;
+
+	Socket::PollResult Poll(int timeoutMs) override;
+
+	void Listen(int backlog) override;
+
+	void Connect(const char* address, short port) override;
+
+	bool Accept(std::unique_ptr<Socket::Transport>* accepted) override;
+
+	void Send(const char* buffer, size_t count) override;
+
+	void Read(char* buffer, size_t count) override;
+
+	size_t TrySend(const char* buffer, size_t count) override;
+
+	size_t TryRead(char* buffer, size_t count) override;
+
+	bool CanSend() override;
+
+	void SendTo(const char* header, int headerLength, const char* payload, int payloadLength, const sockaddr_in* to) override;
+
+	int ReadFrom(char* buffer, int len, sockaddr_in* from) override;
+
+	void Bind(const char* address, short port) override;
+
+	void SetReusePort() override;
+
+	SOCKET Handle() const override;
+
+	// Drops the given share of the datagrams sent to a bound port from now
+	// on, so loss can be measured without a lossy network.
+	static void SetLoss(short port, double rate);
+
+	// Holds the datagrams sent to a bound port until their sender polls or
+	// reads, then hands them over in random order, so a whole window
+	// arrives shuffled as over a network of many paths.
+	static void SetReorder(short port, bool shuffle);
+
+	// Bytes sent to a bound or listening port so far, headers included.
+	// Counts survive the port being closed.
+	static uint64_t BytesSentTo(short port);
+
+	struct Channel;
+	struct Connection;
+	struct Listener;
+	struct DatagramPort;
+
+private:
+	struct Route
+	{
+		std::weak_ptr<DatagramPort> port;
+		std::shared_ptr<SpscQueue>  queue;
+	};
+
+	struct Held
+	{
+		uint16_t          port;
+		std::vector<char> datagram;
+	};
+
+	Channel& Inbound() const;
+
+	Channel& Outbound() const;
+
+	void BindEphemeral();
+
+	// Pushes a datagram into the ring of its route, dropped when full.
+	void Deliver(Route& route, const char* header, int headerLength, const char* payload, int payloadLength);
+
+	// Delivers the datagrams SetReorder held back, shuffled.
+	void ReleaseHeld();
+
+	// The ring holding the next datagram, nullptr when none is waiting.
+	SpscQueue* FrontDatagram(const char** record, size_t* length, uint32_t* sender);
+
+	LoopbackTransport(const LoopbackTransport&);
+
+	LoopbackTransport& operator = (const LoopbackTransport&);
+
+private:
+	Socket::SocketType m_type;
+	bool               m_open;
+	bool               m_noBlock;
+	uint16_t           m_port;
+
+	// stream
+	std::shared_ptr<Listener>   m_listener;
+	std::shared_ptr<Connection> m_connection;
+	bool                        m_accepted;    // server end of m_connection
+	size_t                      m_readOffset;  // consumed part of the front record
+
+	// datagram
+	std::shared_ptr<DatagramPort> m_datagrams;
+	std::map<uint16_t, Route>     m_routes;
+	size_t                        m_nextQueue;
+	uint32_t                      m_random;     // xorshift state for SetLoss and SetReorder
+	std::vector<Held>             m_held;       // the first m_heldCount are waiting, the rest keep their memory
+	size_t                        m_heldCount;
+};
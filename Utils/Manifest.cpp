@@ -0,0 +1,324 @@
+#include "Manifest.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#include <sys/utime.h>
+#else
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+
+namespace
+{
+	const size_t EntryHeader = sizeof(uint64_t) + sizeof(int64_t) + sizeof(uint32_t) + sizeof(uint16_t);
+	const size_t PackedHeader = 2 * sizeof(uint32_t);
+
+	template <typename T>
+	void Put(char*& pos, T value)
+	{
+		memcpy(pos, &value, sizeof(T));
+		pos += sizeof(T);
+	}
+
+	template <typename T>
+	T Get(const char*& pos)
+	{
+		T value;
+		memcpy(&value, pos, sizeof(T));
+		pos += sizeof(T);
+		return value;
+	}
+
+	std::string BaseName(const std::string& path)
+	{
+		std::string name = path;
+		while (!name.empty() && (name.back() == '/' || name.back() == '\\'))
+		{
+			name.pop_back();
+		}
+
+		size_t pos = name.find_last_of("/\\");
+		if (pos != std::string::npos)
+		{
+			name.erase(0, pos + 1);
+		}
+		return name;
+	}
+
+#ifdef _WIN32
+	int64_t FileTimeToUnix(const FILETIME& time)
+	{
+		const int64_t ticks = (int64_t(time.dwHighDateTime) << 32) | time.dwLowDateTime;
+		return ticks / 10000000 - 11644473600LL;
+	}
+#endif
+
+	void ScanDirectory(const std::string& local, const std::string& remote, std::vector<ManifestEntry>* entries)
+	{
+#ifdef _WIN32
+		WIN32_FIND_DATAA findData;
+		HANDLE find = FindFirstFileA((local + "\\*").c_str(), &findData);
+
+		if (find == INVALID_HANDLE_VALUE)
+		{
+			throw std::runtime_error("Error: [ScanTree] failed open directory " + local);
+		}
+
+		do
+		{
+			const std::string name = findData.cFileName;
+			if (name == "." || name == "..")
+				continue;
+
+			ManifestEntry entry;
+			entry.path = remote + "/" + name;
+			entry.mtime = FileTimeToUnix(findData.ftLastWriteTime);
+
+			if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			{
+				entry.mode = MANIFEST_DIRECTORY | 0755;
+				entries->push_back(entry);
+
+				ScanDirectory(local + "\\" + name, entry.path, entries);
+			}
+			else
+			{
+				entry.mode = (findData.dwFileAttributes & FILE_ATTRIBUTE_READONLY) ? 0444 : 0644;
+				entry.size = (uint64_t(findData.nFileSizeHigh) << 32) | findData.nFileSizeLow;
+				entries->push_back(entry);
+			}
+		}
+		while (FindNextFileA(find, &findData));
+
+		FindClose(find);
+#else
+		DIR* dir = opendir(local.c_str());
+
+		if (dir == nullptr)
+		{
+			throw std::runtime_error("Error: [ScanTree] failed open directory " + local);
+		}
+
+		std::vector<std::string> subDirs;
+		while (dirent* item = readdir(dir))
+		{
+			const std::string name = item->d_name;
+			if (name == "." || name == "..")
+				continue;
+
+			struct stat info;
+			if (lstat((local + "/" + name).c_str(), &info) != 0)
+				continue;
+
+			ManifestEntry entry;
+			entry.path = remote + "/" + name;
+			entry.mtime = info.st_mtime;
+			entry.mode = info.st_mode & 07777;
+
+			if (S_ISDIR(info.st_mode))
+			{
+				entry.mode |= MANIFEST_DIRECTORY;
+				subDirs.push_back(name);
+			}
+			else if (S_ISREG(info.st_mode))
+			{
+				entry.size = info.st_size;
+			}
+			else
+			{
+				continue;
+			}
+			entries->push_back(entry);
+		}
+		closedir(dir);
+
+		for (size_t i = 0; i < subDirs.size(); ++i)
+		{
+			ScanDirectory(local + "/" + subDirs[i], remote + "/" + subDirs[i], entries);
+		}
+#endif
+	}
+}
+
+size_t WriteManifestEntries(const std::vector<ManifestEntry>& entries, size_t first, MessageData* frame)
+{
+	char* pos = frame->data;
+	char* const end = frame->data + MAX_LENGTH;
+	size_t count = 0;
+
+	for (size_t i = first; i < entries.size(); ++i, ++count)
+	{
+		const ManifestEntry& entry = entries[i];
+
+		if (entry.path.size() > 0xffff)
+		{
+			throw std::runtime_error("Error: [WriteManifestEntries] path too long " + entry.path);
+		}
+		if (size_t(end - pos) < EntryHeader + entry.path.size())
+			break;
+
+		Put<uint64_t>(pos, entry.size);
+		Put<int64_t>(pos, entry.mtime);
+		Put<uint32_t>(pos, entry.mode);
+		Put<uint16_t>(pos, static_cast<uint16_t>(entry.path.size()));
+		memcpy(pos, entry.path.data(), entry.path.size());
+		pos += entry.path.size();
+	}
+
+	if (count == 0 && first < entries.size())
+	{
+		throw std::runtime_error("Error: [WriteManifestEntries] entry does not fit a frame " + entries[first].path);
+	}
+
+	frame->protocol = Protocol::Manifest;
+	frame->dataIndex = static_cast<int>(first);
+	frame->dataSize = pos - frame->data;
+
+	return count;
+}
+
+void ReadManifestEntries(const MessageData& frame, std::vector<ManifestEntry>* entries)
+{
+	if (frame.dataSize > MAX_LENGTH)
+	{
+		throw std::runtime_error("Error: [ReadManifestEntries] frame size out of range");
+	}
+
+	const char* pos = frame.data;
+	const char* const end = frame.data + frame.dataSize;
+
+	while (pos < end)
+	{
+		if (size_t(end - pos) < EntryHeader)
+		{
+			throw std::runtime_error("Error: [ReadManifestEntries] truncated entry");
+		}
+
+		ManifestEntry entry;
+		entry.size = Get<uint64_t>(pos);
+		entry.mtime = Get<int64_t>(pos);
+		entry.mode = Get<uint32_t>(pos);
+
+		const uint16_t length = Get<uint16_t>(pos);
+		if (size_t(end - pos) < length)
+		{
+			throw std::runtime_error("Error: [ReadManifestEntries] truncated path");
+		}
+		entry.path.assign(pos, length);
+		pos += length;
+
+		entries->push_back(entry);
+	}
+}
+
+bool AppendPackedFile(MessageData* frame, uint32_t entry, const char* bytes, uint32_t length)
+{
+	if (MAX_LENGTH - frame->dataSize < PackedHeader + length)
+		return false;
+
+	char* pos = frame->data + frame->dataSize;
+	Put<uint32_t>(pos, entry);
+	Put<uint32_t>(pos, length);
+	memcpy(pos, bytes, length);
+
+	frame->dataSize += PackedHeader + length;
+
+	return true;
+}
+
+void ScanTree(const std::string& root, std::vector<ManifestEntry>* entries)
+{
+	const std::string name = BaseName(root);
+
+	if (name.empty() || name == "." || name == "..")
+	{
+		throw std::runtime_error("Error: [ScanTree] directory needs a name " + root);
+	}
+
+	struct stat info;
+	if (stat(root.c_str(), &info) != 0)
+	{
+		throw std::runtime_error("Error: [ScanTree] failed stat " + root);
+	}
+
+	ManifestEntry entry;
+	entry.path = name;
+	entry.mtime = info.st_mtime;
+	entry.mode = MANIFEST_DIRECTORY | 0755;
+	entries->push_back(entry);
+
+	ScanDirectory(root, name, entries);
+}
+
+bool IsDirectoryPath(const std::string& path)
+{
+	struct stat info;
+	if (stat(path.c_str(), &info) != 0)
+		return false;
+
+	return (info.st_mode & S_IFMT) == S_IFDIR;
+}
+
+bool IsSafeRelativePath(const std::string& path)
+{
+	if (path.empty() || path[0] == '/' || path[0] == '\\' || path.find(':') != std::string::npos)
+		return false;
+
+	size_t begin = 0;
+	while (begin <= path.size())
+	{
+		size_t end = path.find_first_of("/\\", begin);
+		if (end == std::string::npos)
+			end = path.size();
+
+		const std::string part = path.substr(begin, end - begin);
+		if (part.empty() || part == "..")
+			return false;
+
+		begin = end + 1;
+	}
+
+	return true;
+}
+
+void MakeDirectory(const std::string& path)
+{
+#ifdef _WIN32
+	const int retVal = _mkdir(path.c_str());
+#else
+	const int retVal = mkdir(path.c_str(), 0755);
+#endif
+
+	if (retVal != 0 && !IsDirectoryPath(path))
+	{
+		throw std::runtime_error("Error: [MakeDirectory] failed create " + path);
+	}
+}
+
+void ApplyAttributes(const ManifestEntry& entry)
+{
+#ifdef _WIN32
+	_utimbuf times;
+	times.actime = static_cast<time_t>(entry.mtime);
+	times.modtime = static_cast<time_t>(entry.mtime);
+	_utime(entry.path.c_str(), &times);
+
+	if (!entry.IsDirectory())
+	{
+		_chmod(entry.path.c_str(), (entry.mode & 0200) ? (_S_IREAD | _S_IWRITE) : _S_IREAD);
+	}
+#else
+	utimbuf times;
+	times.actime = static_cast<time_t>(entry.mtime);
+	times.modtime = static_cast<time_t>(entry.mtime);
+	utime(entry.path.c_str(), &times);
+
+	// permission bits only, setuid, setgid and sticky never come from the wire
+	chmod(entry.path.c_str(), entry.mode & 0777);
+#endif
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "Transfer.h"
+#include <cstdint>
+
+#define MANIFEST_DIRECTORY 0040000
+
+// One file or directory of a transferred tree. Paths are relative to the
+// destination and always use '/' as separator.
+struct ManifestEntry
+{
+	std::string path;
+	uint64_t    size;
+	int64_t     mtime;
+	uint32_t    mode;
+
+	ManifestEntry()
+		: size(0)
+		, mtime(0)
+		, mode(0)
+	{}
+
+	bool IsDirectory() const { return (mode & MANIFEST_DIRECTORY) != 0; }
+};
+
+// Fills frame with as many entries starting at first as fit, returns the count.
+size_t WriteManifestEntries(const std::vector<ManifestEntry>& entries, size_t first, MessageData* frame);
+
+void ReadManifestEntries(const MessageData& frame, std::vector<ManifestEntry>* entries);
+
+// Packed small files: [uint32 entry][uint32 length][bytes] records back to back.
+bool AppendPackedFile(MessageData* frame, uint32_t entry, const char* bytes, uint32_t length);
+
+// Walks the tree under root, parents are listed before their children.
+// Entry paths start with the last component of root.
+void ScanTree(const std::string& root, std::vector<ManifestEntry>* entries);
+
+bool IsDirectoryPath(const std::string& path);
+
+// Rejects absolute paths, drive letters and ".." components.
+bool IsSafeRelativePath(const std::string& path);
+
+void MakeDirectory(const std::string& path);
+
+void ApplyAttributes(const ManifestEntry& entry);
@@ -0,0 +1,149 @@
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Address space one view takes, the view moves on when the sender leaves it.
+#define MAPPED_VIEW_LENGTH (64 * 1024 * 1024)
+
+MappedFile::MappedFile()
+	: m_size(0)
+	, m_viewOffset(0)
+	, m_viewLength(0)
+	, m_view(nullptr)
+	, m_granularity(0)
+#ifdef _WIN32
+	, m_mapping(NULL)
+#else
+	, m_file(-1)
+#endif
+{}
+
+MappedFile::~MappedFile()
+{
+	Unmap();
+}
+
+bool MappedFile::Map(FILE* file, uint64_t size)
+{
+	Unmap();
+
+	// an empty file has nothing to map but is valid
+	if (size == 0)
+	{
+		return true;
+	}
+
+#ifdef _WIN32
+	HANDLE handle = reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(file)));
+	if (handle == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	m_mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (m_mapping == NULL)
+	{
+		return false;
+	}
+
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	m_granularity = info.dwAllocationGranularity;
+#else
+	static_assert(sizeof(off_t) >= 8, "large file offsets are needed to map big files");
+
+	m_file = fileno(file);
+	m_granularity = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+
+	m_size = size;
+
+	// the first view tells whether the file can be mapped at all
+	if (View(0, 1) == nullptr)
+	{
+		Unmap();
+		return false;
+	}
+
+	return true;
+}
+
+const char* MappedFile::View(uint64_t offset, size_t length)
+{
+	if (offset + length > m_size)
+	{
+		return nullptr;
+	}
+
+	if (m_view != nullptr && offset >= m_viewOffset && offset + length <= m_viewOffset + m_viewLength)
+	{
+		return m_view + (offset - m_viewOffset);
+	}
+
+	UnmapView();
+
+	const uint64_t start = offset / m_granularity * m_granularity;
+	const uint64_t wanted = std::max<uint64_t>(MAPPED_VIEW_LENGTH, offset + length - start);
+	const size_t viewLength = static_cast<size_t>(std::min<uint64_t>(wanted, m_size - start));
+
+#ifdef _WIN32
+	m_view = static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ,
+		static_cast<DWORD>(start >> 32), static_cast<DWORD>(start), viewLength));
+	if (m_view == nullptr)
+	{
+		return nullptr;
+	}
+#else
+	void* view = mmap(nullptr, viewLength, PROT_READ, MAP_PRIVATE, m_file, static_cast<off_t>(start));
+	if (view == MAP_FAILED)
+	{
+		return nullptr;
+	}
+
+	madvise(view, viewLength, MADV_SEQUENTIAL);
+	m_view = static_cast<const char*>(view);
+#endif
+
+	m_viewOffset = start;
+	m_viewLength = viewLength;
+
+	return m_view + (offset - start);
+}
+
+void MappedFile::UnmapView()
+{
+	if (m_view != nullptr)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(m_view);
+#else
+		munmap(const_cast<char*>(m_view), m_viewLength);
+#endif
+	}
+
+	m_view = nullptr;
+	m_viewOffset = 0;
+	m_viewLength = 0;
+}
+
+void MappedFile::Unmap()
+{
+	UnmapView();
+
+#ifdef _WIN32
+	if (m_mapping != NULL)
+	{
+		CloseHandle(m_mapping);
+		m_mapping = NULL;
+	}
+#else
+	m_file = -1;
+#endif
+
+	m_size = 0;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "Common.h"
+#include <cstdint>
+
+#ifdef _WIN32
+#include <WinSock2.h>
+#endif
+
+// Read-only mapping of an open file, one bounded view at a time so files
+// larger than the address space can be mapped too. The sender slices
+// datagrams straight out of the view, so any block of the current window
+// can be sent again without keeping a copy around.
+class MappedFile
+{
+public:
+	MappedFile();
+
+	~MappedFile();
+
+	// False when the file can't be mapped, the caller falls back to reading it.
+	bool Map(FILE* file, uint64_t size);
+
+	void Unmap();
+
+	// length bytes at offset, valid until the next call. Moves the view when
+	// the range lies outside it, nullptr when that fails.
+	const char* View(uint64_t offset, size_t length);
+
+	uint64_t Size() const { return m_size; }
+
+private:
+	void UnmapView();
+
+	MappedFile(const MappedFile&);
+
+	MappedFile& operator = (const MappedFile&);
+
+private:
+	uint64_t    m_size;
+	uint64_t    m_viewOffset;
+	size_t      m_viewLength;
+	const char* m_view;
+	size_t      m_granularity;   // view offsets are multiples of this
+#ifdef _WIN32
+	HANDLE      m_mapping;
+#else
+	int         m_file;
+#endif
+};
@@ -0,0 +1,176 @@
+#include "Prefetcher.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#endif
+
+namespace
+{
+#ifdef _WIN32
+	// plain stat fails on files over 2 GB
+	typedef struct _stat64 FileInfo;
+
+	int StatFile(const std::string& path, FileInfo* info)
+	{
+		return _stat64(path.c_str(), info);
+	}
+#else
+	static_assert(sizeof(off_t) >= 8, "large files need a 64-bit off_t, define _FILE_OFFSET_BITS=64");
+
+	typedef struct stat FileInfo;
+
+	int StatFile(const std::string& path, FileInfo* info)
+	{
+		return stat(path.c_str(), info);
+	}
+#endif
+}
+
+FilePrefetcher::FilePrefetcher(const std::vector<std::string>& paths, size_t inlineLimit,
+	size_t lookahead, size_t threads)
+	: m_paths(paths)
+	, m_inlineLimit(inlineLimit)
+	, m_lookahead(lookahead > 0 ? lookahead : 1)
+	, m_slots(m_lookahead)
+	, m_ready(m_lookahead, false)
+	, m_next(0)
+	, m_taken(0)
+	, m_stop(false)
+{
+	if (threads > paths.size())
+		threads = paths.size();
+
+	for (size_t i = 0; i < threads; ++i)
+	{
+		m_workers.push_back(std::thread(&FilePrefetcher::WorkerLoop, this));
+	}
+}
+
+FilePrefetcher::~FilePrefetcher()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_wakeUp.notify_all();
+
+	for (size_t i = 0; i < m_workers.size(); ++i)
+	{
+		m_workers[i].join();
+	}
+
+	for (size_t i = 0; i < m_slots.size(); ++i)
+	{
+		if (m_ready[i] && m_slots[i].file != nullptr)
+			fclose(m_slots[i].file);
+	}
+}
+
+void FilePrefetcher::Take(size_t index, Entry* entry)
+{
+	assert(index == m_taken && index < m_paths.size());
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	const size_t slot = index % m_lookahead;
+	m_done.wait(lock, [this, slot]() { return bool(m_ready[slot]); });
+
+	*entry = std::move(m_slots[slot]);
+	m_slots[slot] = Entry();
+	m_ready[slot] = false;
+	++m_taken;
+
+	m_wakeUp.notify_all();
+}
+
+void FilePrefetcher::WorkerLoop()
+{
+	while (true)
+	{
+		size_t index = 0;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+
+			m_wakeUp.wait(lock, [this]()
+			{
+				return m_stop || (m_next < m_paths.size() && m_next < m_taken + m_lookahead);
+			});
+
+			if (m_stop)
+				return;
+
+			index = m_next++;
+		}
+
+		Entry entry;
+		entry.path = m_paths[index];
+		Prepare(&entry);
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+
+			m_slots[index % m_lookahead] = std::move(entry);
+			m_ready[index % m_lookahead] = true;
+		}
+		m_done.notify_all();
+	}
+}
+
+void FilePrefetcher::Open(Entry* entry)
+{
+	FileInfo info;
+	if (StatFile(entry->path, &info) != 0)
+	{
+		entry->error = "Error: failed load file, name " + entry->path;
+		return;
+	}
+
+	if ((info.st_mode & S_IFMT) == S_IFDIR)
+	{
+		entry->isDirectory = true;
+		return;
+	}
+
+	entry->size = info.st_size;
+
+#ifdef _WIN32
+	// 'S' asks the CRT for FILE_FLAG_SEQUENTIAL_SCAN, which enables aggressive read-ahead
+	entry->file = fopen(entry->path.c_str(), "rbS");
+#else
+	entry->file = fopen(entry->path.c_str(), "rb");
+#endif
+
+	if (entry->file == nullptr)
+	{
+		entry->error = "Error: failed load file, name " + entry->path;
+		return;
+	}
+
+#if defined(POSIX_FADV_WILLNEED)
+	posix_fadvise(fileno(entry->file), 0, 0, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(fileno(entry->file), 0, 0, POSIX_FADV_WILLNEED);
+#endif
+}
+
+void FilePrefetcher::Prepare(Entry* entry) const
+{
+	Open(entry);
+
+	if (entry->file == nullptr)
+		return;
+
+	if (m_inlineLimit > 0 && entry->size <= m_inlineLimit)
+	{
+		entry->contents.resize(static_cast<size_t>(entry->size));
+
+		const size_t read = entry->contents.empty() ? 0 :
+			fread(entry->contents.data(), 1, entry->contents.size(), entry->file);
+		entry->contents.resize(read);
+
+		fclose(entry->file);
+		entry->file = nullptr;
+	}
+}
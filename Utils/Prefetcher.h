@@ -0,0 +1,72 @@
+#pragma once
+
+#include "Common.h"
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+#define PREFETCH_LOOKAHEAD 64
+#define PREFETCH_THREADS 4
+
+// Stats and opens the files of a list ahead of the sender on a small
+// thread pool, at most lookahead entries past the one being sent, and
+// hints the OS to start reading them. Files up to inlineLimit bytes are
+// read whole so the sender never blocks on their I/O at all; 0 disables it.
+class FilePrefetcher
+{
+public:
+	struct Entry
+	{
+		std::string       path;
+		FILE*             file;        // at offset 0, owned by the caller after Take
+		uint64_t          size;
+		bool              isDirectory;
+		std::vector<char> contents;    // whole file when it fits inlineLimit
+		std::string       error;
+
+		Entry()
+			: file(nullptr)
+			, size(0)
+			, isDirectory(false)
+		{}
+	};
+
+	FilePrefetcher(const std::vector<std::string>& paths, size_t inlineLimit = 0,
+		size_t lookahead = PREFETCH_LOOKAHEAD, size_t threads = PREFETCH_THREADS);
+
+	// Closes files that were never taken.
+	~FilePrefetcher();
+
+	// Blocks until paths[index] is ready; entries are taken in list order.
+	void Take(size_t index, Entry* entry);
+
+	// Stats and opens entry->path on the calling thread, without reading
+	// ahead, for senders that take one file at a time.
+	static void Open(Entry* entry);
+
+private:
+	void WorkerLoop();
+
+	void Prepare(Entry* entry) const;
+
+	FilePrefetcher(const FilePrefetcher&);
+
+	FilePrefetcher& operator = (const FilePrefetcher&);
+
+private:
+	const std::vector<std::string> m_paths;
+	const size_t                   m_inlineLimit;
+	const size_t                   m_lookahead;
+
+	std::vector<Entry>             m_slots;
+	std::vector<bool>              m_ready;
+	size_t                         m_next;
+	size_t                         m_taken;
+	bool                           m_stop;
+
+	std::vector<std::thread>       m_workers;
+	std::mutex                     m_mutex;
+	std::condition_variable        m_wakeUp;
+	std::condition_variable        m_done;
+};
@@ -0,0 +1,227 @@
+#include "Profiler.h"
+#include <chrono>
+#include <cstring>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace
+{
+	const char* const StageNames[] =
+	{
+		"read", "encrypt", "throttle", "send", "answer",
+		"receive", "decrypt", "handle", "write", "answer"
+	};
+
+	int Log2(uint64_t value)
+	{
+#ifdef _MSC_VER
+		unsigned long index = 0;
+		_BitScanReverse64(&index, value);
+		return static_cast<int>(index);
+#else
+		return 63 - __builtin_clzll(value);
+#endif
+	}
+
+	bool IsClientStage(TransferProfiler::Stage stage)
+	{
+		return stage < TransferProfiler::ServerReceive;
+	}
+
+	double Micros(int64_t ns)
+	{
+		return ns / 1000.0;
+	}
+}
+
+TransferProfiler::TransferProfiler(size_t capacity)
+	: m_spans(capacity)
+	, m_next(0)
+{
+	static_assert(sizeof(StageNames) / sizeof(StageNames[0]) == StageCount, "a stage has no name");
+
+	for (int stage = 0; stage < StageCount; ++stage)
+	{
+		m_count[stage] = 0;
+		m_total[stage] = 0;
+
+		for (int bucket = 0; bucket < BucketCount; ++bucket)
+		{
+			m_histogram[stage][bucket] = 0;
+		}
+	}
+}
+
+int64_t TransferProfiler::Now()
+{
+	const std::chrono::steady_clock::duration now = std::chrono::steady_clock::now().time_since_epoch();
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+
+uint64_t TransferProfiler::BlockId(uint32_t file, uint64_t block)
+{
+	return (uint64_t(file) << 40) | (block & ((uint64_t(1) << 40) - 1));
+}
+
+const char* TransferProfiler::StageName(Stage stage)
+{
+	return StageNames[stage];
+}
+
+size_t TransferProfiler::Bucket(uint64_t ns)
+{
+	if (ns < 8)
+	{
+		return static_cast<size_t>(ns);
+	}
+
+	const int log = Log2(ns);
+	return static_cast<size_t>((log - 2) * 8 + ((ns >> (log - 3)) & 7));
+}
+
+uint64_t TransferProfiler::BucketValue(size_t bucket)
+{
+	if (bucket < 8)
+	{
+		return bucket;
+	}
+
+	// middle of the bucket
+	const int shift = static_cast<int>(bucket / 8) - 1;
+	const uint64_t lower = (8 + bucket % 8) << shift;
+
+	return lower + (uint64_t(1) << shift) / 2;
+}
+
+void TransferProfiler::Record(Stage stage, uint64_t block, int64_t begin, int64_t end)
+{
+	const uint64_t ns = end > begin ? uint64_t(end - begin) : 0;
+
+	m_histogram[stage][Bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+	m_count[stage].fetch_add(1, std::memory_order_relaxed);
+	m_total[stage].fetch_add(ns, std::memory_order_relaxed);
+
+	const size_t index = m_next.fetch_add(1, std::memory_order_relaxed);
+	if (index < m_spans.size())
+	{
+		const Span span = { block, begin, end, stage };
+		m_spans[index] = span;
+	}
+}
+
+uint64_t TransferProfiler::Percentile(Stage stage, uint64_t count, double fraction) const
+{
+	const uint64_t rank = static_cast<uint64_t>(fraction * (count - 1)) + 1;
+	uint64_t seen = 0;
+
+	for (size_t bucket = 0; bucket < BucketCount; ++bucket)
+	{
+		seen += m_histogram[stage][bucket].load(std::memory_order_relaxed);
+		if (seen >= rank)
+		{
+			return BucketValue(bucket);
+		}
+	}
+
+	return 0;
+}
+
+void TransferProfiler::Report(std::ostream& out) const
+{
+	char line[160];
+	snprintf(line, sizeof(line), "%-16s %10s %10s %10s %10s %10s %10s %10s\n",
+		"stage (us)", "spans", "total", "mean", "p50", "p90", "p99", "max");
+	out << line;
+
+	for (int index = 0; index < StageCount; ++index)
+	{
+		const Stage stage = static_cast<Stage>(index);
+		const uint64_t count = m_count[stage].load(std::memory_order_relaxed);
+		if (count == 0)
+			continue;
+
+		const uint64_t total = m_total[stage].load(std::memory_order_relaxed);
+
+		std::string name = IsClientStage(stage) ? "client " : "server ";
+		name += StageName(stage);
+
+		snprintf(line, sizeof(line), "%-16s %10llu %10.0f %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+			name.c_str(), static_cast<unsigned long long>(count),
+			Micros(total), Micros(total) / count,
+			Micros(Percentile(stage, count, 0.5)),
+			Micros(Percentile(stage, count, 0.9)),
+			Micros(Percentile(stage, count, 0.99)),
+			Micros(Percentile(stage, count, 1.0)));
+		out << line;
+	}
+
+	const size_t recorded = m_next.load(std::memory_order_relaxed);
+	if (recorded > m_spans.size())
+	{
+		out << recorded - m_spans.size() << " spans over capacity are missing from the trace" << std::endl;
+	}
+}
+
+void TransferProfiler::WriteTrace(const std::string& path) const
+{
+	std::ofstream out(path.c_str(), std::ios::trunc);
+	if (!out.is_open())
+	{
+		throw std::runtime_error("Error: [WriteTrace] failed open file " + path);
+	}
+
+	char event[256];
+	out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+	out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"client\"}},\n";
+	out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,\"args\":{\"name\":\"server\"}}";
+
+	// one track per stage
+	for (int index = 0; index < StageCount; ++index)
+	{
+		const Stage stage = static_cast<Stage>(index);
+
+		snprintf(event, sizeof(event),
+			",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			IsClientStage(stage) ? 1 : 2, index + 1, StageName(stage));
+		out << event;
+	}
+
+	const size_t count = std::min(m_next.load(std::memory_order_relaxed), m_spans.size());
+	for (size_t i = 0; i < count; ++i)
+	{
+		const Span& span = m_spans[i];
+		const int pid = IsClientStage(span.stage) ? 1 : 2;
+		const int tid = static_cast<int>(span.stage) + 1;
+
+		if (span.block == PROFILE_NO_BLOCK)
+		{
+			snprintf(event, sizeof(event),
+				",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+				StageName(span.stage), pid, tid, Micros(span.begin), Micros(span.end - span.begin));
+			out << event;
+			continue;
+		}
+
+		const unsigned long long file = span.block >> 40;
+		const unsigned long long block = span.block & ((uint64_t(1) << 40) - 1);
+
+		snprintf(event, sizeof(event),
+			",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"file\":%llu,\"block\":%llu}}",
+			StageName(span.stage), pid, tid, Micros(span.begin), Micros(span.end - span.begin), file, block);
+		out << event;
+
+		// arrows from the send of a block to its receive on the other end
+		if (span.stage == ClientSend || span.stage == ServerReceive)
+		{
+			snprintf(event, sizeof(event),
+				",\n{\"name\":\"block\",\"cat\":\"block\",\"ph\":%s,\"id\":\"%llu\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f}",
+				span.stage == ClientSend ? "\"s\"" : "\"f\",\"bp\":\"e\"",
+				static_cast<unsigned long long>(span.block), pid, tid, Micros(span.begin));
+			out << event;
+		}
+	}
+
+	out << "\n]}\n";
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "Common.h"
+#include <atomic>
+#include <cstdint>
+
+#define PROFILE_NO_BLOCK UINT64_MAX
+
+// Opt-in timing of blocks through the stages of the transfer pipeline on
+// both ends. Every span goes into a per-stage histogram, and the first
+// capacity spans are also kept for a Chrome trace (chrome://tracing or
+// ui.perfetto.dev). Spans carry the block id both ends derive from the
+// session, and timestamps come from the machine-wide monotonic clock, so
+// the client and server traces of a local run line up when merged.
+// Recording is lock-free and may come from several threads.
+class TransferProfiler
+{
+public:
+	enum Stage
+	{
+		ClientRead,      // file to buffer
+		ClientEncrypt,
+		ClientThrottle,  // waiting for the bandwidth share
+		ClientSend,
+		ClientAnswer,    // waiting for the server to accept
+		ServerReceive,   // includes waiting for the client
+		ServerDecrypt,
+		ServerHandle,
+		ServerWrite,     // handing the data to storage
+		ServerAnswer,
+		StageCount
+	};
+
+	explicit TransferProfiler(size_t capacity = 1 << 20);
+
+	// Nanoseconds of the monotonic clock, clock_gettime or QueryPerformanceCounter.
+	static int64_t Now();
+
+	// file is the 1-based number of the file within its session, block its offset / MAX_LENGTH.
+	static uint64_t BlockId(uint32_t file, uint64_t block);
+
+	void Record(Stage stage, uint64_t block, int64_t begin, int64_t end);
+
+	// Count, mean and percentiles of every stage that saw a span.
+	void Report(std::ostream& out) const;
+
+	// Only once recording has stopped.
+	void WriteTrace(const std::string& path) const;
+
+	static const char* StageName(Stage stage);
+
+private:
+	// log2 buckets split in eight, within 12.5% of the real value
+	enum { BucketCount = 62 * 8 };
+
+	struct Span
+	{
+		uint64_t block;
+		int64_t  begin;
+		int64_t  end;
+		Stage    stage;
+	};
+
+	static size_t Bucket(uint64_t ns);
+
+	static uint64_t BucketValue(size_t bucket);
+
+	uint64_t Percentile(Stage stage, uint64_t count, double fraction) const;
+
+	TransferProfiler(const TransferProfiler&);
+
+	TransferProfiler& operator = (const TransferProfiler&);
+
+private:
+	std::vector<Span>     m_spans;
+	std::atomic<size_t>   m_next;
+	std::atomic<uint64_t> m_count[StageCount];
+	std::atomic<uint64_t> m_total[StageCount];
+	std::atomic<uint64_t> m_histogram[StageCount][BucketCount];
+};
+
+// Times its scope as one span, does nothing without a profiler.
+class ProfileSpan
+{
+public:
+	ProfileSpan(TransferProfiler* profiler, TransferProfiler::Stage stage, uint64_t block = PROFILE_NO_BLOCK)
+		: m_profiler(profiler)
+		, m_stage(stage)
+		, m_block(block)
+		, m_begin(profiler != nullptr ? TransferProfiler::Now() : 0)
+	{}
+
+	~ProfileSpan()
+	{
+		if (m_profiler != nullptr)
+		{
+			m_profiler->Record(m_stage, m_block, m_begin, TransferProfiler::Now());
+		}
+	}
+
+	// For spans whose block is only known once they are done, like receives.
+	void SetBlock(uint64_t block) { m_block = block; }
+
+private:
+	TransferProfiler*       m_profiler;
+	TransferProfiler::Stage m_stage;
+	uint64_t                m_block;
+	int64_t                 m_begin;
+};
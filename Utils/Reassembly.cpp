@@ -0,0 +1,135 @@
+#include "Reassembly.h"
+
+std::atomic<size_t> ReassemblyBuffer::s_peakHeld(0);
+
+ReassemblyBuffer::ReassemblyBuffer(size_t slots)
+	: m_slots(slots > 0 ? slots : 1)
+	, m_data(m_slots * MAX_LENGTH)
+	, m_sizes(m_slots, 0)
+	, m_bitmap((m_slots + 63) / 64, 0)
+	, m_base(0)
+	, m_pending(0)
+	, m_held(0)
+{}
+
+void ReassemblyBuffer::Reset()
+{
+	std::fill(m_bitmap.begin(), m_bitmap.end(), 0);
+	m_base = 0;
+	m_pending = 0;
+	m_held = 0;
+}
+
+bool ReassemblyBuffer::InWindow(uint64_t block) const
+{
+	return block >= m_base && block - m_base < m_slots;
+}
+
+bool ReassemblyBuffer::IsReceived(uint64_t block) const
+{
+	if (block < m_base)
+		return true;
+
+	return InWindow(block) && TestBit(SlotIndex(block));
+}
+
+ReassemblyBuffer::StoreResult ReassemblyBuffer::Store(uint64_t block, const char* data, size_t size)
+{
+	assert(size <= MAX_LENGTH);
+
+	if (block < m_base)
+		return Duplicate;
+
+	if (!InWindow(block))
+		return OutOfWindow;
+
+	const size_t slot = SlotIndex(block);
+	if (TestBit(slot))
+		return Duplicate;
+
+	memcpy(&m_data[slot * MAX_LENGTH], data, size);
+	MarkReceived(block, size);
+
+	return Stored;
+}
+
+char* ReassemblyBuffer::Slot(uint64_t block)
+{
+	return &m_data[SlotIndex(block) * MAX_LENGTH];
+}
+
+size_t ReassemblyBuffer::SlotSize(uint64_t block) const
+{
+	assert(IsReceived(block));
+
+	return block < m_base ? MAX_LENGTH : m_sizes[SlotIndex(block)];
+}
+
+void ReassemblyBuffer::MarkReceived(uint64_t block, size_t size)
+{
+	assert(InWindow(block));
+
+	const size_t slot = SlotIndex(block);
+	if (TestBit(slot))
+		return;
+
+	SetBit(slot);
+	m_sizes[slot] = size;
+	++m_pending;
+	m_held += size;
+}
+
+void ReassemblyBuffer::Skip(uint64_t blocks)
+{
+	assert(m_pending == 0);
+
+	m_base += blocks;
+}
+
+size_t ReassemblyBuffer::Flush(StorageBackend& out)
+{
+	size_t written = 0;
+
+	while (m_pending > 0)
+	{
+		// one write per run of full slots that are adjacent in ring memory
+		const size_t first = SlotIndex(m_base);
+		const uint64_t offset = m_base * MAX_LENGTH;
+		size_t slot = first;
+		size_t bytes = 0;
+
+		while (slot < m_slots && TestBit(slot))
+		{
+			bytes += m_sizes[slot];
+			ClearBit(slot);
+			--m_pending;
+			++m_base;
+
+			const bool shortBlock = m_sizes[slot] < MAX_LENGTH;
+			++slot;
+
+			if (shortBlock)
+				break;
+		}
+
+		if (slot == first)
+			break;
+
+		out.WriteAt(offset, &m_data[first * MAX_LENGTH], bytes);
+		written += bytes;
+	}
+
+	m_held -= written;
+
+	size_t peak = s_peakHeld.load(std::memory_order_relaxed);
+	while (m_held > peak && !s_peakHeld.compare_exchange_weak(peak, m_held, std::memory_order_relaxed))
+	{
+	}
+
+	return written;
+}
+
+size_t ReassemblyBuffer::TakePeakHeld()
+{
+	return s_peakHeld.exchange(0, std::memory_order_relaxed);
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "Transfer.h"
+#include "Storage.h"
+#include <atomic>
+#include <cstdint>
+
+#define REASSEMBLY_SLOTS (4 * CHUNK_LENGTH)
+
+// Bounded receive window for UDP blocks keyed by absolute block number
+// (file offset / MAX_LENGTH). Blocks land in a ring of fixed slots, a
+// bitmap tracks which are present, and the contiguous prefix is written
+// out as soon as it completes. Memory is slots * MAX_LENGTH per session.
+class ReassemblyBuffer
+{
+public:
+	enum StoreResult
+	{
+		Stored,
+		Duplicate,
+		OutOfWindow
+	};
+
+	explicit ReassemblyBuffer(size_t slots = REASSEMBLY_SLOTS);
+
+	void Reset();
+
+	StoreResult Store(uint64_t block, const char* data, size_t size);
+
+	// Writes every complete block from the window start at its offset,
+	// returns bytes written.
+	size_t Flush(StorageBackend& out);
+
+	bool InWindow(uint64_t block) const;
+
+	bool IsReceived(uint64_t block) const;
+
+	// Ring memory of a block, used to rebuild lost ones in place. For a
+	// block behind the window it stays valid until its slot is reused.
+	char* Slot(uint64_t block);
+
+	size_t SlotSize(uint64_t block) const;
+
+	void MarkReceived(uint64_t block, size_t size);
+
+	// Moves the window past blocks that are never sent, only while none
+	// are pending.
+	void Skip(uint64_t blocks);
+
+	// Blocks held but not yet written because an earlier one is missing.
+	size_t Pending() const { return m_pending; }
+
+	// Most bytes any buffer of the process held after a Flush, waiting for
+	// an earlier block, since the last call. For the benchmarks.
+	static size_t TakePeakHeld();
+
+	uint64_t Base() const { return m_base; }
+
+	size_t Slots() const { return m_slots; }
+
+private:
+	size_t SlotIndex(uint64_t block) const { return static_cast<size_t>(block % m_slots); }
+
+	bool TestBit(size_t slot) const { return (m_bitmap[slot / 64] >> (slot % 64)) & 1; }
+
+	void SetBit(size_t slot) { m_bitmap[slot / 64] |= uint64_t(1) << (slot % 64); }
+
+	void ClearBit(size_t slot) { m_bitmap[slot / 64] &= ~(uint64_t(1) << (slot % 64)); }
+
+private:
+	const size_t          m_slots;
+	std::vector<char>     m_data;
+	std::vector<size_t>   m_sizes;
+	std::vector<uint64_t> m_bitmap;
+	uint64_t              m_base;
+	size_t                m_pending;
+	size_t                m_held;      // bytes of the pending blocks
+
+	static std::atomic<size_t> s_peakHeld;
+};
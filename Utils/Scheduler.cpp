@@ -0,0 +1,202 @@
+#include "Scheduler.h"
+
+#define MIN_BURST (64 * 1024)
+
+// Waiters the list has room for before it first grows.
+#define WAITERS_RESERVED 64
+
+void TransferScheduler::Flow::SetWeight(unsigned int weight)
+{
+	std::lock_guard<std::mutex> lock(m_scheduler->m_mutex);
+
+	m_weight = weight > 0 ? weight : 1;
+}
+
+unsigned int TransferScheduler::Flow::Weight() const
+{
+	std::lock_guard<std::mutex> lock(m_scheduler->m_mutex);
+
+	return m_weight;
+}
+
+double TransferScheduler::Flow::NextTag(size_t bytes) const
+{
+	std::lock_guard<std::mutex> lock(m_scheduler->m_mutex);
+
+	return m_scheduler->TagOf(*this, bytes);
+}
+
+TransferScheduler::TransferScheduler(uint64_t bytesPerSecond)
+	: m_rate(0)
+	, m_burst(MIN_BURST)
+	, m_tokens(0.0)
+	, m_virtualTime(0.0)
+	, m_lastRefill(Clock::now())
+	, m_nextTicket(0)
+{
+	m_waiters.reserve(WAITERS_RESERVED);
+	SetRate(bytesPerSecond);
+}
+
+std::shared_ptr<TransferScheduler::Flow> TransferScheduler::AddFlow(unsigned int weight)
+{
+	return std::shared_ptr<Flow>(new Flow(this, weight > 0 ? weight : 1));
+}
+
+void TransferScheduler::SetRate(uint64_t bytesPerSecond)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	Refill();
+
+	m_rate = bytesPerSecond;
+
+	// about 50 ms worth of traffic, enough to smooth timer jitter
+	m_burst = double(bytesPerSecond) / 20;
+	if (m_burst < MIN_BURST)
+		m_burst = MIN_BURST;
+	if (m_tokens > m_burst)
+		m_tokens = m_burst;
+
+	m_changed.notify_all();
+}
+
+uint64_t TransferScheduler::Rate() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	return m_rate;
+}
+
+void TransferScheduler::Refill()
+{
+	const Clock::time_point now = Clock::now();
+	const double elapsed = std::chrono::duration<double>(now - m_lastRefill).count();
+	m_lastRefill = now;
+
+	m_tokens += elapsed * double(m_rate);
+	if (m_tokens > m_burst)
+		m_tokens = m_burst;
+}
+
+void TransferScheduler::Acquire(Flow& flow, size_t bytes)
+{
+	// uncapped, nothing to wait for or to keep track of
+	if (m_rate == 0)
+		return;
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	const double tag = TagOf(flow, bytes);
+	flow.m_finish = tag;
+
+	const Waiter self = { tag, m_nextTicket++ };
+	m_waiters.push_back(self);
+
+	while (true)
+	{
+		Refill();
+
+		if (m_rate == 0)
+			break;
+
+		// a block larger than the bucket goes out once the bucket is full
+		const double needed = double(bytes) < m_burst ? double(bytes) : m_burst;
+		const bool first = FirstWaiter() == self.ticket;
+
+		if (first && m_tokens >= needed)
+		{
+			m_tokens -= double(bytes);
+			break;
+		}
+
+		if (first)
+		{
+			const double seconds = (needed - m_tokens) / double(m_rate);
+			m_changed.wait_for(lock, std::chrono::duration<double>(seconds));
+		}
+		else
+		{
+			m_changed.wait(lock);
+		}
+	}
+
+	if (tag > m_virtualTime)
+		m_virtualTime = tag;
+	RemoveWaiter(self.ticket);
+	m_changed.notify_all();
+}
+
+bool TransferScheduler::TryAcquire(Flow& flow, size_t bytes, int* retryMs)
+{
+	if (m_rate == 0)
+		return true;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	Refill();
+
+	if (m_rate == 0)
+		return true;
+
+	const double tag = TagOf(flow, bytes);
+	const double needed = double(bytes) < m_burst ? double(bytes) : m_burst;
+
+	bool behind = false;
+	for (size_t i = 0; i < m_waiters.size() && !behind; ++i)
+	{
+		behind = m_waiters[i].tag < tag;
+	}
+
+	if (!behind && m_tokens >= needed)
+	{
+		m_tokens -= double(bytes);
+		flow.m_finish = tag;
+		if (tag > m_virtualTime)
+			m_virtualTime = tag;
+
+		return true;
+	}
+
+	// behind a waiter the bucket refills for it first, asking again once
+	// a block's worth came in is soon enough
+	const double missing = m_tokens < needed ? needed - m_tokens : needed;
+	*retryMs = 1 + static_cast<int>(missing * 1000 / double(m_rate));
+
+	return false;
+}
+
+double TransferScheduler::TagOf(const Flow& flow, size_t bytes) const
+{
+	const double start = flow.m_finish > m_virtualTime ? flow.m_finish : m_virtualTime;
+
+	return start + double(bytes) / flow.m_weight;
+}
+
+uint64_t TransferScheduler::FirstWaiter() const
+{
+	size_t first = 0;
+	for (size_t i = 1; i < m_waiters.size(); ++i)
+	{
+		const Waiter& waiter = m_waiters[i];
+		const Waiter& best = m_waiters[first];
+
+		if (waiter.tag < best.tag || (waiter.tag == best.tag && waiter.ticket < best.ticket))
+			first = i;
+	}
+
+	return m_waiters[first].ticket;
+}
+
+void TransferScheduler::RemoveWaiter(uint64_t ticket)
+{
+	for (size_t i = 0; i < m_waiters.size(); ++i)
+	{
+		if (m_waiters[i].ticket == ticket)
+		{
+			m_waiters[i] = m_waiters.back();
+			m_waiters.pop_back();
+			return;
+		}
+	}
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "Common.h"
+#include <chrono>
+#include <cstdint>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+// Shares one send budget between concurrent transfers. A token bucket
+// enforces the global rate, and while transfers wait for tokens they are
+// served in weighted fair queueing order: each block gets a virtual
+// finish tag of bytes / weight past the flow's previous one, and the
+// smallest tag goes first. The rate can be changed at any time. Without
+// a rate Acquire returns at once, and with one it allocates nothing once
+// the wait list has grown to the number of flows.
+class TransferScheduler
+{
+public:
+	class Flow
+	{
+	public:
+		// Blocks until the flow may put bytes on the wire.
+		void Acquire(size_t bytes) { m_scheduler->Acquire(*this, bytes); }
+
+		// Never blocks, for event loops: takes the bytes when the bucket
+		// has them and no blocked Acquire with a smaller tag waits, else
+		// false with the milliseconds until it is worth asking again.
+		bool TryAcquire(size_t bytes, int* retryMs) { return m_scheduler->TryAcquire(*this, bytes, retryMs); }
+
+		// The tag a block of bytes would get now. A loop that asks for its
+		// flows smallest tag first shares the link by weight.
+		double NextTag(size_t bytes) const;
+
+		void SetWeight(unsigned int weight);
+
+		unsigned int Weight() const;
+
+	private:
+		friend class TransferScheduler;
+
+		Flow(TransferScheduler* scheduler, unsigned int weight)
+			: m_scheduler(scheduler)
+			, m_weight(weight)
+			, m_finish(0.0)
+		{}
+
+	private:
+		TransferScheduler* m_scheduler;
+		unsigned int       m_weight;
+		double             m_finish;
+	};
+
+	// 0 bytes per second means unlimited.
+	explicit TransferScheduler(uint64_t bytesPerSecond = 0);
+
+	// Higher weight gets a proportionally larger share of the link.
+	std::shared_ptr<Flow> AddFlow(unsigned int weight = 1);
+
+	void SetRate(uint64_t bytesPerSecond);
+
+	uint64_t Rate() const;
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Waiter
+	{
+		double   tag;
+		uint64_t ticket;   // breaks ties in arrival order
+	};
+
+	void Acquire(Flow& flow, size_t bytes);
+
+	bool TryAcquire(Flow& flow, size_t bytes, int* retryMs);
+
+	// Caller holds the mutex.
+	double TagOf(const Flow& flow, size_t bytes) const;
+
+	// Ticket of the waiter with the smallest tag.
+	uint64_t FirstWaiter() const;
+
+	void RemoveWaiter(uint64_t ticket);
+
+	void Refill();
+
+	TransferScheduler(const TransferScheduler&);
+
+	TransferScheduler& operator = (const TransferScheduler&);
+
+private:
+	std::atomic<uint64_t>   m_rate;
+	double                  m_burst;
+	double                  m_tokens;
+	double                  m_virtualTime;
+	Clock::time_point       m_lastRefill;
+	std::vector<Waiter>     m_waiters;
+	uint64_t                m_nextTicket;
+	mutable std::mutex      m_mutex;
+	std::condition_variable m_changed;
+};
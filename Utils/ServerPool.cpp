@@ -0,0 +1,177 @@
+#include "ServerPool.h"
+#include <chrono>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+ServerPool::ServerPool(Socket::SocketType type, const char* address, short port, size_t workers)
+	: m_running(0)
+{
+	if (workers == 0)
+	{
+		workers = std::thread::hardware_concurrency();
+	}
+
+	// hardware_concurrency is 0 when it can't tell
+	if (workers == 0)
+	{
+		workers = 1;
+	}
+
+	// the loopback transport has no SO_REUSEPORT either
+	if ((!Socket::SupportsReusePort() || Socket::IsLoopbackAddress(address)) && workers > 1)
+	{
+		m_shared.reset(new SharedSocket(type, address, port, workers));
+	}
+
+	for (size_t i = 0; i < workers; ++i)
+	{
+		ServerPtr server(FileTransferServer::MakeServer(type, address, port));
+
+		if (!server)
+		{
+			throw std::runtime_error("Error: [ServerPool] unknown socket type");
+		}
+
+		if (m_shared)
+			server->SetTransport(m_shared->MakeTransport(i));
+		else
+			server->SetReusePort(workers > 1);
+		server->SetPersistent(true);
+		server->SetCompletionQueue(&m_completed);
+
+		m_servers.push_back(std::move(server));
+	}
+}
+
+ServerPool::~ServerPool()
+{
+	for (size_t i = 0; i < m_threads.size(); ++i)
+	{
+		if (m_threads[i].joinable())
+			m_threads[i].join();
+	}
+}
+
+void ServerPool::Init()
+{
+	for (size_t i = 0; i < m_servers.size(); ++i)
+	{
+		m_servers[i]->Init();
+	}
+
+	if (m_shared)
+	{
+		m_shared->Init();
+	}
+}
+
+void ServerPool::SetSyncPolicy(SyncPolicy policy, bool directIo)
+{
+	for (size_t i = 0; i < m_servers.size(); ++i)
+	{
+		m_servers[i]->SetSyncPolicy(policy, directIo);
+	}
+}
+
+void ServerPool::SetStorage(const StorageFactory& makeStorage)
+{
+	for (size_t i = 0; i < m_servers.size(); ++i)
+	{
+		m_servers[i]->SetStorage(makeStorage);
+	}
+}
+
+void ServerPool::SetProfiler(TransferProfiler* profiler)
+{
+	for (size_t i = 0; i < m_servers.size(); ++i)
+	{
+		m_servers[i]->SetProfiler(profiler);
+	}
+}
+
+void ServerPool::SetKey(const CipherKey& key)
+{
+	for (size_t i = 0; i < m_servers.size(); ++i)
+	{
+		m_servers[i]->SetKey(key);
+	}
+}
+
+void ServerPool::Run()
+{
+	m_running = m_servers.size();
+
+	for (size_t i = 0; i < m_servers.size(); ++i)
+	{
+		m_threads.push_back(std::thread(&ServerPool::WorkerLoop, this, i));
+
+		PinToCore(m_threads.back(), i);
+	}
+
+	while (m_running > 0)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		ReportCompleted();
+	}
+
+	for (size_t i = 0; i < m_threads.size(); ++i)
+	{
+		m_threads[i].join();
+	}
+	m_threads.clear();
+
+	// files the workers finished after the last look
+	ReportCompleted();
+}
+
+void ServerPool::ReportCompleted()
+{
+	std::vector<std::string> finished;
+	m_completed.PopAll(&finished);
+
+	for (size_t i = 0; i < finished.size(); ++i)
+	{
+		std::cout << "File done: " << finished[i] << std::endl;
+	}
+}
+
+void ServerPool::WorkerLoop(size_t index)
+{
+	try
+	{
+		m_servers[index]->Run();
+	}
+	catch (const std::exception& exc)
+	{
+		std::cout << exc.what() << std::endl;
+	}
+
+	--m_running;
+}
+
+void ServerPool::PinToCore(std::thread& thread, size_t core)
+{
+	const size_t cores = std::thread::hardware_concurrency();
+	if (cores == 0)
+		return;
+
+	core %= cores;
+
+#ifdef _WIN32
+	// one mask bit per core, cores past it belong to another processor group
+	if (core >= sizeof(DWORD_PTR) * 8)
+		return;
+
+	SetThreadAffinityMask(thread.native_handle(), DWORD_PTR(1) << core);
+#else
+	if (core >= CPU_SETSIZE)
+		return;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(core, &set);
+	pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#endif
+}
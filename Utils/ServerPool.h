@@ -0,0 +1,57 @@
+#pragma once
+
+#include "SharedSocket.h"
+#include "TransferServer.h"
+#include <atomic>
+#include <thread>
+
+// N persistent servers, one per worker thread pinned to its own core.
+// Every worker binds its own socket with SO_REUSEPORT and keeps its own
+// session state, so nothing is shared on the receive path; finished
+// files are handed to the pool thread through a CompletionQueue. Without
+// SO_REUSEPORT the workers share one socket through a SharedSocket.
+class ServerPool
+{
+public:
+	ServerPool(Socket::SocketType type, const char* address, short port, size_t workers);
+
+	~ServerPool();
+
+	void Init();
+
+	void SetSyncPolicy(SyncPolicy policy, bool directIo);
+
+	// Every session of every worker gets its own backend.
+	void SetStorage(const StorageFactory& makeStorage);
+
+	void SetKey(const CipherKey& key);
+
+	// Shared by all workers.
+	void SetProfiler(TransferProfiler* profiler);
+
+	// Starts the workers and reports finished files until all of them exit.
+	void Run();
+
+	size_t Workers() const { return m_servers.size(); }
+
+private:
+	void WorkerLoop(size_t index);
+
+	// Prints the files finished since the last call.
+	void ReportCompleted();
+
+	static void PinToCore(std::thread& thread, size_t core);
+
+	ServerPool(const ServerPool&);
+
+	ServerPool& operator = (const ServerPool&);
+
+private:
+	typedef std::unique_ptr<FileTransferServer> ServerPtr;
+
+	std::unique_ptr<SharedSocket> m_shared;   // outlives the servers on it
+	std::vector<ServerPtr>        m_servers;
+	std::vector<std::thread>      m_threads;
+	CompletionQueue               m_completed;
+	std::atomic<size_t>           m_running;
+};
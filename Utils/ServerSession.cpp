@@ -0,0 +1,829 @@
+#include "ServerSession.h"
+#include "Fec.h"
+#include <cstddef>
+
+namespace
+{
+	std::string FrameString(const MessageData& data)
+	{
+		const size_t length = data.dataSize < MAX_LENGTH ? data.dataSize : MAX_LENGTH;
+		return std::string(data.data, std::find(data.data, data.data + length, '\0'));
+	}
+
+	// The entry with the paths its storage keeps it under.
+	void ApplyStoredAttributes(const StorageBackend& storage, const ManifestEntry& entry)
+	{
+		ManifestEntry stored = entry;
+
+		if (!entry.IsDirectory())
+		{
+			stored.path = storage.PathOf(entry.path);
+			ApplyAttributes(stored);
+			return;
+		}
+
+		std::vector<std::string> paths;
+		storage.DirectoryPaths(entry.path, &paths);
+
+		for (size_t i = 0; i < paths.size(); ++i)
+		{
+			stored.path = paths[i];
+			ApplyAttributes(stored);
+		}
+	}
+}
+
+ServerSession::ServerSession(const SessionOptions& options, BufferPool& pool)
+	: m_options(options)
+	, m_pool(pool)
+	, m_state(TransferState::Idle)
+	, m_storage(new FileStorage())
+	, m_currentOffset(0)
+	, m_fileNumber(0)
+	, m_accepted(Protocol::Accepted, "Data accepted.")
+	, m_session(DefaultSession())
+{
+	m_sealed = m_pool.Acquire();
+}
+
+ServerSession::~ServerSession()
+{}
+
+void ServerSession::SetStorage(std::unique_ptr<StorageBackend> storage)
+{
+	ResetSession();
+
+	m_storage = std::move(storage);
+	m_storage->SetPolicy(m_options.policy, m_options.directIo);
+}
+
+void ServerSession::ResetSession()
+{
+	if (m_storage->IsOpen())
+	{
+		m_storage->Abort();
+	}
+
+	m_reserves.Cancel();
+	m_storage->DropReserved();
+	m_manifest.clear();
+	m_manifestIndex.clear();
+	m_fileNumber = 0;
+
+	m_state = TransferState::Idle;
+}
+
+SessionInfo ServerSession::LocalSession() const
+{
+	uint32_t capabilities = CapabilityManifest | CapabilitySparse;
+	if (m_options.persistent)
+	{
+		capabilities |= CapabilityKeepAlive;
+	}
+	if (m_options.hasKey)
+	{
+		capabilities |= CapabilityEncryption;
+	}
+
+	return MakeSession(capabilities, CHUNK_LENGTH);
+}
+
+void ServerSession::HandleHello(const MessageData& data, const SessionInfo& local)
+{
+	if (m_state != TransferState::Idle || m_storage->IsOpen())
+	{
+		throw std::runtime_error("Error: [HandleHello] file opened or transfer state not idle");
+	}
+
+	// until the new key is agreed errors go out in the clear
+	m_cipher.reset();
+
+	const SessionInfo remote = ReadHello(data);
+	m_session = Negotiate(local, remote);
+
+	if (m_options.hasKey && !m_session.Has(CapabilityEncryption))
+	{
+		throw std::runtime_error("Error: [HandleHello] encryption required");
+	}
+
+	SessionInfo answer = m_session;
+	answer.nonce = m_options.hasKey ? RandomNonce() : 0;
+	WriteHello(Protocol::HelloAck, answer, &m_helloAck);
+
+	if (m_options.hasKey)
+	{
+		m_cipher.reset(new FrameCipher(DeriveSessionKey(m_options.key, remote.nonce, answer.nonce), false));
+		m_cipher->SignHello(m_helloAck);
+	}
+}
+
+const MessageData& ServerSession::SealFrame(const MessageData& data)
+{
+	if (!m_cipher || data.protocol == Protocol::HelloAck)
+	{
+		return data;
+	}
+
+	m_cipher->Seal(data, data.data, m_sealed.Get());
+
+	return *m_sealed;
+}
+
+bool ServerSession::OpenFrame(MessageData& data)
+{
+	if (data.protocol == Protocol::Hello)
+	{
+		return true;
+	}
+
+	if (!m_cipher)
+	{
+		return !m_options.hasKey;
+	}
+
+	return m_cipher->Open(data);
+}
+
+void ServerSession::HandleFileBegin(const MessageData& data)
+{
+	if (m_state != TransferState::Idle || m_storage->IsOpen())
+	{
+		throw std::runtime_error("Error: [HandleFileBegin] file opened or transfer state not idle");
+	}
+
+	const std::string name = FrameString(data);
+
+	if (!IsSafeRelativePath(name))
+	{
+		throw std::runtime_error("Error: [HandleFileBegin] unsafe file name");
+	}
+
+	const bool reserved = m_manifestIndex.count(name) != 0;
+	if (reserved)
+	{
+		// pre-sized from the manifest, keep the allocation
+		m_reserves.Wait();
+	}
+
+	m_storage->Open(name, reserved);
+
+	m_state = TransferState::LoadFile;
+	m_currentName = name;
+	m_currentOffset = 0;
+	++m_fileNumber;
+
+	std::cout << "Load new file: " << name << std::endl;
+}
+
+void ServerSession::HandleFileData(const MessageData& data)
+{
+	if (m_state != TransferState::LoadFile || !m_storage->IsOpen())
+	{
+		throw std::runtime_error("Error: [HandleFileData] file not opened or transfer state not LoadFile");
+	}
+
+	if (data.dataSize > MAX_LENGTH)
+	{
+		throw std::runtime_error("Error: [HandleFileData] block size out of range");
+	}
+
+	{
+		ProfileSpan span(m_options.profiler, TransferProfiler::ServerWrite, ProfileBlock(data));
+		m_storage->WriteAt(m_currentOffset, data.data, data.dataSize);
+	}
+	m_currentOffset += data.dataSize;
+}
+
+void ServerSession::HandleFileEnd(const MessageData& data)
+{
+	if (m_state != TransferState::LoadFile || !m_storage->IsOpen())
+	{
+		throw std::runtime_error("Error: [HandleFileEnd] file not opened or transfer state not LoadFile");
+	}
+
+	// a sender that gave up on some blocks must not leave a short file behind
+	if (ReadFileEnd(data) != m_currentOffset)
+	{
+		throw std::runtime_error("Error: [HandleFileEnd] file is missing data");
+	}
+
+	m_storage->Finalize();
+
+	m_state = TransferState::Idle;
+
+	ManifestIndex::const_iterator entry = m_manifestIndex.find(m_currentName);
+	if (entry != m_manifestIndex.end())
+	{
+		ApplyStoredAttributes(*m_storage, m_manifest[entry->second]);
+	}
+
+	if (m_options.completed != nullptr)
+	{
+		m_options.completed->Push(m_currentName);
+	}
+}
+
+void ServerSession::HandleDone(const MessageData& data)
+{
+	if (m_state != TransferState::Idle || m_storage->IsOpen())
+	{
+		throw std::runtime_error("Error: [HandleDone] file opened or transfer state not idle");
+	}
+
+	// files announced but never sent leave no .part behind
+	m_reserves.Wait();
+	m_storage->DropReserved();
+
+	// children touched the directories, restore their times last, deepest first
+	for (size_t i = m_manifest.size(); i > 0; --i)
+	{
+		if (m_manifest[i - 1].IsDirectory())
+		{
+			ApplyStoredAttributes(*m_storage, m_manifest[i - 1]);
+		}
+	}
+
+	m_state = TransferState::LoadEnd;
+}
+
+void ServerSession::HandleManifest(const MessageData& data)
+{
+	if (m_state != TransferState::Idle || m_storage->IsOpen())
+	{
+		throw std::runtime_error("Error: [HandleManifest] file opened or transfer state not idle");
+	}
+
+	if (data.dataIndex < 0 || size_t(data.dataIndex) > m_manifest.size())
+	{
+		throw std::runtime_error("Error: [HandleManifest] manifest frame out of order");
+	}
+	if (size_t(data.dataIndex) < m_manifest.size())
+	{
+		// retransmitted frame
+		return;
+	}
+
+	std::vector<ManifestEntry> entries;
+	ReadManifestEntries(data, &entries);
+
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		const ManifestEntry& entry = entries[i];
+
+		if (!IsSafeRelativePath(entry.path))
+		{
+			throw std::runtime_error("Error: [HandleManifest] unsafe path " + entry.path);
+		}
+
+		// parents come first in the manifest, so directories are made in order
+		if (entry.IsDirectory())
+		{
+			m_storage->MakeDirectory(entry.path);
+		}
+		else
+		{
+			// created at full size in the background so their extents are
+			// laid out before the data arrives
+			m_reserves.Push(m_storage.get(), entry.path, entry.size);
+		}
+
+		m_manifestIndex[entry.path] = m_manifest.size();
+		m_manifest.push_back(entry);
+	}
+}
+
+void ServerSession::HandlePackedData(const MessageData& data)
+{
+	if (m_state != TransferState::Idle || m_storage->IsOpen())
+	{
+		throw std::runtime_error("Error: [HandlePackedData] file opened or transfer state not idle");
+	}
+	if (data.dataSize > MAX_LENGTH)
+	{
+		throw std::runtime_error("Error: [HandlePackedData] frame size out of range");
+	}
+
+	m_reserves.Wait();
+
+	const char* pos = data.data;
+	const char* const end = data.data + data.dataSize;
+
+	while (pos < end)
+	{
+		uint32_t index = 0;
+		uint32_t length = 0;
+
+		if (size_t(end - pos) < sizeof(index) + sizeof(length))
+		{
+			throw std::runtime_error("Error: [HandlePackedData] truncated record");
+		}
+		memcpy(&index, pos, sizeof(index));
+		memcpy(&length, pos + sizeof(index), sizeof(length));
+		pos += sizeof(index) + sizeof(length);
+
+		if (index >= m_manifest.size() || m_manifest[index].IsDirectory() || size_t(end - pos) < length)
+		{
+			throw std::runtime_error("Error: [HandlePackedData] bad record");
+		}
+
+		const ManifestEntry& entry = m_manifest[index];
+		m_storage->WriteWhole(entry.path, pos, length);
+
+		ApplyStoredAttributes(*m_storage, entry);
+		pos += length;
+
+		if (m_options.completed != nullptr)
+		{
+			m_options.completed->Push(entry.path);
+		}
+	}
+}
+
+void ServerSession::HandleHole(const MessageData& data)
+{
+	if (m_state != TransferState::LoadFile || !m_storage->IsOpen())
+	{
+		throw std::runtime_error("Error: [HandleHole] file not opened or transfer state not LoadFile");
+	}
+
+	uint64_t offset = 0;
+	uint64_t length = 0;
+	ReadHole(data, &offset, &length);
+
+	if (offset != m_currentOffset)
+	{
+		throw std::runtime_error("Error: [HandleHole] hole out of order");
+	}
+
+	m_storage->WriteHole(offset, length);
+	m_currentOffset += length;
+}
+
+uint64_t ServerSession::ProfileBlock(const MessageData& data) const
+{
+	switch (data.protocol)
+	{
+	case Protocol::FileData: return TransferProfiler::BlockId(m_fileNumber, m_currentOffset / MAX_LENGTH);
+	case Protocol::Chunk: return TransferProfiler::BlockId(m_fileNumber, data.dataIndex);
+	default:
+		return PROFILE_NO_BLOCK;
+	}
+}
+
+void ServerSession::InvokeHandler(const MessageData& data)
+{
+	if (!IsValidProtocol(data.protocol))
+	{
+		throw std::runtime_error("Error: [InvokeHandler] protocol out of range");
+	}
+
+	// Dense switch over the validated enum, compiled to a jump table.
+	// Block frames never get here, the session of their transport
+	// dispatches them before falling back to this.
+	switch (data.protocol)
+	{
+	case Protocol::FileBegin: HandleFileBegin(data); break;
+	case Protocol::FileEnd: HandleFileEnd(data); break;
+	case Protocol::Done: HandleDone(data); break;
+	case Protocol::Manifest: HandleManifest(data); break;
+	case Protocol::PackedData: HandlePackedData(data); break;
+	case Protocol::Hello: HandleHello(data, LocalSession()); break;
+	default:
+		throw std::runtime_error("Error: [InvokeHandler] unexpected protocol");
+	}
+}
+
+TcpSession::TcpSession(const SessionOptions& options, BufferPool& pool)
+	: ServerSession(options, pool)
+{}
+
+void TcpSession::Receive(Socket* client, MessageData& data)
+{
+	TransferProfiler* const profiler = m_options.profiler;
+	uint64_t block = PROFILE_NO_BLOCK;
+	{
+		ProfileSpan span(profiler, TransferProfiler::ServerReceive);
+		client->Read((char*)&data, sizeof(MessageData));
+
+		block = ProfileBlock(data);
+		span.SetBlock(block);
+	}
+
+	{
+		ProfileSpan span(m_cipher ? profiler : nullptr, TransferProfiler::ServerDecrypt, block);
+		if (!OpenFrame(data))
+		{
+			throw std::runtime_error("Error: [Receive] frame failed authentication");
+		}
+	}
+
+	{
+		ProfileSpan span(profiler, TransferProfiler::ServerHandle, block);
+		Dispatch(data);
+	}
+
+	ProfileSpan span(profiler, TransferProfiler::ServerAnswer, block);
+
+	SetAnswered(data, &m_accepted);
+
+	const MessageData& answer = data.protocol == Protocol::Hello ? m_helloAck : m_accepted;
+	client->Send((char*)&SealFrame(answer), sizeof(answer));
+}
+
+void TcpSession::Dispatch(const MessageData& data)
+{
+	switch (data.protocol)
+	{
+	case Protocol::FileData: HandleFileData(data); break;
+	case Protocol::Hole: HandleHole(data); break;
+	default:
+		InvokeHandler(data);
+	}
+}
+
+bool TcpSession::KeepAlive() const
+{
+	return m_session.Has(CapabilityKeepAlive);
+}
+
+void TcpSession::Restart()
+{
+	ResetSession();
+
+	m_session = DefaultSession();
+	m_cipher.reset();
+}
+
+void TcpSession::Fail(Socket* client, const std::string& message)
+{
+	MessageBuffer answer = m_pool.Acquire();
+	*answer = MessageData(Protocol::FatalError, message);
+	client->Send((char*)&SealFrame(*answer), sizeof(MessageData));
+}
+
+UdpSession::UdpSession(const SessionOptions& options, BufferPool& pool, Socket& socket)
+	: ServerSession(options, pool)
+	, m_socket(socket)
+	, m_skipAnswer(false)
+	, m_lastControl(0)
+	, m_helloAnswered(false)
+	, m_parity(m_window.Slots() * MAX_LENGTH)
+	, m_parityFirst(m_window.Slots(), -1)
+	, m_parityRow(m_window.Slots(), 0)
+	, m_parityLast(m_window.Slots(), 0)
+	, m_parityCount(m_window.Slots(), 0)
+	, m_parityRest(FEC_MAX_PARITY * MAX_LENGTH)
+	, m_groupOf(m_window.Slots(), -1)
+	, m_recoveredCount(0)
+	, m_recoveredAck(Protocol::Recovered, "Data recovered.")
+{
+	// rebuilt blocks are answered as chunks
+	MessageData chunk;
+	chunk.protocol = Protocol::Chunk;
+	chunk.dataIndex = 0;
+	SetAnswered(chunk, &m_recoveredAck);
+	m_recoveredAck.protocol = Protocol::Recovered;
+}
+
+SessionInfo UdpSession::LocalSession() const
+{
+	SessionInfo info = ServerSession::LocalSession();
+	info.capabilities |= CapabilityFec | CapabilityConcurrent;
+
+	// the key belongs to the last Hello, a pooled client would skip it
+	if (m_options.hasKey)
+	{
+		info.capabilities &= ~CapabilityKeepAlive;
+	}
+	info.windowSize = static_cast<uint32_t>(std::min<size_t>(CHUNK_LENGTH, m_window.Slots()));
+
+	return info;
+}
+
+void UdpSession::Receive(MessageData& data, const sockaddr_in* client)
+{
+	TransferProfiler* const profiler = m_options.profiler;
+	const uint64_t block = ProfileBlock(data);
+	{
+		// forged and replayed datagrams are dropped unanswered
+		ProfileSpan span(m_cipher ? profiler : nullptr, TransferProfiler::ServerDecrypt, block);
+		if (!OpenFrame(data))
+			return;
+	}
+
+	if (AnswerRetransmit(data, client))
+		return;
+
+	m_skipAnswer = data.protocol == Protocol::Parity;
+
+	if (data.protocol == Protocol::FileBegin)
+	{
+		m_window.Reset();
+	}
+
+	{
+		ProfileSpan span(profiler, TransferProfiler::ServerHandle, block);
+		Dispatch(data);
+	}
+
+	if (IsNumbered(data.protocol))
+	{
+		m_lastControl = data.dataIndex;
+	}
+	else if (data.protocol == Protocol::Hello)
+	{
+		m_hello = data;
+		m_helloFrom = *client;
+		m_helloAnswered = true;
+		m_lastControl = 0;
+	}
+
+	ProfileSpan answer(profiler, TransferProfiler::ServerAnswer, block);
+
+	// parity is only answered through the blocks it rebuilds
+	if (data.protocol == Protocol::Hello)
+	{
+		m_socket.SendTo((char*)&m_helloAck, sizeof(m_helloAck), client);
+	}
+	else if (!m_skipAnswer)
+	{
+		SetAnswered(data, &m_accepted);
+		m_socket.SendTo((char*)&SealFrame(m_accepted), sizeof(m_accepted), client);
+	}
+
+	for (int i = 0; i < m_recoveredCount; ++i)
+	{
+		m_recoveredAck.dataIndex = m_recovered[i];
+		m_socket.SendTo((char*)&SealFrame(m_recoveredAck), sizeof(m_recoveredAck), client);
+	}
+	m_recoveredCount = 0;
+
+	if (m_options.persistent && m_state == TransferState::LoadEnd)
+	{
+		Restart();
+	}
+}
+
+void UdpSession::Dispatch(const MessageData& data)
+{
+	switch (data.protocol)
+	{
+	case Protocol::Chunk: HandleChunk(data); break;
+	case Protocol::Parity: HandleParity(data); break;
+	case Protocol::Hole: HandleHole(data); break;
+	case Protocol::Hello: HandleHello(data, LocalSession()); break;
+	default:
+		InvokeHandler(data);
+	}
+}
+
+void UdpSession::AnswerLate(MessageData& data, const sockaddr_in* client)
+{
+	if (OpenFrame(data))
+	{
+		AnswerRetransmit(data, client);
+	}
+}
+
+void UdpSession::Fail(const sockaddr_in* client, const std::string& message)
+{
+	MessageBuffer answer = m_pool.Acquire();
+	*answer = MessageData(Protocol::FatalError, message);
+	m_socket.SendTo((char*)&SealFrame(*answer), sizeof(MessageData), client);
+
+	// the client gives up on a fatal error, drop its half-written file
+	Restart();
+}
+
+void UdpSession::Restart()
+{
+	ResetSession();
+	m_window.Reset();
+	m_lastControl = 0;
+}
+
+void UdpSession::HandleChunk(const MessageData& data)
+{
+	if (m_state != TransferState::LoadFile || !m_storage->IsOpen())
+	{
+		throw std::runtime_error("Error: [HandleChunk] file not opened or transfer state not LoadFile");
+	}
+	if (data.dataIndex < 0 || data.dataSize > MAX_LENGTH)
+	{
+		throw std::runtime_error("Error: [HandleChunk] block out of range");
+	}
+
+	const int64_t block = data.dataIndex;
+	const ReassemblyBuffer::StoreResult result = m_window.Store(block, data.data, data.dataSize);
+
+	if (result == ReassemblyBuffer::OutOfWindow)
+	{
+		// not acknowledged, the client sends it again once the window moves
+		m_skipAnswer = true;
+		return;
+	}
+
+	if (result == ReassemblyBuffer::Stored)
+	{
+		const int64_t first = m_groupOf[block % m_window.Slots()];
+		if (first >= 0 && first <= block)
+		{
+			TryRecover(first);
+		}
+		ProfileSpan span(m_options.profiler, TransferProfiler::ServerWrite, ProfileBlock(data));
+		m_currentOffset += m_window.Flush(*m_storage);
+	}
+}
+
+void UdpSession::HandleParity(const MessageData& data)
+{
+	if (m_state != TransferState::LoadFile || !m_storage->IsOpen())
+	{
+		throw std::runtime_error("Error: [HandleParity] file not opened or transfer state not LoadFile");
+	}
+
+	size_t lastSize = 0;
+	int count = 0;
+	int row = 0;
+	UnpackParity(data.dataSize, &lastSize, &count, &row);
+
+	if (data.dataIndex < 0 || count <= 0 || count > FEC_MAX_GROUP || size_t(count) > m_window.Slots() ||
+		row >= count || row >= FEC_MAX_PARITY || lastSize > MAX_LENGTH)
+	{
+		throw std::runtime_error("Error: [HandleParity] group out of range");
+	}
+
+	const int64_t first = data.dataIndex;
+	const int64_t last = first + count - 1;
+	if (uint64_t(last) < m_window.Base())
+		return;
+
+	// row r of a group is kept in the slot of its block r
+	const size_t slot = (first + row) % m_window.Slots();
+	memcpy(&m_parity[slot * MAX_LENGTH], data.data, MAX_LENGTH);
+	m_parityFirst[slot] = first;
+	m_parityRow[slot] = row;
+	m_parityLast[slot] = lastSize;
+	m_parityCount[slot] = count;
+
+	for (int64_t i = first; i <= last; ++i)
+	{
+		m_groupOf[i % m_window.Slots()] = first;
+	}
+
+	TryRecover(first);
+	m_currentOffset += m_window.Flush(*m_storage);
+}
+
+// Windows are sent one after the other, so a hole always starts where
+// the received blocks end. Holes are sent again until answered.
+void UdpSession::HandleHole(const MessageData& data)
+{
+	if (m_state != TransferState::LoadFile || !m_storage->IsOpen())
+	{
+		throw std::runtime_error("Error: [HandleHole] file not opened or transfer state not LoadFile");
+	}
+
+	uint64_t offset = 0;
+	uint64_t length = 0;
+	ReadHole(data, &offset, &length);
+
+	const uint64_t blocks = (length + MAX_LENGTH - 1) / MAX_LENGTH;
+
+	if (offset % MAX_LENGTH == 0 && offset / MAX_LENGTH + blocks <= m_window.Base())
+	{
+		// already skipped, the answer was lost and goes out again
+		return;
+	}
+
+	if (offset != m_window.Base() * MAX_LENGTH || m_window.Pending() > 0 ||
+		data.dataIndex != static_cast<int>(offset / MAX_LENGTH))
+	{
+		throw std::runtime_error("Error: [HandleHole] hole out of order");
+	}
+
+	m_storage->WriteHole(offset, length);
+	m_window.Skip(blocks);
+	m_currentOffset += length;
+}
+
+void UdpSession::TryRecover(int64_t first)
+{
+	const size_t slots = m_window.Slots();
+
+	int rows[FEC_MAX_PARITY];
+	const char* parity[FEC_MAX_PARITY];
+	int received = 0;
+	int count = 0;
+	size_t lastSize = 0;
+
+	for (int row = 0; row < FEC_MAX_PARITY; ++row)
+	{
+		const size_t slot = (first + row) % slots;
+		if (m_parityFirst[slot] != first || m_parityRow[slot] != row)
+			continue;
+
+		rows[received] = row;
+		parity[received] = &m_parity[slot * MAX_LENGTH];
+		++received;
+
+		count = m_parityCount[slot];
+		lastSize = m_parityLast[slot];
+	}
+
+	if (received == 0)
+		return;
+
+	const int64_t last = first + count;
+	int lostBlocks[FEC_MAX_PARITY];
+	int lost = 0;
+
+	for (int64_t i = first; i < last; ++i)
+	{
+		if (m_window.IsReceived(i))
+		{
+			// a flushed block whose slot was already reused is gone
+			if (!m_window.InWindow(i) && m_window.IsReceived(i + slots))
+				return;
+			continue;
+		}
+		if (lost == received || !m_window.InWindow(i))
+			return;
+
+		lostBlocks[lost++] = static_cast<int>(i - first);
+	}
+
+	uint8_t inverse[FEC_MAX_PARITY * FEC_MAX_PARITY];
+	if (lost == 0 || !FecInvert(rows, lostBlocks, lost, inverse))
+		return;
+
+	// what is left of each row once the received blocks are taken out
+	for (int r = 0; r < lost; ++r)
+	{
+		char* rest = &m_parityRest[r * MAX_LENGTH];
+		memcpy(rest, parity[r], MAX_LENGTH);
+
+		for (int64_t i = first; i < last; ++i)
+		{
+			if (m_window.IsReceived(i))
+			{
+				GfMulAdd(rest, m_window.Slot(i), FecCoefficient(rows[r], static_cast<int>(i - first)), m_window.SlotSize(i));
+			}
+		}
+	}
+
+	for (int b = 0; b < lost; ++b)
+	{
+		const int64_t missing = first + lostBlocks[b];
+		char* block = m_window.Slot(missing);
+
+		memset(block, 0, MAX_LENGTH);
+		for (int r = 0; r < lost; ++r)
+		{
+			GfMulAdd(block, &m_parityRest[r * MAX_LENGTH], inverse[b * lost + r], MAX_LENGTH);
+		}
+
+		m_window.MarkReceived(missing, missing + 1 < last ? MAX_LENGTH : lastSize);
+		m_recovered[m_recoveredCount++] = static_cast<int>(missing);
+	}
+}
+
+// Numbered control frames and Hello are answered once more, older
+// numbered ones were answered long ago and are dropped.
+bool UdpSession::AnswerRetransmit(const MessageData& data, const sockaddr_in* client)
+{
+	if (data.protocol == Protocol::Hello)
+	{
+		// a Hello that is not the one answered last starts a new session
+		if (!m_helloAnswered || !SamePeer(*client, m_helloFrom) || data.dataSize != m_hello.dataSize ||
+			memcmp(data.data, m_hello.data, std::min<size_t>(data.dataSize, MAX_LENGTH)) != 0)
+		{
+			return false;
+		}
+
+		m_socket.SendTo((char*)&m_helloAck, sizeof(m_helloAck), client);
+		return true;
+	}
+
+	if (!IsNumbered(data.protocol) || data.dataIndex > m_lastControl)
+		return false;
+
+	if (data.dataIndex == m_lastControl)
+	{
+		SetAnswered(data, &m_accepted);
+		m_socket.SendTo((char*)&SealFrame(m_accepted), sizeof(m_accepted), client);
+	}
+
+	return true;
+}
+
+bool UdpSession::SamePeer(const sockaddr_in& a, const sockaddr_in& b)
+{
+	return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+}
+
+bool UdpSession::IsNumbered(Protocol pr)
+{
+	return pr == Protocol::FileBegin || pr == Protocol::FileEnd ||
+		pr == Protocol::Done || pr == Protocol::PackedData;
+}
@@ -0,0 +1,209 @@
+#pragma once
+
+#include "Transfer.h"
+#include "BufferPool.h"
+#include "CompletionQueue.h"
+#include "FrameCipher.h"
+#include "Handshake.h"
+#include "Manifest.h"
+#include "Profiler.h"
+#include "Reassembly.h"
+#include "Sparse.h"
+#include "Storage.h"
+#include <unordered_map>
+
+// What a server hands each of its sessions, owned by the server.
+struct SessionOptions
+{
+	SessionOptions()
+		: persistent(false)
+		, hasKey(false)
+		, policy(SyncNone)
+		, directIo(false)
+		, completed(nullptr)
+		, profiler(nullptr)
+	{}
+
+	bool              persistent;
+	bool              hasKey;
+	CipherKey         key;
+	SyncPolicy        policy;
+	bool              directIo;
+	CompletionQueue*  completed;
+	TransferProfiler* profiler;
+};
+
+// One client's transfer: the files it is sending, its manifest and its
+// cipher. The handlers of the frames every transport shares live here.
+// Each transport's session is final and dispatches its per-block frames
+// itself, so those calls are direct and only control frames go through
+// InvokeHandler.
+class ServerSession
+{
+public:
+	enum TransferState
+	{
+		Idle,
+		LoadFile,
+		LoadEnd
+	};
+
+	TransferState State() const { return m_state; }
+
+	// Where received files go. Only between files, the sync policy of the
+	// options is applied to it.
+	void SetStorage(std::unique_ptr<StorageBackend> storage);
+
+	// Drops the file being received and everything announced for the session.
+	void ResetSession();
+
+	// Profiler id of a data frame, read before it is handled.
+	uint64_t ProfileBlock(const MessageData& data) const;
+
+protected:
+	ServerSession(const SessionOptions& options, BufferPool& pool);
+
+	~ServerSession();
+
+	void HandleFileBegin(const MessageData& data);
+
+	void HandleFileData(const MessageData& data);
+
+	void HandleFileEnd(const MessageData& data);
+
+	void HandleDone(const MessageData& data);
+
+	void HandleManifest(const MessageData& data);
+
+	void HandlePackedData(const MessageData& data);
+
+	// Agrees on the session local offers and prepares m_helloAck as the answer.
+	void HandleHello(const MessageData& data, const SessionInfo& local);
+
+	// A run of zeros the client did not send, right after the data so far.
+	void HandleHole(const MessageData& data);
+
+	// The control frames every transport handles the same way, throws for the rest.
+	void InvokeHandler(const MessageData& data);
+
+	// What this server offers in the handshake, before the transport adds its part.
+	SessionInfo LocalSession() const;
+
+	// The frame to put on the wire, sealed into scratch once the session is encrypted.
+	const MessageData& SealFrame(const MessageData& data);
+
+	// Decrypts in place, false for frames that are not authentic or
+	// arrive in the clear while a key is required.
+	bool OpenFrame(MessageData& data);
+
+private:
+	ServerSession(const ServerSession&);
+
+	ServerSession& operator = (const ServerSession&);
+
+protected:
+	const SessionOptions& m_options;
+	BufferPool&     m_pool;
+	TransferState   m_state;
+	std::unique_ptr<StorageBackend> m_storage;
+	std::string     m_currentName;
+	uint64_t        m_currentOffset;
+	uint32_t        m_fileNumber;   // 1-based within the session
+
+	typedef std::unordered_map<std::string, size_t> ManifestIndex;
+
+	std::vector<ManifestEntry>     m_manifest;
+	ManifestIndex                  m_manifestIndex;
+	ReserveQueue                   m_reserves;
+	MessageData     m_accepted;
+	SessionInfo     m_session;
+	MessageData     m_helloAck;
+
+	std::unique_ptr<FrameCipher> m_cipher;
+	MessageBuffer                m_sealed;
+};
+
+// A session over a TCP connection, frames arrive whole and in order.
+class TcpSession final : public ServerSession
+{
+public:
+	TcpSession(const SessionOptions& options, BufferPool& pool);
+
+	// Reads the next frame from client, handles and answers it.
+	void Receive(Socket* client, MessageData& data);
+
+	void Dispatch(const MessageData& data);
+
+	// The client keeps the connection for its next session.
+	bool KeepAlive() const;
+
+	// Back to a fresh connection's state.
+	void Restart();
+
+	void Fail(Socket* client, const std::string& message);
+};
+
+// A session over UDP: blocks come in windows, out of order, and are
+// put back together in m_window. Parity frames rebuild lost blocks.
+class UdpSession final : public ServerSession
+{
+public:
+	UdpSession(const SessionOptions& options, BufferPool& pool, Socket& socket);
+
+	// Handles and answers a datagram from client. Forged and replayed
+	// ones are dropped unanswered.
+	void Receive(MessageData& data, const sockaddr_in* client);
+
+	void Dispatch(const MessageData& data);
+
+	// After the session ended: answers retransmitted frames, drops the rest.
+	void AnswerLate(MessageData& data, const sockaddr_in* client);
+
+	void Fail(const sockaddr_in* client, const std::string& message);
+
+	// Forgets the session along with the frames numbered in it.
+	void Restart();
+
+private:
+	// Chunk dataIndex is the absolute block number, file offset / MAX_LENGTH.
+	void HandleChunk(const MessageData& data);
+
+	void HandleParity(const MessageData& data);
+
+	void HandleHole(const MessageData& data);
+
+	// Adds FEC and the window to what every server offers.
+	SessionInfo LocalSession() const;
+
+	// Answers a frame whose answer was lost without handling it again.
+	// True when the frame was one of those.
+	bool AnswerRetransmit(const MessageData& data, const sockaddr_in* client);
+
+	// Rebuilds the lost blocks of the group once there are as many parity
+	// rows for it.
+	void TryRecover(int64_t first);
+
+	static bool SamePeer(const sockaddr_in& a, const sockaddr_in& b);
+
+	static bool IsNumbered(Protocol pr);
+
+private:
+	Socket& m_socket;
+	bool m_skipAnswer;
+	int  m_lastControl;     // number of the last control frame handled
+	bool m_helloAnswered;
+	MessageData m_hello;    // the Hello m_helloAck answers
+	sockaddr_in m_helloFrom;
+
+	ReassemblyBuffer     m_window;
+	std::vector<char>    m_parity;
+	std::vector<int64_t> m_parityFirst;
+	std::vector<int>     m_parityRow;
+	std::vector<size_t>  m_parityLast;    // size of the last block of the group
+	std::vector<int>     m_parityCount;
+	std::vector<char>    m_parityRest;    // scratch, one block per lost one
+	std::vector<int64_t> m_groupOf;
+	int                  m_recovered[REASSEMBLY_SLOTS];
+	int                  m_recoveredCount;
+	MessageData          m_recoveredAck;
+};
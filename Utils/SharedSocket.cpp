@@ -0,0 +1,260 @@
+#include "SharedSocket.h"
+#include "Transfer.h"
+
+// Datagrams an inbox holds before the dispatch thread drops new ones.
+#define SHARED_INBOX_SLOTS 256
+
+// Milliseconds the dispatch thread waits for a datagram before it looks
+// whether the socket is closing.
+#define SHARED_POLL_INTERVAL 100
+
+struct SharedSocket::Inbox
+{
+	Inbox()
+		: datagrams(SHARED_INBOX_SLOTS, sizeof(sockaddr_in) + sizeof(MessageData))
+	{}
+
+	// sender address followed by the datagram
+	SpscQueue datagrams;
+
+	std::mutex                          mutex;
+	std::condition_variable             ready;
+	std::deque<std::unique_ptr<Socket>> connections;
+};
+
+class SharedSocket::WorkerTransport : public Socket::Transport
+{
+public:
+	WorkerTransport(SharedSocket& shared, Inbox& inbox)
+		: m_shared(shared)
+		, m_inbox(inbox)
+	{}
+
+	// the shared socket is opened, bound and closed by its owner
+	void Open(bool noBlock) override
+	{}
+
+	void Close() override
+	{}
+
+	bool IsOpen() const override
+	{
+		return !m_shared.m_closed;
+	}
+
+	Socket::PollResult Poll(int timeoutMs) override
+	{
+		if (m_shared.m_socket.Type() == Socket::Tcp)
+		{
+			std::unique_lock<std::mutex> lock(m_inbox.mutex);
+			auto ready = [this]() { return !m_inbox.connections.empty() || m_shared.m_closed; };
+
+			if (timeoutMs < 0)
+				m_inbox.ready.wait(lock, ready);
+			else if (!m_inbox.ready.wait_for(lock, std::chrono::milliseconds(timeoutMs), ready))
+				return Socket::PollTimeout;
+
+			return m_inbox.connections.empty() ? Socket::PollClosed : Socket::PollReadable;
+		}
+
+		if (!WaitUntil([this]() { return !m_inbox.datagrams.Empty() || m_shared.m_closed; }, timeoutMs))
+		{
+			return Socket::PollTimeout;
+		}
+
+		return m_inbox.datagrams.Empty() ? Socket::PollClosed : Socket::PollReadable;
+	}
+
+	void Listen(int backlog) override
+	{}
+
+	void Connect(const char* address, short port) override
+	{
+		throw std::runtime_error("Error: unable to connect");
+	}
+
+	bool Accept(std::unique_ptr<Socket::Transport>* accepted) override
+	{
+		std::unique_lock<std::mutex> lock(m_inbox.mutex);
+		m_inbox.ready.wait(lock, [this]() { return !m_inbox.connections.empty() || m_shared.m_closed; });
+
+		if (m_inbox.connections.empty())
+		{
+			return false;
+		}
+
+		*accepted = m_inbox.connections.front()->Release();
+		m_inbox.connections.pop_front();
+
+		return true;
+	}
+
+	void Send(const char* buffer, size_t count) override
+	{
+		throw std::runtime_error("Error: unable to send");
+	}
+
+	void Read(char* buffer, size_t count) override
+	{
+		throw std::runtime_error("Error: unable to read");
+	}
+
+	size_t TrySend(const char* buffer, size_t count) override
+	{
+		throw std::runtime_error("Error: unable to send");
+	}
+
+	size_t TryRead(char* buffer, size_t count) override
+	{
+		throw std::runtime_error("Error: unable to read");
+	}
+
+	// datagrams go out through the shared socket
+	bool CanSend() override
+	{
+		return true;
+	}
+
+	void SendTo(const char* header, int headerLength, const char* payload, int payloadLength, const sockaddr_in* to) override
+	{
+		m_shared.m_socket.SendTo(header, headerLength, payload, payloadLength, to);
+	}
+
+	int ReadFrom(char* buffer, int len, sockaddr_in* from) override
+	{
+		SpscQueue& queue = m_inbox.datagrams;
+		WaitUntil([&]() { return !queue.Empty() || m_shared.m_closed; }, -1);
+
+		size_t length = 0;
+		const char* record = queue.Front(&length, nullptr);
+		if (record == nullptr)
+		{
+			throw std::runtime_error("Error: unable to read");
+		}
+
+		memcpy(from, record, sizeof(sockaddr_in));
+
+		const size_t received = std::min(length - sizeof(sockaddr_in), size_t(len));
+		memcpy(buffer, record + sizeof(sockaddr_in), received);
+		queue.Pop();
+
+		return int(received);
+	}
+
+	void Bind(const char* address, short port) override
+	{}
+
+	void SetReusePort() override
+	{}
+
+	SOCKET Handle() const override
+	{
+		return INVALID_SOCKET;
+	}
+
+private:
+	SharedSocket& m_shared;
+	Inbox&        m_inbox;
+};
+
+SharedSocket::SharedSocket(Socket::SocketType type, const char* address, short port, size_t workers)
+	: m_address(address)
+	, m_port(port)
+	, m_socket(type, address)
+	, m_closed(false)
+{
+	for (size_t i = 0; i < workers; ++i)
+	{
+		m_inboxes.push_back(std::unique_ptr<Inbox>(new Inbox()));
+	}
+}
+
+SharedSocket::~SharedSocket()
+{
+	m_closed = true;
+
+	// a blocked accept only returns once its socket is closed
+	if (m_socket.Type() == Socket::Tcp)
+	{
+		m_socket.Close();
+	}
+
+	if (m_thread.joinable())
+	{
+		m_thread.join();
+	}
+	m_socket.Close();
+
+	for (size_t i = 0; i < m_inboxes.size(); ++i)
+	{
+		std::lock_guard<std::mutex> lock(m_inboxes[i]->mutex);
+		m_inboxes[i]->ready.notify_all();
+	}
+}
+
+void SharedSocket::Init()
+{
+	m_socket.Init();
+	m_socket.Bind(m_address.c_str(), m_port);
+
+	if (m_socket.Type() == Socket::Tcp)
+	{
+		m_socket.Listen(int(5 * m_inboxes.size()));
+		m_thread = std::thread(&SharedSocket::DispatchConnections, this);
+	}
+	else
+	{
+		m_thread = std::thread(&SharedSocket::DispatchDatagrams, this);
+	}
+}
+
+std::unique_ptr<Socket::Transport> SharedSocket::MakeTransport(size_t worker)
+{
+	return std::unique_ptr<Socket::Transport>(new WorkerTransport(*this, *m_inboxes.at(worker)));
+}
+
+void SharedSocket::DispatchDatagrams()
+{
+	std::vector<char> buffer(sizeof(MessageData));
+	sockaddr_in from;
+
+	while (!m_closed)
+	{
+		try
+		{
+			if (m_socket.Poll(SHARED_POLL_INTERVAL) != Socket::PollReadable)
+				continue;
+
+			const int received = m_socket.ReadFrom(buffer.data(), int(buffer.size()), &from);
+			if (received <= 0)
+				continue;
+
+			// a full inbox drops the datagram, the client retransmits it
+			Inbox& inbox = *m_inboxes[Socket::PeerKey(from) % m_inboxes.size()];
+			inbox.datagrams.TryPush((const char*)&from, sizeof(from), buffer.data(), size_t(received), 0);
+		}
+		catch (const std::runtime_error& error)
+		{
+			std::cout << error.what() << std::endl;
+		}
+	}
+}
+
+void SharedSocket::DispatchConnections()
+{
+	std::unique_ptr<Socket> client;
+	size_t next = 0;
+
+	while (!m_closed)
+	{
+		// a connection reset before it was accepted is not the end
+		if (!m_socket.Accept(&client))
+			continue;
+
+		Inbox& inbox = *m_inboxes[next++ % m_inboxes.size()];
+
+		std::lock_guard<std::mutex> lock(inbox.mutex);
+		inbox.connections.push_back(std::move(client));
+		inbox.ready.notify_one();
+	}
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "Socket.h"
+#include "SpscQueue.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+// One system socket served by several workers, for systems without
+// SO_REUSEPORT. A dispatch thread owns the socket: a datagram goes to the
+// worker of its sender through that worker's SpscQueue, so a client always
+// meets the same session, and a full queue drops the datagram like a full
+// socket buffer would. Accepted connections are handed out in turn. Each
+// worker runs on a transport that reads its own queue and sends through
+// the shared socket.
+class SharedSocket
+{
+public:
+	SharedSocket(Socket::SocketType type, const char* address, short port, size_t workers);
+
+	~SharedSocket();
+
+	// Binds the socket and starts dispatching.
+	void Init();
+
+	// The transport of one worker, once per index before Init.
+	std::unique_ptr<Socket::Transport> MakeTransport(size_t worker);
+
+	class WorkerTransport;
+
+	struct Inbox;
+
+private:
+	void DispatchDatagrams();
+
+	void DispatchConnections();
+
+	SharedSocket(const SharedSocket&);
+
+	SharedSocket& operator = (const SharedSocket&);
+
+private:
+	std::string                         m_address;
+	short                               m_port;
+	Socket                              m_socket;
+	std::vector<std::unique_ptr<Inbox>> m_inboxes;
+	std::atomic<bool>                   m_closed;
+	std::thread                         m_thread;
+};
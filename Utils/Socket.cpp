@@ -1,4 +1,12 @@
 #include "Socket.h"
+#include "Loopback.h"
+
+#ifndef _WIN32
+#include <cerrno>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/uio.h>
+#endif
 
 #ifdef _WINSOCK2API_
 
@@ -17,105 +25,601 @@ void FreeSockets()
 
 #endif
 
-Socket::Socket()
-	: m_type(SocketType::Unknown)
-	, m_sock(INVALID_SOCKET)
-{}
+namespace
+{
+#ifdef _WIN32
+	typedef WSAPOLLFD PollFd;
+#else
+	typedef pollfd PollFd;
+#endif
+
+	// The last call on a nonblocking socket found it busy, or a connect
+	// is still under way.
+	bool WouldBlock()
+	{
+#ifdef _WIN32
+		return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+		return errno == EWOULDBLOCK || errno == EAGAIN || errno == EINPROGRESS;
+#endif
+	}
+
+	// Winsock, or BSD sockets through the same names.
+	class SystemTransport : public Socket::Transport
+	{
+	public:
+		explicit SystemTransport(Socket::SocketType type)
+			: m_type(type)
+			, m_sock(INVALID_SOCKET)
+			, m_listening(false)
+			, m_noBlock(false)
+		{}
+
+		SystemTransport(Socket::SocketType type, SOCKET sock, const sockaddr_in& sin)
+			: m_type(type)
+			, m_sin(sin)
+			, m_sock(sock)
+			, m_listening(false)
+			, m_noBlock(false)
+		{}
+
+		~SystemTransport()
+		{
+			Close();
+		}
+
+		void Open(bool noBlock) override
+		{
+			const int sockType = m_type == Socket::Tcp ? SOCK_STREAM : SOCK_DGRAM;
+			m_sock = socket(PF_INET, sockType, (int)m_type);
+
+			if (m_sock == INVALID_SOCKET)
+			{
+				throw std::runtime_error("Error: socket is invalid");
+			}
+			if (noBlock)
+			{
+				unsigned long mode = 1;  // 1 to enable non-blocking socket
+				ioctlsocket(m_sock, FIONBIO, &mode);
+			}
+			m_noBlock = noBlock;
+		}
+
+		void Close() override
+		{
+			if (m_sock != INVALID_SOCKET)
+			{
+				closesocket(m_sock);
+				m_sock = INVALID_SOCKET;
+			}
+		}
+
+		bool IsOpen() const override
+		{
+			return m_sock != INVALID_SOCKET;
+		}
+
+		Socket::PollResult Poll(int timeoutMs) override
+		{
+			fd_set readSet;
+			FD_ZERO(&readSet);
+			FD_SET(m_sock, &readSet);
+
+			timeval timeout;
+			timeout.tv_sec = timeoutMs / 1000;
+			timeout.tv_usec = (timeoutMs % 1000) * 1000;
+
+			int retVal = select(int(m_sock + 1), &readSet, nullptr, nullptr, &timeout);
+			if (retVal == SOCKET_ERROR)
+			{
+				throw std::runtime_error("Error: unable to poll");
+			}
+			if (retVal == 0)
+			{
+				return Socket::PollTimeout;
+			}
+			if (m_type == Socket::Udp || m_listening)
+			{
+				return Socket::PollReadable;
+			}
+
+			char next = 0;
+			retVal = recv(m_sock, &next, 1, MSG_PEEK);
+
+			return retVal > 0 ? Socket::PollReadable : Socket::PollClosed;
+		}
+
+		void Bind(const char* address, short port) override
+		{
+			sockaddr_in addr;
+			Socket::FillAddr(&addr, address, port);
+
+			int retVal = bind(m_sock, (LPSOCKADDR)&addr, sizeof(addr));
+			if (retVal == SOCKET_ERROR)
+			{
+				std::string lastError = std::to_string(GetLastError());
+				throw std::runtime_error(("Error: " + lastError).c_str());
+			}
+		}
+
+		void SetReusePort() override
+		{
+#ifdef SO_REUSEPORT
+			int enable = 1;
+			int retVal = setsockopt(m_sock, SOL_SOCKET, SO_REUSEPORT, (const char*)&enable, sizeof(enable));
+			if (retVal == SOCKET_ERROR)
+			{
+				std::string lastError = std::to_string(GetLastError());
+				throw std::runtime_error(("Error: " + lastError).c_str());
+			}
+#else
+			throw std::runtime_error("Error: SO_REUSEPORT not supported");
+#endif
+		}
+
+		void Listen(int backlog) override
+		{
+			if (m_type == Socket::Udp)
+				return;
+
+			int retVal = listen(m_sock, backlog);
+
+			if (retVal == SOCKET_ERROR)
+			{
+				std::string lastError = std::to_string(GetLastError());
+				throw std::runtime_error(("Error: " + lastError).c_str());
+			}
+			m_listening = true;
+		}
+
+		void Connect(const char* address, short port) override
+		{
+			sockaddr_in addr;
+			Socket::FillAddr(&addr, address, port);
+
+			int retVal = connect(m_sock, (sockaddr*)&addr, sizeof(addr));
+
+			if (retVal == SOCKET_ERROR && !(m_noBlock && WouldBlock()))
+			{
+				throw std::runtime_error("Error: unable to connect");
+			}
+
+			SetNoDelay();
+		}
+
+		bool Accept(std::unique_ptr<Socket::Transport>* accepted) override
+		{
+			if (m_type == Socket::Udp)
+			{
+				return false;
+			}
+
+			sockaddr_in sin;
+			int nameLen = sizeof(sin);
+			SOCKET sock = accept(m_sock, (sockaddr*)&sin, &nameLen);
+
+			if (sock == INVALID_SOCKET)
+			{
+				return false;
+			}
+			SystemTransport* transport = new SystemTransport(m_type, sock, sin);
+			accepted->reset(transport);
+			transport->SetNoDelay();
+
+			return true;
+		}
+
+		void Send(const char* buffer, size_t count) override
+		{
+			int retVal = send(m_sock, buffer, count, 0);
+
+			if (retVal == SOCKET_ERROR)
+			{
+				throw std::runtime_error("Error: unable to send");
+			}
+		}
+
+		// recv may return part of a frame, so it is called until count bytes
+		// arrived. A peer that hangs up mid-frame is an error, not a short read.
+		void Read(char* buffer, size_t count) override
+		{
+			while (count > 0)
+			{
+				int retVal = recv(m_sock, buffer, count, 0);
+
+				if (retVal == SOCKET_ERROR)
+				{
+					throw std::runtime_error("Error: unable to read");
+				}
+				if (retVal == 0)
+				{
+					throw std::runtime_error("Error: connection closed");
+				}
+
+				buffer += retVal;
+				count -= retVal;
+			}
+		}
+
+		size_t TrySend(const char* buffer, size_t count) override
+		{
+			int retVal = send(m_sock, buffer, count, 0);
+
+			if (retVal == SOCKET_ERROR)
+			{
+				if (WouldBlock())
+					return 0;
+
+				throw std::runtime_error("Error: unable to send");
+			}
+
+			return size_t(retVal);
+		}
+
+		size_t TryRead(char* buffer, size_t count) override
+		{
+			int retVal = recv(m_sock, buffer, count, 0);
+
+			if (retVal == SOCKET_ERROR)
+			{
+				if (WouldBlock())
+					return 0;
+
+				throw std::runtime_error("Error: unable to read");
+			}
+			if (retVal == 0)
+			{
+				throw std::runtime_error("Error: connection closed");
+			}
+
+			return size_t(retVal);
+		}
+
+		bool CanSend() override
+		{
+			fd_set writeSet;
+			FD_ZERO(&writeSet);
+			FD_SET(m_sock, &writeSet);
+
+			timeval timeout = { 0, 0 };
+
+			return select(int(m_sock + 1), nullptr, &writeSet, nullptr, &timeout) > 0;
+		}
+
+		void SendTo(const char* header, int headerLength, const char* payload, int payloadLength, const sockaddr_in* to) override
+		{
+			int retVal = SOCKET_ERROR;
+
+			if (payloadLength == 0)
+			{
+				retVal = sendto(m_sock, header, headerLength, 0, (LPSOCKADDR)to, sizeof(sockaddr_in));
+			}
+			else
+			{
+#ifdef _WIN32
+				WSABUF buffers[2];
+				buffers[0].buf = const_cast<char*>(header);
+				buffers[0].len = headerLength;
+				buffers[1].buf = const_cast<char*>(payload);
+				buffers[1].len = payloadLength;
+
+				DWORD sent = 0;
+				retVal = WSASendTo(m_sock, buffers, 2, &sent, 0,
+					(const sockaddr*)to, sizeof(sockaddr_in), NULL, NULL);
+#else
+				iovec buffers[2];
+				buffers[0].iov_base = const_cast<char*>(header);
+				buffers[0].iov_len = headerLength;
+				buffers[1].iov_base = const_cast<char*>(payload);
+				buffers[1].iov_len = payloadLength;
+
+				msghdr message;
+				memset(&message, 0, sizeof(message));
+				message.msg_name = const_cast<sockaddr_in*>(to);
+				message.msg_namelen = sizeof(sockaddr_in);
+				message.msg_iov = buffers;
+				message.msg_iovlen = 2;
+
+				retVal = sendmsg(m_sock, &message, 0);
+#endif
+			}
+
+			// a nonblocking socket with a full buffer drops the datagram
+			if (retVal == SOCKET_ERROR && !(m_noBlock && WouldBlock()))
+			{
+				throw std::runtime_error("Error: unable to send");
+			}
+		}
+
+		int ReadFrom(char* buffer, int len, sockaddr_in* from) override
+		{
+			int size = sizeof(sockaddr_in);
+			int retVal = recvfrom(m_sock, buffer, len, 0, (LPSOCKADDR)from, &size);
+
+			if (retVal == SOCKET_ERROR)
+			{
+				int lastError = WSAGetLastError();
+				std::string msg = "Error: unable to read " + std::to_string(lastError);
+				throw std::runtime_error(msg.c_str());
+			}
+
+			return retVal;
+		}
+
+		SOCKET Handle() const override
+		{
+			return m_sock;
+		}
+
+	private:
+		// Frames go out in batches before their answers come back, Nagle
+		// would hold the tail of a batch until the peer's delayed ACK.
+		void SetNoDelay()
+		{
+			int enable = 1;
+			setsockopt(m_sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&enable, sizeof(enable));
+		}
+
+	private:
+		Socket::SocketType m_type;
+		sockaddr_in        m_sin;
+		SOCKET             m_sock;
+		bool               m_listening;
+		bool               m_noBlock;
+	};
+
+	std::unique_ptr<Socket::Transport> MakeTransport(Socket::SocketType type, const char* address)
+	{
+		if (Socket::IsLoopbackAddress(address))
+		{
+			return std::unique_ptr<Socket::Transport>(new LoopbackTransport(type));
+		}
+
+		return std::unique_ptr<Socket::Transport>(new SystemTransport(type));
+	}
+}
 
-Socket::Socket(SocketType type)
+Socket::Socket(SocketType type, const char* address)
 	: m_type(type)
-	, m_sock(INVALID_SOCKET)
+	, m_transport(MakeTransport(type, address))
 {}
 
+Socket::Socket(SocketType type, std::unique_ptr<Transport> transport)
+	: m_type(type)
+	, m_transport(std::move(transport))
+{}
 
 Socket::~Socket()
+{}
+
+bool Socket::IsLoopbackAddress(const char* address)
 {
-	if (m_sock != INVALID_SOCKET)
-		closesocket(m_sock);
+	return address != nullptr && strcmp(address, LOOPBACK_ADDRESS) == 0;
 }
 
 void Socket::FillAddr(sockaddr_in* addr, const char* ip, short port)
 {
-	memset(addr, 0, sizeof(addr));
+	memset(addr, 0, sizeof(*addr));
 	addr->sin_family = PF_INET;
 	addr->sin_port = htons(port);
-	addr->sin_addr.s_addr = inet_addr(ip);
+
+	// the loopback transport only looks at the port
+	if (!IsLoopbackAddress(ip))
+	{
+		addr->sin_addr.s_addr = inet_addr(ip);
+	}
 }
 
+uint64_t Socket::PeerKey(const sockaddr_in& addr)
+{
+	return (uint64_t(addr.sin_addr.s_addr) << 16) | addr.sin_port;
+}
 
 void Socket::Init(bool noBlock)
 {
-	const int sockType = m_type == Tcp ? SOCK_STREAM : SOCK_DGRAM;
-	m_sock = socket(PF_INET, sockType, (int)m_type);
+	m_transport->Open(noBlock);
+}
+
+void Socket::Close()
+{
+	m_transport->Close();
+}
 
-	if (m_sock == INVALID_SOCKET)
+bool Socket::IsOpen() const
+{
+	return m_transport->IsOpen();
+}
+
+void Socket::Swap(Socket& other)
+{
+	std::swap(m_type, other.m_type);
+	std::swap(m_transport, other.m_transport);
+}
+
+std::unique_ptr<Socket::Transport> Socket::Release()
+{
+	return std::move(m_transport);
+}
+
+Socket::PollResult Socket::Poll(int timeoutMs)
+{
+	return m_transport->Poll(timeoutMs);
+}
+
+int Socket::Select(const std::vector<Socket*>& sockets, int timeoutMs)
+{
+	fd_set readSet;
+	FD_ZERO(&readSet);
+	SOCKET highest = 0;
+	bool system = true;
+
+	for (size_t i = 0; i < sockets.size() && system; ++i)
 	{
-		throw std::runtime_error("Error: socket is invalid");
+		const SOCKET sock = sockets[i]->m_transport->Handle();
+		system = sock != INVALID_SOCKET;
+
+		if (system)
+		{
+			FD_SET(sock, &readSet);
+			highest = std::max(highest, sock);
+		}
 	}
-	if (noBlock)
+
+	if (!system)
 	{
-		unsigned long mode = 1;  // 1 to enable non-blocking socket
-		ioctlsocket(m_sock, FIONBIO, &mode);
+		// the loopback and shared transports are asked in turn
+		int ready = -1;
+		WaitUntil([&]()
+		{
+			for (size_t i = 0; i < sockets.size() && ready < 0; ++i)
+			{
+				if (sockets[i]->Poll(0) != PollTimeout)
+					ready = int(i);
+			}
+			return ready >= 0;
+		}, timeoutMs);
+
+		return ready;
 	}
-}
 
-void Socket::Bind(const char* address, short port)
-{
-	sockaddr_in addr;
-	FillAddr(&addr, address, port);
+	timeval timeout;
+	timeout.tv_sec = timeoutMs / 1000;
+	timeout.tv_usec = (timeoutMs % 1000) * 1000;
 
-	int retVal = bind(m_sock, (LPSOCKADDR)&addr, sizeof(addr));
+	int retVal = select(int(highest + 1), &readSet, nullptr, nullptr, timeoutMs < 0 ? nullptr : &timeout);
 	if (retVal == SOCKET_ERROR)
 	{
-		std::string lastError = std::to_string(GetLastError());
-		throw std::runtime_error(("Error: " + lastError).c_str());
+		throw std::runtime_error("Error: unable to poll");
 	}
+
+	for (size_t i = 0; i < sockets.size(); ++i)
+	{
+		if (FD_ISSET(sockets[i]->m_transport->Handle(), &readSet))
+			return int(i);
+	}
+
+	return -1;
 }
 
-void Socket::Listen(int backlog)
+int Socket::Wait(std::vector<Watch>& watches, int timeoutMs)
 {
-	if (m_type == Udp)
-		return;
+	bool system = true;
+	for (size_t i = 0; i < watches.size() && system; ++i)
+	{
+		system = watches[i].socket->m_transport->Handle() != INVALID_SOCKET;
+	}
 
-	int retVal = listen(m_sock, backlog);
+	int ready = 0;
 
-	if (retVal == SOCKET_ERROR)
+	if (!system)
 	{
-		std::string lastError = std::to_string(GetLastError());
-		throw std::runtime_error(("Error: " + lastError).c_str());
+		// the loopback and shared transports are asked in turn
+		WaitUntil([&]()
+		{
+			ready = 0;
+			for (size_t i = 0; i < watches.size(); ++i)
+			{
+				Watch& watch = watches[i];
+				watch.ready = 0;
+
+				if ((watch.events & Readable) && watch.socket->Poll(0) != PollTimeout)
+					watch.ready |= Readable;
+				if ((watch.events & Writable) && watch.socket->m_transport->CanSend())
+					watch.ready |= Writable;
+
+				if (watch.ready != 0)
+					++ready;
+			}
+			return ready > 0;
+		}, timeoutMs);
+
+		return ready;
 	}
-}
 
-void Socket::Connect(const char* address, short port)
-{
-	sockaddr_in addr;
-	FillAddr(&addr, address, port);
+	// kept between calls, a loop waits on the same sockets again and again
+	static thread_local std::vector<PollFd> fds;
+	fds.resize(watches.size());
 
-	int retVal = connect(m_sock, (sockaddr*)&addr, sizeof(addr));
+	for (size_t i = 0; i < watches.size(); ++i)
+	{
+		fds[i].fd = watches[i].socket->m_transport->Handle();
+		fds[i].events = 0;
+		fds[i].revents = 0;
+
+		if (watches[i].events & Readable)
+			fds[i].events |= POLLIN;
+		if (watches[i].events & Writable)
+			fds[i].events |= POLLOUT;
+	}
 
+#ifdef _WIN32
+	int retVal = WSAPoll(fds.data(), ULONG(fds.size()), timeoutMs);
+#else
+	int retVal = poll(fds.data(), fds.size(), timeoutMs);
+#endif
 	if (retVal == SOCKET_ERROR)
 	{
-		throw std::runtime_error("Error: unable to connect");
+		throw std::runtime_error("Error: unable to poll");
 	}
-}
 
-bool Socket::Accept(std::unique_ptr<Socket>* sock)
-{
-	if (m_type == Udp)
+	for (size_t i = 0; i < watches.size(); ++i)
 	{
-		return false;
+		const int found = fds[i].revents;
+		Watch& watch = watches[i];
+
+		watch.ready = 0;
+		if (found & (POLLERR | POLLHUP | POLLNVAL))
+			watch.ready = watch.events;
+		if (found & POLLIN)
+			watch.ready |= Readable;
+		if (found & POLLOUT)
+			watch.ready |= Writable;
+
+		if (watch.ready != 0)
+			++ready;
 	}
 
-	Socket* accepted(new Socket);
-	int nameLen = sizeof(accepted->m_sin);
-	accepted->m_sock = accept(m_sock, (sockaddr*)&accepted->m_sin, &nameLen);
+	return ready;
+}
+
+void Socket::Bind(const char* address, short port)
+{
+	m_transport->Bind(address, port);
+}
+
+void Socket::SetReusePort()
+{
+	m_transport->SetReusePort();
+}
+
+bool Socket::SupportsReusePort()
+{
+#ifdef SO_REUSEPORT
+	return true;
+#else
+	return false;
+#endif
+}
 
-	if (accepted->m_sock == INVALID_SOCKET)
+void Socket::Listen(int backlog)
+{
+	m_transport->Listen(backlog);
+}
+
+void Socket::Connect(const char* address, short port)
+{
+	m_transport->Connect(address, port);
+}
+
+bool Socket::Accept(std::unique_ptr<Socket>* sock)
+{
+	std::unique_ptr<Transport> accepted;
+
+	if (!m_transport->Accept(&accepted))
 	{
-		delete accepted;
 		return false;
 	}
-	sock->reset(accepted);
+	sock->reset(new Socket(m_type, std::move(accepted)));
 
 	return true;
 }
@@ -125,12 +629,7 @@ void Socket::Send(const char* buffer, size_t count)
 	assert(buffer != NULL);
 	assert(count > 0);
 
-	int retVal = send(m_sock, buffer, count, 0);
-
-	if (retVal == SOCKET_ERROR)
-	{
-		throw std::runtime_error("Error: unable to send");
-	}
+	m_transport->Send(buffer, count);
 }
 
 void Socket::Read(char* buffer, size_t count)
@@ -138,27 +637,37 @@ void Socket::Read(char* buffer, size_t count)
 	assert(buffer != NULL);
 	assert(count > 0);
 
-	int retVal = recv(m_sock, buffer, count, 0);
+	m_transport->Read(buffer, count);
+}
 
-	if (retVal == SOCKET_ERROR)
-	{
-		throw std::runtime_error("Error: unable to send");
-	}
+size_t Socket::TrySend(const char* buffer, size_t count)
+{
+	assert(buffer != NULL);
+
+	return m_transport->TrySend(buffer, count);
 }
 
-void Socket::SendTo(const char* buffer, int len, const sockaddr_in* to = nullptr)
+size_t Socket::TryRead(char* buffer, size_t count)
+{
+	assert(buffer != NULL);
+
+	return m_transport->TryRead(buffer, count);
+}
+
+void Socket::SendTo(const char* buffer, int len, const sockaddr_in* to)
 {
 	assert(buffer != NULL);
 	assert(len > 0);
 
-	
-	int retVal = sendto(m_sock, buffer, len, 0, (LPSOCKADDR)to, sizeof(sockaddr_in));
+	m_transport->SendTo(buffer, len, nullptr, 0, to);
+}
 
-	if (retVal == SOCKET_ERROR)
-	{
-		int code = WSAGetLastError();
-		throw std::runtime_error("Error: unable to send");
-	}
+void Socket::SendTo(const char* header, int headerLength, const char* payload, int payloadLength, const sockaddr_in* to)
+{
+	assert(header != NULL);
+	assert(headerLength > 0);
+
+	m_transport->SendTo(header, headerLength, payload, payloadLength, to);
 }
 
 int Socket::ReadFrom(char* buffer, int len, sockaddr_in* from)
@@ -166,15 +675,5 @@ int Socket::ReadFrom(char* buffer, int len, sockaddr_in* from)
 	assert(buffer != NULL);
 	assert(len > 0);
 
-	int size = sizeof(sockaddr_in);
-	int retVal = recvfrom(m_sock, buffer, len, 0, (LPSOCKADDR)from, &size);
-
-	if (retVal == SOCKET_ERROR)
-	{
-		int lastError = WSAGetLastError();
-		std::string msg = "Error: unable to read " + std::to_string(lastError);
-		throw std::runtime_error(msg.c_str());
-	}
-
-	return retVal;
-}
\ No newline at end of file
+	return m_transport->ReadFrom(buffer, len, from);
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Common.h"
+#include <cstdint>
 
 #ifdef _WIN32
 
@@ -12,6 +13,9 @@ void FreeSockets();
 
 #endif
 
+// Address that selects the in-process loopback transport.
+#define LOOPBACK_ADDRESS "loopback"
+
 class Socket
 {
 public:
@@ -22,39 +26,156 @@ public:
 		Udp = IPPROTO_UDP
 	};
 
-	Socket(SocketType type);
+	enum PollResult
+	{
+		PollTimeout,
+		PollReadable,
+		PollClosed
+	};
+
+	enum Readiness
+	{
+		Readable = 1 << 0,
+		Writable = 1 << 1
+	};
+
+	// A socket Wait watches, events and ready are Readiness flags.
+	struct Watch
+	{
+		Socket* socket;
+		int     events;
+		int     ready;
+	};
+
+	// What a socket runs on, the system's sockets or the in-process loopback.
+	class Transport
+	{
+	public:
+		virtual ~Transport() {}
+
+		virtual void Open(bool noBlock) = 0;
+
+		virtual void Close() = 0;
+
+		virtual bool IsOpen() const = 0;
+
+		virtual PollResult Poll(int timeoutMs) = 0;
+
+		virtual void Listen(int backlog) = 0;
+
+		virtual void Connect(const char* address, short port) = 0;
+
+		virtual bool Accept(std::unique_ptr<Transport>* accepted) = 0;
+
+		virtual void Send(const char* buffer, size_t count) = 0;
+
+		virtual void Read(char* buffer, size_t count) = 0;
+
+		virtual size_t TrySend(const char* buffer, size_t count) = 0;
+
+		virtual size_t TryRead(char* buffer, size_t count) = 0;
+
+		// Wait asks this of transports without a system socket.
+		virtual bool CanSend() = 0;
+
+		virtual void SendTo(const char* header, int headerLength, const char* payload, int payloadLength, const sockaddr_in* to) = 0;
+
+		virtual int ReadFrom(char* buffer, int len, sockaddr_in* from) = 0;
+
+		virtual void Bind(const char* address, short port) = 0;
+
+		virtual void SetReusePort() = 0;
+
+		// The system socket underneath, INVALID_SOCKET when there is none.
+		virtual SOCKET Handle() const = 0;
+	};
+
+	// LOOPBACK_ADDRESS as address gives a loopback socket, anything else a system one.
+	Socket(SocketType type, const char* address = nullptr);
+
+	// Runs on a transport made elsewhere, see SharedSocket.
+	Socket(SocketType type, std::unique_ptr<Transport> transport);
 
 	~Socket();
 
 	void Init(bool noBlock = false);
 
+	void Close();
+
+	bool IsOpen() const;
+
+	SocketType Type() const { return m_type; }
+
+	// Exchanges the underlying sockets, used to move connections in and
+	// out of a pool.
+	void Swap(Socket& other);
+
+	// Hands the underlying socket over, this one is left without any.
+	std::unique_ptr<Transport> Release();
+
+	// Waits up to timeoutMs for data, PollClosed when the peer has shut
+	// the connection down. A listener is readable with a connection waiting.
+	PollResult Poll(int timeoutMs);
+
+	// Waits up to timeoutMs, or without end when negative, until one of
+	// sockets has data, a waiting connection or a peer that hung up.
+	// Returns its index, -1 on timeout.
+	static int Select(const std::vector<Socket*>& sockets, int timeoutMs);
+
+	// Like Select for any number of sockets and for writing too: waits until
+	// one of them is ready and sets ready on every watch. Errors and a peer
+	// that hung up count as both, so the next call reports them. Returns the
+	// number of ready sockets, 0 on timeout.
+	static int Wait(std::vector<Watch>& watches, int timeoutMs);
+
 	void Listen(int backlog);
 
+	// A nonblocking socket may return before the connection is up, it turns
+	// writable once it is.
 	void Connect(const char* address, short port);
 
 	bool Accept(std::unique_ptr<Socket>* sock);
 
 	void Send(const char* buffer, size_t count);
 
+	// Reads exactly count bytes, throws when the connection is closed.
 	void Read(char* buffer, size_t count);
 
+	// Never waits: the bytes the connection took, 0 when its buffers are full.
+	size_t TrySend(const char* buffer, size_t count);
+
+	// Never waits: the bytes that were there, 0 when none. Throws when the
+	// connection is closed.
+	size_t TryRead(char* buffer, size_t count);
+
 	void SendTo(const char* buffer, int len, const sockaddr_in* to);
 
+	// One datagram gathered from a header and a payload kept elsewhere.
+	void SendTo(const char* header, int headerLength, const char* payload, int payloadLength, const sockaddr_in* to);
+
 	int ReadFrom(char* buffer, int len, sockaddr_in* from);
 
 	void Bind(const char* address, short port);
 
+	// Lets several sockets bind the same address, the kernel spreads
+	// connections and datagrams between them. Call before Bind.
+	void SetReusePort();
+
+	static bool SupportsReusePort();
+
+	static bool IsLoopbackAddress(const char* address);
+
 	static void FillAddr(sockaddr_in* addr, const char* ip, short port);
 
-private:
-	Socket();
+	// One number per address and port, to keep state per peer.
+	static uint64_t PeerKey(const sockaddr_in& addr);
 
+private:
 	Socket(const Socket&);
 
 	Socket& operator = (const Socket&);
 
 private:
-	SocketType  m_type;
-	sockaddr_in m_sin;
-	SOCKET      m_sock;
+	SocketType                 m_type;
+	std::unique_ptr<Transport> m_transport;
 };
\ No newline at end of file
@@ -0,0 +1,190 @@
+#include "Sparse.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SPARSE_AVX2 1
+#elif defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define SPARSE_SSE2 1
+#endif
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+bool IsZeroBlock(const char* data, size_t size)
+{
+	size_t i = 0;
+
+	// OR a cache line together, one branch per 64 bytes
+#if SPARSE_AVX2
+	for (; i + 64 <= size; i += 64)
+	{
+		const __m256i a = _mm256_loadu_si256((const __m256i*)(data + i));
+		const __m256i b = _mm256_loadu_si256((const __m256i*)(data + i + 32));
+		const __m256i any = _mm256_or_si256(a, b);
+
+		if (!_mm256_testz_si256(any, any))
+			return false;
+	}
+#elif SPARSE_SSE2
+	for (; i + 64 <= size; i += 64)
+	{
+		const __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i*)(data + i)),
+			_mm_loadu_si128((const __m128i*)(data + i + 16)));
+		const __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i*)(data + i + 32)),
+			_mm_loadu_si128((const __m128i*)(data + i + 48)));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(a, b), _mm_setzero_si128())) != 0xffff)
+			return false;
+	}
+#endif
+
+	for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+	{
+		uint64_t word;
+		memcpy(&word, data + i, sizeof(word));
+		if (word != 0)
+			return false;
+	}
+
+	for (; i < size; ++i)
+	{
+		if (data[i] != 0)
+			return false;
+	}
+
+	return true;
+}
+
+void WriteHole(uint64_t offset, uint64_t length, MessageData* data)
+{
+	const uint64_t fields[] = { offset, length };
+
+	data->protocol = Protocol::Hole;
+	data->dataIndex = static_cast<int>(offset / MAX_LENGTH);
+	data->dataSize = sizeof(fields);
+	memcpy(data->data, fields, sizeof(fields));
+}
+
+void ReadHole(const MessageData& data, uint64_t* offset, uint64_t* length)
+{
+	uint64_t fields[2];
+
+	if (data.dataSize != sizeof(fields))
+	{
+		throw std::runtime_error("Error: [ReadHole] malformed hole");
+	}
+
+	memcpy(fields, data.data, sizeof(fields));
+	*offset = fields[0];
+	*length = fields[1];
+
+	if (*length == 0 || *offset + *length < *offset)
+	{
+		throw std::runtime_error("Error: [ReadHole] hole out of range");
+	}
+}
+
+SparseMap::SparseMap(FILE* file, uint64_t size)
+	: m_size(size)
+	, m_from(0)
+	, m_data(0)
+	, m_dataEnd(0)
+#ifdef _WIN32
+	, m_file(reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(file))))
+#else
+	, m_file(fileno(file))
+#endif
+{}
+
+uint64_t SparseMap::HoleLength(uint64_t offset, uint64_t blockLength)
+{
+	if (offset >= m_size)
+		return 0;
+
+	const uint64_t data = NextData(offset);
+	if (data >= m_size)
+		return m_size - offset;
+
+	return (data - offset) / blockLength * blockLength;
+}
+
+uint64_t SparseMap::NextData(uint64_t offset)
+{
+	if (offset >= m_from && offset < m_dataEnd)
+	{
+		return offset > m_data ? offset : m_data;
+	}
+
+	m_from = offset;
+
+#ifdef _WIN32
+	FILE_ALLOCATED_RANGE_BUFFER query;
+	query.FileOffset.QuadPart = static_cast<LONGLONG>(offset);
+	query.Length.QuadPart = static_cast<LONGLONG>(m_size - offset);
+
+	// only the first allocated range is needed, the rest are looked up later
+	FILE_ALLOCATED_RANGE_BUFFER range;
+	DWORD returned = 0;
+
+	if (!DeviceIoControl(m_file, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query),
+			&range, sizeof(range), &returned, NULL) && GetLastError() != ERROR_MORE_DATA)
+	{
+		m_from = 0;
+		m_data = 0;
+		m_dataEnd = m_size;
+	}
+	else if (returned < sizeof(range))
+	{
+		m_data = m_size;
+		m_dataEnd = m_size;
+	}
+	else
+	{
+		m_data = static_cast<uint64_t>(range.FileOffset.QuadPart);
+		m_dataEnd = m_data + static_cast<uint64_t>(range.Length.QuadPart);
+	}
+#elif defined(SEEK_DATA) && defined(SEEK_HOLE)
+	// the descriptor offset is shared with the stream, put it back after
+	const off_t position = lseek(m_file, 0, SEEK_CUR);
+	const off_t data = lseek(m_file, static_cast<off_t>(offset), SEEK_DATA);
+
+	if (data >= 0)
+	{
+		const off_t hole = lseek(m_file, data, SEEK_HOLE);
+
+		m_data = static_cast<uint64_t>(data);
+		m_dataEnd = hole >= data ? static_cast<uint64_t>(hole) : m_size;
+	}
+	else if (errno == ENXIO)
+	{
+		m_data = m_size;
+		m_dataEnd = m_size;
+	}
+	else
+	{
+		m_from = 0;
+		m_data = 0;
+		m_dataEnd = m_size;
+	}
+
+	lseek(m_file, position, SEEK_SET);
+#else
+	m_from = 0;
+	m_data = 0;
+	m_dataEnd = m_size;
+#endif
+
+	// a hole up to the end has no data extent to cache
+	if (m_data >= m_size)
+	{
+		m_dataEnd = m_size;
+		return m_size;
+	}
+
+	return offset > m_data ? offset : m_data;
+}
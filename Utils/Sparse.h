@@ -0,0 +1,56 @@
+#pragma once
+
+#include "Transfer.h"
+#include <cstdint>
+
+#ifdef _WIN32
+#include <WinSock2.h>
+#endif
+
+// Runs of zeros are not sent. The sender finds them in the holes the file
+// system reports and by checking the blocks it reads, and sends one Hole
+// frame per run instead. The receiver leaves the range unwritten, so it
+// becomes a hole on its side too.
+
+// True when all size bytes are zero.
+bool IsZeroBlock(const char* data, size_t size);
+
+// A Hole frame carries its byte range. dataIndex is the first block, which
+// is what UDP acknowledges.
+void WriteHole(uint64_t offset, uint64_t length, MessageData* data);
+
+// Throws on malformed frames.
+void ReadHole(const MessageData& data, uint64_t* offset, uint64_t* length);
+
+// Holes of an open file, looked up lazily while it is read front to back.
+// Uses SEEK_DATA/SEEK_HOLE, or FSCTL_QUERY_ALLOCATED_RANGES on Windows.
+// Where neither works, the whole file counts as data. The stream position
+// of the file is left alone.
+class SparseMap
+{
+public:
+	SparseMap(FILE* file, uint64_t size);
+
+	// Bytes from offset, in whole blocks, that lie in holes, or everything
+	// left when the file ends in one.
+	uint64_t HoleLength(uint64_t offset, uint64_t blockLength);
+
+private:
+	// First data byte at or after offset, the file size when there is none.
+	uint64_t NextData(uint64_t offset);
+
+	SparseMap(const SparseMap&);
+
+	SparseMap& operator = (const SparseMap&);
+
+private:
+	const uint64_t m_size;
+	uint64_t       m_from;      // the last lookup knows [m_from, m_dataEnd)
+	uint64_t       m_data;      // a hole up to here, data after it
+	uint64_t       m_dataEnd;
+#ifdef _WIN32
+	HANDLE         m_file;
+#else
+	int            m_file;
+#endif
+};
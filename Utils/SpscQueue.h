@@ -0,0 +1,161 @@
+#pragma once
+
+#include "Common.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+
+#define CACHE_LINE_LENGTH 64
+
+// Lock-free ring of byte records between exactly one producer thread and
+// one consumer thread. Every record takes one fixed-size slot, so a push
+// is a copy and one release store, with no allocation after construction.
+// Head and tail only grow and sit on their own cache lines, so the two
+// sides never write to the same line. Slots are sized for the largest
+// record, small records only ever touch the first page of theirs.
+class SpscQueue
+{
+public:
+	// slotCount is rounded up to a power of two.
+	SpscQueue(size_t slotCount, size_t slotLength)
+		: m_head(0)
+		, m_tail(0)
+		, m_mask(RoundUp(slotCount) - 1)
+		, m_slotLength(slotLength)
+		, m_slots(m_mask + 1)
+		, m_storage(new char[(m_mask + 1) * slotLength])
+	{}
+
+	// Producer side. The record is header followed by payload, false when
+	// the ring is full or the record does not fit a slot.
+	bool TryPush(const char* header, size_t headerLength, const char* payload, size_t payloadLength, uint32_t tag)
+	{
+		if (headerLength + payloadLength > m_slotLength)
+		{
+			return false;
+		}
+
+		const uint64_t tail = m_tail.load(std::memory_order_relaxed);
+		if (tail - m_head.load(std::memory_order_acquire) > m_mask)
+		{
+			return false;
+		}
+
+		const size_t index = static_cast<size_t>(tail & m_mask);
+		char* record = &m_storage[index * m_slotLength];
+
+		memcpy(record, header, headerLength);
+		if (payloadLength > 0)
+		{
+			memcpy(record + headerLength, payload, payloadLength);
+		}
+
+		m_slots[index].length = headerLength + payloadLength;
+		m_slots[index].tag = tag;
+
+		m_tail.store(tail + 1, std::memory_order_release);
+
+		return true;
+	}
+
+	// Consumer side. The oldest record, nullptr when the ring is empty. It
+	// stays valid until Pop.
+	const char* Front(size_t* length, uint32_t* tag) const
+	{
+		const uint64_t head = m_head.load(std::memory_order_relaxed);
+		if (head == m_tail.load(std::memory_order_acquire))
+		{
+			return nullptr;
+		}
+
+		const size_t index = static_cast<size_t>(head & m_mask);
+		*length = m_slots[index].length;
+		if (tag != nullptr)
+		{
+			*tag = m_slots[index].tag;
+		}
+
+		return &m_storage[index * m_slotLength];
+	}
+
+	void Pop()
+	{
+		m_head.store(m_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	bool Empty() const
+	{
+		return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+	}
+
+	// Producer side, true when the next push would fail for lack of a slot.
+	bool Full() const
+	{
+		return m_tail.load(std::memory_order_relaxed) - m_head.load(std::memory_order_acquire) > m_mask;
+	}
+
+	size_t SlotLength() const { return m_slotLength; }
+
+private:
+	struct Slot
+	{
+		size_t   length;
+		uint32_t tag;
+	};
+
+	static size_t RoundUp(size_t count)
+	{
+		size_t size = 1;
+		while (size < count)
+		{
+			size <<= 1;
+		}
+
+		return size;
+	}
+
+	SpscQueue(const SpscQueue&);
+
+	SpscQueue& operator = (const SpscQueue&);
+
+private:
+	std::atomic<uint64_t>   m_head;   // consumer
+	char                    m_headPad[CACHE_LINE_LENGTH - sizeof(std::atomic<uint64_t>)];
+	std::atomic<uint64_t>   m_tail;   // producer
+	char                    m_tailPad[CACHE_LINE_LENGTH - sizeof(std::atomic<uint64_t>)];
+	const uint64_t          m_mask;
+	const size_t            m_slotLength;
+	std::vector<Slot>       m_slots;
+	std::unique_ptr<char[]> m_storage;   // uninitialized, a page is resident once a record touched it
+};
+
+// Spins briefly, then yields, so a waiting thread picks data up within
+// microseconds even when both ends share a core. Only after a couple of
+// milliseconds without data does it fall back to short sleeps, so an
+// idle socket does not hold a core. A negative timeout waits until ready.
+template <typename Ready>
+bool WaitUntil(Ready ready, int timeoutMs)
+{
+	const auto start = std::chrono::steady_clock::now();
+
+	for (unsigned spins = 0; !ready(); ++spins)
+	{
+		if (spins < 64)
+			continue;
+
+		const auto waited = std::chrono::steady_clock::now() - start;
+		if (timeoutMs >= 0 && waited >= std::chrono::milliseconds(timeoutMs))
+		{
+			return false;
+		}
+
+		if (waited < std::chrono::milliseconds(2))
+			std::this_thread::yield();
+		else
+			std::this_thread::sleep_for(std::chrono::microseconds(50));
+	}
+
+	return true;
+}
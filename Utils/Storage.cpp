@@ -0,0 +1,469 @@
+#include "Storage.h"
+#include "Manifest.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define PART_SUFFIX ".part"
+
+namespace
+{
+	// FNV-1a, stable across runs and platforms so a name always lands in
+	// the same place.
+	uint64_t HashName(const std::string& name)
+	{
+		uint64_t hash = 14695981039346656037ULL;
+
+		for (size_t i = 0; i < name.size(); ++i)
+		{
+			hash ^= static_cast<unsigned char>(name[i]);
+			hash *= 1099511628211ULL;
+		}
+
+		return hash;
+	}
+
+	std::string ParentOf(const std::string& path)
+	{
+		const size_t slash = path.find_last_of("/\\");
+		return slash == std::string::npos ? "." : path.substr(0, slash);
+	}
+
+	void ReplaceFile(const std::string& from, const std::string& to)
+	{
+#ifdef _WIN32
+		const bool replaced = MoveFileExA(from.c_str(), to.c_str(),
+			MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+		const bool replaced = rename(from.c_str(), to.c_str()) == 0;
+#endif
+		if (!replaced)
+		{
+			throw std::runtime_error("Error: [ReplaceFile] failed rename " + to);
+		}
+	}
+
+	// Makes a rename durable, Windows gets that from MOVEFILE_WRITE_THROUGH.
+	void SyncDirectory(const std::string& path)
+	{
+#ifndef _WIN32
+		const int directory = open(path.c_str(), O_RDONLY);
+		if (directory < 0)
+			return;
+
+		fsync(directory);
+		close(directory);
+#endif
+	}
+}
+
+FileStorage::FileStorage(const std::vector<std::string>& roots, unsigned int shardLevels)
+	: m_roots(roots)
+	, m_shardLevels(shardLevels)
+{
+	if (m_roots.empty())
+	{
+		throw std::runtime_error("Error: [FileStorage] no root");
+	}
+}
+
+void FileStorage::SetPolicy(SyncPolicy policy, bool directIo)
+{
+	m_writer.SetPolicy(policy, directIo);
+}
+
+SyncPolicy FileStorage::Policy() const
+{
+	return m_writer.Policy();
+}
+
+std::string FileStorage::Place(const std::string& name, std::string* root) const
+{
+	const uint64_t hash = HashName(name);
+	*root = m_roots[hash % m_roots.size()];
+
+	// the root takes the low bits, the shards the high ones
+	std::string path = *root;
+	for (unsigned int level = 0; level < m_shardLevels && level < 4; ++level)
+	{
+		char shard[4];
+		snprintf(shard, sizeof(shard), "/%02x", unsigned(hash >> (56 - 8 * level)) & 0xff);
+		path += shard;
+	}
+
+	return path + "/" + name;
+}
+
+std::string FileStorage::PathOf(const std::string& name) const
+{
+	std::string root;
+	return Place(name, &root);
+}
+
+void FileStorage::DirectoryPaths(const std::string& name, std::vector<std::string>* paths) const
+{
+	paths->clear();
+
+	// sharded trees only exist in pieces under the shards
+	if (m_shardLevels > 0)
+		return;
+
+	for (size_t i = 0; i < m_roots.size(); ++i)
+	{
+		paths->push_back(m_roots[i] + "/" + name);
+	}
+}
+
+void FileStorage::MakeParents(const std::string& root, const std::string& path)
+{
+	std::lock_guard<std::mutex> lock(m_madeMutex);
+
+	for (size_t slash = path.find('/', root.size() + 1); slash != std::string::npos; slash = path.find('/', slash + 1))
+	{
+		const std::string directory = path.substr(0, slash);
+
+		if (m_made.insert(directory).second)
+		{
+			::MakeDirectory(directory);
+		}
+	}
+}
+
+void FileStorage::MakeDirectory(const std::string& name)
+{
+	// sharded files find their parents through MakeParents
+	if (m_shardLevels > 0)
+		return;
+
+	std::lock_guard<std::mutex> lock(m_madeMutex);
+
+	for (size_t i = 0; i < m_roots.size(); ++i)
+	{
+		const std::string directory = m_roots[i] + "/" + name;
+
+		if (m_made.insert(directory).second)
+		{
+			::MakeDirectory(directory);
+		}
+	}
+}
+
+void FileStorage::Reserve(const std::string& name, uint64_t size)
+{
+	std::string root;
+	const std::string path = Place(name, &root);
+
+	MakeParents(root, path);
+
+	{
+		std::lock_guard<std::mutex> lock(m_madeMutex);
+		m_reserved.insert(path);
+	}
+
+	FileWriter::Preallocate(path + PART_SUFFIX, size);
+}
+
+void FileStorage::DropReserved()
+{
+	std::lock_guard<std::mutex> lock(m_madeMutex);
+
+	for (std::unordered_set<std::string>::const_iterator it = m_reserved.begin(); it != m_reserved.end(); ++it)
+	{
+		remove((*it + PART_SUFFIX).c_str());
+	}
+	m_reserved.clear();
+}
+
+void FileStorage::Open(const std::string& name, bool reserved)
+{
+	std::string root;
+	m_path = Place(name, &root);
+
+	MakeParents(root, m_path);
+
+	// from here on Finalize or Abort take care of the .part file
+	{
+		std::lock_guard<std::mutex> lock(m_madeMutex);
+		m_reserved.erase(m_path);
+	}
+
+	m_writer.Open(m_path + PART_SUFFIX, !reserved);
+}
+
+bool FileStorage::IsOpen() const
+{
+	return m_writer.IsOpen();
+}
+
+void FileStorage::WriteAt(uint64_t offset, const char* data, size_t size)
+{
+	m_writer.WriteAt(offset, data, size);
+}
+
+void FileStorage::WriteHole(uint64_t offset, uint64_t size)
+{
+	m_writer.WriteHole(offset, size);
+}
+
+void FileStorage::Finalize()
+{
+	const std::string temp = m_path + PART_SUFFIX;
+
+	try
+	{
+		m_writer.Close();
+	}
+	catch (...)
+	{
+		remove(temp.c_str());
+		throw;
+	}
+
+	Publish(temp, m_path);
+}
+
+void FileStorage::Abort()
+{
+	if (!m_writer.IsOpen())
+		return;
+
+	m_writer.Abort();
+	remove((m_path + PART_SUFFIX).c_str());
+}
+
+void FileStorage::WriteWhole(const std::string& name, const char* data, size_t size)
+{
+	std::string root;
+	const std::string path = Place(name, &root);
+	const std::string temp = path + PART_SUFFIX;
+
+	MakeParents(root, path);
+
+	{
+		std::lock_guard<std::mutex> lock(m_madeMutex);
+		m_reserved.erase(path);
+	}
+
+	FileWriter::WriteWhole(temp, data, size, m_writer.Policy());
+
+	Publish(temp, path);
+}
+
+void FileStorage::Publish(const std::string& temp, const std::string& path)
+{
+	ReplaceFile(temp, path);
+
+	if (m_writer.Policy() != SyncNone)
+	{
+		SyncDirectory(ParentOf(path));
+	}
+}
+
+ObjectStorage::ObjectStorage(const std::string& bucket)
+	: m_bucket(bucket)
+	, m_policy(SyncNone)
+	, m_open(false)
+{}
+
+void ObjectStorage::SetPolicy(SyncPolicy policy, bool directIo)
+{
+	m_policy = policy;
+}
+
+SyncPolicy ObjectStorage::Policy() const
+{
+	return m_policy;
+}
+
+std::string ObjectStorage::PathOf(const std::string& name) const
+{
+	// keys are flat, escape the separators
+	std::string key;
+	for (size_t i = 0; i < name.size(); ++i)
+	{
+		if (name[i] == '/')
+			key += "%2F";
+		else if (name[i] == '%')
+			key += "%25";
+		else
+			key += name[i];
+	}
+
+	return m_bucket + "/" + key;
+}
+
+void ObjectStorage::Reserve(const std::string& name, uint64_t size)
+{}
+
+void ObjectStorage::MakeDirectory(const std::string& name)
+{}
+
+void ObjectStorage::DirectoryPaths(const std::string& name, std::vector<std::string>* paths) const
+{
+	paths->clear();
+}
+
+void ObjectStorage::DropReserved()
+{}
+
+void ObjectStorage::Open(const std::string& name, bool reserved)
+{
+	if (m_open)
+	{
+		throw std::runtime_error("Error: [ObjectStorage] object already open");
+	}
+
+	m_name = name;
+	m_object.clear();
+	m_open = true;
+}
+
+bool ObjectStorage::IsOpen() const
+{
+	return m_open;
+}
+
+void ObjectStorage::Extend(uint64_t offset, uint64_t size)
+{
+	if (size > OBJECT_MAX_SIZE || offset > OBJECT_MAX_SIZE - size)
+	{
+		throw std::runtime_error("Error: [ObjectStorage] object larger than OBJECT_MAX_SIZE");
+	}
+
+	if (offset + size > m_object.size())
+	{
+		m_object.resize(static_cast<size_t>(offset + size));
+	}
+}
+
+void ObjectStorage::WriteAt(uint64_t offset, const char* data, size_t size)
+{
+	assert(m_open);
+
+	if (size == 0)
+		return;
+
+	Extend(offset, size);
+	memcpy(&m_object[static_cast<size_t>(offset)], data, size);
+}
+
+void ObjectStorage::WriteHole(uint64_t offset, uint64_t size)
+{
+	assert(m_open);
+
+	if (size == 0)
+		return;
+
+	// objects have no holes, the range just has to read back as zeros
+	Extend(offset, size);
+	memset(&m_object[static_cast<size_t>(offset)], 0, static_cast<size_t>(size));
+}
+
+void ObjectStorage::Finalize()
+{
+	m_open = false;
+
+	WriteWhole(m_name, m_object.data(), m_object.size());
+}
+
+void ObjectStorage::Abort()
+{
+	m_open = false;
+	m_object.clear();
+}
+
+void ObjectStorage::WriteWhole(const std::string& name, const char* data, size_t size)
+{
+	// a put replaces the whole object or nothing
+	const std::string path = PathOf(name);
+	const std::string temp = path + PART_SUFFIX;
+
+	FileWriter::WriteWhole(temp, data, size, m_policy);
+
+	ReplaceFile(temp, path);
+}
+
+ReserveQueue::ReserveQueue()
+	: m_busy(false)
+	, m_stop(false)
+{}
+
+ReserveQueue::~ReserveQueue()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+		m_jobs.clear();
+	}
+	m_wakeUp.notify_all();
+
+	if (m_thread.joinable())
+	{
+		m_thread.join();
+	}
+}
+
+void ReserveQueue::Push(StorageBackend* storage, const std::string& name, uint64_t size)
+{
+	const Job job = { storage, name, size };
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_jobs.push_back(job);
+
+		if (!m_thread.joinable())
+		{
+			m_thread = std::thread(&ReserveQueue::WorkerLoop, this);
+		}
+	}
+	m_wakeUp.notify_one();
+}
+
+void ReserveQueue::Wait()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	m_done.wait(lock, [this]() { return m_jobs.empty() && !m_busy; });
+}
+
+void ReserveQueue::Cancel()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_jobs.clear();
+	}
+
+	Wait();
+}
+
+void ReserveQueue::WorkerLoop()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	while (true)
+	{
+		m_wakeUp.wait(lock, [this]() { return m_stop || !m_jobs.empty(); });
+
+		if (m_stop)
+			return;
+
+		const Job job = m_jobs.front();
+		m_jobs.pop_front();
+		m_busy = true;
+		lock.unlock();
+
+		try
+		{
+			job.storage->Reserve(job.name, job.size);
+		}
+		catch (const std::exception&)
+		{
+			// Open creates the file as usual
+		}
+
+		lock.lock();
+		m_busy = false;
+		m_done.notify_all();
+	}
+}
@@ -0,0 +1,219 @@
+#pragma once
+
+#include "FileWriter.h"
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+
+// Largest object ObjectStorage stages in memory.
+#define OBJECT_MAX_SIZE (256ULL * 1024 * 1024)
+
+// Where the server puts what it receives. Names are the relative paths of
+// the transfer; the backend decides where they land. One file is open at
+// a time, and nothing shows up under its name before Finalize.
+class StorageBackend
+{
+public:
+	virtual ~StorageBackend() {}
+
+	// Only while no file is open.
+	virtual void SetPolicy(SyncPolicy policy, bool directIo) = 0;
+
+	virtual SyncPolicy Policy() const = 0;
+
+	// Creates name at its final size with the space allocated, ahead of the
+	// data. Runs on another thread while files are being received.
+	virtual void Reserve(const std::string& name, uint64_t size) = 0;
+
+	// Keeps what Reserve laid out when reserved is true.
+	virtual void Open(const std::string& name, bool reserved) = 0;
+
+	virtual bool IsOpen() const = 0;
+
+	virtual void WriteAt(uint64_t offset, const char* data, size_t size) = 0;
+
+	// Makes the range read back as zeros without data for it, a hole
+	// where the file system has them.
+	virtual void WriteHole(uint64_t offset, uint64_t size) = 0;
+
+	// Returns once the sync policy holds and the file is visible under its name.
+	virtual void Finalize() = 0;
+
+	// Drops the open file, the name keeps whatever it had before.
+	virtual void Abort() = 0;
+
+	// A small file in one go, on the calling thread.
+	virtual void WriteWhole(const std::string& name, const char* data, size_t size) = 0;
+
+	// A directory of the transferred tree, nothing for layouts that have none.
+	virtual void MakeDirectory(const std::string& name) = 0;
+
+	// Where the file name is kept, for its attributes.
+	virtual std::string PathOf(const std::string& name) const = 0;
+
+	// Every copy of the directory name, none where the layout has no
+	// directory of that name.
+	virtual void DirectoryPaths(const std::string& name, std::vector<std::string>* paths) const = 0;
+
+	// Removes what Reserve laid out for files that were never opened.
+	virtual void DropReserved() = 0;
+};
+
+typedef std::function<std::unique_ptr<StorageBackend>()> StorageFactory;
+
+// Files on local disks. Each file is written to "<path>.part" next to its
+// destination and renamed over it once complete. With several roots, a
+// hash of the name picks the root, so files of one transfer spread over
+// as many disks as are mounted there. shardLevels adds that many (up to four)
+// levels of 256 subdirectories from the same hash in front of the name, keeping
+// directories small when millions of files arrive; the tree below the
+// name is kept. Without shards and with one root, this is the old layout.
+class FileStorage : public StorageBackend
+{
+public:
+	explicit FileStorage(const std::vector<std::string>& roots = std::vector<std::string>(1, "."), unsigned int shardLevels = 0);
+
+	void SetPolicy(SyncPolicy policy, bool directIo) override;
+
+	SyncPolicy Policy() const override;
+
+	void Reserve(const std::string& name, uint64_t size) override;
+
+	void Open(const std::string& name, bool reserved) override;
+
+	bool IsOpen() const override;
+
+	void WriteAt(uint64_t offset, const char* data, size_t size) override;
+
+	void WriteHole(uint64_t offset, uint64_t size) override;
+
+	void Finalize() override;
+
+	void Abort() override;
+
+	void WriteWhole(const std::string& name, const char* data, size_t size) override;
+
+	void MakeDirectory(const std::string& name) override;
+
+	std::string PathOf(const std::string& name) const override;
+
+	void DirectoryPaths(const std::string& name, std::vector<std::string>* paths) const override;
+
+	void DropReserved() override;
+
+private:
+	// Destination of name, root is set to the root it falls under.
+	std::string Place(const std::string& name, std::string* root) const;
+
+	// Creates the directories between root and path, once per storage.
+	void MakeParents(const std::string& root, const std::string& path);
+
+	void Publish(const std::string& temp, const std::string& path);
+
+private:
+	const std::vector<std::string>  m_roots;
+	const unsigned int              m_shardLevels;
+	FileWriter                      m_writer;
+	std::string                     m_path;
+	std::mutex                      m_madeMutex;
+	std::unordered_set<std::string> m_made;
+	std::unordered_set<std::string> m_reserved;   // paths with a reserved .part file, under m_madeMutex
+};
+
+// Test stand-in for an object store: a flat bucket directory of whole
+// objects. Names are keys, '/' included, so there are no directories. An
+// object is staged in memory and put in one go on Finalize, atomically
+// replacing the previous version. Not meant for large files, objects are
+// capped at OBJECT_MAX_SIZE.
+class ObjectStorage : public StorageBackend
+{
+public:
+	explicit ObjectStorage(const std::string& bucket);
+
+	void SetPolicy(SyncPolicy policy, bool directIo) override;
+
+	SyncPolicy Policy() const override;
+
+	void Reserve(const std::string& name, uint64_t size) override;
+
+	void Open(const std::string& name, bool reserved) override;
+
+	bool IsOpen() const override;
+
+	void WriteAt(uint64_t offset, const char* data, size_t size) override;
+
+	void WriteHole(uint64_t offset, uint64_t size) override;
+
+	void Finalize() override;
+
+	void Abort() override;
+
+	void WriteWhole(const std::string& name, const char* data, size_t size) override;
+
+	void MakeDirectory(const std::string& name) override;
+
+	std::string PathOf(const std::string& name) const override;
+
+	void DirectoryPaths(const std::string& name, std::vector<std::string>* paths) const override;
+
+	void DropReserved() override;
+
+private:
+	// Grows the staged object to end, which comes off the wire.
+	void Extend(uint64_t offset, uint64_t size);
+
+private:
+	const std::string m_bucket;
+	SyncPolicy        m_policy;
+	bool              m_open;
+	std::string       m_name;
+	std::vector<char> m_object;
+};
+
+// Runs StorageBackend::Reserve on one background thread, in the order the
+// files were pushed, so a manifest of any size costs a single thread. The
+// thread starts with the first push. Reserving only helps the layout, a
+// file that fails is created by Open as usual.
+class ReserveQueue
+{
+public:
+	ReserveQueue();
+
+	// Drops what was not reserved yet.
+	~ReserveQueue();
+
+	void Push(StorageBackend* storage, const std::string& name, uint64_t size);
+
+	// Returns once everything pushed so far is reserved.
+	void Wait();
+
+	// Drops what was not reserved yet and waits for the file in progress.
+	void Cancel();
+
+private:
+	struct Job
+	{
+		StorageBackend* storage;
+		std::string     name;
+		uint64_t        size;
+	};
+
+	void WorkerLoop();
+
+	ReserveQueue(const ReserveQueue&);
+
+	ReserveQueue& operator = (const ReserveQueue&);
+
+private:
+	std::deque<Job>         m_jobs;
+	bool                    m_busy;
+	bool                    m_stop;
+	std::mutex              m_mutex;
+	std::condition_variable m_wakeUp;
+	std::condition_variable m_done;
+	std::thread             m_thread;
+};
@@ -1,7 +1,8 @@
 #pragma once
 
 #include "Socket.h"
-#include <map>
+#include <cstdint>
+#include <cstring>
 
 enum Protocol
 {
@@ -9,15 +10,32 @@ enum Protocol
 	FileData,
 	FileEnd,
 	Chunk,
-	ChunkEnd,
+	ChunkEnd,   // unused, blocks are written as they complete
 	Done,
 	FatalError,
-	Accepted
+	Accepted,
+	Manifest,
+	PackedData,
+	Parity,
+	Recovered,
+	Hello,
+	HelloAck,
+	Hole,       // a run of zeros that is not sent, see Sparse.h
+
+	ProtocolCount
 };
 
+inline bool IsValidProtocol(Protocol pr)
+{
+	return static_cast<unsigned int>(pr) < static_cast<unsigned int>(ProtocolCount);
+}
+
 #define TRANSPORT_UDP 1
 #define TRANSPORT_TCP 0
 
+// Poly1305 tag of sealed frames, see FrameCipher.
+#define FRAME_TAG_LENGTH 16
+
 #define PORT 5500
 #define ADDRESS "127.0.0.1"
 
@@ -40,6 +58,8 @@ struct MessageData
 	Protocol	protocol;
 	size_t		dataSize;
 	int			dataIndex;
+	uint64_t	sequence;                  // nonce of sealed frames
+	uint8_t		tag[FRAME_TAG_LENGTH];     // authentication tag of sealed frames
 	char		data[MAX_LENGTH];
 
 	MessageData() {}
@@ -48,7 +68,65 @@ struct MessageData
 		: protocol(pr)
 		, dataSize(message.size())
 		, dataIndex(0)
+		, sequence(0)
 	{
 		sprintf_s(data, MAX_LENGTH, "%s", message.c_str());
 	}
 };
+
+// FileEnd carries the bytes the sender put on the wire, so the receiver can
+// tell a complete file from one that lost its tail.
+inline void WriteFileEnd(uint64_t size, MessageData* data)
+{
+	data->protocol = Protocol::FileEnd;
+	data->dataSize = sizeof(size);
+	memcpy(data->data, &size, sizeof(size));
+}
+
+inline uint64_t ReadFileEnd(const MessageData& data)
+{
+	uint64_t size = 0;
+
+	if (data.dataSize != sizeof(size))
+	{
+		throw std::runtime_error("Error: [ReadFileEnd] malformed file end");
+	}
+	memcpy(&size, data.data, sizeof(size));
+
+	return size;
+}
+
+// An Accepted answer names the frame it answers: dataIndex is the frame's
+// and the payload its protocol. Over UDP that tells a late duplicate answer
+// to an earlier frame from the one being waited for.
+inline void SetAnswered(const MessageData& request, MessageData* answer)
+{
+	const uint32_t answered = request.protocol;
+
+	answer->dataIndex = request.dataIndex;
+	answer->dataSize = sizeof(answered);
+	memcpy(answer->data, &answered, sizeof(answered));
+}
+
+// ProtocolCount for frames that are not Accepted answers.
+inline Protocol AnsweredProtocol(const MessageData& answer)
+{
+	uint32_t answered = ProtocolCount;
+
+	if (answer.protocol == Protocol::Accepted && answer.dataSize == sizeof(answered))
+	{
+		memcpy(&answered, answer.data, sizeof(answered));
+	}
+
+	return answered < ProtocolCount ? static_cast<Protocol>(answered) : ProtocolCount;
+}
+
+inline bool IsAnswerTo(const MessageData& answer, const MessageData& request)
+{
+	if (request.protocol == Protocol::Hello)
+	{
+		return answer.protocol == Protocol::HelloAck;
+	}
+
+	return AnsweredProtocol(answer) == request.protocol && answer.dataIndex == request.dataIndex;
+}
@@ -1,10 +1,35 @@
 #include "TransferClient.h"
 #include "Transfer.h"
+#include "Fec.h"
+#include "MappedFile.h"
+#include <cstddef>
 #include <functional>
 #include <memory>
 
 #define PROGRESS_LENGTH 256
 
+// TCP frames sent before their answers are read, so a key can seal them in
+// parallel. The server answers with frames of the same size, this many of
+// them in each direction stay well inside the socket buffers.
+#define TCP_BATCH_FRAMES 4
+
+namespace
+{
+	// Moves the stream past a hole, files may be larger than a long.
+	void SeekFile(FILE* file, uint64_t offset)
+	{
+#ifdef _WIN32
+		const int result = _fseeki64(file, static_cast<__int64>(offset), SEEK_SET);
+#else
+		const int result = fseeko(file, static_cast<off_t>(offset), SEEK_SET);
+#endif
+		if (result != 0)
+		{
+			throw std::runtime_error("Error: [SeekFile] seek failed");
+		}
+	}
+}
+
 class ProgressPrinter
 {
 public:
@@ -55,71 +80,452 @@ private:
 FileTransferClient::FileTransferClient(Socket::SocketType type, const char* address, short port)
 	: m_address(address)
 	, m_port(port)
-	, m_socket(type)
+	, m_socket(type, address)
+	, m_cancelled(false)
+	, m_manifestSent(0)
+	, m_fec(false)
+	, m_mappedReads(true)
+	, m_sparse(true)
+	, m_connections(nullptr)
+	, m_session(DefaultSession())
+	, m_profiler(nullptr)
+	, m_fileNumber(0)
+	, m_control(0)
+	, m_hasKey(false)
 {}
 
 FileTransferClient::~FileTransferClient()
 {}
 
+void FileTransferClient::SetProgressCallback(const ProgressCallback& callback)
+{
+	m_progress = callback;
+}
+
+void FileTransferClient::SetForwardErrorCorrection(bool enable)
+{
+	m_fec = enable;
+}
+
+void FileTransferClient::SetMappedReads(bool enable)
+{
+	m_mappedReads = enable;
+}
+
+void FileTransferClient::SetSparse(bool enable)
+{
+	m_sparse = enable;
+}
+
+void FileTransferClient::SetSchedulerFlow(const std::shared_ptr<TransferScheduler::Flow>& flow)
+{
+	m_flow = flow;
+}
+
+void FileTransferClient::Throttle(size_t bytes)
+{
+	if (m_flow)
+	{
+		m_flow->Acquire(bytes);
+	}
+}
+
+void FileTransferClient::SetKey(const CipherKey& key)
+{
+	m_key = key;
+	m_hasKey = true;
+}
+
+void FileTransferClient::SetConnectionPool(ConnectionPool* connections)
+{
+	m_connections = connections;
+}
+
+void FileTransferClient::SetProfiler(TransferProfiler* profiler)
+{
+	m_profiler = profiler;
+}
+
+void FileTransferClient::Cancel()
+{
+	m_cancelled = true;
+}
+
+bool FileTransferClient::IsCancelled() const
+{
+	return m_cancelled;
+}
+
+void FileTransferClient::ReportProgress(uint64_t sent, uint64_t total)
+{
+	if (m_cancelled)
+	{
+		throw std::runtime_error("Error: transfer cancelled");
+	}
+
+	if (m_progress)
+	{
+		m_progress(m_fileName, sent, total);
+	}
+}
+
 void FileTransferClient::CheckAnswer()
 {
-	MessageData serverAnswer;
-	Read(serverAnswer);
-	if (serverAnswer.protocol == Protocol::FatalError)
+	MessageBuffer serverAnswer = m_pool.Acquire();
+	Read(*serverAnswer);
+	if (serverAnswer->protocol == Protocol::FatalError)
 	{
-		throw std::runtime_error(serverAnswer.data);
+		throw std::runtime_error(serverAnswer->data);
 	}
 }
 
-void FileTransferClient::FileTransferBegin(const char* fileName)
+void FileTransferClient::Exchange(const MessageData& request, MessageData& answer)
 {
-	std::string name = fileName;
-	size_t pos = name.find_last_of("/\\");
-	if (pos != std::string::npos)
+	Send(request);
+
+	Read(answer);
+	if (answer.protocol == Protocol::FatalError)
+	{
+		throw std::runtime_error(answer.data);
+	}
+}
+
+int FileTransferClient::NextControl()
+{
+	return ++m_control;
+}
+
+void FileTransferClient::Handshake()
+{
+	uint32_t capabilities = CapabilityFec | CapabilityManifest | CapabilityKeepAlive |
+		CapabilitySparse | CapabilityConcurrent;
+	if (m_hasKey)
+	{
+		capabilities |= CapabilityEncryption;
+	}
+
+	SessionInfo local = MakeSession(capabilities, CHUNK_LENGTH);
+	local.nonce = m_hasKey ? RandomNonce() : 0;
+	m_cipher.reset();
+
+	MessageBuffer hello = m_pool.Acquire();
+	WriteHello(Protocol::Hello, local, hello.Get());
+
+	MessageBuffer helloAck = m_pool.Acquire();
+	Exchange(*hello, *helloAck);
+
+	if (helloAck->protocol != Protocol::HelloAck)
 	{
-		name.erase(0, pos + 1);
+		throw std::runtime_error("Error: [Handshake] unexpected answer");
 	}
 
-	MessageData header(Protocol::FileBegin, name);
-	Send(header);
+	const SessionInfo answer = ReadHello(*helloAck);
+	m_session = Negotiate(local, answer);
 
-	CheckAnswer();
+	if (m_hasKey)
+	{
+		if (!m_session.Has(CapabilityEncryption))
+		{
+			throw std::runtime_error("Error: [Handshake] server does not encrypt");
+		}
+
+		m_cipher = std::make_shared<FrameCipher>(DeriveSessionKey(m_key, local.nonce, answer.nonce), true);
+
+		if (!m_cipher->CheckHello(*helloAck))
+		{
+			m_cipher.reset();
+			throw std::runtime_error("Error: [Handshake] server key does not match");
+		}
+	}
 }
 
-void FileTransferClient::FileTransferData(const char* fileName)
+bool FileTransferClient::TakePooled()
 {
-	std::unique_ptr<FILE, std::function<void(FILE*)>> file(fopen(fileName, "rb"), [](FILE* f) { fclose(f); });
+	ConnectionPool::Connection connection;
+
+	if (m_connections == nullptr ||
+		!m_connections->Take(m_socket.Type(), m_address, m_port, &connection))
+	{
+		return false;
+	}
+
+	// a connection keyed differently is closed rather than reused
+	if (m_hasKey != (connection.cipher != nullptr))
+	{
+		return false;
+	}
+
+	m_socket.Swap(*connection.socket);
+	m_session = connection.session;
+	m_cipher = connection.cipher;
+
+	return true;
+}
+
+void FileTransferClient::ReleaseConnection()
+{
+	if (!m_session.Has(CapabilityKeepAlive))
+	{
+		m_socket.Close();
+		return;
+	}
+
+	if (m_connections != nullptr)
+	{
+		ConnectionPool::Connection connection;
+		connection.socket.reset(new Socket(m_socket.Type()));
+		connection.socket->Swap(m_socket);
+		connection.session = m_session;
+		connection.cipher = m_cipher;
+		m_cipher.reset();
+
+		m_connections->Put(connection.socket->Type(), m_address, m_port, connection);
+	}
+}
+
+const MessageData& FileTransferClient::SealFrame(const MessageData& data)
+{
+	if (!m_cipher || data.protocol == Protocol::Hello)
+	{
+		return data;
+	}
+
+	if (m_sealed.IsNull())
+	{
+		m_sealed = m_pool.Acquire();
+	}
+
+	m_cipher->Seal(data, data.data, m_sealed.Get());
+
+	return *m_sealed;
+}
+
+bool FileTransferClient::OpenFrame(MessageData& data)
+{
+	// the answer to Hello and errors before the key are in the clear
+	if (!m_cipher)
+	{
+		return true;
+	}
+
+	return m_cipher->Open(data);
+}
+
+bool FileTransferClient::UseFec() const
+{
+	return m_fec && m_session.Has(CapabilityFec);
+}
+
+bool FileTransferClient::UseSparse() const
+{
+	return m_sparse && m_session.Has(CapabilitySparse);
+}
+
+void FileTransferClient::SendHole(uint64_t offset, uint64_t length)
+{
+	MessageBuffer hole = m_pool.Acquire();
+	WriteHole(offset, length, hole.Get());
+
+	MessageBuffer answer = m_pool.Acquire();
+	Exchange(*hole, *answer);
+}
+
+void FileTransferClient::FileTransferBegin(const char* fileName, const std::string& remoteName)
+{
+	m_fileName = fileName;
+	++m_fileNumber;
+
+	MessageData header(Protocol::FileBegin, remoteName);
+	header.dataIndex = NextControl();
+
+	MessageBuffer answer = m_pool.Acquire();
+	Exchange(header, *answer);
+}
+
+void FileTransferClient::FileTransferData(FilePrefetcher::Entry& entry)
+{
+	std::unique_ptr<FILE, std::function<void(FILE*)>> file(entry.file, [](FILE* f) { fclose(f); });
+	entry.file = nullptr;
 
 	if (file == nullptr)
 	{
-		char buff[256];
-		sprintf_s(buff, 256, "Error: failed load file, name %s", fileName);
-		throw std::runtime_error(buff);
+		throw std::runtime_error(entry.error);
 	}
 
-	SendFile(file.get());
+	const uint64_t sent = SendFile(file.get(), entry.size);
 
 	std::cout << std::endl;
-	MessageData data;
-	data.protocol = Protocol::FileEnd;
-	Send(data);
+	MessageBuffer data = m_pool.Acquire();
+	WriteFileEnd(sent, data.Get());
+	data->dataIndex = NextControl();
+
+	MessageBuffer answer = m_pool.Acquire();
+	Exchange(*data, *answer);
 }
 
 void FileTransferClient::FileTransferDone()
 {
 	MessageData data(Protocol::Done, "Done.");
-	Send(data);
+	data.dataIndex = NextControl();
 
-	CheckAnswer();
+	MessageBuffer answer = m_pool.Acquire();
+	Exchange(data, *answer);
+}
+
+void FileTransferClient::FlushPacked(MessageData& packed)
+{
+	if (packed.dataSize == 0)
+		return;
+
+	Throttle(packed.dataSize);
+
+	packed.dataIndex = NextControl();
+
+	MessageBuffer answer = m_pool.Acquire();
+	Exchange(packed, *answer);
+
+	packed.dataSize = 0;
+}
+
+void FileTransferClient::TransferTree(const std::string& root)
+{
+	if (!m_session.Has(CapabilityManifest))
+	{
+		throw std::runtime_error("Error: [TransferTree] server does not accept directories");
+	}
+
+	std::vector<ManifestEntry> entries;
+	ScanTree(root, &entries);
+
+	const size_t base = m_manifestSent;
+	MessageBuffer frame = m_pool.Acquire();
+	MessageBuffer answer = m_pool.Acquire();
+
+	for (size_t first = 0; first < entries.size();)
+	{
+		const size_t count = WriteManifestEntries(entries, first, frame.Get());
+		frame->dataIndex = static_cast<int>(base + first);
+
+		Exchange(*frame, *answer);
+
+		first += count;
+	}
+	m_manifestSent += entries.size();
+
+	// entries[0] is the root itself, named by its last path component
+	const size_t rootLength = entries[0].path.size();
+	const size_t packLimit = MAX_LENGTH - 2 * sizeof(uint32_t);
+
+	MessageBuffer packed = m_pool.Acquire();
+	packed->protocol = Protocol::PackedData;
+	packed->dataIndex = 0;
+	packed->dataSize = 0;
+
+	std::vector<std::string> locals;
+	std::vector<size_t> indices;
+	for (size_t i = 1; i < entries.size(); ++i)
+	{
+		if (entries[i].IsDirectory())
+			continue;
+
+		locals.push_back(root + entries[i].path.substr(rootLength));
+		indices.push_back(i);
+	}
+
+	// small files are read whole by the prefetcher and packed
+	FilePrefetcher prefetcher(locals, packLimit);
+	FilePrefetcher::Entry file;
+
+	for (size_t k = 0; k < locals.size(); ++k)
+	{
+		const ManifestEntry& entry = entries[indices[k]];
+		prefetcher.Take(k, &file);
+
+		if (!file.error.empty())
+		{
+			throw std::runtime_error(file.error);
+		}
+
+		if (file.file != nullptr)
+		{
+			FileTransferBegin(file.path.c_str(), entry.path);
+
+			FileTransferData(file);
+			continue;
+		}
+
+		m_fileName = file.path;
+
+		const uint32_t index = static_cast<uint32_t>(base + indices[k]);
+		const uint32_t size = static_cast<uint32_t>(file.contents.size());
+		if (!AppendPackedFile(packed.Get(), index, file.contents.data(), size))
+		{
+			FlushPacked(*packed);
+
+			AppendPackedFile(packed.Get(), index, file.contents.data(), size);
+		}
+
+		ReportProgress(size, size);
+	}
+
+	FlushPacked(*packed);
 }
 
 void FileTransferClient::Transfer(const std::vector<std::string>& files)
 {
+	if (!m_socket.IsOpen())
+	{
+		Init();
+	}
+
+	try
+	{
+		TransferFiles(files);
+	}
+	catch (...)
+	{
+		// the server drops the session on errors
+		m_socket.Close();
+		throw;
+	}
+
+	ReleaseConnection();
+}
+
+void FileTransferClient::TransferFiles(const std::vector<std::string>& files)
+{
+	m_manifestSent = 0;
+	m_fileNumber = 0;
+	m_control = 0;
+
+	// stat and open upcoming files while the current one is on the wire
+	FilePrefetcher prefetcher(files);
+	FilePrefetcher::Entry file;
+
 	for (size_t i = 0; i < files.size(); ++i)
 	{
-		FileTransferBegin(files[i].c_str());
+		prefetcher.Take(i, &file);
+
+		if (file.isDirectory)
+		{
+			TransferTree(files[i]);
+			continue;
+		}
+		if (!file.error.empty())
+		{
+			throw std::runtime_error(file.error);
+		}
+
+		std::string name = files[i];
+		size_t pos = name.find_last_of("/\\");
+		if (pos != std::string::npos)
+		{
+			name.erase(0, pos + 1);
+		}
+
+		FileTransferBegin(files[i].c_str(), name);
 
-		FileTransferData(files[i].c_str());
+		FileTransferData(file);
 	}
 
 	FileTransferDone();
@@ -135,33 +541,156 @@ public:
 
 	void Init() override
 	{
+		if (TakePooled())
+			return;
+
 		m_socket.Init();
 
 		m_socket.Connect(m_address.c_str(), m_port);
+
+		Handshake();
 	}
 
 	void Send(const MessageData& data) override
 	{
-		m_socket.Send((const char*)&data, sizeof(MessageData));
+		m_socket.Send((const char*)&SealFrame(data), sizeof(MessageData));
 	}
 
 	void Read(MessageData& data) override
 	{
 		m_socket.Read((char*)&data, sizeof(data));
+
+		if (!OpenFrame(data))
+		{
+			throw std::runtime_error("Error: [Read] frame failed authentication");
+		}
 	}
 
-	void SendFile(FILE* file) override
+	uint64_t SendFile(FILE* file, uint64_t fileSize) override
 	{
-		MessageData data;
+		Batch batch;
+		batch.count = 0;
+
+		SparseMap sparse(file, fileSize);
+		const bool skipZeros = UseSparse();
+		uint64_t offset = 0;
+		uint64_t hole = 0;   // zeros up to offset, not sent yet
 
 		while (!feof(file))
 		{
-			data.dataSize = fread(data.data, 1, MAX_LENGTH, file);
+			if (skipZeros)
+			{
+				const uint64_t skipped = sparse.HoleLength(offset, MAX_LENGTH);
+				if (skipped > 0)
+				{
+					// the hole goes out after the frames before it
+					SendBatch(batch, offset, fileSize);
+
+					offset += skipped;
+					hole += skipped;
+					SeekFile(file, offset);
+
+					if (offset >= fileSize)
+						break;
+				}
+			}
 
-			Send(data);
+			MessageBuffer& frame = batch.frames[batch.count];
+			if (frame.IsNull())
+				frame = m_pool.Acquire();
 
+			MessageData& data = *frame;
+			data.protocol = Protocol::FileData;
+
+			const uint64_t id = TransferProfiler::BlockId(m_fileNumber, offset / MAX_LENGTH);
+			{
+				ProfileSpan span(m_profiler, TransferProfiler::ClientRead, id);
+				data.dataSize = fread(data.data, 1, MAX_LENGTH, file);
+			}
+
+			if (data.dataSize == 0)
+				break;
+
+			if (skipZeros && IsZeroBlock(data.data, data.dataSize))
+			{
+				SendBatch(batch, offset, fileSize);
+
+				offset += data.dataSize;
+				hole += data.dataSize;
+				continue;
+			}
+
+			if (hole > 0)
+			{
+				SendHole(offset - hole, hole);
+				hole = 0;
+			}
+
+			const FrameCipher::SealJob job = { &data, data.data, &data };
+			batch.jobs[batch.count] = job;
+			batch.ids[batch.count] = id;
+			offset += data.dataSize;
+
+			if (++batch.count == TCP_BATCH_FRAMES)
+			{
+				SendBatch(batch, offset, fileSize);
+			}
+		}
+
+		SendBatch(batch, offset, fileSize);
+
+		if (hole > 0)
+		{
+			SendHole(offset - hole, hole);
+			ReportProgress(offset, fileSize);
+		}
+
+		return offset;
+	}
+
+private:
+	// Frames read ahead of their answers, sealed in place.
+	struct Batch
+	{
+		MessageBuffer        frames[TCP_BATCH_FRAMES];
+		FrameCipher::SealJob jobs[TCP_BATCH_FRAMES];
+		uint64_t             ids[TCP_BATCH_FRAMES];
+		size_t               count;
+	};
+
+	// Sends the frames back to back, then reads their answers. sent is
+	// the file offset after the last of them.
+	void SendBatch(Batch& batch, uint64_t sent, uint64_t fileSize)
+	{
+		if (batch.count == 0)
+			return;
+
+		for (size_t k = 0; k < batch.count; ++k)
+		{
+			ProfileSpan span(m_flow ? m_profiler : nullptr, TransferProfiler::ClientThrottle, batch.ids[k]);
+			Throttle(batch.frames[k]->dataSize);
+		}
+
+		if (m_cipher)
+		{
+			ProfileSpan span(m_profiler, TransferProfiler::ClientEncrypt, batch.ids[0]);
+			m_cipher->SealBatch(batch.jobs, batch.count);
+		}
+
+		for (size_t k = 0; k < batch.count; ++k)
+		{
+			ProfileSpan span(m_profiler, TransferProfiler::ClientSend, batch.ids[k]);
+			m_socket.Send((const char*)batch.frames[k].Get(), sizeof(MessageData));
+		}
+
+		for (size_t k = 0; k < batch.count; ++k)
+		{
+			ProfileSpan span(m_profiler, TransferProfiler::ClientAnswer, batch.ids[k]);
 			CheckAnswer();
 		}
+
+		batch.count = 0;
+		ReportProgress(sent, fileSize);
 	}
 };
 
@@ -176,128 +705,314 @@ public:
 
 	void Init() override
 	{
+		if (TakePooled())
+			return;
+
 		m_socket.Init();
+
+		Handshake();
 	}
 
 	void Send(const MessageData& data) override
 	{
-		m_socket.SendTo((const char*)&data, sizeof(data), &m_serverAddr);
+		m_socket.SendTo((const char*)&SealFrame(data), sizeof(data), &m_serverAddr);
 	}
 
+	// Datagrams that fail authentication are dropped as if lost.
 	void Read(MessageData& data) override
 	{
-		m_socket.ReadFrom((char*)&data, sizeof(data), &m_serverAddr);
+		do
+		{
+			m_socket.ReadFrom((char*)&data, sizeof(data), &m_serverAddr);
+		}
+		while (!OpenFrame(data));
 	}
 
-	void SendFile(FILE* file) override
+	uint64_t SendFile(FILE* file, uint64_t fileSize) override
 	{
-		fseek(file, 0, SEEK_END);
-		const size_t fileSize = ftell(file);
-		fseek(file, 0, SEEK_SET);
+		ProgressPrinter printer(static_cast<int>(fileSize / MAX_LENGTH));
+
+		MessageBuffer answer = m_pool.Acquire();
+		MessageBuffer frames[CHUNK_LENGTH];
+		const char* payloads[CHUNK_LENGTH];
+		FrameCipher::SealJob jobs[CHUNK_LENGTH];
 
-		ProgressPrinter printer(fileSize / MAX_LENGTH);
+		// datagrams are gathered from a view of the file that follows the
+		// window, files that can't be mapped are read window by window into
+		// a staging buffer
+		MappedFile mapping;
+		const bool mapped = m_mappedReads && mapping.Map(file, fileSize);
 
-		MessageData data;
-		data.protocol = Protocol::Chunk;
+		SparseMap sparse(file, fileSize);
+		const bool skipZeros = UseSparse();
 
-		char buff[MAX_LENGTH * CHUNK_LENGTH];
+		// the agreed window never exceeds CHUNK_LENGTH
+		const int window = static_cast<int>(m_session.windowSize);
+		char staging[MAX_LENGTH * CHUNK_LENGTH];
+		const char* buff = staging;
 		bool done[CHUNK_LENGTH] = {0};
 		int reTry = 0;
 		int size = 0;
-		int chunks = 0;
+		int acked = 0;
+		int lost = 0;   // blocks rebuilt or sent again in this window
+		uint64_t sent = 0;
 
-		while (!feof(file))
+		while (true)
 		{
-			if(reTry == 0)
-				size = fread(buff, 1, MAX_LENGTH * CHUNK_LENGTH, file);
+			// windows start after the zeros, zero blocks inside a window are sent
+			if (reTry == 0 && skipZeros)
+			{
+				const uint64_t hole = ZeroRun(sparse, mapped ? &mapping : nullptr, sent, fileSize);
+				if (hole > 0)
+				{
+					SendHole(sent, hole);
+					sent += hole;
 
-			int count = ceil(size / MAX_LENGTH);
+					if (!mapped)
+					{
+						SeekFile(file, sent);
+					}
+					ReportProgress(sent, fileSize);
+				}
+			}
+
+			if (reTry == 0)
+			{
+				ProfileSpan span(m_profiler, TransferProfiler::ClientRead,
+					TransferProfiler::BlockId(m_fileNumber, sent / MAX_LENGTH));
+
+				if (mapped)
+				{
+					const uint64_t left = fileSize - sent;
+					size = static_cast<int>(std::min<uint64_t>(left, MAX_LENGTH * window));
+					buff = size > 0 ? mapping.View(sent, size) : staging;
+
+					if (buff == nullptr)
+					{
+						throw std::runtime_error("Error: [SendFile] unable to map the file");
+					}
+				}
+				else
+				{
+					size = fread(staging, 1, MAX_LENGTH * window, file);
+				}
+			}
+
+			if (size <= 0)
+				break;
+
+			// blocks are numbered by file offset so the server can place
+			// them directly and stale answers never match a later window
+			const int firstBlock = static_cast<int>(sent / MAX_LENGTH);
+			const int count = (size + MAX_LENGTH - 1) / MAX_LENGTH;
+			int pending = 0;
 			for (int i = 0; i < count; ++i)
 			{
 				if (done[i])
 					continue;
 
+				if (frames[i].IsNull())
+					frames[i] = m_pool.Acquire();
+
+				MessageData& data = *frames[i];
 				const int pos = i * MAX_LENGTH;
-				data.dataIndex = i;
+				data.protocol = Protocol::Chunk;
+				data.dataIndex = firstBlock + i;
 				data.dataSize = size - pos;
 				if (data.dataSize > MAX_LENGTH) 
 					data.dataSize = MAX_LENGTH;
 
-				memcpy(data.data, buff + pos, data.dataSize);
+				payloads[i] = buff + pos;
+
+				const FrameCipher::SealJob job = { &data, buff + pos, &data };
+				jobs[pending++] = job;
+			}
+
+			// sealed blocks are sent from their frames, plain ones from the file data
+			if (m_cipher)
+			{
+				ProfileSpan span(m_profiler, TransferProfiler::ClientEncrypt,
+					TransferProfiler::BlockId(m_fileNumber, firstBlock));
 
-				Send(data);
+				m_cipher->SealBatch(jobs, pending);
 			}
 
+			for (int k = 0; k < pending; ++k)
+			{
+				const MessageData& data = *jobs[k].out;
+				const int i = data.dataIndex - firstBlock;
+				const uint64_t id = TransferProfiler::BlockId(m_fileNumber, data.dataIndex);
+
+				{
+					ProfileSpan span(m_flow ? m_profiler : nullptr, TransferProfiler::ClientThrottle, id);
+					Throttle(data.dataSize);
+				}
+
+				ProfileSpan span(m_profiler, TransferProfiler::ClientSend, id);
+				SendBlock(data, m_cipher ? data.data : payloads[i]);
+			}
+
+			if (reTry == 0 && UseFec())
+			{
+				SendParity(buff, size, firstBlock, count);
+			}
+
+			// missing blocks are sent again once no answer came for a while
 			const DWORD begin = timeGetTime();
-			int i = 0;
+			const int64_t windowSent = m_profiler != nullptr ? TransferProfiler::Now() : 0;
 			while (true)
 			{
-				MessageData md;
+				const DWORD waited = timeGetTime() - begin;
+				if (waited >= RETRANSMIT_TIMEOUT ||
+					m_socket.Poll(int(RETRANSMIT_TIMEOUT - waited)) != Socket::PollReadable)
+				{
+					++reTry;
+					break;
+				}
+
+				MessageData& md = *answer;
 				Read(md);
 
-				if (md.protocol == Protocol::Accepted && 
-					md.dataIndex >= 0 && 
-					md.dataIndex < CHUNK_LENGTH &&
-					!done[md.dataIndex])
+				// answers to control frames that show up late are skipped
+				const int index = md.dataIndex - firstBlock;
+				if ((AnsweredProtocol(md) == Protocol::Chunk || md.protocol == Protocol::Recovered) && 
+					index >= 0 && 
+					index < count &&
+					!done[index])
 				{
-					done[md.dataIndex] = true;
+					done[index] = true;
+
+					if (m_profiler != nullptr)
+					{
+						m_profiler->Record(TransferProfiler::ClientAnswer,
+							TransferProfiler::BlockId(m_fileNumber, md.dataIndex), windowSent, TransferProfiler::Now());
+					}
+
+					if (md.protocol == Protocol::Recovered || reTry > 0)
+						++lost;
 					
-					++i;
-					printer.Update(i + chunks * CHUNK_LENGTH);
+					++acked;
+					printer.Update(firstBlock + acked);
 				}
 
-				if (i >= count)
+				if (acked >= count)
 				{
 					for (int j = 0; j < CHUNK_LENGTH; ++j)
 						done[j] = false;
 
 					reTry = 0;
-					ChunkEnd(size);
-					++chunks;
+					m_loss.Update(count, lost);
+					acked = 0;
+					lost = 0;
+					sent += size;
 					break;
 				}
+			}
 
-				if (timeGetTime() - begin > 300)
-				{
-					++reTry;
-				}
+			if (reTry > RETRANSMIT_TRIES)
+			{
+				throw std::runtime_error("Error: [SendFile] no answer from server");
 			}
 
-			if (reTry > 5)
-				break;
+			ReportProgress(sent, fileSize);
 
-			printer.Print();
+			if (!m_progress)
+				printer.Print();
 		}
+
+		return sent;
 	}
 
-	void ChunkEnd(int size)
+	// Zeros from offset in whole blocks, or to the end of the file. Without
+	// a mapping only the holes the file system reports are found.
+	static uint64_t ZeroRun(SparseMap& sparse, MappedFile* mapping, uint64_t offset, uint64_t fileSize)
 	{
-		MessageData data;
-		data.protocol = Protocol::ChunkEnd;
-		data.dataSize = size;
+		uint64_t end = offset + sparse.HoleLength(offset, MAX_LENGTH);
 
-		int i = 0;
+		while (mapping != nullptr && end < fileSize)
+		{
+			const size_t length = static_cast<size_t>(std::min<uint64_t>(MAX_LENGTH, fileSize - end));
+			const char* block = mapping->View(end, length);
+			if (block == nullptr || !IsZeroBlock(block, length))
+				break;
 
-		do
+			end += length;
+			end += sparse.HoleLength(end, MAX_LENGTH);
+		}
+
+		return end - offset;
+	}
+
+	// Sent again until the answer to this frame arrives, like a window of
+	// one block. Answers to earlier frames that show up late are skipped.
+	void Exchange(const MessageData& request, MessageData& answer) override
+	{
+		for (int reTry = 0; reTry <= RETRANSMIT_TRIES; ++reTry)
 		{
-			Send(data);
+			Send(request);
 
-			MessageData md;
-			Read(md);
+			const DWORD begin = timeGetTime();
+			while (true)
+			{
+				const DWORD waited = timeGetTime() - begin;
+				if (waited >= RETRANSMIT_TIMEOUT ||
+					m_socket.Poll(int(RETRANSMIT_TIMEOUT - waited)) != Socket::PollReadable)
+				{
+					break;
+				}
 
-			if (md.protocol == Protocol::Accepted)
+				Read(answer);
+				if (answer.protocol == Protocol::FatalError)
+				{
+					throw std::runtime_error(answer.data);
+				}
+
+				if (IsAnswerTo(answer, request))
+					return;
+			}
+		}
+
+		throw std::runtime_error("Error: [Exchange] no answer from server");
+	}
+
+	// Header from the frame, payload from the file data or the sealed frame.
+	void SendBlock(const MessageData& header, const char* payload)
+	{
+		m_socket.SendTo((const char*)&header, offsetof(MessageData, data),
+			payload, static_cast<int>(header.dataSize), &m_serverAddr);
+	}
+
+	// One group per window, with as many parity rows as the loss rate asks
+	// for. Rows are built one at a time in a pooled frame.
+	void SendParity(const char* buff, int size, int firstBlock, int count)
+	{
+		MessageBuffer parity = m_pool.Acquire();
+		parity->protocol = Protocol::Parity;
+		parity->dataIndex = firstBlock;
+
+		const int rows = FecParityRows(m_loss.Rate(), count);
+		const size_t lastSize = size - (count - 1) * MAX_LENGTH;
+
+		for (int row = 0; row < rows; ++row)
+		{
+			memset(parity->data, 0, MAX_LENGTH);
+
+			for (int i = 0; i < count; ++i)
 			{
-				break;
+				const size_t length = i + 1 < count ? MAX_LENGTH : lastSize;
+				GfMulAdd(parity->data, buff + i * MAX_LENGTH, FecCoefficient(row, i), length);
 			}
-	
-			Sleep(100);
-			++i;
-		} 
-		while (i < 5);
+			parity->dataSize = PackParity(lastSize, count, row);
+
+			Throttle(MAX_LENGTH);
+
+			Send(*parity);
+		}
 	}
 
 private:
-	sockaddr_in m_serverAddr;
+	sockaddr_in   m_serverAddr;
+	LossEstimator m_loss;
 };
 
 
@@ -1,19 +1,75 @@
 #pragma once
 
 #include "Transfer.h"
+#include "BufferPool.h"
+#include "ConnectionPool.h"
+#include "FrameCipher.h"
+#include "Manifest.h"
+#include "Prefetcher.h"
+#include "Profiler.h"
+#include "Scheduler.h"
+#include "Sparse.h"
+#include <atomic>
+#include <functional>
 
 class MessageData;
 
+// Milliseconds without an answer before a UDP window is sent again.
+#define RETRANSMIT_TIMEOUT 300
+
+// Times a UDP frame or window goes out unanswered before the transfer fails.
+#define RETRANSMIT_TRIES 5
+
+// Called with the current file name, bytes confirmed by the server and file size.
+typedef std::function<void(const std::string&, uint64_t, uint64_t)> ProgressCallback;
+
 class FileTransferClient
 {
 public:
 
 	virtual ~FileTransferClient();
 
+	// Connects and agrees on the session with the server, or takes an
+	// idle connection from the pool when one is set.
 	virtual void Init() = 0;
 
+	// Can be called again, over the same connection when the server
+	// keeps it alive, otherwise over a new one.
 	void Transfer(const std::vector<std::string>& files);
 
+	void SetProgressCallback(const ProgressCallback& callback);
+
+	// Send Reed-Solomon parity with every UDP window, ignored by TCP.
+	void SetForwardErrorCorrection(bool enable);
+
+	// Send UDP blocks straight from a mapping of the file, the default, or
+	// read them through a staging buffer. Ignored by TCP.
+	void SetMappedReads(bool enable);
+
+	// Skip holes and zero blocks when the server can recreate them, the
+	// default, or send every byte.
+	void SetSparse(bool enable);
+
+	// Data frames wait for the flow's share of the scheduler's bandwidth.
+	void SetSchedulerFlow(const std::shared_ptr<TransferScheduler::Flow>& flow);
+
+	// Encrypt every frame with a session key derived from this pre-shared one.
+	void SetKey(const CipherKey& key);
+
+	// Kept-alive connections go back to the pool after Transfer.
+	void SetConnectionPool(ConnectionPool* connections);
+
+	// Times every block through the stages, nullptr stops it.
+	void SetProfiler(TransferProfiler* profiler);
+
+	// Thread safe, the running Transfer throws at the next block boundary.
+	void Cancel();
+
+	bool IsCancelled() const;
+
+	// What Init agreed on with the server.
+	const SessionInfo& Session() const { return m_session; }
+
 	static FileTransferClient* MakeClient(Socket::SocketType type, const char* address, short port);
 
 protected:
@@ -22,20 +78,87 @@ protected:
 
 	void CheckAnswer();
 
-	void FileTransferBegin(const char* fileName);
+	// Sends a control frame and reads the answer to it, throws when the
+	// server reports an error.
+	virtual void Exchange(const MessageData& request, MessageData& answer);
+
+	// Numbers FileBegin, FileEnd, Done and PackedData within the session,
+	// so the server can spot retransmitted ones.
+	int NextControl();
+
+	void TransferFiles(const std::vector<std::string>& files);
+
+	// Sends Hello and keeps the session agreed with the server.
+	void Handshake();
 
-	void FileTransferData(const char* fileName);
+	bool TakePooled();
+
+	// Pools or keeps the connection when the server allows it, closes it otherwise.
+	void ReleaseConnection();
+
+	bool UseFec() const;
+
+	// Runs of zeros go as Hole frames.
+	bool UseSparse() const;
+
+	// Tells the server the range is zeros, once the data before it is accepted.
+	void SendHole(uint64_t offset, uint64_t length);
+
+	// The frame to put on the wire, sealed into scratch once the session is encrypted.
+	const MessageData& SealFrame(const MessageData& data);
+
+	// Decrypts in place, false when the frame is not authentic.
+	bool OpenFrame(MessageData& data);
+
+	void FileTransferBegin(const char* fileName, const std::string& remoteName);
+
+	// Sends an already opened file and closes it.
+	void FileTransferData(FilePrefetcher::Entry& entry);
 
 	void FileTransferDone();
 
+	// Sends the manifest of a directory tree, then its files, with the
+	// small ones packed back to back into shared PackedData frames.
+	void TransferTree(const std::string& root);
+
+	void FlushPacked(MessageData& packed);
+
+	void ReportProgress(uint64_t sent, uint64_t total);
+
+	void Throttle(size_t bytes);
+
 	virtual void Send(const MessageData& data) = 0;
 
 	virtual void Read(MessageData& data) = 0;
 
-	virtual void SendFile(FILE* file) = 0;
+	// Returns the bytes sent, holes included, for FileEnd.
+	virtual uint64_t SendFile(FILE* file, uint64_t fileSize) = 0;
 
 protected:
 	std::string m_address;
 	short       m_port;
 	Socket      m_socket;
+	BufferPool  m_pool;
+
+	ProgressCallback  m_progress;
+	std::atomic<bool> m_cancelled;
+	std::string       m_fileName;
+	size_t            m_manifestSent;
+	bool              m_fec;
+	bool              m_mappedReads;
+	bool              m_sparse;
+
+	std::shared_ptr<TransferScheduler::Flow> m_flow;
+
+	ConnectionPool*   m_connections;
+	SessionInfo       m_session;
+
+	TransferProfiler* m_profiler;
+	uint32_t          m_fileNumber;   // 1-based within the session, as the server counts
+	int               m_control;      // last control frame number of the session
+
+	bool                         m_hasKey;
+	CipherKey                    m_key;
+	std::shared_ptr<FrameCipher> m_cipher;
+	MessageBuffer                m_sealed;
 };
\ No newline at end of file
@@ -1,83 +1,88 @@
 #include "TransferServer.h"
+#include <cstddef>
+#include <unordered_map>
 
+// Milliseconds a server that is not persistent keeps answering a
+// retransmitted Done after the session ended.
+#define DONE_LINGER 1000
+
+// Clients a UDP server keeps sessions for at the same time, enough for an
+// AsyncTransferClient running a thousand uploads or more.
+#define MAX_SESSIONS 4096
+
+// Connections a TCP server keeps open between sessions.
+#define MAX_IDLE_CONNECTIONS 32
+
+// Milliseconds between looks for sessions whose client went quiet.
+#define SESSION_SWEEP 1000
 
 FileTransferServer::FileTransferServer(Socket::SocketType type, const char* address, short port)
 	: m_address(address)
 	, m_port(port)
-	, m_socket(type)
-	, m_state(TransferState::Idle)
+	, m_socket(type, address)
+	, m_reusePort(false)
+	, m_makeStorage([]() { return std::unique_ptr<StorageBackend>(new FileStorage()); })
 {}
 
 FileTransferServer::~FileTransferServer()
 {}
 
-void FileTransferServer::HandleFileBegin(const MessageData& data)
+void FileTransferServer::SetReusePort(bool reusePort)
 {
-	if (m_state != TransferState::Idle || m_currentFile.is_open())
-	{
-		throw std::runtime_error("Error: [HandleFileBegin] file opened or transfer state not idle");
-	}
-
-	m_currentFile.open(data.data, std::ios::trunc | std::ios::binary);
-
-	if (!m_currentFile.is_open())
-	{
-		throw std::runtime_error("Error: [HandleFileBegin] failed open file");
-	}
-
-	m_state = TransferState::LoadFile;
-
-	std::cout << "Load new file: " << data.data << std::endl;
+	m_reusePort = reusePort;
 }
 
-void FileTransferServer::HandleFileData(const MessageData& data)
+void FileTransferServer::SetPersistent(bool persistent)
 {
-	if (m_state != TransferState::LoadFile || !m_currentFile.is_open())
-	{
-		throw std::runtime_error("Error: [HandleFileData] file not opened or transfer state not LoadFile");
-	}
-
-	m_currentFile.write(data.data, data.dataSize);
+	m_options.persistent = persistent;
 }
 
-void FileTransferServer::HandleFileEnd(const MessageData& data)
+void FileTransferServer::SetCompletionQueue(CompletionQueue* completed)
 {
-	if (m_state != TransferState::LoadFile || !m_currentFile.is_open())
-	{
-		throw std::runtime_error("Error: [HandleFileEnd] file not opened or transfer state not LoadFile");
-	}
+	m_options.completed = completed;
+}
 
-	m_currentFile.close();
+void FileTransferServer::SetKey(const CipherKey& key)
+{
+	m_options.key = key;
+	m_options.hasKey = true;
+}
 
-	m_state = TransferState::Idle;
+void FileTransferServer::SetSyncPolicy(SyncPolicy policy, bool directIo)
+{
+	m_options.policy = policy;
+	m_options.directIo = directIo;
 }
 
-void FileTransferServer::HandleDone(const MessageData& data)
+void FileTransferServer::SetProfiler(TransferProfiler* profiler)
 {
-	if (m_state != TransferState::Idle || m_currentFile.is_open())
-	{
-		throw std::runtime_error("Error: [HandleDone] file opened or transfer state not idle");
-	}
+	m_options.profiler = profiler;
+}
 
-	m_state = TransferState::LoadEnd;
+void FileTransferServer::SetStorage(const StorageFactory& makeStorage)
+{
+	m_makeStorage = makeStorage;
 }
 
-void FileTransferServer::RegistryHandler(Protocol pr, Handler handler)
+void FileTransferServer::SetTransport(std::unique_ptr<Socket::Transport> transport)
 {
-	m_handlers.insert(std::make_pair(pr, handler));
+	Socket socket(m_socket.Type(), std::move(transport));
+	m_socket.Swap(socket);
 }
 
-void FileTransferServer::InvokeHandler(const MessageData& data)
+void FileTransferServer::BindSocket()
 {
-	HandlerMap::iterator iter = m_handlers.find(data.protocol);
+	m_socket.Init();
 
-	if (iter != m_handlers.end())
+	if (m_reusePort)
 	{
-		(this->*iter->second)(data);
+		m_socket.SetReusePort();
 	}
+
+	m_socket.Bind(m_address.c_str(), m_port);
 }
 
-class TcpServer :public FileTransferServer
+class TcpServer final :public FileTransferServer
 {
 public:
 	TcpServer(const char* address, short port)
@@ -86,118 +91,354 @@ public:
 
 	void Run() override
 	{
-		std::unique_ptr<Socket> client;
+		do
+		{
+			Connection client;
+
+			if (!NextClient(&client))
+				continue;
+
+			if (Serve(client))
+			{
+				KeepIdle(std::move(client));
+			}
+		}
+		while (m_options.persistent);
+	}
+
+	void Init() override
+	{
+		BindSocket();
+
+		m_socket.Listen(5);
+	}
+
+private:
+	// A connection with the session state negotiated on it.
+	struct Connection
+	{
+		std::unique_ptr<Socket>     socket;
+		std::unique_ptr<TcpSession> session;
+		DWORD                       idleSince;
+	};
+
+	// Waits for a new connection and for the next session on the kept-alive
+	// ones at the same time, so a client that keeps its connection does not
+	// hold up accept. False when nothing came within SESSION_SWEEP.
+	bool NextClient(Connection* client)
+	{
+		ExpireIdle();
+
+		std::vector<Socket*> sockets(1, &m_socket);
+		for (size_t i = 0; i < m_idle.size(); ++i)
+		{
+			sockets.push_back(m_idle[i].socket.get());
+		}
+
+		const int ready = Socket::Select(sockets, m_idle.empty() ? -1 : SESSION_SWEEP);
+		if (ready < 0)
+		{
+			return false;
+		}
+
+		if (ready > 0)
+		{
+			*client = std::move(m_idle[ready - 1]);
+			m_idle.erase(m_idle.begin() + (ready - 1));
+
+			// a client that hangs up on a kept connection is done, not failed
+			return client->socket->Poll(0) == Socket::PollReadable;
+		}
 
-		if (!m_socket.Accept(&client))
+		if (!m_socket.Accept(&client->socket))
 		{
 			throw std::runtime_error("Error: failed accept");
 		}
 
+		client->session.reset(new TcpSession(m_options, m_pool));
+		client->session->SetStorage(m_makeStorage());
+
+		return true;
+	}
+
+	// Serves sessions on the connection until it goes quiet after one,
+	// true when the client keeps it for its next session.
+	bool Serve(Connection& client)
+	{
+		MessageBuffer data = m_pool.Acquire();
+		TcpSession& session = *client.session;
+
 		try
 		{
-			while (m_state != TransferState::LoadEnd)
+			do
 			{
-				MessageData data;
-				client->Read((char*)&data, sizeof(data));
+				while (session.State() != ServerSession::LoadEnd)
+				{
+					session.Receive(client.socket.get(), *data);
+				}
 
-				InvokeHandler(data);
+				if (!session.KeepAlive())
+				{
+					session.ResetSession();
+					return false;
+				}
 
-				Answer(client.get(), Protocol::Accepted, "Data accepted.");
+				session.ResetSession();
 			}
+			while (client.socket->Poll(0) == Socket::PollReadable);
 		}
 		catch (const std::runtime_error& error)
 		{
 			std::cout << error.what() << std::endl;
-			Answer(client.get(), Protocol::FatalError, error.what());
+
+			// drop the half-written file even when the answer cannot go out
+			session.ResetSession();
+			try
+			{
+				session.Fail(client.socket.get(), error.what());
+			}
+			catch (const std::runtime_error&)
+			{
+				// the client is gone already
+			}
+
+			return false;
 		}
+
+		return true;
 	}
 
-	void Init() override
+	void KeepIdle(Connection client)
 	{
-		m_socket.Init();
-
-		m_socket.Bind(m_address.c_str(), m_port);
-
-		m_socket.Listen(5);
+		if (m_idle.size() >= MAX_IDLE_CONNECTIONS)
+		{
+			m_idle.erase(m_idle.begin());
+		}
 
-		FileTransferServer::Init();
+		client.idleSince = timeGetTime();
+		m_idle.push_back(std::move(client));
 	}
 
-	void Answer(Socket* client, Protocol pr, const std::string& message)
+	// Closes kept connections that saw no session for KEEPALIVE_TIMEOUT.
+	void ExpireIdle()
 	{
-		MessageData accepted(Protocol::Accepted, message);
-		client->Send((char*)&accepted, sizeof(accepted));
+		const DWORD now = timeGetTime();
+
+		for (size_t i = 0; i < m_idle.size();)
+		{
+			if (now - m_idle[i].idleSince >= KEEPALIVE_TIMEOUT)
+				m_idle.erase(m_idle.begin() + i);
+			else
+				++i;
+		}
 	}
+
+private:
+	std::vector<Connection> m_idle;   // oldest first
 };
 
-class UdpServer :public FileTransferServer
+class UdpServer final :public FileTransferServer
 {
 public:
 	UdpServer(const char* address, short port)
 		:FileTransferServer(Socket::Udp ,address, port)
+		, m_sessionDone(false)
+		, m_lastSweep(0)
 	{}
 
-	void HandleChunk(const MessageData& data) 
-	{
-		int pos = data.dataIndex * MAX_LENGTH;
-		lastIndex = data.dataIndex;
-		memcpy(buff + pos, data.data, data.dataSize);
-	}
-
+	// Every client gets a session of its own, keyed by its address, so
+	// clients sharing the port do not see each other's frames.
 	void Run() override
 	{
 		sockaddr_in tmp;
+		MessageBuffer data = m_pool.Acquire();
 
-		while (m_state != TransferState::LoadEnd)
+		while (!Finished())
 		{
+			// only a server waiting for its last clients needs to wake up
+			// without traffic, everything else blocks in the read
+			if (m_sessionDone && m_socket.Poll(SESSION_SWEEP) != Socket::PollReadable)
+			{
+				ExpireSessions();
+				continue;
+			}
+
 			try
 			{
-				MessageData data;
+				UdpSession* session = ReadDatagram(*data, &tmp, true);
 
-				m_socket.ReadFrom((char*)&data, sizeof(data), &tmp);
+				session->Receive(*data, &tmp);
 
-				if (data.protocol == Protocol::Chunk)
-				{
-					HandleChunk(data);
-				}
-				else if (data.protocol == Protocol::ChunkEnd)
+				if (session->State() == ServerSession::LoadEnd)
 				{
-					m_currentFile.write(buff, data.dataSize);
+					m_sessionDone = true;
 				}
-				else
-				{
-					InvokeHandler(data);
-				}
-
-				Answer(&tmp, Protocol::Accepted, "Data accepted.");
 			}
 			catch (const std::runtime_error& error)
 			{
 				std::cout << error.what() << std::endl;
-				Answer(&tmp, Protocol::FatalError, error.what());
+				Fail(tmp, error.what());
 			}
+
+			ExpireSessions();
 		}
+
+		Linger();
 	}
 
-	void Init() override
+	// Reads the next datagram and finds the session of its sender, nullptr
+	// for a sender without one unless create is set. Throws for a datagram
+	// too short for its header and for a client past MAX_SESSIONS.
+	UdpSession* ReadDatagram(MessageData& data, sockaddr_in* from, bool create)
+	{
+		ProfileSpan span(m_options.profiler, TransferProfiler::ServerReceive);
+		const int received = m_socket.ReadFrom((char*)&data, sizeof(MessageData), from);
+
+		// data blocks arrive without the unused tail of the frame
+		const size_t payload = data.dataSize < MAX_LENGTH ? data.dataSize : MAX_LENGTH;
+		if (received < 0 || size_t(received) < offsetof(MessageData, data) + payload)
+		{
+			throw std::runtime_error("Error: [Run] truncated frame");
+		}
+
+		UdpSession* session = FindSession(*from, create);
+		if (session != nullptr)
+		{
+			span.SetBlock(session->ProfileBlock(data));
+		}
+
+		return session;
+	}
+
+	UdpSession* FindSession(const sockaddr_in& client, bool create)
+	{
+		const uint64_t key = Socket::PeerKey(client);
+		const DWORD now = timeGetTime();
+
+		auto found = m_sessions.find(key);
+		if (found != m_sessions.end())
+		{
+			found->second.lastSeen = now;
+			return found->second.session.get();
+		}
+
+		if (!create)
+		{
+			return nullptr;
+		}
+		if (m_sessions.size() >= MAX_SESSIONS)
+		{
+			throw std::runtime_error("Error: [Run] too many clients");
+		}
+
+		Peer peer;
+		peer.session.reset(new UdpSession(m_options, m_pool, m_socket));
+		peer.session->SetStorage(m_makeStorage());
+		peer.lastSeen = now;
+
+		return (m_sessions[key] = std::move(peer)).session.get();
+	}
+
+	// Answers the error through the session of the client when it has one.
+	void Fail(const sockaddr_in& client, const std::string& message)
 	{
-		m_socket.Init();
+		UdpSession* session = FindSession(client, false);
+		if (session != nullptr)
+		{
+			session->Fail(&client, message);
+			return;
+		}
+
+		MessageBuffer answer = m_pool.Acquire();
+		*answer = MessageData(Protocol::FatalError, message);
+		m_socket.SendTo((char*)answer.Get(), sizeof(MessageData), &client);
+	}
+
+	// Drops the sessions of clients quiet for KEEPALIVE_TIMEOUT along with
+	// their half-written files.
+	void ExpireSessions()
+	{
+		const DWORD now = timeGetTime();
+		if (now - m_lastSweep < SESSION_SWEEP)
+			return;
 
-		m_socket.Bind(m_address.c_str(), m_port);
+		m_lastSweep = now;
 
-		FileTransferServer::Init();
+		for (auto peer = m_sessions.begin(); peer != m_sessions.end();)
+		{
+			if (now - peer->second.lastSeen >= KEEPALIVE_TIMEOUT)
+			{
+				peer->second.session->Restart();
+				peer = m_sessions.erase(peer);
+			}
+			else
+			{
+				++peer;
+			}
+		}
 	}
 
-	void Answer(const sockaddr_in* client, Protocol pr, const std::string& message)
+	// A server that is not persistent is done once a session ended and no
+	// other client is still in the middle of one.
+	bool Finished() const
 	{
-		MessageData accepted(pr, message);
-		accepted.dataIndex = lastIndex;
-		m_socket.SendTo((char*)&accepted, sizeof(accepted), client);
+		if (m_options.persistent || !m_sessionDone)
+			return false;
+
+		for (auto peer = m_sessions.begin(); peer != m_sessions.end(); ++peer)
+		{
+			if (peer->second.session->State() != ServerSession::LoadEnd)
+				return false;
+		}
+
+		return true;
+	}
+
+	// The answer to Done may be lost; its retransmissions are answered for
+	// a while before a server that is not persistent goes away.
+	void Linger()
+	{
+		sockaddr_in tmp;
+		MessageBuffer data = m_pool.Acquire();
+		const DWORD begin = timeGetTime();
+
+		while (true)
+		{
+			const DWORD waited = timeGetTime() - begin;
+			if (waited >= DONE_LINGER || m_socket.Poll(int(DONE_LINGER - waited)) != Socket::PollReadable)
+				return;
+
+			try
+			{
+				UdpSession* session = ReadDatagram(*data, &tmp, false);
+
+				if (session != nullptr)
+				{
+					session->AnswerLate(*data, &tmp);
+				}
+			}
+			catch (const std::runtime_error&)
+			{
+				// nobody waits for answers any more
+			}
+		}
+	}
+
+	void Init() override
+	{
+		BindSocket();
 	}
 
 private:
-	char buff[MAX_LENGTH * CHUNK_LENGTH];
-	int lastIndex;
+	struct Peer
+	{
+		std::unique_ptr<UdpSession> session;
+		DWORD                       lastSeen;
+	};
+
+	std::unordered_map<uint64_t, Peer> m_sessions;
+	bool                               m_sessionDone;   // some session reached LoadEnd
+	DWORD                              m_lastSweep;
 };
 
 FileTransferServer* FileTransferServer::MakeServer(Socket::SocketType protocol, const char* address, short port)
@@ -208,4 +449,4 @@ FileTransferServer* FileTransferServer::MakeServer(Socket::SocketType protocol,
 		return new UdpServer(address, port);
 
 	return nullptr;
-}
\ No newline at end of file
+}
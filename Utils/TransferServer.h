@@ -1,54 +1,56 @@
 #pragma once
 
-#include "Transfer.h"
+#include "ServerSession.h"
 
 class FileTransferServer
 {
 public:
-	typedef void(FileTransferServer::* Handler) (const MessageData&);
-
-	enum TransferState
-	{
-		Idle,
-		LoadFile,
-		LoadEnd
-	};
-	typedef std::map<Protocol, Handler> HandlerMap;
-
 	static FileTransferServer* MakeServer(Socket::SocketType protocol, const char* address, short port);
 
 	virtual ~FileTransferServer();
 
-	virtual void Init()
-	{
-		RegistryHandler(Protocol::FileBegin, &FileTransferServer::HandleFileBegin);
-		RegistryHandler(Protocol::FileData, &FileTransferServer::HandleFileData);
-		RegistryHandler(Protocol::FileEnd, &FileTransferServer::HandleFileEnd);
-		RegistryHandler(Protocol::Done, &FileTransferServer::HandleDone);
-	}
+	virtual void Init() = 0;
 
 	virtual void Run() = 0;
 
-protected:
-	FileTransferServer(Socket::SocketType type, const char* address, short port);
+	// Bind with SO_REUSEPORT so several servers can share the port.
+	void SetReusePort(bool reusePort);
+
+	// Keep serving new sessions after a client is done instead of returning,
+	// TCP clients may also keep their connection for the next session.
+	void SetPersistent(bool persistent);
 
-	void HandleFileBegin(const MessageData& data);
+	// Finished file names are pushed here when set.
+	void SetCompletionQueue(CompletionQueue* completed);
 
-	void HandleFileData(const MessageData& data);
+	// Accept only clients that encrypt with a key derived from this one.
+	void SetKey(const CipherKey& key);
 
-	void HandleFileEnd(const MessageData& data);
+	// FileEnd is answered only once the policy holds for the file.
+	void SetSyncPolicy(SyncPolicy policy, bool directIo);
 
-	void HandleDone(const MessageData& data);
+	// Where received files go, FileStorage in the working directory by
+	// default. Every session gets a backend of its own. Before Init.
+	void SetStorage(const StorageFactory& makeStorage);
 
-	void RegistryHandler(Protocol pr, Handler handler);
+	// Serves on this transport instead of a socket of its own, see
+	// SharedSocket. Before Init.
+	void SetTransport(std::unique_ptr<Socket::Transport> transport);
+
+	// Times every received block through the stages, nullptr stops it.
+	void SetProfiler(TransferProfiler* profiler);
+
+protected:
+	FileTransferServer(Socket::SocketType type, const char* address, short port);
 
-	void InvokeHandler(const MessageData& data);
+	void BindSocket();
 
 protected:
 	std::string     m_address;
 	short           m_port;
 	Socket          m_socket;
-	TransferState   m_state;
-	std::ofstream   m_currentFile;
-	HandlerMap      m_handlers;
-};
\ No newline at end of file
+	bool            m_reusePort;
+	SessionOptions  m_options;
+	BufferPool      m_pool;
+	StorageFactory  m_makeStorage;
+};